@@ -0,0 +1,410 @@
+// bench - microbenchmarks for libpuf internals
+//
+// Copyright (C) 2016 Assured Information Security, Inc.
+//
+// Times the library's fixed per-call overhead: blob header framing in
+// puflib_seal()/puflib_unseal() (through the no-op puflibtest module), module
+// lookup and status, NV store management, and the string and base64 helpers.
+// Results go to stdout as JSON, one entry per case, so that runs can be
+// compared across commits.
+//
+// usage: bench [FILTER...]
+//   Only cases whose names contain one of the FILTERs are run. Environment:
+//   BENCH_SAMPLES   samples per case (default 5)
+//   BENCH_TIME_MS   target duration of each sample (default 100)
+//   BENCH_COMMIT    commit identifier recorded in the output
+
+#define _XOPEN_SOURCE 700
+
+#include <puflib.h>
+#include <puflib_module.h>
+#include "misc.h"
+#include "base64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <ftw.h>
+
+#define MAX_SAMPLES 100
+
+/// Stand-in module for NV store cases, so that no real module's store is touched
+static module_info const BENCH_MODULE = {
+    .name = "puflib-bench",
+    .author = "",
+    .desc = "benchmark placeholder",
+};
+
+static module_info const * TEST_MODULE;
+
+static uint8_t PAYLOAD[4096];
+static uint8_t * SEALED_SMALL, * SEALED_LARGE;
+static size_t SEALED_SMALL_LEN, SEALED_LARGE_LEN;
+static char BASE64_TEXT[BASE64_SIZE(sizeof(PAYLOAD))];
+
+// Written by cases so that the compiler cannot drop their work
+static volatile size_t SINK;
+
+static bool FAILED = false;
+
+
+/**
+ * Stand in for the C library's getuid(), which libpuf's calls resolve to this
+ * definition ahead of. Root's NV stores would live under /var/lib/puflib, next
+ * to the host's real ones; reporting an ordinary user keeps them under the
+ * temporary HOME set in main() instead.
+ */
+uid_t getuid(void)
+{
+    uid_t uid = geteuid();
+    return uid ? uid : 65534;       // nobody
+}
+
+
+static void fail(char const * what)
+{
+    if (!FAILED) {
+        fprintf(stderr, "bench: %s: %s\n", what, strerror(errno));
+        FAILED = true;
+    }
+}
+
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/******************************************************************************
+ * Cases                                                                      *
+ *****************************************************************************/
+
+static void seal_n(size_t iters, size_t len)
+{
+    for (size_t i = 0; i < iters; ++i) {
+        uint8_t * out;
+        size_t out_len;
+        if (puflib_seal(TEST_MODULE, PAYLOAD, len, &out, &out_len)) {
+            fail("puflib_seal");
+            return;
+        }
+        SINK += out_len;
+        free(out);
+    }
+}
+
+static void unseal_n(size_t iters, uint8_t const * blob, size_t blob_len)
+{
+    for (size_t i = 0; i < iters; ++i) {
+        uint8_t * out;
+        size_t out_len;
+        if (puflib_unseal(blob, blob_len, &out, &out_len)) {
+            fail("puflib_unseal");
+            return;
+        }
+        SINK += out_len;
+        free(out);
+    }
+}
+
+static void case_seal_64(size_t iters) { seal_n(iters, 64); }
+static void case_seal_4k(size_t iters) { seal_n(iters, sizeof(PAYLOAD)); }
+static void case_unseal_64(size_t iters) { unseal_n(iters, SEALED_SMALL, SEALED_SMALL_LEN); }
+static void case_unseal_4k(size_t iters) { unseal_n(iters, SEALED_LARGE, SEALED_LARGE_LEN); }
+
+
+static void case_get_module(size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i) {
+        SINK += (size_t) puflib_get_module("puflibtest");
+    }
+}
+
+
+static void case_get_module_missing(size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i) {
+        SINK += (size_t) puflib_get_module("no-such-module");
+    }
+}
+
+
+static void case_module_status(size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i) {
+        SINK += (size_t) puflib_module_status(TEST_MODULE);
+    }
+}
+
+
+static void case_nv_create_delete(size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i) {
+        char * path = puflib_create_nv_store(&BENCH_MODULE, STORAGE_TEMP_FILE);
+        if (!path || puflib_delete_nv_store(&BENCH_MODULE, STORAGE_TEMP_FILE)) {
+            free(path);
+            fail("NV store create/delete");
+            return;
+        }
+        free(path);
+    }
+}
+
+
+static void case_nv_get(size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i) {
+        char * path = puflib_get_nv_store(&BENCH_MODULE, STORAGE_FINAL_FILE);
+        if (!path) {
+            fail("puflib_get_nv_store");
+            return;
+        }
+        SINK += strlen(path);
+        free(path);
+    }
+}
+
+
+static void case_concat(size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i) {
+        char * s = puflib_concat("/var/lib/puflib/", "final/", "puflibtest", NULL);
+        if (!s) {
+            fail("puflib_concat");
+            return;
+        }
+        SINK += strlen(s);
+        free(s);
+    }
+}
+
+
+static void case_duplicate_string(size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i) {
+        char * s = puflib_duplicate_string("/var/lib/puflib/final/puflibtest");
+        if (!s) {
+            fail("puflib_duplicate_string");
+            return;
+        }
+        SINK += (size_t) s[0];
+        free(s);
+    }
+}
+
+
+static void case_asprintf(size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i) {
+        char * s;
+        int n = puflib_asprintf(&s, "%s (%s): %s", "puflibtest", "info", "creating NV store");
+        if (n < 0) {
+            fail("puflib_asprintf");
+            return;
+        }
+        SINK += (size_t) n;
+        free(s);
+    }
+}
+
+
+static void case_base64_encode_4k(size_t iters)
+{
+    static char out[BASE64_SIZE(sizeof(PAYLOAD))];
+    for (size_t i = 0; i < iters; ++i) {
+        SINK += (size_t) base64_encode(out, sizeof(out), PAYLOAD, sizeof(PAYLOAD));
+    }
+}
+
+
+static void case_base64_decode_4k(size_t iters)
+{
+    static uint8_t out[sizeof(PAYLOAD) + 3];
+    for (size_t i = 0; i < iters; ++i) {
+        SINK += (size_t) base64_decode(out, BASE64_TEXT, sizeof(out));
+    }
+}
+
+
+static struct {
+    char const * name;
+    void (*run)(size_t iters);
+} const CASES[] = {
+    { "seal_64",                case_seal_64 },
+    { "seal_4k",                case_seal_4k },
+    { "unseal_64",              case_unseal_64 },
+    { "unseal_4k",              case_unseal_4k },
+    { "get_module",             case_get_module },
+    { "get_module_missing",     case_get_module_missing },
+    { "module_status",          case_module_status },
+    { "nv_store_create_delete", case_nv_create_delete },
+    { "nv_store_get",           case_nv_get },
+    { "concat",                 case_concat },
+    { "duplicate_string",       case_duplicate_string },
+    { "asprintf",               case_asprintf },
+    { "base64_encode_4k",       case_base64_encode_4k },
+    { "base64_decode_4k",       case_base64_decode_4k },
+};
+
+
+/******************************************************************************
+ * Harness                                                                    *
+ *****************************************************************************/
+
+static long env_long(char const * name, long def, long min, long max)
+{
+    char const * value = getenv(name);
+    if (!value || !*value) {
+        return def;
+    }
+    char * end;
+    long n = strtol(value, &end, 10);
+    if (*end || n < min || n > max) {
+        fprintf(stderr, "bench: ignoring invalid %s=%s\n", name, value);
+        return def;
+    }
+    return n;
+}
+
+
+static int compare_double(void const * a, void const * b)
+{
+    double x = *(double const *) a, y = *(double const *) b;
+    return (x > y) - (x < y);
+}
+
+
+static bool selected(char const * name, int n_filters, char ** filters)
+{
+    if (!n_filters) {
+        return true;
+    }
+    for (int i = 0; i < n_filters; ++i) {
+        if (strstr(name, filters[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool setup(void)
+{
+    for (size_t i = 0; i < sizeof(PAYLOAD); ++i) {
+        PAYLOAD[i] = (uint8_t) (i * 131 + 7);
+    }
+
+    TEST_MODULE = puflib_get_module("puflibtest");
+    if (!TEST_MODULE) {
+        fprintf(stderr, "bench: puflibtest module is not built\n");
+        return true;
+    }
+
+    if (puflib_seal(TEST_MODULE, PAYLOAD, 64, &SEALED_SMALL, &SEALED_SMALL_LEN)
+            || puflib_seal(TEST_MODULE, PAYLOAD, sizeof(PAYLOAD), &SEALED_LARGE, &SEALED_LARGE_LEN)) {
+        fail("puflib_seal");
+        return true;
+    }
+
+    base64_encode(BASE64_TEXT, sizeof(BASE64_TEXT), PAYLOAD, sizeof(PAYLOAD));
+
+    // nv_store_get needs an existing store
+    char * path = puflib_create_nv_store(&BENCH_MODULE, STORAGE_FINAL_FILE);
+    if (!path) {
+        fail("puflib_create_nv_store");
+        return true;
+    }
+    free(path);
+    return false;
+}
+
+
+static void teardown(void)
+{
+    puflib_delete_nv_store(&BENCH_MODULE, STORAGE_FINAL_FILE);
+    puflib_delete_nv_store(&BENCH_MODULE, STORAGE_TEMP_FILE);
+    free(SEALED_SMALL);
+    free(SEALED_LARGE);
+}
+
+
+static int remove_entry(char const * path, struct stat const * sb, int flag, struct FTW * ftw)
+{
+    (void) sb; (void) flag; (void) ftw;
+    return remove(path);
+}
+
+
+int main(int argc, char ** argv)
+{
+    long n_samples = env_long("BENCH_SAMPLES", 5, 1, MAX_SAMPLES);
+    double target_ns = env_long("BENCH_TIME_MS", 100, 1, 60000) * 1e6;
+    char const * commit = getenv("BENCH_COMMIT");
+    int rc = 1;
+
+    // Keep NV stores in a fresh directory of their own, for root too (see
+    // getuid()), so that no earlier run or real store gets in the way.
+    char home[] = "/tmp/puflib-bench.XXXXXX";
+    if (!mkdtemp(home) || setenv("HOME", home, 1)) {
+        perror("bench: temporary HOME");
+        return 1;
+    }
+
+    if (setup()) {
+        goto out;
+    }
+
+    printf("{\n  \"suite\": \"libpuf\",\n  \"commit\": \"%s\",\n  \"cases\": [",
+            commit && *commit ? commit : "unknown");
+
+    bool first = true;
+    for (size_t c = 0; c < sizeof(CASES) / sizeof(CASES[0]) && !FAILED; ++c) {
+        if (!selected(CASES[c].name, argc - 1, argv + 1)) {
+            continue;
+        }
+
+        // Double the iteration count until one sample takes long enough
+        size_t iters = 1;
+        double elapsed;
+        for (;;) {
+            double start = now_ns();
+            CASES[c].run(iters);
+            elapsed = now_ns() - start;
+            if (FAILED || elapsed >= target_ns || iters >= (size_t) 1 << 40) {
+                break;
+            }
+            iters *= elapsed > target_ns / 64 ? (size_t) (target_ns / elapsed) + 1 : 64;
+        }
+
+        double samples[MAX_SAMPLES];
+        for (long s = 0; s < n_samples && !FAILED; ++s) {
+            double start = now_ns();
+            CASES[c].run(iters);
+            samples[s] = (now_ns() - start) / iters;
+        }
+        if (FAILED) {
+            break;
+        }
+        qsort(samples, n_samples, sizeof(samples[0]), compare_double);
+
+        printf("%s\n    {\"name\": \"%s\", \"iterations\": %zu, \"samples\": %ld, "
+                "\"ns_per_op\": {\"min\": %.1f, \"median\": %.1f, \"max\": %.1f}}",
+                first ? "" : ",", CASES[c].name, iters, n_samples,
+                samples[0], samples[n_samples / 2], samples[n_samples - 1]);
+        fflush(stdout);
+        first = false;
+    }
+    printf("\n  ]\n}\n");
+    rc = FAILED;
+
+out:
+    teardown();
+    nftw(home, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return rc;
+}
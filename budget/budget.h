@@ -0,0 +1,38 @@
+// budget - allocation and syscall counters
+//
+// Copyright (C) 2016 Assured Information Security, Inc.
+//
+// Interface between the budget driver and the counting interposer, which is
+// loaded into the driver with LD_PRELOAD.
+//
+
+#ifndef _BUDGET_H_
+#define _BUDGET_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct budget_counts {
+    uint64_t allocs;        ///< malloc(), calloc() and realloc() calls
+    uint64_t frees;         ///< free() calls, not counting free(NULL)
+    uint64_t fs_calls;      ///< filesystem calls; see interpose.c for the list
+};
+
+/**
+ * Start or stop counting. Calls are only counted while counting is enabled,
+ * from any thread. Enabling it also resets the counts.
+ */
+void budget_enable(bool enable);
+
+/**
+ * Read the counts accumulated since counting was last enabled.
+ */
+void budget_read(struct budget_counts * counts);
+
+/**
+ * Make getuid() report an ordinary user in place of root, so that libpuf keeps
+ * NV stores under $HOME rather than /var/lib/puflib even when run as root.
+ */
+void budget_hide_root(void);
+
+#endif // _BUDGET_H_
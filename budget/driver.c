@@ -0,0 +1,372 @@
+// budget - allocation and syscall budgets for libpuf API calls
+//
+// Copyright (C) 2016 Assured Information Security, Inc.
+//
+// Runs each public API call with the counting interposer loaded, and checks
+// the allocations, frees and filesystem calls made per call (including
+// freeing its results) against the budgets recorded in a file. A call that
+// goes over budget fails the run; one that comes in under it is reported, so
+// that the budget can be tightened to lock the improvement in.
+//
+// usage: LD_PRELOAD=libbudget.so budget BUDGETS
+//        LD_PRELOAD=libbudget.so budget -r
+//   -r  print a budgets file recording the current counts
+
+#define _XOPEN_SOURCE 700
+
+#include <puflib.h>
+#include <puflib_module.h>
+#include "budget.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ftw.h>
+
+#pragma weak budget_enable
+#pragma weak budget_read
+#pragma weak budget_hide_root
+
+#define ITERATIONS 16
+#define MAX_CASES 64
+
+/// Stand-in module for NV store cases, so that no real module's store is touched
+static module_info const BUDGET_MODULE = {
+    .name = "puflib-budget",
+    .author = "",
+    .desc = "budget placeholder",
+};
+
+static module_info const * TEST_MODULE;
+
+static uint8_t PAYLOAD[64];
+static uint8_t * SEALED;
+static size_t SEALED_LEN;
+
+static bool FAILED = false;
+
+
+static void fail(char const * what)
+{
+    if (!FAILED) {
+        fprintf(stderr, "budget: %s: %s\n", what, strerror(errno));
+        FAILED = true;
+    }
+}
+
+
+/******************************************************************************
+ * Cases                                                                      *
+ *****************************************************************************/
+
+static void case_get_module(void)
+{
+    if (!puflib_get_module("puflibtest")) {
+        fail("puflib_get_module");
+    }
+}
+
+
+static void case_module_status(void)
+{
+    if (puflib_module_status(TEST_MODULE) == MODULE_STATUS_ERROR) {
+        fail("puflib_module_status");
+    }
+}
+
+
+static void case_get_nv_store(void)
+{
+    char * path = puflib_get_nv_store(&BUDGET_MODULE, STORAGE_FINAL_FILE);
+    if (!path) {
+        fail("puflib_get_nv_store");
+    }
+    free(path);
+}
+
+
+static void case_create_delete_nv_store(void)
+{
+    char * path = puflib_create_nv_store(&BUDGET_MODULE, STORAGE_TEMP_FILE);
+    if (!path || puflib_delete_nv_store(&BUDGET_MODULE, STORAGE_TEMP_FILE)) {
+        fail("NV store create/delete");
+    }
+    free(path);
+}
+
+
+static void case_seal(void)
+{
+    uint8_t * out;
+    size_t out_len;
+    if (puflib_seal(TEST_MODULE, PAYLOAD, sizeof(PAYLOAD), &out, &out_len)) {
+        fail("puflib_seal");
+        return;
+    }
+    free(out);
+}
+
+
+static void case_unseal(void)
+{
+    uint8_t * out;
+    size_t out_len;
+    if (puflib_unseal(SEALED, SEALED_LEN, &out, &out_len)) {
+        fail("puflib_unseal");
+        return;
+    }
+    free(out);
+}
+
+
+static void case_chal_resp(void)
+{
+    void * out;
+    size_t out_len;
+    if (puflib_chal_resp(TEST_MODULE, PAYLOAD, sizeof(PAYLOAD), &out, &out_len)) {
+        fail("puflib_chal_resp");
+        return;
+    }
+    free(out);
+}
+
+
+static struct {
+    char const * name;
+    void (*run)(void);
+} const CASES[] = {
+    { "get_module",             case_get_module },
+    { "module_status",          case_module_status },
+    { "get_nv_store",           case_get_nv_store },
+    { "create_delete_nv_store", case_create_delete_nv_store },
+    { "seal",                   case_seal },
+    { "unseal",                 case_unseal },
+    { "chal_resp",              case_chal_resp },
+};
+
+#define N_CASES (sizeof(CASES) / sizeof(CASES[0]))
+
+
+/******************************************************************************
+ * Harness                                                                    *
+ *****************************************************************************/
+
+struct budget {
+    char name[64];
+    struct budget_counts limit;
+};
+
+
+/**
+ * Load a budgets file: one "NAME ALLOCS FREES FS_CALLS" line per case, with
+ * blank lines and # comments ignored.
+ * @return number of budgets loaded, or -1 on error
+ */
+static int load_budgets(char const * path, struct budget * budgets)
+{
+    FILE * f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int n = 0, lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ++lineno;
+        char * comment = strchr(line, '#');
+        if (comment) {
+            *comment = 0;
+        }
+
+        char extra;
+        struct budget b;
+        int fields = sscanf(line, "%63s %" SCNu64 " %" SCNu64 " %" SCNu64 " %c", b.name,
+                &b.limit.allocs, &b.limit.frees, &b.limit.fs_calls, &extra);
+        if (fields <= 0) {
+            continue;
+        } else if (fields != 4 || n == MAX_CASES) {
+            fprintf(stderr, "%s:%d: invalid budget\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        budgets[n++] = b;
+    }
+
+    fclose(f);
+    return n;
+}
+
+
+static struct budget const * find_budget(struct budget const * budgets, int n, char const * name)
+{
+    for (int i = 0; i < n; ++i) {
+        if (!strcmp(budgets[i].name, name)) {
+            return &budgets[i];
+        }
+    }
+    return NULL;
+}
+
+
+static uint64_t per_call(uint64_t total)
+{
+    return (total + ITERATIONS - 1) / ITERATIONS;
+}
+
+
+/**
+ * Run a case, after one untimed warm-up call, and return its counts per call.
+ */
+static void measure(void (*run)(void), struct budget_counts * counts)
+{
+    run();
+
+    budget_enable(true);
+    for (int i = 0; i < ITERATIONS; ++i) {
+        run();
+    }
+    budget_enable(false);
+
+    budget_read(counts);
+    counts->allocs = per_call(counts->allocs);
+    counts->frees = per_call(counts->frees);
+    counts->fs_calls = per_call(counts->fs_calls);
+}
+
+
+static bool setup(void)
+{
+    memset(PAYLOAD, 0xa5, sizeof(PAYLOAD));
+
+    TEST_MODULE = puflib_get_module("puflibtest");
+    if (!TEST_MODULE) {
+        fprintf(stderr, "budget: puflibtest module is not built\n");
+        return true;
+    }
+
+    if (puflib_seal(TEST_MODULE, PAYLOAD, sizeof(PAYLOAD), &SEALED, &SEALED_LEN)) {
+        fail("puflib_seal");
+        return true;
+    }
+
+    // get_nv_store needs an existing store, and module_status is counted
+    // for a provisioned module; the test module is provisioned once its
+    // final store exists.
+    module_info const * const modules[] = { &BUDGET_MODULE, TEST_MODULE };
+    for (size_t i = 0; i < sizeof(modules) / sizeof(modules[0]); ++i) {
+        char * path = puflib_create_nv_store(modules[i], STORAGE_FINAL_FILE);
+        if (!path) {
+            fail("puflib_create_nv_store");
+            return true;
+        }
+        free(path);
+    }
+    return false;
+}
+
+
+static void teardown(void)
+{
+    puflib_delete_nv_store(&BUDGET_MODULE, STORAGE_FINAL_FILE);
+    puflib_delete_nv_store(&BUDGET_MODULE, STORAGE_TEMP_FILE);
+    free(SEALED);
+}
+
+
+static int remove_entry(char const * path, struct stat const * sb, int flag, struct FTW * ftw)
+{
+    (void) sb; (void) flag; (void) ftw;
+    return remove(path);
+}
+
+
+int main(int argc, char ** argv)
+{
+    bool record = argc == 2 && !strcmp(argv[1], "-r");
+    if (argc != 2) {
+        fprintf(stderr, "usage: LD_PRELOAD=libbudget.so %s BUDGETS | -r\n", argv[0]);
+        return 2;
+    }
+    if (!budget_enable || !budget_read || !budget_hide_root) {
+        fprintf(stderr, "budget: the counting interposer is not loaded (LD_PRELOAD=libbudget.so)\n");
+        return 2;
+    }
+
+    static struct budget budgets[MAX_CASES];
+    int n_budgets = 0;
+    if (!record) {
+        n_budgets = load_budgets(argv[1], budgets);
+        if (n_budgets < 0) {
+            return 2;
+        }
+    }
+
+    // Keep NV stores in a fresh directory of a fixed depth, for root too,
+    // so that the counts do not depend on the user, the real home directory
+    // or what is already provisioned on the machine.
+    char home[] = "/tmp/puflib-budget.XXXXXX";
+    budget_hide_root();
+    if (!mkdtemp(home) || setenv("HOME", home, 1)) {
+        perror("budget: temporary HOME");
+        return 2;
+    }
+
+    int rc = 2;
+    if (setup()) {
+        goto out;
+    }
+
+    struct budget_counts counts[N_CASES];
+    for (size_t c = 0; c < N_CASES && !FAILED; ++c) {
+        measure(CASES[c].run, &counts[c]);
+    }
+    if (FAILED) {
+        goto out;
+    }
+
+    if (record) {
+        printf("# libpuf API call budgets, per call: allocations, frees, filesystem calls\n");
+        printf("# %-24s %7s %7s %7s\n", "case", "allocs", "frees", "fs");
+        for (size_t c = 0; c < N_CASES; ++c) {
+            printf("%-26s %7" PRIu64 " %7" PRIu64 " %7" PRIu64 "\n", CASES[c].name,
+                    counts[c].allocs, counts[c].frees, counts[c].fs_calls);
+        }
+        rc = 0;
+        goto out;
+    }
+
+    rc = 0;
+    printf("%-24s %15s %15s %15s\n", "case", "allocs", "frees", "fs");
+    for (size_t c = 0; c < N_CASES; ++c) {
+        struct budget const * b = find_budget(budgets, n_budgets, CASES[c].name);
+        if (!b) {
+            printf("%-24s no budget recorded\n", CASES[c].name);
+            rc = 1;
+            continue;
+        }
+
+        uint64_t const got[] = { counts[c].allocs, counts[c].frees, counts[c].fs_calls };
+        uint64_t const limit[] = { b->limit.allocs, b->limit.frees, b->limit.fs_calls };
+        bool over = false, under = false;
+
+        printf("%-24s", CASES[c].name);
+        for (size_t i = 0; i < 3; ++i) {
+            char cell[32];
+            snprintf(cell, sizeof(cell), "%" PRIu64 "/%" PRIu64, got[i], limit[i]);
+            printf(" %15s", cell);
+            over |= got[i] > limit[i];
+            under |= got[i] < limit[i];
+        }
+        printf("  %s\n", over ? "OVER BUDGET" : under ? "ok (budget can be lowered)" : "ok");
+        rc |= over;
+    }
+
+out:
+    teardown();
+    nftw(home, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return rc;
+}
@@ -0,0 +1,291 @@
+// budget - allocation and filesystem call counter, for LD_PRELOAD
+//
+// Copyright (C) 2016 Assured Information Security, Inc.
+//
+// Wraps the C library's allocator and filesystem entry points, counting calls
+// while counting is enabled (see budget.h) and forwarding them unchanged.
+// Calls that the C library makes internally (e.g. the open() inside fopen())
+// do not pass through here, so each call counts once, as made by libpuf or
+// its modules. It can also hide root from getuid() (see budget_hide_root()),
+// which is not counted. glibc-specific: allocation is forwarded to __libc_malloc() and
+// friends, since dlsym() itself may allocate.
+//
+
+#define _GNU_SOURCE
+
+#include "budget.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void __libc_free(void * ptr);
+
+static bool ENABLED = false;
+static bool HIDE_ROOT = false;
+static struct budget_counts COUNTS;
+
+#define COUNT(field) do {                                               \
+        if (__atomic_load_n(&ENABLED, __ATOMIC_RELAXED)) {              \
+            __atomic_fetch_add(&COUNTS.field, 1, __ATOMIC_RELAXED);     \
+        }                                                               \
+    } while (0)
+
+// Look up the next definition of the wrapped function, once
+#define NEXT(name)                                                      \
+    static __typeof__(&name) next;                                      \
+    if (!next) {                                                        \
+        next = (__typeof__(&name)) dlsym(RTLD_NEXT, #name);             \
+    }
+
+
+void budget_enable(bool enable)
+{
+    if (enable) {
+        __atomic_store_n(&COUNTS.allocs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&COUNTS.frees, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&COUNTS.fs_calls, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&ENABLED, enable, __ATOMIC_SEQ_CST);
+}
+
+
+void budget_read(struct budget_counts * counts)
+{
+    counts->allocs = __atomic_load_n(&COUNTS.allocs, __ATOMIC_RELAXED);
+    counts->frees = __atomic_load_n(&COUNTS.frees, __ATOMIC_RELAXED);
+    counts->fs_calls = __atomic_load_n(&COUNTS.fs_calls, __ATOMIC_RELAXED);
+}
+
+
+void budget_hide_root(void)
+{
+    __atomic_store_n(&HIDE_ROOT, true, __ATOMIC_SEQ_CST);
+}
+
+
+/******************************************************************************
+ * Identity                                                                   *
+ *****************************************************************************/
+
+uid_t getuid(void)
+{
+    NEXT(getuid);
+    uid_t uid = next();
+    if (uid == 0 && __atomic_load_n(&HIDE_ROOT, __ATOMIC_RELAXED)) {
+        uid = 65534;    // nobody
+    }
+    return uid;
+}
+
+
+/******************************************************************************
+ * Allocation                                                                 *
+ *****************************************************************************/
+
+void * malloc(size_t size)
+{
+    COUNT(allocs);
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+    COUNT(allocs);
+    return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    COUNT(allocs);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void * ptr)
+{
+    if (ptr) {
+        COUNT(frees);
+    }
+    __libc_free(ptr);
+}
+
+
+/******************************************************************************
+ * Filesystem                                                                 *
+ *****************************************************************************/
+
+static mode_t open_mode(int flags, va_list ap)
+{
+    return (flags & (O_CREAT | O_TMPFILE)) ? va_arg(ap, mode_t) : 0;
+}
+
+int open(char const * path, int flags, ...)
+{
+    NEXT(open);
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    COUNT(fs_calls);
+    return next(path, flags, mode);
+}
+
+int open64(char const * path, int flags, ...)
+{
+    NEXT(open64);
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    COUNT(fs_calls);
+    return next(path, flags, mode);
+}
+
+int openat(int dirfd, char const * path, int flags, ...)
+{
+    NEXT(openat);
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = open_mode(flags, ap);
+    va_end(ap);
+    COUNT(fs_calls);
+    return next(dirfd, path, flags, mode);
+}
+
+FILE * fopen(char const * path, char const * mode)
+{
+    NEXT(fopen);
+    COUNT(fs_calls);
+    return next(path, mode);
+}
+
+FILE * fopen64(char const * path, char const * mode)
+{
+    NEXT(fopen64);
+    COUNT(fs_calls);
+    return next(path, mode);
+}
+
+int stat(char const * path, struct stat * buf)
+{
+    NEXT(stat);
+    COUNT(fs_calls);
+    return next(path, buf);
+}
+
+int lstat(char const * path, struct stat * buf)
+{
+    NEXT(lstat);
+    COUNT(fs_calls);
+    return next(path, buf);
+}
+
+int fstat(int fd, struct stat * buf)
+{
+    NEXT(fstat);
+    COUNT(fs_calls);
+    return next(fd, buf);
+}
+
+int fstatat(int dirfd, char const * path, struct stat * buf, int flags)
+{
+    NEXT(fstatat);
+    COUNT(fs_calls);
+    return next(dirfd, path, buf, flags);
+}
+
+// Before glibc 2.33, the stat() family are inline wrappers around these
+int __xstat(int ver, char const * path, struct stat * buf)
+{
+    NEXT(__xstat);
+    COUNT(fs_calls);
+    return next(ver, path, buf);
+}
+
+int __lxstat(int ver, char const * path, struct stat * buf)
+{
+    NEXT(__lxstat);
+    COUNT(fs_calls);
+    return next(ver, path, buf);
+}
+
+int __fxstat(int ver, int fd, struct stat * buf)
+{
+    NEXT(__fxstat);
+    COUNT(fs_calls);
+    return next(ver, fd, buf);
+}
+
+int access(char const * path, int mode)
+{
+    NEXT(access);
+    COUNT(fs_calls);
+    return next(path, mode);
+}
+
+int faccessat(int dirfd, char const * path, int mode, int flags)
+{
+    NEXT(faccessat);
+    COUNT(fs_calls);
+    return next(dirfd, path, mode, flags);
+}
+
+int mkdir(char const * path, mode_t mode)
+{
+    NEXT(mkdir);
+    COUNT(fs_calls);
+    return next(path, mode);
+}
+
+int rmdir(char const * path)
+{
+    NEXT(rmdir);
+    COUNT(fs_calls);
+    return next(path);
+}
+
+int unlink(char const * path)
+{
+    NEXT(unlink);
+    COUNT(fs_calls);
+    return next(path);
+}
+
+int remove(char const * path)
+{
+    NEXT(remove);
+    COUNT(fs_calls);
+    return next(path);
+}
+
+int rename(char const * oldpath, char const * newpath)
+{
+    NEXT(rename);
+    COUNT(fs_calls);
+    return next(oldpath, newpath);
+}
+
+DIR * opendir(char const * path)
+{
+    NEXT(opendir);
+    COUNT(fs_calls);
+    return next(path);
+}
+
+int nftw(char const * path,
+        int (*fn)(char const *, struct stat const *, int, struct FTW *),
+        int nopenfd, int flags)
+{
+    NEXT(nftw);
+    COUNT(fs_calls);
+    return next(path, fn, nopenfd, flags);
+}
@@ -13,11 +13,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/**
+ * Marks a function as part of libpuf's exported interface. The library is
+ * built with hidden visibility, and libpuf.map decides which of these symbols
+ * are public; everything else stays internal to the library.
+ */
+#ifndef PUFLIB_API
+#define PUFLIB_API __attribute__((visibility("default")))
+#endif
+
 /**
  * Magic header prepended to all sealed blobs
  */
 #define PUFLIB_HEADER "puflib-sealed\n"
 
+/**
+ * Length of a module root key, in bytes (see module_info::get_root_key)
+ */
+#define PUFLIB_ROOT_KEY_LEN 32
+
+/// No particular instance: see puflib_select_instance()
+#define PUFLIB_INSTANCE_ANY ((unsigned) -1)
+
 /**
  * Module status flags - bitwise OR'd
  */
@@ -53,6 +70,11 @@ typedef struct module_info_s {
 
   /**
    * Seal (encrypt) the provided data.
+   *
+   * A module with no sealing support (one used only through chal_resp()) may
+   * leave seal and unseal NULL, in which case puflib_seal() and
+   * puflib_unseal() fail with ENOTSUP.
+   *
    * @param data_in - data to be sealed
    * @param data_in_len - length of the data to be sealed, in bytes
    * @param data_out - outparam for the encrypted data. Will be allocated by
@@ -101,6 +123,91 @@ typedef struct module_info_s {
           void const * data_in,  size_t   data_in_len,
           void **      data_out, size_t * data_out_len );
 
+  /**
+   * Name of a hardware resource this module shares with other modules, such
+   * as a bus or a memory region that cannot be measured by two modules at
+   * once. Modules naming the same resource are never provisioned
+   * concurrently, and their seal, unseal and chal_resp requests share one
+   * queue. Leave NULL if the module has no such conflict.
+   */
+  char * hw_resource;
+
+  /**
+   * Reconstruct the module's root key: a secret that only this PUF can
+   * reproduce. This is an optional alternative to seal() and unseal(): if it
+   * is provided, puflib seals and unseals for the module, deriving a fresh
+   * key from the root key for every blob, and seal and unseal may be left
+   * NULL. It also lets applications cache the root key (see
+   * puflib_key_cache_configure()) so that a burst of seals reads the PUF
+   * only once.
+   *
+   * @param key - outparam for the root key, PUFLIB_ROOT_KEY_LEN bytes
+   * @return false on success, true on error
+   */
+  bool (*get_root_key)(uint8_t * key);
+
+  /**
+   * Set if chal_resp() always gives the same response to the same challenge,
+   * for example because the module error-corrects its responses. This allows
+   * applications to cache responses (see puflib_resp_cache_configure()).
+   */
+  bool chal_resp_deterministic;
+
+  /**
+   * Open a session (see puflib_session_open()): acquire whatever the module
+   * would otherwise set up on every call, such as open device handles,
+   * parsed helper data or mapped NV stores, and return it as an opaque
+   * state pointer to be passed to the session_ functions below.
+   *
+   * This is optional. A module without it can still be used through a
+   * session, which then simply calls its ordinary functions.
+   *
+   * @return session state, or NULL on error (with errno set)
+   */
+  void * (*session_open)();
+
+  /**
+   * Release a session's state. Required if session_open() is provided.
+   * @param state - state returned by session_open()
+   */
+  void (*session_close)(void * state);
+
+  /**
+   * Optional session variants of seal(), unseal(), chal_resp() and
+   * get_root_key(), taking the session's state as their first argument.
+   * Each must give the same results as its stateless counterpart, which
+   * must also be provided, and which is used instead wherever a session
+   * variant is left NULL. Calls on one session are never made concurrently.
+   */
+  bool (*session_seal)(void * state,
+          uint8_t const * data_in,  size_t   data_in_len,
+          uint8_t **      data_out, size_t * data_out_len );
+  bool (*session_unseal)(void * state,
+          uint8_t const * data_in,  size_t   data_in_len,
+          uint8_t **      data_out, size_t * data_out_len );
+  bool (*session_chal_resp)(void * state,
+          void const * data_in,  size_t   data_in_len,
+          void **      data_out, size_t * data_out_len );
+  bool (*session_get_root_key)(void * state, uint8_t * key);
+
+  /**
+   * Do the module's one-time setup ahead of its first call (see
+   * puflib_warmup()), such as initialising the hardware and checking that
+   * helper data can be loaded, so that the first seal, unseal or chal_resp
+   * is as fast as later ones. Optional.
+   * @return false on success, true on error
+   */
+  bool (*warmup)();
+
+  /**
+   * Return the number of identical devices present, such as several SRAM
+   * banks or secure elements. Each is an instance of the module, numbered
+   * from 0, with its own NV stores; the module reads puflib_instance() to
+   * find which device a call is for. Optional: a module without it has the
+   * single instance 0.
+   */
+  unsigned (*instances)();
+
 } module_info;
 
 /**
@@ -111,6 +218,8 @@ enum provisioning_status {
     PROVISION_INCOMPLETE,       ///< Some provisioning was performed, but needs to be continued
     PROVISION_COMPLETE,         ///< Provisioning is complete
     PROVISION_ERROR,            ///< An error occurred
+    PROVISION_REBOOT_REQUIRED,  ///< Some provisioning was performed, but the
+                                ///< system must be rebooted before continuing
 };
 
 
@@ -156,14 +265,14 @@ typedef bool (*puflib_query_handler_p)(
  *
  * List ends with a sentinel NULL pointer.
  */
-module_info const * const * puflib_get_modules();
+PUFLIB_API module_info const * const * puflib_get_modules();
 
 /**
  * Return a module by name, or NULL if it doesn't exist. Note that a module
  * being returned does not imply that the running system is supported by it, so
  * ->is_hw_supported() must be called on any module before using it.
  */
-module_info const * puflib_get_module(char const * name);
+PUFLIB_API module_info const * puflib_get_module(char const * name);
 
 /**
  * Query the status of a module.
@@ -171,13 +280,48 @@ module_info const * puflib_get_module(char const * name);
  * @return bitwise OR of status flags, or MODULE_STATUS_ERROR on error (with
  *  errno set).
  */
-enum module_status puflib_module_status(module_info const * module);
+PUFLIB_API enum module_status puflib_module_status(module_info const * module);
+
+/**
+ * Return the number of instances (devices) of a module present. Instances
+ * are numbered from 0.
+ */
+PUFLIB_API unsigned puflib_instance_count(module_info const * module);
+
+/**
+ * Choose which instance of a module the calling thread's later calls use.
+ *
+ * By default (PUFLIB_INSTANCE_ANY), puflib_seal() and new sessions go to
+ * the provisioned, enabled instance with the fewest requests queued, and
+ * puflib_chal_resp() picks one by a hash of the challenge, so that the same
+ * challenge always reaches the same device while different challenges are
+ * spread over all of them. If that device is not provisioned and enabled,
+ * puflib_chal_resp() fails with ENODEV rather than ask another device, whose
+ * response would not match. puflib_unseal() always uses the instance named
+ * in the blob. Status, provisioning, enabling, disabling and the NV store
+ * functions apply to instance 0.
+ *
+ * Selecting an instance sends every call to it, and makes the functions
+ * above apply to it. The selection is per thread.
+ *
+ * @param instance - instance number, or PUFLIB_INSTANCE_ANY
+ * @return the previous selection
+ */
+PUFLIB_API unsigned puflib_select_instance(unsigned instance);
 
 /**
  * Seal a secret. The input data will be encrypted by the PUF module, and the
  * output data will be passed as a newly allocated block through data_out and
  * data_out_len. Caller is responsible for freeing data_out.
  *
+ * Seals, unseals and challenge-response calls on one module (or on modules
+ * sharing a hw_resource) are passed to the hardware one at a time, in the
+ * order they were made; concurrent callers queue in the library rather than
+ * in the module. For a module that provides a root key, only reading the key
+ * is queued, and the encryption runs concurrently on the calling threads. A
+ * module with several instances has a queue for each (see
+ * puflib_select_instance()), and the blob records the instance used.
+ *
  * @param module - module to use
  * @param data_in - data to be sealed
  * @param data_in_len - length of data_in, in bytes
@@ -186,9 +330,9 @@ enum module_status puflib_module_status(module_info const * module);
  * @param data_out_len - pointer to a size_t to receive the output data's
  *  length, in bytes.
  *
- * @return true on error
+ * @return true on error (errno is ENOTSUP if the module cannot seal)
  */
-bool puflib_seal(module_info const * module,
+PUFLIB_API bool puflib_seal(module_info const * module,
         uint8_t const * data_in, size_t data_in_len,
         uint8_t ** data_out, size_t * data_out_len);
 
@@ -197,6 +341,13 @@ bool puflib_seal(module_info const * module,
  * output data will be passed as a newly allocated block through data_out and
  * data_out_len. Caller is responsible for freeing data_out.
  *
+ * If another thread is already unsealing the same blob, this waits for it
+ * and returns a copy of its result rather than unsealing again.
+ *
+ * Blobs from puflib_seal_redundant() are unsealed by whichever of their
+ * modules answers first; the other modules may still be running when this
+ * returns (see there).
+ *
  * @param data_in - data to be unsealed
  * @param data_in_len - length of data_in, in bytes
  * @param data_out - pointer to a (uint8_t *) to receive the data.
@@ -206,7 +357,7 @@ bool puflib_seal(module_info const * module,
  *
  * @return true on error, including if the data cannot be decrypted.
  */
-bool puflib_unseal(
+PUFLIB_API bool puflib_unseal(
         uint8_t const * data_in, size_t data_in_len,
         uint8_t ** data_out, size_t * data_out_len);
 
@@ -222,6 +373,9 @@ bool puflib_unseal(
  * Not all modules implement chal_resp(); if the chosen module does not,
  * this function will return true.
  *
+ * Concurrent calls with the same challenge to the same module are merged
+ * into one hardware query, and every caller receives a copy of its response.
+ *
  * @param module - module to use
  * @param data_in - challenge input data
  * @param data_in_len - challenge input length in bytes
@@ -230,7 +384,7 @@ bool puflib_unseal(
  * @param data_out_len - outparam for the length of the data, in bytes.
  * @return false on success, true on error.
  */
-bool puflib_chal_resp(module_info const * module,
+PUFLIB_API bool puflib_chal_resp(module_info const * module,
         void const * data_in, size_t data_in_len,
         void ** data_out, size_t * data_out_len);
 
@@ -240,31 +394,346 @@ bool puflib_chal_resp(module_info const * module,
  * @param module - module to deprovision
  * @return true on error
  */
-bool puflib_deprovision(module_info const * module);
+PUFLIB_API bool puflib_deprovision(module_info const * module);
 
 /**
  * Enable the module if disabled. No-op if the module is not disabled or not
- * provisioned.
+ * provisioned. Safe against concurrent enabling and disabling from other
+ * threads or processes: the module ends up in the state of whichever call
+ * came last.
  * @param module - module to enable
  * @return true on error
  */
-bool puflib_enable(module_info const * module);
+PUFLIB_API bool puflib_enable(module_info const * module);
 
 /**
  * Disable the module if enabled. No-op if the module is not enabled or not
- * provisionsed.
+ * provisionsed. Safe against concurrent calls, as for puflib_enable().
  * @param module - module to enable
  * @return true on error
  */
-bool puflib_disable(module_info const * module);
+PUFLIB_API bool puflib_disable(module_info const * module);
+
+/// Cancellation token. Opaque.
+struct puflib_cancel;
+
+/**
+ * Limits on one operation, for the _deadline variants of the calls below.
+ */
+struct puflib_deadline {
+    uint64_t timeout_ms;            ///< Time allowed from the start of the
+                                    ///< call, in milliseconds; 0 for no limit
+    struct puflib_cancel * cancel;  ///< Token to cancel the call, or NULL
+};
+
+/**
+ * Create a cancellation token. A token may be shared by any number of
+ * operations; cancelling it cancels them all.
+ * @return token, or NULL on error (with errno set)
+ */
+PUFLIB_API struct puflib_cancel * puflib_cancel_new(void);
+
+/**
+ * Free a cancellation token. It must not be in use by any operation.
+ */
+PUFLIB_API void puflib_cancel_free(struct puflib_cancel * cancel);
+
+/**
+ * Cancel the operations using a token. Safe to call from any thread, and
+ * from a signal handler. Operations waiting for the device give up within
+ * a few milliseconds; an operation already running in a module stops when
+ * the module next checks (see puflib_op_expired()). Cancellation cannot be
+ * undone: use a new token for later operations.
+ */
+PUFLIB_API void puflib_cancel(struct puflib_cancel * cancel);
+
+/**
+ * As puflib_seal(), but give up when @a deadline expires or is cancelled.
+ * The time spent queued behind other calls to the device counts against the
+ * deadline. A call merged with an identical one waits for it only until its
+ * own deadline.
+ *
+ * @param deadline - limits on the call, or NULL for none
+ * @return true on error (errno is ETIMEDOUT if the deadline passed, or
+ *  ECANCELED if it was cancelled)
+ */
+PUFLIB_API bool puflib_seal_deadline(module_info const * module,
+        struct puflib_deadline const * deadline,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * As puflib_unseal(), with a deadline as for puflib_seal_deadline().
+ * @return true on error (errno is ETIMEDOUT or ECANCELED if the deadline
+ *  expired)
+ */
+PUFLIB_API bool puflib_unseal_deadline(struct puflib_deadline const * deadline,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * As puflib_chal_resp(), with a deadline as for puflib_seal_deadline().
+ * @return true on error (errno is ETIMEDOUT or ECANCELED if the deadline
+ *  expired)
+ */
+PUFLIB_API bool puflib_chal_resp_deadline(module_info const * module,
+        struct puflib_deadline const * deadline,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len);
+
+/**
+ * Run a module's provision() with a deadline. Provisioning can only stop
+ * early where the module checks puflib_op_expired().
+ *
+ * @return status from provision(), or PROVISION_ERROR with errno ETIMEDOUT
+ *  or ECANCELED if the deadline had already expired
+ */
+PUFLIB_API enum provisioning_status puflib_provision_deadline(module_info const * module,
+        struct puflib_deadline const * deadline);
+
+/**
+ * Seal a secret so that any one of several modules can unseal it. The data
+ * is encrypted once under a random key, and that key is sealed by each module
+ * in parallel; the call fails if any of them fails. The result is unsealed
+ * with puflib_unseal() as usual.
+ *
+ * Unsealing starts with the module expected to be fastest, from a running
+ * estimate of each module's unseal latency, and starts the next module
+ * whenever the last has taken longer than expected (see
+ * puflib_set_hedge_delay()). The first module to succeed wins and the others
+ * are cancelled, so a slow or failing device costs at most its hedge delay.
+ * Modules not built into the library that unseals the blob are skipped.
+ *
+ * Each module unseals on a thread of its own, and puflib_unseal() does not
+ * wait for the losers: they stop waiting for their device when cancelled,
+ * but a module already in the middle of a call runs on until that call
+ * returns. Until then they may call into the module and report through the
+ * status handler, from their own threads and after puflib_unseal() has
+ * returned. The status handler must be safe to call from any thread, and a
+ * program that unloads libpuf with dlclose() must not unseal redundant blobs
+ * beforehand.
+ *
+ * @param modules - modules to seal under
+ * @param n_modules - number of modules, from 1 to 16
+ * @return true on error (errno is EINVAL for a bad module list)
+ */
+PUFLIB_API bool puflib_seal_redundant(module_info const * const * modules, size_t n_modules,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Set how long unsealing a redundant blob waits for one module before also
+ * starting the next. By default (0), each module gets its mean unseal time
+ * plus four times its mean deviation, between 1 ms and 2 s, or 20 ms until
+ * it has been used.
+ */
+PUFLIB_API void puflib_set_hedge_delay(unsigned long delay_ms);
+
+/// Open module session. Opaque.
+struct puflib_session;
+
+/**
+ * Open a session on a module. A session keeps the module's per-call setup,
+ * such as open device handles and loaded helper data, alive across calls,
+ * so that a series of seals, unseals or challenge-response calls pays for it
+ * once. Modules that do not support sessions (see module_info::session_open)
+ * may still be used through one, at no benefit.
+ *
+ * A session may be used from several threads at once: like the stateless
+ * calls, its calls are passed to the hardware one at a time. It must not be
+ * used after, or concurrently with, puflib_session_close(). A session holds
+ * state loaded when it was opened, so close it before deprovisioning,
+ * disabling or reprovisioning its module.
+ *
+ * @param module - module to open a session on
+ * @return session, or NULL on error (with errno set)
+ */
+PUFLIB_API struct puflib_session * puflib_session_open(module_info const * module);
+
+/**
+ * Close a session and release the module state it holds.
+ * @param session - session to close. May be NULL.
+ */
+PUFLIB_API void puflib_session_close(struct puflib_session * session);
+
+/**
+ * Return the module a session was opened on.
+ */
+PUFLIB_API module_info const * puflib_session_module(struct puflib_session const * session);
+
+/**
+ * Seal a secret through a session. As for puflib_seal(); the output can be
+ * unsealed with or without a session.
+ * @return true on error
+ */
+PUFLIB_API bool puflib_session_seal(struct puflib_session * session,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Unseal a secret through a session. As for puflib_unseal(), except that the
+ * blob must have been sealed by the session's module.
+ * @return true on error (errno is EINVAL if the blob belongs to another
+ *  module)
+ */
+PUFLIB_API bool puflib_session_unseal(struct puflib_session * session,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Perform a challenge-response call through a session. As for
+ * puflib_chal_resp().
+ * @return false on success, true on error
+ */
+PUFLIB_API bool puflib_session_chal_resp(struct puflib_session * session,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len);
+
+/**
+ * Move a sealed secret to another module: unseal a blob and seal its
+ * contents again through a session, as when a module is retired or
+ * re-enrolled. The secret never leaves the library, and is wiped as soon as
+ * it has been sealed again.
+ *
+ * Migrating many blobs is fastest with a pair of sessions per thread, which
+ * spreads the work over the instances of each module (see
+ * puflib_select_instance()).
+ *
+ * @param from - session on the module the blob was sealed by, used when the
+ *  blob belongs to the session's instance. A blob sealed by another module
+ *  is rejected with EINVAL. If NULL, any blob is accepted, as by
+ *  puflib_unseal().
+ * @param to - session to seal the secret through
+ * @param data_in - sealed blob
+ * @param data_in_len - length of the blob
+ * @param data_out - outparam for the new blob, allocated by the library; the
+ *  caller frees it
+ * @param data_out_len - outparam for the length of the new blob
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_reseal(struct puflib_session * from, struct puflib_session * to,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Phases of puflib_warmup() - bitwise OR'd
+ */
+enum puflib_warmup_flags {
+    WARMUP_LIBRARY = 0x01,      ///< Run the library's crypto once and set up
+                                ///< the module's request queue and caches
+    WARMUP_MODULE = 0x02,       ///< Call the module's warmup() hook
+    WARMUP_ROOT_KEY = 0x04,     ///< Fill the root key cache, if it is
+                                ///< configured for the module
+    WARMUP_ALL = 0x07,
+};
+
+/**
+ * Time taken by each phase of puflib_warmup().
+ */
+struct puflib_warmup_report {
+    unsigned done;              ///< Phases that did work; see enum puflib_warmup_flags
+    uint64_t library_us;        ///< Duration of WARMUP_LIBRARY, in microseconds
+    uint64_t module_us;         ///< Duration of WARMUP_MODULE, in microseconds
+    uint64_t root_key_us;       ///< Duration of WARMUP_ROOT_KEY, in microseconds
+};
+
+/**
+ * Do ahead of time the work that would otherwise make the first call to a
+ * module slower than the rest: fault in and exercise the library's crypto,
+ * set up the module's request queue, let the module initialise its hardware
+ * and load its helper data, and read the root key into the key cache. Call
+ * this once at startup, before reporting ready. Each phase is reported with
+ * its duration as a STATUS_INFO message.
+ *
+ * A phase with nothing to do is skipped: WARMUP_MODULE if the module has no
+ * warmup() hook, WARMUP_ROOT_KEY unless puflib_key_cache_configure() has
+ * enabled the cache for the module.
+ *
+ * @param module - module to warm up
+ * @param flags - phases to run, from enum puflib_warmup_flags
+ * @param report - outparam for the phases run and their durations. May be
+ *  NULL.
+ * @return false on success, true on error (the report covers the phases run
+ *  up to the error)
+ */
+PUFLIB_API bool puflib_warmup(module_info const * module, unsigned flags,
+        struct puflib_warmup_report * report);
+
+/**
+ * Let puflib keep a module's root key in memory between seal and unseal
+ * calls, so that only the first of a burst of calls has to read the PUF.
+ * The key is held in memory that is locked against swapping, and is
+ * discarded once it is older than @a ttl_ms or has been used @a max_uses
+ * times, whichever comes first. The cache is off by default.
+ *
+ * Only modules providing get_root_key() can be cached. Reconfiguring a
+ * module discards its cached key.
+ *
+ * @param module - module to configure
+ * @param ttl_ms - maximum age of the cached key in milliseconds, or 0 for no
+ *  limit
+ * @param max_uses - maximum number of seals and unseals served by one
+ *  reconstruction of the key, or 0 for no limit. If both limits are 0, the
+ *  cache is turned off for this module.
+ * @return false on success, true on error (errno is ENOTSUP if the module
+ *  does not provide get_root_key())
+ */
+PUFLIB_API bool puflib_key_cache_configure(module_info const * module,
+        unsigned long ttl_ms, unsigned long max_uses);
+
+/**
+ * Discard cached root keys, overwriting them in memory. Cached keys are also
+ * discarded when their module is deprovisioned or disabled, and when the
+ * library is unloaded.
+ *
+ * @param module - module whose key to discard, or NULL for all modules
+ */
+PUFLIB_API void puflib_key_cache_flush(module_info const * module);
+
+/**
+ * Turn caching of puflib_chal_resp() responses on or off for a module.
+ * Responses are kept in a process-wide LRU cache, bounded by
+ * puflib_resp_cache_set_capacity(), so that a repeated challenge does not
+ * query the hardware again. The cache is off by default.
+ *
+ * @param module - module to configure. Must set chal_resp_deterministic.
+ * @param enable - whether to cache this module's responses. Turning caching
+ *  off discards the module's cached responses.
+ * @return false on success, true on error (errno is ENOTSUP if the module's
+ *  responses are not deterministic)
+ */
+PUFLIB_API bool puflib_resp_cache_configure(module_info const * module, bool enable);
+
+/**
+ * Set the maximum number of responses held by the response cache, across all
+ * modules. Least recently used responses are evicted to fit. The default is
+ * PUFLIB_RESP_CACHE_DEFAULT_CAPACITY.
+ *
+ * @param max_entries - maximum number of cached responses. The cache is
+ *  split into equal shards, so this is rounded up to a multiple of the
+ *  shard count.
+ */
+PUFLIB_API void puflib_resp_cache_set_capacity(size_t max_entries);
+
+/// Default capacity of the response cache
+#define PUFLIB_RESP_CACHE_DEFAULT_CAPACITY 4096
+
+/**
+ * Discard cached responses. Responses are also discarded when their module
+ * is deprovisioned, enabled or disabled.
+ *
+ * @param module - module whose responses to discard, or NULL for all modules
+ */
+PUFLIB_API void puflib_resp_cache_flush(module_info const * module);
 
 /**
  * Set a callback function to receive status messages. This defaults to NULL,
- * so any messages generated before this is called will be dropped!
+ * so any messages generated before this is called will be dropped! The
+ * handler may be replaced at any time, even while other threads are running.
  *
  * @param callback - callback, or NULL to ignore messages.
  */
-void puflib_set_status_handler(puflib_status_handler_p callback);
+PUFLIB_API void puflib_set_status_handler(puflib_status_handler_p callback);
 
 /**
  * Set a callback function to receive queries. This defaults to NULL. If any
@@ -274,6 +743,328 @@ void puflib_set_status_handler(puflib_status_handler_p callback);
  *
  * @param callback - callback, or NULL to clear (but see warning above)
  */
-void puflib_set_query_handler(puflib_query_handler_p callback);
+PUFLIB_API void puflib_set_query_handler(puflib_query_handler_p callback);
+
+/**
+ * @name Challenge-response database
+ * Verifier-side storage of enrolled challenge-response pairs (CRPs), for
+ * attesting a device through puflib_chal_resp(). A database is a single file
+ * holding one device's CRPs in fixed-width records behind a hash index, and
+ * is memory-mapped on open so that a lookup touches only a couple of pages.
+ * Each CRP carries a used flag, so that a challenge is accepted only once and
+ * a recorded response cannot be replayed.
+ */
+/// @{
+
+/**
+ * Result of checking a response against the database.
+ */
+enum crp_result {
+    CRP_MATCH,      ///< Response is within tolerance of the enrolled one
+    CRP_MISMATCH,   ///< Response differs from the enrolled one
+    CRP_UNKNOWN,    ///< Challenge is not in the database
+    CRP_USED,       ///< Challenge has already been used
+    CRP_ERROR,      ///< There was an error checking the response
+};
+
+/// Open CRP database. Opaque.
+struct puflib_crpdb;
+
+/**
+ * One challenge-response pair, pointing into an open database.
+ */
+struct puflib_crp {
+    size_t index;                   ///< Position of the CRP in the database
+    uint8_t const * challenge;      ///< Challenge, puflib_crpdb_chal_len() bytes
+    uint8_t const * response;       ///< Response, puflib_crpdb_resp_len() bytes
+    bool used;                      ///< Whether the CRP has been used
+};
+
+/**
+ * Create a CRP database from bulk challenge-response output. Fails with
+ * EEXIST if the file exists, or if the same challenge appears twice.
+ *
+ * @param path - file to create
+ * @param chal_len - length of each challenge, in bytes
+ * @param resp_len - length of each response, in bytes
+ * @param n_crps - number of pairs
+ * @param challenges - n_crps challenges, back to back
+ * @param responses - n_crps responses, back to back, in the same order
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_crpdb_create(char const * path, size_t chal_len, size_t resp_len,
+        size_t n_crps, uint8_t const * challenges, uint8_t const * responses);
+
+/**
+ * Enroll a device: send it random challenges through puflib_chal_resp() and
+ * create a CRP database of the responses. The module must give responses of
+ * the same length to every challenge. The device enrolled is the selected
+ * instance (see puflib_select_instance()), or instance 0.
+ *
+ * @param module - module to enroll
+ * @param path - database file to create
+ * @param n_crps - number of pairs to enroll
+ * @param chal_len - length of each random challenge, in bytes
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_crpdb_enroll(module_info const * module, char const * path,
+        size_t n_crps, size_t chal_len);
+
+/**
+ * Open a CRP database.
+ * @param path - database file
+ * @param writable - open for marking CRPs used. A read-only database can
+ *  look up CRPs, but puflib_crpdb_verify() cannot consume them.
+ * @return database (close with puflib_crpdb_close()), or NULL on error with
+ *  errno set (EBADMSG if the file is not a valid database)
+ */
+PUFLIB_API struct puflib_crpdb * puflib_crpdb_open(char const * path, bool writable);
+
+/**
+ * Close a CRP database, flushing used flags to disk.
+ * @return false on success, true on error (with errno set). The database is
+ *  closed either way.
+ */
+PUFLIB_API bool puflib_crpdb_close(struct puflib_crpdb * db);
+
+/// Return the number of CRPs in a database.
+PUFLIB_API size_t puflib_crpdb_count(struct puflib_crpdb const * db);
+
+/// Return the length of each challenge in a database, in bytes.
+PUFLIB_API size_t puflib_crpdb_chal_len(struct puflib_crpdb const * db);
+
+/// Return the length of each response in a database, in bytes.
+PUFLIB_API size_t puflib_crpdb_resp_len(struct puflib_crpdb const * db);
+
+/**
+ * Look up a challenge.
+ * @param db - database
+ * @param challenge - challenge to look up
+ * @param chal_len - length of the challenge, in bytes
+ * @param crp - outparam for the pair, valid until the database is closed
+ * @return false if found, true if not (errno is ENOENT, or EBADMSG if the
+ *  database is damaged)
+ */
+PUFLIB_API bool puflib_crpdb_lookup(struct puflib_crpdb const * db,
+        uint8_t const * challenge, size_t chal_len, struct puflib_crp * crp);
+
+/**
+ * Find the next unused CRP, to issue its challenge to the device.
+ * @param db - database
+ * @param cursor - in/out: index to start searching from; set past the CRP
+ *  found. Start at zero.
+ * @param crp - outparam for the pair, valid until the database is closed
+ * @return false if found, true if not (errno is ENOENT)
+ */
+PUFLIB_API bool puflib_crpdb_next_unused(struct puflib_crpdb const * db, size_t * cursor,
+        struct puflib_crp * crp);
+
+/**
+ * Check a device's response to a challenge.
+ *
+ * @param db - database
+ * @param challenge - challenge that was issued
+ * @param chal_len - length of the challenge, in bytes
+ * @param response - response received from the device
+ * @param resp_len - length of the response, in bytes
+ * @param max_distance - number of response bits allowed to differ from the
+ *  enrolled response, to tolerate PUF noise
+ * @param consume - mark the CRP used, so that it is never accepted again. The
+ *  CRP is consumed whether or not the response matches. Concurrent
+ *  consumption of the same CRP, including from other processes, lets exactly
+ *  one caller through.
+ * @return result of the check; on CRP_ERROR, errno is set
+ */
+PUFLIB_API enum crp_result puflib_crpdb_verify(struct puflib_crpdb * db,
+        uint8_t const * challenge, size_t chal_len,
+        uint8_t const * response, size_t resp_len,
+        size_t max_distance, bool consume);
+
+/// @}
+
+/**
+ * @name Keystore
+ * Many named secrets in a single file, each sealed on its own. Looking a name
+ * up takes a hash index probe and unseals only that secret. Updates are
+ * appended to a log within the file, and the file is compacted as garbage
+ * builds up. Several threads and processes may use a keystore at once.
+ */
+/// @{
+
+/// Open keystore. Opaque.
+struct puflib_keystore;
+
+/**
+ * Create an empty keystore. Fails with EEXIST if the file exists.
+ * @param path - file to create. A lock file is kept beside it, named
+ *  @a path with ".lock" appended.
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_keystore_create(char const * path);
+
+/**
+ * Open a keystore.
+ * @param path - keystore file
+ * @param writable - open for puflib_keystore_put(), puflib_keystore_delete()
+ *  and puflib_keystore_compact(), which otherwise fail with EBADF
+ * @return keystore (close with puflib_keystore_close()), or NULL on error
+ *  with errno set (EBADMSG if the file is not a valid keystore)
+ */
+PUFLIB_API struct puflib_keystore * puflib_keystore_open(char const * path, bool writable);
+
+/**
+ * Close a keystore.
+ * @return false on success, true on error (with errno set). The keystore is
+ *  closed either way.
+ */
+PUFLIB_API bool puflib_keystore_close(struct puflib_keystore * ks);
+
+/**
+ * Seal a secret with a module, as puflib_seal() does, and store it under a
+ * name, replacing any secret already stored under that name. The keystore is
+ * only locked once the secret has been sealed.
+ *
+ * @param ks - keystore, opened writable
+ * @param module - module to seal with
+ * @param name - name, a non-empty string of at most 1024 bytes
+ * @param data - secret
+ * @param data_len - length of the secret
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_keystore_put(struct puflib_keystore * ks, module_info const * module,
+        char const * name, uint8_t const * data, size_t data_len);
+
+/**
+ * Look up a secret by name and unseal it, as puflib_unseal() does.
+ * @param ks - keystore
+ * @param name - name
+ * @param data_out - outparam for the secret, allocated by the library; the
+ *  caller frees it
+ * @param data_out_len - outparam for the length of the secret
+ * @return false on success, true on error (with errno set; ENOENT if there is
+ *  no such name)
+ */
+PUFLIB_API bool puflib_keystore_get(struct puflib_keystore * ks, char const * name,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Delete a secret.
+ * @return false on success, true on error (with errno set; ENOENT if there is
+ *  no such name)
+ */
+PUFLIB_API bool puflib_keystore_delete(struct puflib_keystore * ks, char const * name);
+
+/**
+ * List the names in a keystore, in no particular order.
+ * @param ks - keystore
+ * @param names - outparam for a NULL-terminated array of names, allocated
+ *  together with the names themselves; the caller frees it with one free()
+ * @param n_names - outparam for the number of names
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_keystore_list(struct puflib_keystore * ks, char *** names,
+        size_t * n_names);
+
+/**
+ * Rewrite a keystore without the space taken by replaced and deleted
+ * secrets. Updates do this by themselves when it is worthwhile; this is for
+ * reclaiming the space at once.
+ * @param ks - keystore, opened writable
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_keystore_compact(struct puflib_keystore * ks);
+
+/// @}
+
+/**
+ * @name Quality analysis
+ * Qualification metrics for PUF devices. A dataset summarises one device: its
+ * majority response to a fixed series of challenges, and how far repeated
+ * reads strayed from it. Datasets are collected on each device, saved to
+ * files, and analysed together to compare devices.
+ *
+ * Challenge i is derived from i alone, so every device of a batch answers the
+ * same challenges.
+ */
+/// @{
+
+/// Collected dataset. Opaque.
+struct puflib_dataset;
+
+/**
+ * Quality metrics over one or more datasets. Fractions are of response bits;
+ * min and max are over devices (or, for uniqueness, over pairs of devices).
+ */
+struct puflib_quality {
+    size_t n_devices;
+    uint64_t n_bits;            ///< Response bits per device
+    double uniformity;          ///< Mean fraction of 1 bits; ideally 0.5
+    double uniformity_min;
+    double uniformity_max;
+    double reliability;         ///< 1 - mean distance of a read from the majority; ideally 1
+    double reliability_min;
+    double unstable;            ///< Mean fraction of bits that flipped in any read; ideally 0
+    double uniqueness;          ///< Mean distance between devices; ideally 0.5, NaN for one device
+    double uniqueness_min;
+    double uniqueness_max;
+    double bit_aliasing_min;    ///< Lowest fraction of devices setting any one bit; ideally 0.5
+    double bit_aliasing_max;    ///< Highest fraction of devices setting any one bit; ideally 0.5
+    double min_entropy;         ///< Mean min-entropy per bit across devices; ideally 1
+};
+
+/**
+ * Collect a dataset from a module by reading each of n_challenges challenges
+ * n_reads times. Challenges are processed in blocks spread over n_threads
+ * threads, and only one block's reads are held in memory at once. All
+ * responses must have the same length. Every read is from one device: the
+ * selected instance (see puflib_select_instance()), or instance 0.
+ *
+ * @param module - module to read; must implement chal_resp()
+ * @param n_challenges - number of challenges
+ * @param chal_len - length of each challenge, in bytes
+ * @param n_reads - reads per challenge, 1 to 65535
+ * @param n_threads - worker threads, or 0 for one per CPU
+ * @return dataset, or NULL on error (with errno set; EPROTO if response
+ *  lengths vary)
+ */
+PUFLIB_API struct puflib_dataset * puflib_dataset_collect(module_info const * module,
+        size_t n_challenges, size_t chal_len, unsigned n_reads, unsigned n_threads);
+
+/**
+ * Save a dataset to a file, replacing it if it exists.
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_dataset_save(struct puflib_dataset const * dataset, char const * path);
+
+/**
+ * Load a dataset saved by puflib_dataset_save().
+ * @return dataset, or NULL on error (with errno set; EBADMSG if the file is
+ *  not a valid dataset)
+ */
+PUFLIB_API struct puflib_dataset * puflib_dataset_load(char const * path);
+
+/// Free a dataset. NULL is a no-op.
+PUFLIB_API void puflib_dataset_free(struct puflib_dataset * dataset);
+
+/// Return the name of the module a dataset was collected from, with
+/// "@N" appended for any instance but the first.
+PUFLIB_API char const * puflib_dataset_module(struct puflib_dataset const * dataset);
+
+/**
+ * Compute quality metrics over datasets from one or more devices. The
+ * datasets must have been collected with the same number and length of
+ * challenges, and have the same response length.
+ *
+ * @param datasets - datasets, one per device
+ * @param n_datasets - number of datasets, 1 to 65535
+ * @param n_threads - worker threads, or 0 for one per CPU
+ * @param quality - outparam for the metrics
+ * @return false on success, true on error (with errno set; EINVAL if the
+ *  datasets do not match)
+ */
+PUFLIB_API bool puflib_analyze(struct puflib_dataset const * const * datasets, size_t n_datasets,
+        unsigned n_threads, struct puflib_quality * quality);
+
+/// @}
 
 #endif // _PUFLIB_H_
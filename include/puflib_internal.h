@@ -1,7 +1,8 @@
 // (C) Copyright 2016 Assured Information Security, Inc.
 //
 // Internal header, to expose internal puflib functions for use by
-// tools like pufctl.
+// tools like pufctl. These are exported under the PUFLIB_PRIVATE symbol
+// version and are not part of the stable ABI.
 
 #ifndef _PUFLIB_INTERNAL_H_
 #define _PUFLIB_INTERNAL_H_
@@ -20,7 +21,7 @@
 /**
  * Return the path separator on this platform.
  */
-char const * puflib_get_path_sep();
+PUFLIB_API char const * puflib_get_path_sep();
 
 /**
  * Return a path for a nonvolatile store, given the store type and module
@@ -31,7 +32,62 @@ char const * puflib_get_path_sep();
  *
  * @return path to directory on success, NULL on error (with errno set)
  */
-char * puflib_get_nv_store_path(char const * module_name, enum puflib_storage_type type);
+PUFLIB_API char * puflib_get_nv_store_path(char const * module_name, enum puflib_storage_type type);
+
+/// Returned by puflib_lock_stores() when there is nothing to lock
+#define PUFLIB_NO_LOCK (-2)
+
+/**
+ * Lock the NV stores of all modules against changes of state (provisioning,
+ * enabling and disabling) by other threads and processes, so that state
+ * spread over several stores is read and changed consistently. Any number of
+ * shared locks can be held at once, but an exclusive lock excludes all
+ * others. Locks are advisory and are not recursive.
+ *
+ * @param exclusive - take an exclusive lock, to change state, rather than a
+ *  shared one, to read it
+ * @return lock to release with puflib_unlock_stores(), PUFLIB_NO_LOCK if no
+ *  store exists yet or a shared lock cannot be taken for lack of access to
+ *  the lock file, or -1 on error (with errno set)
+ */
+PUFLIB_API int puflib_lock_stores(bool exclusive);
+
+/**
+ * Release a lock from puflib_lock_stores(). PUFLIB_NO_LOCK is ignored.
+ */
+PUFLIB_API void puflib_unlock_stores(int lock);
+
+/**
+ * Open a lock file, creating it if it does not exist, for guarding another
+ * file against concurrent changes by other threads and processes. If the
+ * file cannot be created or written, it is opened for shared locks only.
+ *
+ * @param path - path to the lock file
+ * @return handle for puflib_lock_file(), or -1 on error (with errno set)
+ */
+int puflib_open_lock_file(char const * path);
+
+/**
+ * Take a lock on a lock file, waiting for it as long as needed. As with
+ * puflib_lock_stores(), locks are advisory, and any number of shared locks
+ * can be held at once but an exclusive lock excludes all others.
+ *
+ * @param lock - handle from puflib_open_lock_file()
+ * @param exclusive - take an exclusive lock, to write, rather than a shared
+ *  one, to read
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_lock_file(int lock, bool exclusive);
+
+/**
+ * Release a lock taken with puflib_lock_file().
+ */
+void puflib_unlock_file(int lock);
+
+/**
+ * Close a lock file opened with puflib_open_lock_file(), releasing any lock.
+ */
+void puflib_close_lock_file(int lock);
 
 /**
  * Create a directory and all parent directories that don't already exist. This
@@ -41,7 +97,7 @@ char * puflib_get_nv_store_path(char const * module_name, enum puflib_storage_ty
  *  used to pass in a full file path and avoid creating the file as a directory.
  * @return false on success, true on error (with errno set)
  */
-bool puflib_create_directory_tree(char const * path, bool skip_last);
+PUFLIB_API bool puflib_create_directory_tree(char const * path, bool skip_last);
 
 /**
  * Create and open a new file, but fail if it already exists. This should be
@@ -63,12 +119,29 @@ FILE * puflib_create_and_open(char const * path, char const * mode);
  */
 FILE * puflib_open_existing(char const * path, char const * mode);
 
+/**
+ * Write an open file's buffered data and wait until it is on disk.
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_sync_file(FILE * f);
+
+/**
+ * Atomically replace a file with another, so that anyone opening @a path
+ * sees either the old file or the new one in full, and wait until the
+ * change is on disk.
+ *
+ * @param from - path of the new file, which is moved
+ * @param path - path of the file to replace
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_replace_file(char const * from, char const * path);
+
 /**
  * Create a directory.
  * @param path - path to directory
  * @return false on success, true on failure
  */
-bool puflib_mkdir(char const * path);
+PUFLIB_API bool puflib_mkdir(char const * path);
 
 /**
  * Check whether the running process can access a path.
@@ -83,7 +156,7 @@ bool puflib_mkdir(char const * path);
  * @param isdirectory - if true, test as a directory rather than as a file.
  * @return false iff the running process can access a path.
  */
-bool puflib_check_access(char const * path, bool isdirectory);
+PUFLIB_API bool puflib_check_access(char const * path, bool isdirectory);
 
 /**
  * Delete an entire directory tree.
@@ -91,6 +164,62 @@ bool puflib_check_access(char const * path, bool isdirectory);
  * @param path - tree to delete
  * @return false on success, true on error (with errno set)
  */
-bool puflib_delete_tree(char const * path);
+PUFLIB_API bool puflib_delete_tree(char const * path);
+
+/**
+ * Map a whole file into memory. Changes to a writable mapping are written
+ * back to the file and are visible to other processes mapping it.
+ *
+ * @param path - path to the file
+ * @param writable - map for reading and writing rather than reading only
+ * @param len - outparam for the length of the mapping, in bytes
+ * @return mapping (release with puflib_unmap_file()), or NULL on error (with
+ *  errno set; EINVAL if the file is empty)
+ */
+PUFLIB_API void * puflib_map_file(char const * path, bool writable, size_t * len);
+
+/**
+ * Release a mapping made by puflib_map_file().
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_unmap_file(void * addr, size_t len);
+
+/**
+ * Flush changes to a writable mapping to the underlying file.
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_sync_mapping(void * addr, size_t len);
+
+/**
+ * Allocate memory for holding keys: locked into RAM so that it is never
+ * written to swap, and excluded from core dumps where the platform allows.
+ * The memory is zeroed.
+ *
+ * @param len - number of bytes
+ * @return memory (release with puflib_secure_free()), or NULL on error (with
+ *  errno set; typically EPERM or ENOMEM if the locked memory limit is
+ *  reached)
+ */
+PUFLIB_API void * puflib_secure_alloc(size_t len);
+
+/**
+ * Zero and release memory from puflib_secure_alloc(). NULL is ignored.
+ */
+PUFLIB_API void puflib_secure_free(void * addr, size_t len);
+
+/**
+ * Return a monotonic time in milliseconds, for measuring intervals.
+ */
+PUFLIB_API uint64_t puflib_monotonic_ms(void);
+
+/**
+ * Return a monotonic time in microseconds, for measuring short intervals.
+ */
+PUFLIB_API uint64_t puflib_monotonic_us(void);
+
+/**
+ * Return the number of CPUs available, or 1 if it cannot be determined.
+ */
+PUFLIB_API unsigned puflib_cpu_count(void);
 
 #endif // _PUFLIB_INTERNAL_H_
@@ -14,7 +14,8 @@
  * @name Nonvolatile storage
  * These functions provide nonvolatile storage to modules, both for temporary
  * use during provisioning, and for permanent storage of the results of
- * provisioning.
+ * provisioning. Each instance of a module has its own stores: the functions
+ * act on the stores of the instance the call is for (see puflib_instance()).
  */
 /// @{
 
@@ -50,7 +51,7 @@ enum puflib_storage_type
  * @param type - type of storage requested
  * @return path or NULL on error; caller is responsible for calling free().
  */
-char * puflib_create_nv_store(module_info const * module, enum puflib_storage_type type);
+PUFLIB_API char * puflib_create_nv_store(module_info const * module, enum puflib_storage_type type);
 
 /**
  * Return the path to an existing nonvolatile store that was created by
@@ -63,7 +64,7 @@ char * puflib_create_nv_store(module_info const * module, enum puflib_storage_ty
  * @param type - type of storage requested
  * @return path or NULL on error; caller is responsible for calling free().
  */
-char * puflib_get_nv_store(module_info const * module, enum puflib_storage_type type);
+PUFLIB_API char * puflib_get_nv_store(module_info const * module, enum puflib_storage_type type);
 
 /**
  * Delete a nonvolatile store that was created by puflib_create_nv_store().
@@ -75,7 +76,50 @@ char * puflib_get_nv_store(module_info const * module, enum puflib_storage_type
  * @param type - type of storage requested
  * @return false on success, true on error
  */
-bool puflib_delete_nv_store(module_info const * module, enum puflib_storage_type type);
+PUFLIB_API bool puflib_delete_nv_store(module_info const * module, enum puflib_storage_type type);
+
+/// @}
+
+/**
+ * @name Instances
+ * A module with several identical devices reports how many through
+ * module_info.instances, and every call into the module is for one of them.
+ */
+/// @{
+
+/**
+ * Return the instance (device number, from 0) that the calling thread's
+ * call into the module is for. Modules with a single device can ignore it.
+ */
+PUFLIB_API unsigned puflib_instance(void);
+
+/// @}
+
+/**
+ * @name Deadlines and cancellation
+ * Operations started through a _deadline function (see puflib_seal_deadline())
+ * carry a deadline and a cancellation token. Modules that may spend a long
+ * time in one call, such as by retrying reads of a marginal device, should
+ * poll them and give up early.
+ */
+/// @{
+
+/**
+ * Check whether the operation the calling thread is running for has passed
+ * its deadline or been cancelled. Always false outside such an operation.
+ * If it returns true, stop and return an error, leaving errno as set here.
+ *
+ * @return true if the operation should stop, with errno set to ETIMEDOUT or
+ *  ECANCELED
+ */
+PUFLIB_API bool puflib_op_expired(void);
+
+/**
+ * Return the time left before the calling thread's operation reaches its
+ * deadline, in milliseconds: 0 if it has passed, or UINT64_MAX if there is
+ * no deadline. Useful to bound a wait on hardware.
+ */
+PUFLIB_API uint64_t puflib_op_time_left_ms(void);
 
 /// @}
 
@@ -88,7 +132,7 @@ bool puflib_delete_nv_store(module_info const * module, enum puflib_storage_type
  * @param level - status level
  * @param message - message
  */
-void puflib_report(module_info const * module, enum puflib_status_level level,
+PUFLIB_API void puflib_report(module_info const * module, enum puflib_status_level level,
         char const * message);
 
 /**
@@ -102,7 +146,7 @@ void puflib_report(module_info const * module, enum puflib_status_level level,
  * @param fmt - printf format string
  * @param ... - printf arguments
  */
-void puflib_report_fmt(module_info const * module, enum puflib_status_level level,
+PUFLIB_API void puflib_report_fmt(module_info const * module, enum puflib_status_level level,
         char const * fmt, ...)
 #ifndef DOXYGEN
     __attribute__((format (printf, 3, 4)))
@@ -115,7 +159,7 @@ void puflib_report_fmt(module_info const * module, enum puflib_status_level leve
  *
  * @param module - the calling module
  */
-void puflib_perror(module_info const * module);
+PUFLIB_API void puflib_perror(module_info const * module);
 
 /**
  * Query for data. This should only be run during provisioning, and can be used
@@ -139,8 +183,369 @@ void puflib_perror(module_info const * module);
  * @param buflen - the length of the buffer
  * @return zero on success, nonzero on error (including user cancel)
  */
-bool puflib_query(module_info const * module, char const * key, char const * prompt,
+PUFLIB_API bool puflib_query(module_info const * module, char const * key, char const * prompt,
         char * buffer, size_t buflen);
 
+/**
+ * @name Cryptographic helpers
+ * Primitives for turning a reconstructed PUF secret into keys and for
+ * sealing data under such a key.
+ */
+/// @{
+
+/// Length of a SHA-256 digest, in bytes
+#define PUFLIB_SHA256_LEN 32
+
+/// Incremental SHA-256 state. Treat as opaque.
+struct puflib_sha256_ctx {
+    uint32_t state[8];
+    uint64_t total_len;
+    uint8_t buffer[64];
+    size_t buffer_len;
+};
+
+/// Begin an incremental SHA-256 computation.
+PUFLIB_API void puflib_sha256_init(struct puflib_sha256_ctx * ctx);
+
+/// Add data to an incremental SHA-256 computation.
+PUFLIB_API void puflib_sha256_update(struct puflib_sha256_ctx * ctx, void const * data, size_t len);
+
+/// Finish an incremental SHA-256 computation and wipe the context.
+PUFLIB_API void puflib_sha256_final(struct puflib_sha256_ctx * ctx, uint8_t digest[PUFLIB_SHA256_LEN]);
+
+/**
+ * Compute the SHA-256 digest of a buffer.
+ * @param data - data to hash
+ * @param len - length of data, in bytes
+ * @param digest - outparam for the digest
+ */
+PUFLIB_API void puflib_sha256(void const * data, size_t len, uint8_t digest[PUFLIB_SHA256_LEN]);
+
+/**
+ * Compute HMAC-SHA256.
+ * @param key - MAC key
+ * @param key_len - length of key, in bytes
+ * @param data - data to authenticate
+ * @param len - length of data, in bytes
+ * @param mac - outparam for the MAC
+ */
+PUFLIB_API void puflib_hmac_sha256(void const * key, size_t key_len,
+        void const * data, size_t len, uint8_t mac[PUFLIB_SHA256_LEN]);
+
+/**
+ * Derive keys with HKDF-SHA256 (RFC 5869).
+ * @param salt - optional salt; NULL for none
+ * @param salt_len - length of salt, in bytes
+ * @param ikm - input keying material
+ * @param ikm_len - length of ikm, in bytes
+ * @param info - context string binding the output to its use
+ * @param info_len - length of info, in bytes
+ * @param out - outparam for the derived key material
+ * @param out_len - number of bytes to derive, at most 255 * PUFLIB_SHA256_LEN
+ * @return false on success, true on error (EINVAL if out_len is too large)
+ */
+PUFLIB_API bool puflib_hkdf_sha256(void const * salt, size_t salt_len,
+        void const * ikm, size_t ikm_len,
+        void const * info, size_t info_len,
+        uint8_t * out, size_t out_len);
+
+/**
+ * Overwrite memory with zeros in a way the compiler will not optimize out.
+ * Use this on keys and PUF responses once they are no longer needed.
+ */
+PUFLIB_API void puflib_secure_zero(void * buf, size_t len);
+
+/**
+ * Fill a buffer with cryptographically secure random bytes from the
+ * platform.
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_random_bytes(void * buf, size_t len);
+
+/**
+ * Encrypt and authenticate data under a 256-bit key, using a fresh random
+ * nonce. This is suitable for implementing seal() once a module has
+ * reconstructed its key. The output is 48 bytes longer than the input.
+ *
+ * @param key - 256-bit key
+ * @param data_in - data to be sealed
+ * @param data_in_len - length of data_in, in bytes
+ * @param data_out - outparam for the sealed data. Caller is responsible for
+ *  freeing.
+ * @param data_out_len - outparam for the length of the sealed data, in bytes
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_key_seal(uint8_t const key[PUFLIB_SHA256_LEN],
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Verify and decrypt data sealed by puflib_key_seal().
+ *
+ * @param key - 256-bit key
+ * @param data_in - data to be unsealed
+ * @param data_in_len - length of data_in, in bytes
+ * @param data_out - outparam for the unsealed data. Caller is responsible for
+ *  freeing.
+ * @param data_out_len - outparam for the length of the unsealed data, in bytes
+ * @return false on success, true on error (errno is EBADMSG if the data was
+ *  not sealed under this key or has been modified)
+ */
+PUFLIB_API bool puflib_key_unseal(uint8_t const key[PUFLIB_SHA256_LEN],
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/// @}
+
+/**
+ * @name Fuzzy extractor
+ * Turns a noisy PUF response into a stable key. This is a code-offset
+ * construction over an outer BCH(255, k, t) code concatenated with an inner
+ * repetition code: at provisioning, puflib_fe_generate() picks a random key
+ * and produces public helper data; afterwards, puflib_fe_reproduce() recovers
+ * the same key from a fresh response and the helper data, as long as the
+ * response has not drifted too far.
+ *
+ * Helper data reveals nothing about the key only to the extent that the
+ * response has entropy; it does not need to be kept secret, but should be
+ * integrity-checked by the module (for example, by storing a hash of the key
+ * alongside it).
+ */
+/// @{
+
+/// Fuzzy extractor instance. Opaque.
+struct puflib_fe;
+
+/**
+ * Create a fuzzy extractor.
+ * @param key_bits - length of the key, in bits. Must be a multiple of 8.
+ * @param t - number of errors each 255-bit BCH block can correct, 1 to 60.
+ *  Each block carries fewer key bits the larger this is.
+ * @param rep - repetition factor of the inner code, 1 to 255. Odd values
+ *  are recommended.
+ * @return new instance (free with puflib_fe_free()), or NULL on error with
+ *  errno set (EINVAL for bad parameters)
+ */
+PUFLIB_API struct puflib_fe * puflib_fe_new(size_t key_bits, unsigned t, unsigned rep);
+
+/// Free a fuzzy extractor.
+PUFLIB_API void puflib_fe_free(struct puflib_fe * fe);
+
+/// Return the number of bytes of PUF response consumed by the extractor.
+PUFLIB_API size_t puflib_fe_response_len(struct puflib_fe const * fe);
+
+/// Return the number of bytes of helper data produced by the extractor.
+PUFLIB_API size_t puflib_fe_helper_len(struct puflib_fe const * fe);
+
+/**
+ * Enroll a response: pick a random key and compute helper data for it.
+ *
+ * @param fe - fuzzy extractor
+ * @param response - reference PUF response, puflib_fe_response_len() bytes
+ * @param key - outparam for the key, key_bits / 8 bytes
+ * @param helper - outparam for the helper data, puflib_fe_helper_len() bytes
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_fe_generate(struct puflib_fe const * fe, uint8_t const * response,
+        uint8_t * key, uint8_t * helper);
+
+/**
+ * Reproduce the key from a fresh response.
+ *
+ * @param fe - fuzzy extractor, with the parameters used for enrollment
+ * @param response - fresh PUF response, puflib_fe_response_len() bytes
+ * @param helper - helper data from puflib_fe_generate()
+ * @param key - outparam for the key, key_bits / 8 bytes
+ * @return false on success, true on error. errno is EBADMSG if the response
+ *  had too many errors to correct. Note that a response with far too many
+ *  errors can also decode to the wrong key without an error being detected.
+ */
+PUFLIB_API bool puflib_fe_reproduce(struct puflib_fe const * fe, uint8_t const * response,
+        uint8_t const * helper, uint8_t * key);
+
+/**
+ * Return the number of bytes of helper data produced by
+ * puflib_fe_generate_soft(). This is five times the response length: the
+ * code offset plus four bits of reliability per response bit.
+ */
+PUFLIB_API size_t puflib_fe_soft_helper_len(struct puflib_fe const * fe);
+
+/**
+ * Enroll several reads of the same response for soft-decision decoding.
+ * The reference response is the per-bit majority of the reads, and how
+ * consistently each bit read the same is recorded in the helper data as a
+ * reliability (log-likelihood ratio). Soft-decision decoding corrects more
+ * errors than hard-decision decoding with the same code, so a smaller
+ * repetition factor (fewer response bits) and fewer re-reads are needed.
+ *
+ * @param fe - fuzzy extractor
+ * @param reads - n_reads responses of puflib_fe_response_len() bytes each,
+ *  back to back
+ * @param n_reads - number of reads, 1 to 65535. More reads give better
+ *  reliability estimates.
+ * @param key - outparam for the key, key_bits / 8 bytes
+ * @param helper - outparam for the helper data, puflib_fe_soft_helper_len()
+ *  bytes
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_fe_generate_soft(struct puflib_fe const * fe, uint8_t const * reads,
+        size_t n_reads, uint8_t * key, uint8_t * helper);
+
+/**
+ * Reproduce the key from a fresh response and soft helper data.
+ *
+ * @param fe - fuzzy extractor, with the parameters used for enrollment
+ * @param response - fresh PUF response, puflib_fe_response_len() bytes
+ * @param helper - helper data from puflib_fe_generate_soft()
+ * @param key - outparam for the key, key_bits / 8 bytes
+ * @return false on success, true on error; see puflib_fe_reproduce().
+ */
+PUFLIB_API bool puflib_fe_reproduce_soft(struct puflib_fe const * fe, uint8_t const * response,
+        uint8_t const * helper, uint8_t * key);
+
+/// @}
+
+/**
+ * @name Majority voting
+ * Stabilises a noisy PUF region by reading it several times and taking the
+ * per-bit majority. Readouts are added one at a time as they arrive and are
+ * accumulated in bit-sliced counters, so the cost of adding a readout is a
+ * handful of SIMD operations per 512 bits rather than a loop over its bits.
+ */
+/// @{
+
+/// Maximum number of readouts a vote can accumulate
+#define PUFLIB_VOTE_MAX_READS 65535
+
+/// Majority vote in progress. Opaque.
+struct puflib_vote;
+
+/**
+ * Start a majority vote over readouts of a fixed length.
+ * @param len - length of each readout, in bytes
+ * @return new vote (free with puflib_vote_free()), or NULL on error with
+ *  errno set
+ */
+PUFLIB_API struct puflib_vote * puflib_vote_new(size_t len);
+
+/// Free a vote, clearing its counters.
+PUFLIB_API void puflib_vote_free(struct puflib_vote * vote);
+
+/**
+ * Add one readout to the vote.
+ * @param vote - vote
+ * @param readout - readout, of the length given to puflib_vote_new()
+ * @return false on success, true on error (errno is EOVERFLOW if
+ *  PUFLIB_VOTE_MAX_READS readouts have already been added)
+ */
+PUFLIB_API bool puflib_vote_add(struct puflib_vote * vote, uint8_t const * readout);
+
+/// Return the number of readouts added so far.
+PUFLIB_API size_t puflib_vote_count(struct puflib_vote const * vote);
+
+/**
+ * Compute the result of the vote so far. More readouts can be added
+ * afterwards.
+ *
+ * @param vote - vote
+ * @param majority - outparam for the per-bit majority, of the readout length.
+ *  Ties resolve to zero. May be NULL.
+ * @param stability - outparam, one entry per readout bit (bit i of byte j is
+ *  entry 8 * j + i): the number of readouts that agreed with the majority.
+ *  May be NULL.
+ * @return false on success, true on error (errno is EINVAL if no readouts
+ *  have been added)
+ */
+PUFLIB_API bool puflib_vote_result(struct puflib_vote * vote, uint8_t * majority,
+        uint16_t * stability);
+
+/**
+ * Find the bits that read the same in every readout.
+ * @param vote - vote
+ * @param mask - outparam, of the readout length: bits set where all readouts
+ *  agreed. May be NULL.
+ * @return number of unanimous bits; zero if no readouts have been added
+ */
+PUFLIB_API size_t puflib_vote_unanimous(struct puflib_vote * vote, uint8_t * mask);
+
+/**
+ * Find the bits that read the same in all but a few readouts.
+ * @param vote - vote
+ * @param max_disagree - number of readouts allowed to disagree with the
+ *  majority
+ * @param mask - outparam, of the readout length: bits set where at most
+ *  max_disagree readouts disagreed with the majority. May be NULL.
+ * @return number of stable bits; zero if no readouts have been added
+ */
+PUFLIB_API size_t puflib_vote_stable(struct puflib_vote * vote, size_t max_disagree,
+        uint8_t * mask);
+
+/// @}
+
+/**
+ * @name Bit masks
+ * Dark-bit masking: at enrollment, a module finds the bits of its PUF that
+ * are stable (see puflib_vote_stable()) and stores the selection; afterwards
+ * it extracts just those bits from each fresh readout, so that the fuzzy
+ * extractor sees far fewer errors. Masks are byte strings where bit i of
+ * byte j selects bit i of byte j of the readout.
+ */
+/// @{
+
+/// Return the number of bits set in a mask.
+PUFLIB_API size_t puflib_mask_weight(uint8_t const * mask, size_t len);
+
+/**
+ * Clear all but the first @a n_bits set bits of a mask.
+ * @return the new weight of the mask
+ */
+PUFLIB_API size_t puflib_mask_truncate(uint8_t * mask, size_t len, size_t n_bits);
+
+/**
+ * Compress a mask for storage. The encoding is a sequence of run lengths of
+ * alternating clear and set bits, so it is small when the selected bits are
+ * clustered or sparse; masks that would not shrink this way are stored as
+ * they are, plus one byte.
+ *
+ * @param mask - mask to encode
+ * @param len - length of the mask, in bytes
+ * @param data_out - outparam for the encoded mask. Caller is responsible for
+ *  freeing.
+ * @param data_out_len - outparam for the length of the encoded mask, in bytes
+ * @return false on success, true on error (with errno set)
+ */
+PUFLIB_API bool puflib_mask_encode(uint8_t const * mask, size_t len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Decompress a mask encoded by puflib_mask_encode().
+ *
+ * @param data_in - encoded mask
+ * @param data_in_len - length of the encoded mask, in bytes
+ * @param mask - outparam for the mask, @a len bytes
+ * @param len - length of the mask, in bytes
+ * @return false on success, true on error (errno is EBADMSG if the encoded
+ *  mask is malformed or does not describe exactly @a len bytes)
+ */
+PUFLIB_API bool puflib_mask_decode(uint8_t const * data_in, size_t data_in_len,
+        uint8_t * mask, size_t len);
+
+/**
+ * Extract the bits of @a in selected by @a mask and pack them together, in
+ * order, LSB-first. Uses the BMI2 PEXT instruction where available.
+ *
+ * @param in - readout, @a len bytes
+ * @param mask - mask, @a len bytes
+ * @param len - length of the readout and mask, in bytes
+ * @param out - outparam for the packed bits: room for
+ *  puflib_mask_weight() bits, rounded up to a whole byte. Unused bits of the
+ *  last byte are cleared.
+ * @return number of bits written
+ */
+PUFLIB_API size_t puflib_mask_gather(uint8_t const * in, uint8_t const * mask, size_t len,
+        uint8_t * out);
+
+/// @}
+
 
 #endif // _PUFLIB_MODULE_H_
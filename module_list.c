@@ -0,0 +1,14 @@
+// WARNING: this file is autogenerated by the build system. Do not edit!
+
+#include <puflib.h>
+
+extern module_info const puflibtest__MODULE_INFO;
+extern module_info const sramsim__MODULE_INFO;
+extern module_info const arbitersim__MODULE_INFO;
+
+module_info const * const PUFLIB_MODULES[] = {
+    &puflibtest__MODULE_INFO,
+    &sramsim__MODULE_INFO,
+    &arbitersim__MODULE_INFO,
+    (module_info const *) 0,
+};
@@ -0,0 +1,447 @@
+// PUFlib simulated arbiter PUF module
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Models a delay-based (arbiter) PUF, for exercising challenge-response
+// workloads without PUF hardware. Each response bit comes from its own
+// XOR-arbiter PUF: the XOR of several arbiter chains, each chain deciding its
+// bit by the sign of the delay difference w . phi(c) between its two paths,
+// where w holds the chain's per-stage delay differences and phi(c) is the
+// standard parity transform of the challenge. Weights are derived from a
+// per-device seed; every evaluation adds fresh Gaussian noise to the delay.
+// The model is configured through the environment:
+//
+//   PUFLIB_ARBITERSIM_SEED        device identity (default: /etc/machine-id)
+//   PUFLIB_ARBITERSIM_STAGES      challenge bits, 64 or 128 (64)
+//   PUFLIB_ARBITERSIM_XOR         arbiter chains XORed per response bit (1)
+//   PUFLIB_ARBITERSIM_RESP_BITS   response bits per challenge, a multiple
+//                                 of 8 (64)
+//   PUFLIB_ARBITERSIM_NOISE       delay noise relative to the delay spread
+//                                 (0.05)
+//   PUFLIB_ARBITERSIM_LATENCY_US  time taken by each call, in microseconds (0)
+//
+// A challenge is STAGES / 8 bytes. chal_resp() also accepts several
+// challenges back to back and returns their responses back to back, which
+// is how bulk enrollment should drive it; challenges are then evaluated in
+// batches, each chain's weights being applied to the whole batch at once.
+//
+// The module only implements chal_resp(); it has no sealing support.
+
+#define _XOPEN_SOURCE 700
+
+#include <puflib_module.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+bool is_hw_supported();
+enum provisioning_status provision();
+bool chal_resp(void const * data_in, size_t data_in_len, void ** data_out, size_t * data_out_len);
+bool warmup();
+
+module_info const MODULE_INFO =
+{
+    .name = "arbitersim",
+    .author = "agent <agent@local>",
+    .desc = "simulated XOR-arbiter PUF",
+    .is_hw_supported = &is_hw_supported,
+    .provision = &provision,
+    .chal_resp = &chal_resp,
+    .warmup = &warmup,
+};
+
+#define LANES 8                 ///< floats per vector
+#define BATCH 64                ///< challenges evaluated together
+#define MAX_STAGES 128
+#define MAX_XOR 16
+#define MAX_RESP_BITS 1024
+#define DELAY_SLICE_US 5000     ///< deadline check interval while reading
+
+typedef float v8f __attribute__((vector_size(LANES * sizeof(float))));
+
+static struct {
+    bool initialized;
+    size_t stages;
+    size_t n_xor;
+    size_t resp_bits;
+    size_t n_chains;            ///< resp_bits * n_xor
+    size_t row;                 ///< stages + 1, rounded up to whole vectors
+    double noise;               ///< standard deviation of the delay noise
+    long latency_us;
+
+    float * weights;            ///< n_chains rows of row floats; chain r * n_xor + x
+    float * phi;                ///< BATCH rows of row floats, for the batch in progress
+    uint64_t rng[4];            ///< xoshiro256** state for evaluation noise
+    pthread_mutex_t lock;
+} SIM = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+/******************************************************************************
+ * Random number generation                                                   *
+ *****************************************************************************/
+
+static uint64_t splitmix64(uint64_t * state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+static uint64_t rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+
+static uint64_t xoshiro256ss(uint64_t s[4])
+{
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+
+    return result;
+}
+
+
+static double uniform01(uint64_t s[4])
+{
+    // 53 random bits, never exactly zero
+    return ((xoshiro256ss(s) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+
+static double gaussian(uint64_t s[4])
+{
+    double u1 = uniform01(s), u2 = uniform01(s);
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+
+/******************************************************************************
+ * Delay model                                                                *
+ *****************************************************************************/
+
+static double env_double(char const * name, double def, double min, double max)
+{
+    char const * value = getenv(name);
+    if (!value || !*value) {
+        return def;
+    }
+
+    char * end;
+    double d = strtod(value, &end);
+    if (*end || d < min || d > max) {
+        puflib_report_fmt(&MODULE_INFO, STATUS_WARN,
+                "ignoring invalid %s=%s, using %g", name, value, def);
+        return def;
+    }
+    return d;
+}
+
+
+static void device_seed(uint64_t seed[4])
+{
+    char buf[256] = { 0 };
+    char const * env = getenv("PUFLIB_ARBITERSIM_SEED");
+    size_t len;
+
+    if (env) {
+        len = strlen(env);
+        if (len > sizeof(buf)) {
+            len = sizeof(buf);
+        }
+        memcpy(buf, env, len);
+    } else {
+        FILE * f = fopen("/etc/machine-id", "r");
+        len = f ? fread(buf, 1, sizeof(buf), f) : 0;
+        if (f) {
+            fclose(f);
+        }
+        if (!len) {
+            puflib_report(&MODULE_INFO, STATUS_WARN,
+                    "no device seed available, all simulated devices will be identical");
+        }
+    }
+
+    uint8_t digest[PUFLIB_SHA256_LEN];
+    puflib_hmac_sha256("arbitersim-device", 17, buf, len, digest);
+
+    uint64_t sm = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        sm = (sm << 8) | digest[i];
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        seed[i] = splitmix64(&sm);
+    }
+}
+
+
+/**
+ * Wait out the simulated read latency, in slices so that the operation's
+ * deadline and cancellation are noticed while waiting.
+ * @return true if the operation expired first (with errno set)
+ */
+static bool sim_delay(long latency_us)
+{
+    while (latency_us > 0) {
+        if (puflib_op_expired()) {
+            return true;
+        }
+        long slice_us = latency_us < DELAY_SLICE_US ? latency_us : DELAY_SLICE_US;
+        struct timespec ts = {
+            .tv_sec = slice_us / 1000000,
+            .tv_nsec = (slice_us % 1000000) * 1000,
+        };
+        while (nanosleep(&ts, &ts) && errno == EINTR);
+        latency_us -= slice_us;
+    }
+    return puflib_op_expired();
+}
+
+
+static void sim_init_locked(void)
+{
+    if (SIM.initialized) {
+        return;
+    }
+
+    SIM.stages = (size_t) env_double("PUFLIB_ARBITERSIM_STAGES", 64, 64, MAX_STAGES);
+    if (SIM.stages != 64 && SIM.stages != 128) {
+        puflib_report_fmt(&MODULE_INFO, STATUS_WARN,
+                "unsupported PUFLIB_ARBITERSIM_STAGES=%zu, using 64", SIM.stages);
+        SIM.stages = 64;
+    }
+    SIM.n_xor = (size_t) env_double("PUFLIB_ARBITERSIM_XOR", 1, 1, MAX_XOR);
+    SIM.resp_bits = (size_t) env_double("PUFLIB_ARBITERSIM_RESP_BITS", 64, 8, MAX_RESP_BITS);
+    SIM.resp_bits -= SIM.resp_bits % 8;
+    SIM.latency_us = (long) env_double("PUFLIB_ARBITERSIM_LATENCY_US", 0, 0, 60e6);
+
+    SIM.n_chains = SIM.resp_bits * SIM.n_xor;
+    SIM.row = (SIM.stages + 1 + LANES - 1) / LANES * LANES;
+
+    // Weights are N(0,1), so a chain's delay difference has standard
+    // deviation sqrt(stages + 1); noise is scaled to that
+    SIM.noise = env_double("PUFLIB_ARBITERSIM_NOISE", 0.05, 0.0, 10.0) * sqrt(SIM.stages + 1.0);
+
+    SIM.weights = calloc(SIM.n_chains * SIM.row, sizeof(float));
+    SIM.phi = malloc(BATCH * SIM.row * sizeof(float));
+    if (!SIM.weights || !SIM.phi) {
+        free(SIM.weights);
+        free(SIM.phi);
+        SIM.weights = SIM.phi = NULL;
+        return;
+    }
+
+    uint64_t dev[4];
+    device_seed(dev);
+    for (size_t c = 0; c < SIM.n_chains; ++c) {
+        for (size_t i = 0; i <= SIM.stages; ++i) {
+            SIM.weights[c * SIM.row + i] = (float) gaussian(dev);
+        }
+    }
+
+    if (puflib_random_bytes(SIM.rng, sizeof(SIM.rng))) {
+        puflib_perror(&MODULE_INFO);
+        free(SIM.weights);
+        free(SIM.phi);
+        SIM.weights = SIM.phi = NULL;
+        return;
+    }
+
+    SIM.initialized = true;
+}
+
+
+/**
+ * Compute the parity feature vector of a challenge: phi[i] is the product of
+ * (1 - 2 c_j) over stages j >= i, and phi[stages] is 1. The rest of the row
+ * is zero padding.
+ */
+static void transform(uint8_t const * chal, float * phi)
+{
+    float p = 1.0f;
+
+    memset(phi, 0, SIM.row * sizeof(float));
+    phi[SIM.stages] = 1.0f;
+    for (size_t i = SIM.stages; i-- > 0;) {
+        if ((chal[i / 8] >> (i % 8)) & 1) {
+            p = -p;
+        }
+        phi[i] = p;
+    }
+}
+
+
+/**
+ * Evaluate up to BATCH challenges, whose feature rows transform() has
+ * written to SIM.phi. Caller holds SIM.lock.
+ *
+ * @param n - number of challenges
+ * @param out - n responses of resp_bits / 8 bytes
+ */
+static void evaluate_batch(size_t n, uint8_t * out)
+{
+    float const * phi = SIM.phi;
+    size_t resp_len = SIM.resp_bits / 8;
+    memset(out, 0, n * resp_len);
+
+    for (size_t c = 0; c < SIM.n_chains; ++c) {
+        float const * w = SIM.weights + c * SIM.row;
+        size_t bit = c / SIM.n_xor;
+
+        // Apply this chain to the whole batch while its weights are hot
+        for (size_t k = 0; k < n; ++k) {
+            v8f acc = { 0 };
+            for (size_t i = 0; i < SIM.row; i += LANES) {
+                v8f a, b;
+                memcpy(&a, w + i, sizeof(a));
+                memcpy(&b, phi + k * SIM.row + i, sizeof(b));
+                acc += a * b;
+            }
+
+            double delay = 0;
+            for (size_t i = 0; i < LANES; ++i) {
+                delay += acc[i];
+            }
+            if (SIM.noise > 0) {
+                delay += SIM.noise * gaussian(SIM.rng);
+            }
+
+            out[k * resp_len + bit / 8] ^= (uint8_t) ((delay > 0) << (bit % 8));
+        }
+    }
+}
+
+
+bool is_hw_supported()
+{
+    return true;
+}
+
+
+bool warmup()
+{
+    // Draw the chain weights now rather than on the first challenge
+    pthread_mutex_lock(&SIM.lock);
+    sim_init_locked();
+    bool initialized = SIM.initialized;
+    pthread_mutex_unlock(&SIM.lock);
+
+    if (!initialized) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "cannot initialize simulated PUF");
+        errno = ENOMEM;
+        return true;
+    }
+    return false;
+}
+
+
+bool chal_resp(void const * data_in, size_t data_in_len, void ** data_out, size_t * data_out_len)
+{
+    pthread_mutex_lock(&SIM.lock);
+    sim_init_locked();
+
+    if (!SIM.initialized) {
+        pthread_mutex_unlock(&SIM.lock);
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "cannot initialize simulated PUF");
+        errno = ENOMEM;
+        return true;
+    }
+
+    size_t chal_len = SIM.stages / 8;
+    size_t resp_len = SIM.resp_bits / 8;
+    if (!data_in_len || data_in_len % chal_len) {
+        pthread_mutex_unlock(&SIM.lock);
+        puflib_report_fmt(&MODULE_INFO, STATUS_ERROR,
+                "challenge must be a multiple of %zu bytes", chal_len);
+        errno = EINVAL;
+        return true;
+    }
+    size_t n = data_in_len / chal_len;
+
+    uint8_t * buf = malloc(n * resp_len);
+    if (!buf) {
+        pthread_mutex_unlock(&SIM.lock);
+        puflib_perror(&MODULE_INFO);
+        return true;
+    }
+
+    if (sim_delay(SIM.latency_us)) {
+        pthread_mutex_unlock(&SIM.lock);
+        free(buf);
+        return true;
+    }
+
+    uint8_t const * chal = data_in;
+    for (size_t first = 0; first < n; first += BATCH) {
+        if (puflib_op_expired()) {
+            pthread_mutex_unlock(&SIM.lock);
+            free(buf);
+            return true;
+        }
+        size_t count = n - first < BATCH ? n - first : BATCH;
+        for (size_t k = 0; k < count; ++k) {
+            transform(chal + (first + k) * chal_len, SIM.phi + k * SIM.row);
+        }
+        evaluate_batch(count, buf + first * resp_len);
+    }
+
+    pthread_mutex_unlock(&SIM.lock);
+    *data_out = buf;
+    *data_out_len = n * resp_len;
+    return false;
+}
+
+
+/**
+ * Provisioning has nothing to measure; it records the model configuration in
+ * the final NV store so that the device shows as provisioned.
+ */
+enum provisioning_status provision()
+{
+    pthread_mutex_lock(&SIM.lock);
+    sim_init_locked();
+    bool ok = SIM.initialized;
+    size_t stages = SIM.stages, n_xor = SIM.n_xor, resp_bits = SIM.resp_bits;
+    pthread_mutex_unlock(&SIM.lock);
+
+    if (!ok) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "cannot initialize simulated PUF");
+        return PROVISION_ERROR;
+    }
+
+    char * path = puflib_create_nv_store(&MODULE_INFO, STORAGE_FINAL_FILE);
+    if (!path) {
+        puflib_perror(&MODULE_INFO);
+        return PROVISION_ERROR;
+    }
+
+    FILE * f = fopen(path, "w");
+    free(path);
+    if (!f) {
+        puflib_perror(&MODULE_INFO);
+        return PROVISION_ERROR;
+    }
+
+    fprintf(f, "stages %zu\nxor %zu\nresp_bits %zu\n", stages, n_xor, resp_bits);
+    if (fclose(f)) {
+        puflib_perror(&MODULE_INFO);
+        return PROVISION_ERROR;
+    }
+
+    puflib_report_fmt(&MODULE_INFO, STATUS_INFO,
+            "%zu-stage %zu-XOR arbiter PUF, %zu response bits per challenge",
+            stages, n_xor, resp_bits);
+    return PROVISION_COMPLETE;
+}
@@ -25,6 +25,7 @@ module_info const MODULE_INFO =
     .chal_resp = &chal_resp,
     .seal = &seal,
     .unseal = &unseal,
+    .chal_resp_deterministic = true,
 };
 
 
@@ -0,0 +1,886 @@
+// PUFlib simulated SRAM PUF module
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Models the power-up values of an SRAM array, for exercising everything
+// built on puflib without PUF hardware. Each cell has a fixed mismatch and a
+// temperature coefficient derived from a per-device seed; every read adds
+// fresh thermal noise. The model is configured through the environment:
+//
+//   PUFLIB_SRAMSIM_SEED        device identity (default: /etc/machine-id)
+//   PUFLIB_SRAMSIM_SIZE        size of the simulated SRAM in bytes (8192)
+//   PUFLIB_SRAMSIM_BER         average bit-error rate per read (0.05)
+//   PUFLIB_SRAMSIM_BIAS        probability of a cell powering up as 1 (0.5)
+//   PUFLIB_SRAMSIM_TEMP        operating temperature in degrees C (25)
+//   PUFLIB_SRAMSIM_DRIFT       mismatch shift per degree C away from 25 C,
+//                              relative to the cell spread (0.005)
+//   PUFLIB_SRAMSIM_LATENCY_US  time taken by each read, in microseconds (0)
+//   PUFLIB_SRAMSIM_INSTANCES   number of simulated devices, 1 to 8 (1)
+//
+// Each instance is a separate array with its own identity, derived from the
+// device seed and the instance number, and is read under its own lock.
+//
+// Keys are derived with the library's soft-decision fuzzy extractor;
+// PUFLIB_SRAMSIM_REP and PUFLIB_SRAMSIM_BCH_T select its code at
+// provisioning time. Provisioning surveys a window of the array larger than
+// the extractor needs and keeps only the most stable cells (dark-bit
+// masking); the selection and the helper data live in the module's final NV
+// store.
+
+#define _XOPEN_SOURCE 700
+
+#include <puflib_module.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+bool is_hw_supported();
+enum provisioning_status provision();
+bool get_root_key(uint8_t * key);
+void * session_open();
+void session_close(void * state);
+bool session_get_root_key(void * state, uint8_t * key);
+bool warmup();
+bool chal_resp(void const * data_in, size_t data_in_len, void ** data_out, size_t * data_out_len);
+unsigned instances();
+
+module_info const MODULE_INFO =
+{
+    .name = "sramsim",
+    .author = "agent <agent@local>",
+    .desc = "simulated SRAM PUF",
+    .is_hw_supported = &is_hw_supported,
+    .provision = &provision,
+    .chal_resp = &chal_resp,
+    .get_root_key = &get_root_key,
+    .session_open = &session_open,
+    .session_close = &session_close,
+    .session_get_root_key = &session_get_root_key,
+    .warmup = &warmup,
+    .instances = &instances,
+};
+
+#define KEY_BITS 256
+#define DEFAULT_REP 3
+#define DEFAULT_BCH_T 18
+#define ENROLL_READS 15
+#define MAX_READ_ATTEMPTS 3
+#define CHAL_RESP_LEN 32
+#define DARK_BIT_WINDOW 4        ///< cells surveyed per cell kept
+#define HELPER_MAGIC "SRAMSIM4"
+#define HELPER_MAGIC_LEN 8
+#define HELPER_HEADER_LEN (HELPER_MAGIC_LEN + 16 + PUFLIB_SHA256_LEN)
+#define MAX_MASK_ENC_LEN (1 << 20)
+#define REFERENCE_TEMP 25.0
+#define DELAY_SLICE_US 5000     ///< deadline check interval while reading
+#define MAX_INSTANCES 8
+
+struct sim {
+    bool initialized;
+    size_t size;
+    double ber;
+    double bias;
+    double temp;
+    double drift;
+    long latency_us;
+
+    uint32_t * threshold;   ///< per cell: P(power up as 1) scaled to 2^32
+    uint64_t noise[4];      ///< xoshiro256** state for read noise
+    pthread_mutex_t lock;
+};
+
+#define SIM_INIT { .lock = PTHREAD_MUTEX_INITIALIZER }
+static struct sim SIMS[MAX_INSTANCES] = {
+    SIM_INIT, SIM_INIT, SIM_INIT, SIM_INIT, SIM_INIT, SIM_INIT, SIM_INIT, SIM_INIT,
+};
+
+
+/******************************************************************************
+ * Random number generation                                                   *
+ *****************************************************************************/
+
+static uint64_t splitmix64(uint64_t * state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+static uint64_t rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+
+static uint64_t xoshiro256ss(uint64_t s[4])
+{
+    uint64_t result = rotl64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl64(s[3], 45);
+
+    return result;
+}
+
+
+static double uniform01(uint64_t s[4])
+{
+    // 53 random bits, never exactly zero
+    return ((xoshiro256ss(s) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+
+static double gaussian(uint64_t s[4])
+{
+    double u1 = uniform01(s), u2 = uniform01(s);
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+
+/******************************************************************************
+ * Cell model                                                                 *
+ *****************************************************************************/
+
+static double normal_cdf(double x)
+{
+    return 0.5 * erfc(-x / M_SQRT2);
+}
+
+
+static double normal_quantile(double p)
+{
+    double lo = -40.0, hi = 40.0;
+    for (int i = 0; i < 100; ++i) {
+        double mid = (lo + hi) / 2;
+        if (normal_cdf(mid) < p) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo + hi) / 2;
+}
+
+
+static double env_double(char const * name, double def, double min, double max)
+{
+    char const * value = getenv(name);
+    if (!value || !*value) {
+        return def;
+    }
+
+    char * end;
+    double d = strtod(value, &end);
+    if (*end || d < min || d > max) {
+        puflib_report_fmt(&MODULE_INFO, STATUS_WARN,
+                "ignoring invalid %s=%s, using %g", name, value, def);
+        return def;
+    }
+    return d;
+}
+
+
+static void device_seed(unsigned instance, uint64_t seed[4])
+{
+    char buf[256] = { 0 };
+    char const * env = getenv("PUFLIB_SRAMSIM_SEED");
+    size_t len;
+
+    if (env) {
+        len = strlen(env);
+        if (len > sizeof(buf)) {
+            len = sizeof(buf);
+        }
+        memcpy(buf, env, len);
+    } else {
+        FILE * f = fopen("/etc/machine-id", "r");
+        len = f ? fread(buf, 1, sizeof(buf), f) : 0;
+        if (f) {
+            fclose(f);
+        }
+        if (!len) {
+            puflib_report(&MODULE_INFO, STATUS_WARN,
+                    "no device seed available, all simulated devices will be identical");
+        }
+    }
+
+    uint8_t digest[PUFLIB_SHA256_LEN];
+    puflib_hmac_sha256("sramsim-device", 14, buf, len, digest);
+
+    // Instance 0 keeps the identity it had before there were instances
+    if (instance) {
+        uint8_t base[PUFLIB_SHA256_LEN];
+        uint8_t id[4] = {
+            (uint8_t) instance, (uint8_t) (instance >> 8),
+            (uint8_t) (instance >> 16), (uint8_t) (instance >> 24),
+        };
+        memcpy(base, digest, sizeof(base));
+        puflib_hmac_sha256(base, sizeof(base), id, sizeof(id), digest);
+    }
+
+    uint64_t sm = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        sm = (sm << 8) | digest[i];
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        seed[i] = splitmix64(&sm);
+    }
+}
+
+
+/**
+ * Wait out the simulated read latency, in slices so that the operation's
+ * deadline and cancellation are noticed while waiting.
+ * @return true if the operation expired first (with errno set)
+ */
+static bool sim_delay(long latency_us)
+{
+    while (latency_us > 0) {
+        if (puflib_op_expired()) {
+            return true;
+        }
+        long slice_us = latency_us < DELAY_SLICE_US ? latency_us : DELAY_SLICE_US;
+        struct timespec ts = {
+            .tv_sec = slice_us / 1000000,
+            .tv_nsec = (slice_us % 1000000) * 1000,
+        };
+        while (nanosleep(&ts, &ts) && errno == EINTR);
+        latency_us -= slice_us;
+    }
+    return puflib_op_expired();
+}
+
+
+static void sim_init_locked(struct sim * sim, unsigned instance)
+{
+    if (sim->initialized) {
+        return;
+    }
+
+    sim->size = (size_t) env_double("PUFLIB_SRAMSIM_SIZE", 8192, 64, 64 * 1024 * 1024);
+    sim->ber = env_double("PUFLIB_SRAMSIM_BER", 0.05, 0.0, 0.49);
+    sim->bias = env_double("PUFLIB_SRAMSIM_BIAS", 0.5, 0.01, 0.99);
+    sim->temp = env_double("PUFLIB_SRAMSIM_TEMP", REFERENCE_TEMP, -273.0, 500.0);
+    sim->drift = env_double("PUFLIB_SRAMSIM_DRIFT", 0.005, 0.0, 1.0);
+    sim->latency_us = (long) env_double("PUFLIB_SRAMSIM_LATENCY_US", 0, 0, 60e6);
+
+    size_t cells = sim->size * 8;
+    sim->threshold = malloc(cells * sizeof(*sim->threshold));
+    if (!sim->threshold) {
+        return;
+    }
+
+    // Mean error rate over cells with N(0,1) mismatch and N(0,sigma) noise is
+    // atan(sigma)/pi, which gives sigma for the requested rate. The bias
+    // offset shifts every cell so that the requested fraction powers up as 1.
+    double sigma = tan(M_PI * sim->ber);
+    double offset = sqrt(1.0 + sigma * sigma) * normal_quantile(sim->bias);
+    double shift = sim->drift * (sim->temp - REFERENCE_TEMP);
+
+    uint64_t dev[4];
+    device_seed(instance, dev);
+
+    for (size_t i = 0; i < cells; ++i) {
+        double mismatch = gaussian(dev);
+        double tempco = gaussian(dev);
+        double x = mismatch + offset + tempco * shift;
+        double p = (sigma > 0) ? normal_cdf(x / sigma) : (x > 0);
+        sim->threshold[i] = (p >= 1.0) ? UINT32_MAX : (uint32_t) (p * 4294967296.0);
+    }
+
+    if (puflib_random_bytes(sim->noise, sizeof(sim->noise))) {
+        puflib_perror(&MODULE_INFO);
+        free(sim->threshold);
+        sim->threshold = NULL;
+        return;
+    }
+
+    sim->initialized = true;
+}
+
+
+/**
+ * Return the size of the simulated SRAM in bytes, or zero if it cannot be
+ * initialized.
+ */
+static size_t sram_size(void)
+{
+    unsigned instance = puflib_instance();
+    struct sim * sim = &SIMS[instance];
+    pthread_mutex_lock(&sim->lock);
+    sim_init_locked(sim, instance);
+    size_t size = sim->initialized ? sim->size : 0;
+    pthread_mutex_unlock(&sim->lock);
+    return size;
+}
+
+
+/**
+ * Read len bytes of simulated SRAM power-up state starting at offset. Every
+ * call costs one read latency, as the whole array must be power-cycled.
+ * @return false on success, true on error
+ */
+static bool sram_read(size_t offset, size_t len, uint8_t * out)
+{
+    unsigned instance = puflib_instance();
+    struct sim * sim = &SIMS[instance];
+    pthread_mutex_lock(&sim->lock);
+    sim_init_locked(sim, instance);
+
+    if (!sim->initialized || offset + len > sim->size) {
+        pthread_mutex_unlock(&sim->lock);
+        puflib_report(&MODULE_INFO, STATUS_ERROR,
+                sim->initialized ? "read beyond end of simulated SRAM"
+                                : "cannot initialize simulated SRAM");
+        errno = sim->initialized ? EINVAL : ENOMEM;
+        return true;
+    }
+
+    if (sim_delay(sim->latency_us)) {
+        pthread_mutex_unlock(&sim->lock);
+        return true;
+    }
+
+    // Each 64-bit draw supplies the noise for two cells
+    uint32_t const * threshold = sim->threshold + offset * 8;
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t byte = 0;
+        for (int b = 0; b < 8; b += 2) {
+            uint64_t r = xoshiro256ss(sim->noise);
+            byte |= (uint8_t) (((uint32_t) r < threshold[b]) << b);
+            byte |= (uint8_t) (((uint32_t) (r >> 32) < threshold[b + 1]) << (b + 1));
+        }
+        out[i] = byte;
+        threshold += 8;
+    }
+
+    pthread_mutex_unlock(&sim->lock);
+    return false;
+}
+
+
+/******************************************************************************
+ * Key reconstruction                                                         *
+ *****************************************************************************/
+
+struct helper {
+    uint32_t rep;
+    uint32_t t;
+    uint32_t window;            ///< bytes of SRAM read for each response
+    uint8_t check[PUFLIB_SHA256_LEN];
+    uint8_t * mask;             ///< window bytes: cells that make up the response
+    uint8_t * data;             ///< soft-decision fuzzy extractor helper data
+    struct puflib_fe * fe;
+};
+
+
+static void put_le32(uint8_t * buf, uint32_t value)
+{
+    for (size_t i = 0; i < 4; ++i) {
+        buf[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+
+static uint32_t get_le32(uint8_t const * buf)
+{
+    return (uint32_t) buf[0] | (uint32_t) buf[1] << 8
+        | (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+
+static void key_check(uint8_t const key[KEY_BITS / 8], uint8_t check[PUFLIB_SHA256_LEN])
+{
+    puflib_hmac_sha256(key, KEY_BITS / 8, "sramsim-check", 13, check);
+}
+
+
+static void helper_free(struct helper * helper)
+{
+    free(helper->mask);
+    free(helper->data);
+    puflib_fe_free(helper->fe);
+    helper->mask = NULL;
+    helper->data = NULL;
+    helper->fe = NULL;
+}
+
+
+static bool helper_load(struct helper * helper)
+{
+    char * path = NULL;
+    FILE * f = NULL;
+    uint8_t * mask_enc = NULL;
+    uint8_t header[HELPER_HEADER_LEN];
+
+    helper->mask = NULL;
+    helper->data = NULL;
+    helper->fe = NULL;
+
+    path = puflib_get_nv_store(&MODULE_INFO, STORAGE_FINAL_FILE);
+    if (!path) {
+        goto err;
+    }
+
+    f = fopen(path, "rb");
+    if (!f) {
+        goto err;
+    }
+
+    if (fread(header, 1, sizeof(header), f) != sizeof(header)
+            || memcmp(header, HELPER_MAGIC, HELPER_MAGIC_LEN)) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    helper->rep = get_le32(header + HELPER_MAGIC_LEN);
+    helper->t = get_le32(header + HELPER_MAGIC_LEN + 4);
+    helper->window = get_le32(header + HELPER_MAGIC_LEN + 8);
+    uint32_t mask_enc_len = get_le32(header + HELPER_MAGIC_LEN + 12);
+    memcpy(helper->check, header + HELPER_MAGIC_LEN + 16, PUFLIB_SHA256_LEN);
+
+    helper->fe = puflib_fe_new(KEY_BITS, helper->t, helper->rep);
+    if (!helper->fe) {
+        goto err;
+    }
+
+    if (!helper->window || mask_enc_len > MAX_MASK_ENC_LEN) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    mask_enc = malloc(mask_enc_len);
+    helper->mask = malloc(helper->window);
+    if (!mask_enc || !helper->mask) {
+        goto err;
+    }
+
+    if (fread(mask_enc, 1, mask_enc_len, f) != mask_enc_len
+            || puflib_mask_decode(mask_enc, mask_enc_len, helper->mask, helper->window)
+            || puflib_mask_weight(helper->mask, helper->window)
+                != puflib_fe_response_len(helper->fe) * 8) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    size_t len = puflib_fe_soft_helper_len(helper->fe);
+    helper->data = malloc(len);
+    if (!helper->data) {
+        goto err;
+    }
+
+    if (fread(helper->data, 1, len, f) != len) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    fclose(f);
+    free(path);
+    free(mask_enc);
+    return false;
+
+err:
+    {
+        int errno_hold = errno;
+        if (f) {
+            fclose(f);
+        }
+        free(path);
+        free(mask_enc);
+        helper_free(helper);
+        errno = errno_hold;
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "cannot load helper data");
+        return true;
+    }
+}
+
+
+/**
+ * Reconstruct the enrolled key from a fresh SRAM read, retrying the read if
+ * the fuzzy extractor cannot correct it.
+ */
+static bool reconstruct_key(struct helper const * helper, uint8_t key[KEY_BITS / 8])
+{
+    uint8_t * raw = NULL;
+    uint8_t * response = NULL;
+    size_t response_len = 0;
+    bool rc = true;
+
+    response_len = puflib_fe_response_len(helper->fe);
+    raw = malloc(helper->window);
+    response = malloc(response_len);
+    if (!raw || !response) {
+        goto out;
+    }
+
+    for (int attempt = 0; attempt < MAX_READ_ATTEMPTS; ++attempt) {
+        // sram_read() gives up once the operation expires
+        if (sram_read(0, helper->window, raw)) {
+            goto out;
+        }
+        puflib_mask_gather(raw, helper->mask, helper->window, response);
+
+        if (!puflib_fe_reproduce_soft(helper->fe, response, helper->data, key)) {
+            uint8_t check[PUFLIB_SHA256_LEN];
+            key_check(key, check);
+            if (!memcmp(check, helper->check, sizeof(check))) {
+                rc = false;
+                goto out;
+            }
+        }
+
+        puflib_report(&MODULE_INFO, STATUS_DEBUG, "key reconstruction failed, re-reading");
+    }
+
+    puflib_report(&MODULE_INFO, STATUS_ERROR, "cannot reconstruct key: too many bit errors");
+    errno = EIO;
+
+out:
+    if (raw) {
+        puflib_secure_zero(raw, helper->window);
+    }
+    if (response) {
+        puflib_secure_zero(response, response_len);
+    }
+    free(raw);
+    free(response);
+    if (rc) {
+        puflib_secure_zero(key, KEY_BITS / 8);
+    }
+    return rc;
+}
+
+
+/******************************************************************************
+ * Module interface                                                           *
+ *****************************************************************************/
+
+unsigned instances()
+{
+    return (unsigned) env_double("PUFLIB_SRAMSIM_INSTANCES", 1, 1, MAX_INSTANCES);
+}
+
+
+bool is_hw_supported()
+{
+    return true;
+}
+
+
+bool chal_resp(void const * data_in, size_t data_in_len, void ** data_out, size_t * data_out_len)
+{
+    // The challenge selects a window of the array; the response is its raw,
+    // uncorrected power-up state.
+    uint8_t digest[PUFLIB_SHA256_LEN];
+    puflib_sha256(data_in, data_in_len, digest);
+
+    size_t size = sram_size();
+    if (size < CHAL_RESP_LEN) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "simulated SRAM is unavailable or too small");
+        errno = EINVAL;
+        return true;
+    }
+
+    uint64_t index = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        index = (index << 8) | digest[i];
+    }
+
+    uint8_t * buf = malloc(CHAL_RESP_LEN);
+    if (!buf) {
+        puflib_perror(&MODULE_INFO);
+        return true;
+    }
+
+    if (sram_read((size_t) (index % (size - CHAL_RESP_LEN + 1)), CHAL_RESP_LEN, buf)) {
+        free(buf);
+        return true;
+    }
+
+    *data_out = buf;
+    *data_out_len = CHAL_RESP_LEN;
+    return false;
+}
+
+
+static bool derive_root_key(struct helper const * helper, uint8_t * root_key)
+{
+    uint8_t key[KEY_BITS / 8];
+
+    if (reconstruct_key(helper, key)) {
+        return true;
+    }
+
+    puflib_hmac_sha256(key, sizeof(key), "sramsim-root", 12, root_key);
+    puflib_secure_zero(key, sizeof(key));
+    return false;
+}
+
+
+bool get_root_key(uint8_t * root_key)
+{
+    struct helper helper;
+
+    if (helper_load(&helper)) {
+        return true;
+    }
+
+    bool rc = derive_root_key(&helper, root_key);
+    int errno_hold = errno;
+    helper_free(&helper);
+    errno = errno_hold;
+    return rc;
+}
+
+
+bool warmup()
+{
+    // Build the simulated array, and check that the helper data loads
+    if (!sram_size()) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "simulated SRAM is unavailable");
+        errno = ENOMEM;
+        return true;
+    }
+
+    if (puflib_module_status(&MODULE_INFO) & MODULE_PROVISIONED) {
+        struct helper helper;
+        if (helper_load(&helper)) {
+            return true;
+        }
+        helper_free(&helper);
+    }
+    return false;
+}
+
+
+// A session keeps the helper data loaded, so each key reconstruction is
+// just a read of the array.
+
+void * session_open()
+{
+    struct helper * helper = malloc(sizeof(*helper));
+    if (!helper) {
+        puflib_perror(&MODULE_INFO);
+        return NULL;
+    }
+
+    if (helper_load(helper)) {
+        int errno_hold = errno;
+        free(helper);
+        errno = errno_hold;
+        return NULL;
+    }
+    return helper;
+}
+
+
+void session_close(void * state)
+{
+    helper_free(state);
+    free(state);
+}
+
+
+bool session_get_root_key(void * state, uint8_t * root_key)
+{
+    return derive_root_key(state, root_key);
+}
+
+
+/**
+ * Survey the start of the SRAM over several reads and pick the cells to use
+ * as the response: the len * 8 cells that disagreed with their majority in
+ * the fewest reads.
+ *
+ * @param len - response length, in bytes
+ * @param window - outparam: number of bytes of SRAM the selection spans
+ * @param mask - outparam: selection, window bytes. Caller frees.
+ * @param reads - outparam: ENROLL_READS responses of len bytes, gathered
+ *  through the mask. Caller frees.
+ * @return false on success, true on error
+ */
+static bool select_cells(size_t len, size_t * window, uint8_t ** mask, uint8_t ** reads)
+{
+    size_t survey = len * DARK_BIT_WINDOW;
+    size_t size = sram_size();
+    struct puflib_vote * vote = NULL;
+    uint8_t * raw = NULL;
+    bool rc = true;
+
+    if (survey > size) {
+        survey = size;
+    }
+    if (survey < len) {
+        puflib_report(&MODULE_INFO, STATUS_ERROR, "simulated SRAM is too small for the chosen code");
+        errno = ENOSPC;
+        return true;
+    }
+
+    *mask = NULL;
+    *reads = NULL;
+    vote = puflib_vote_new(survey);
+    raw = calloc(ENROLL_READS, survey);
+    *mask = calloc(1, survey);
+    *reads = calloc(ENROLL_READS, len);
+    if (!vote || !raw || !*mask || !*reads) {
+        goto out;
+    }
+
+    puflib_report_fmt(&MODULE_INFO, STATUS_INFO,
+            "surveying %d reads of %zu bytes", ENROLL_READS, survey);
+    for (size_t i = 0; i < ENROLL_READS; ++i) {
+        if (sram_read(0, survey, raw + i * survey) || puflib_vote_add(vote, raw + i * survey)) {
+            goto out;
+        }
+    }
+
+    // Loosen the stability requirement until there are enough cells. Once
+    // half the reads may disagree every cell qualifies, so this terminates.
+    size_t max_disagree = 0;
+    while (puflib_vote_stable(vote, max_disagree, *mask) < len * 8) {
+        ++max_disagree;
+    }
+    puflib_mask_truncate(*mask, survey, len * 8);
+
+    *window = survey;
+    while (!(*mask)[*window - 1]) {
+        --*window;
+    }
+
+    puflib_report_fmt(&MODULE_INFO, STATUS_INFO,
+            "using %zu cells of the first %zu, each flipping in at most %zu of %d reads",
+            len * 8, *window * 8, max_disagree, ENROLL_READS);
+
+    for (size_t i = 0; i < ENROLL_READS; ++i) {
+        puflib_mask_gather(raw + i * survey, *mask, *window, *reads + i * len);
+    }
+    rc = false;
+
+out:
+    {
+        int errno_hold = errno;
+        if (raw) {
+            puflib_secure_zero(raw, ENROLL_READS * survey);
+        }
+        free(raw);
+        puflib_vote_free(vote);
+        if (rc) {
+            free(*mask);
+            free(*reads);
+            *mask = NULL;
+            *reads = NULL;
+        }
+        errno = errno_hold;
+        return rc;
+    }
+}
+
+
+enum provisioning_status provision()
+{
+    uint32_t rep = (uint32_t) env_double("PUFLIB_SRAMSIM_REP", DEFAULT_REP, 1, 255);
+    uint32_t t = (uint32_t) env_double("PUFLIB_SRAMSIM_BCH_T", DEFAULT_BCH_T, 1, 60);
+    uint8_t key[KEY_BITS / 8];
+    uint8_t header[HELPER_HEADER_LEN];
+    uint8_t * reads = NULL;
+    uint8_t * mask = NULL;
+    uint8_t * mask_enc = NULL;
+    uint8_t * data = NULL;
+    char * path = NULL;
+    FILE * f = NULL;
+    size_t len = 0;
+    size_t window = 0;
+    size_t mask_enc_len = 0;
+
+    struct puflib_fe * fe = puflib_fe_new(KEY_BITS, t, rep);
+    if (!fe) {
+        goto err;
+    }
+
+    len = puflib_fe_response_len(fe);
+    data = calloc(1, puflib_fe_soft_helper_len(fe));
+    if (!data) {
+        goto err;
+    }
+
+    if (select_cells(len, &window, &mask, &reads)
+            || puflib_mask_encode(mask, window, &mask_enc, &mask_enc_len)) {
+        goto err;
+    }
+
+    if (puflib_fe_generate_soft(fe, reads, ENROLL_READS, key, data)) {
+        goto err;
+    }
+
+    memcpy(header, HELPER_MAGIC, HELPER_MAGIC_LEN);
+    put_le32(header + HELPER_MAGIC_LEN, rep);
+    put_le32(header + HELPER_MAGIC_LEN + 4, t);
+    put_le32(header + HELPER_MAGIC_LEN + 8, (uint32_t) window);
+    put_le32(header + HELPER_MAGIC_LEN + 12, (uint32_t) mask_enc_len);
+    key_check(key, header + HELPER_MAGIC_LEN + 16);
+    puflib_secure_zero(key, sizeof(key));
+
+    path = puflib_create_nv_store(&MODULE_INFO, STORAGE_FINAL_FILE);
+    if (!path) {
+        goto err;
+    }
+
+    f = fopen(path, "wb");
+    if (!f) {
+        goto err_store;
+    }
+
+    if (fwrite(header, 1, sizeof(header), f) != sizeof(header)
+            || fwrite(mask_enc, 1, mask_enc_len, f) != mask_enc_len
+            || fwrite(data, 1, puflib_fe_soft_helper_len(fe), f) != puflib_fe_soft_helper_len(fe)) {
+        goto err_store;
+    }
+
+    if (fclose(f)) {
+        f = NULL;
+        goto err_store;
+    }
+
+    puflib_report_fmt(&MODULE_INFO, STATUS_INFO, "complete (cell selection stored in %zu bytes)",
+            mask_enc_len);
+    free(path);
+    puflib_secure_zero(reads, ENROLL_READS * len);
+    free(reads);
+    free(mask);
+    free(mask_enc);
+    free(data);
+    puflib_fe_free(fe);
+    return PROVISION_COMPLETE;
+
+err_store:
+    {
+        int errno_hold = errno;
+        if (f) {
+            fclose(f);
+        }
+        puflib_delete_nv_store(&MODULE_INFO, STORAGE_FINAL_FILE);
+        errno = errno_hold;
+    }
+err:
+    puflib_perror(&MODULE_INFO);
+    free(path);
+    if (reads) {
+        puflib_secure_zero(reads, ENROLL_READS * len);
+    }
+    free(reads);
+    free(mask);
+    free(mask_enc);
+    free(data);
+    puflib_fe_free(fe);
+    return PROVISION_ERROR;
+}
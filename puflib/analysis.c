@@ -0,0 +1,665 @@
+// PUFlib quality analysis
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Dataset file layout (integers little-endian):
+//
+//   header (DATASET_HEADER_LEN bytes):
+//     magic "PUFDSET1", then u64 each: n_challenges, chal_len, resp_len,
+//     n_reads, intra, unstable, name_len
+//   module name (name_len bytes)
+//   majority responses (n_challenges * resp_len bytes, in challenge order)
+//
+// intra is the total number of bits, over all reads, that differed from the
+// majority; unstable is the number of majority bits that any read disagreed
+// with.
+//
+
+#include <puflib.h>
+#include <puflib_module.h>
+#include <puflib_internal.h>
+#include "misc.h"
+#include "bitslice.h"
+#include "instance.h"
+
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#define DATASET_MAGIC "PUFDSET1"
+#define DATASET_MAGIC_LEN 8
+#define DATASET_HEADER_LEN (DATASET_MAGIC_LEN + 7 * 8)
+#define MAX_NAME_LEN 4096
+
+/// Challenges read together in one vote during collection
+#define BLOCK_CHALLENGES 1024
+
+/// Response bytes compared at once when computing per-bit statistics
+#define CHUNK_BYTES 8192
+
+struct puflib_dataset {
+    char * module;
+    size_t n_challenges;
+    size_t chal_len;
+    size_t resp_len;
+    unsigned n_reads;
+    uint64_t intra;
+    uint64_t unstable;
+    size_t n_bytes;             ///< n_challenges * resp_len
+    uint64_t * ref;             ///< majority responses, zero-padded to whole words
+};
+
+
+static struct puflib_dataset * dataset_new(char const * module, size_t n_challenges,
+        size_t chal_len, size_t resp_len, unsigned n_reads)
+{
+    struct puflib_dataset * dataset = calloc(1, sizeof(*dataset));
+    if (!dataset) {
+        return NULL;
+    }
+
+    if (resp_len && n_challenges > SIZE_MAX / resp_len) {
+        free(dataset);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    dataset->n_challenges = n_challenges;
+    dataset->chal_len = chal_len;
+    dataset->resp_len = resp_len;
+    dataset->n_reads = n_reads;
+    dataset->n_bytes = n_challenges * resp_len;
+    dataset->module = puflib_duplicate_string(module);
+    dataset->ref = calloc(dataset->n_bytes / 8 + 1, sizeof(uint64_t));
+    if (!dataset->module || !dataset->ref) {
+        puflib_dataset_free(dataset);
+        return NULL;
+    }
+    return dataset;
+}
+
+
+void puflib_dataset_free(struct puflib_dataset * dataset)
+{
+    if (dataset) {
+        free(dataset->module);
+        free(dataset->ref);
+        free(dataset);
+    }
+}
+
+
+char const * puflib_dataset_module(struct puflib_dataset const * dataset)
+{
+    return dataset->module;
+}
+
+
+/**
+ * Run fn(arg) on n_threads threads, one of them the caller's, and wait for
+ * all of them. If threads cannot be created, runs on fewer.
+ */
+static void run_workers(unsigned n_threads, void * (*fn)(void *), void * arg)
+{
+    pthread_t * threads = NULL;
+    unsigned started = 0;
+
+    if (n_threads > 1) {
+        threads = calloc(n_threads - 1, sizeof(*threads));
+    }
+    if (threads) {
+        while (started < n_threads - 1
+                && !pthread_create(&threads[started], NULL, fn, arg)) {
+            ++started;
+        }
+    }
+
+    fn(arg);
+
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+
+/******************************************************************************
+ * Collection                                                                 *
+ *****************************************************************************/
+
+static uint64_t mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+
+/**
+ * Fill in challenge number index. The challenge depends only on index and
+ * length, so that all devices see the same series.
+ */
+static void make_challenge(size_t index, uint8_t * chal, size_t chal_len)
+{
+    size_t words = (chal_len + 7) / 8;
+    for (size_t i = 0; i < chal_len; i += 8) {
+        uint8_t buf[8];
+        puflib_store_le64(buf, mix64((uint64_t) index * words + i / 8));
+        memcpy(chal + i, buf, chal_len - i < 8 ? chal_len - i : 8);
+    }
+}
+
+
+struct collector {
+    module_info const * module;
+    unsigned instance;          ///< every worker reads the same device
+    struct puflib_dataset * dataset;
+    size_t next_block;          ///< atomic
+    uint64_t intra;             ///< atomic
+    uint64_t unstable;          ///< atomic
+    int error;                  ///< atomic; errno of the first failure, or 0
+};
+
+
+static void collector_fail(struct collector * c, int error)
+{
+    int expected = 0;
+    __atomic_compare_exchange_n(&c->error, &expected, error ? error : EIO,
+            false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+
+/**
+ * Read one block of challenges n_reads times and vote on the results.
+ * @return false on success, true on error (with errno set)
+ */
+static bool collect_block(struct collector * c, size_t first, size_t count,
+        uint8_t * chal, uint8_t * reads, uint16_t * stability)
+{
+    struct puflib_dataset * ds = c->dataset;
+    size_t bytes = count * ds->resp_len;
+
+    struct puflib_vote * vote = puflib_vote_new(bytes);
+    if (!vote) {
+        return true;
+    }
+
+    for (unsigned r = 0; r < ds->n_reads; ++r) {
+        for (size_t i = 0; i < count; ++i) {
+            void * resp;
+            size_t resp_len;
+
+            make_challenge(first + i, chal, ds->chal_len);
+            if (puflib_chal_resp(c->module, chal, ds->chal_len, &resp, &resp_len)) {
+                goto err;
+            }
+            if (resp_len != ds->resp_len) {
+                free(resp);
+                errno = EPROTO;
+                goto err;
+            }
+            memcpy(reads + i * ds->resp_len, resp, resp_len);
+            free(resp);
+        }
+        if (puflib_vote_add(vote, reads)) {
+            goto err;
+        }
+
+        if (__atomic_load_n(&c->error, __ATOMIC_RELAXED)) {
+            // Another worker failed; the result will be discarded anyway
+            puflib_vote_free(vote);
+            return false;
+        }
+    }
+
+    // Blocks cover disjoint bytes of ref, so workers never write the same word
+    if (puflib_vote_result(vote, (uint8_t *) ds->ref + first * ds->resp_len, stability)) {
+        goto err;
+    }
+    puflib_vote_free(vote);
+
+    uint64_t intra = 0, unstable = 0;
+    for (size_t j = 0; j < bytes * 8; ++j) {
+        unsigned disagree = ds->n_reads - stability[j];
+        intra += disagree;
+        unstable += !!disagree;
+    }
+    __atomic_add_fetch(&c->intra, intra, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->unstable, unstable, __ATOMIC_RELAXED);
+    return false;
+
+err:
+    {
+        int errno_hold = errno;
+        puflib_vote_free(vote);
+        errno = errno_hold;
+    }
+    return true;
+}
+
+
+static void * collect_worker(void * arg)
+{
+    struct collector * c = arg;
+    struct puflib_dataset * ds = c->dataset;
+    unsigned saved = puflib_select_instance(c->instance);
+
+    uint8_t * chal = malloc(ds->chal_len ? ds->chal_len : 1);
+    uint8_t * reads = malloc(BLOCK_CHALLENGES * ds->resp_len);
+    uint16_t * stability = malloc(BLOCK_CHALLENGES * ds->resp_len * 8 * sizeof(uint16_t));
+    if (!chal || !reads || !stability) {
+        collector_fail(c, errno);
+        goto out;
+    }
+
+    while (!__atomic_load_n(&c->error, __ATOMIC_RELAXED)) {
+        size_t first = __atomic_fetch_add(&c->next_block, 1, __ATOMIC_RELAXED) * BLOCK_CHALLENGES;
+        if (first >= ds->n_challenges) {
+            break;
+        }
+
+        size_t count = ds->n_challenges - first;
+        if (count > BLOCK_CHALLENGES) {
+            count = BLOCK_CHALLENGES;
+        }
+        if (collect_block(c, first, count, chal, reads, stability)) {
+            collector_fail(c, errno);
+        }
+    }
+
+out:
+    free(chal);
+    free(reads);
+    free(stability);
+    puflib_select_instance(saved);
+    return NULL;
+}
+
+
+struct puflib_dataset * puflib_dataset_collect(module_info const * module,
+        size_t n_challenges, size_t chal_len, unsigned n_reads, unsigned n_threads)
+{
+    if (!module || !module->chal_resp || !n_challenges
+            || !n_reads || n_reads > PUFLIB_VOTE_MAX_READS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // The first response fixes the response length
+    uint8_t * chal = malloc(chal_len ? chal_len : 1);
+    if (!chal) {
+        return NULL;
+    }
+    make_challenge(0, chal, chal_len);
+
+    // A dataset describes one device: the selected instance, or instance 0,
+    // rather than whichever instance each challenge would be balanced to
+    unsigned instance = puflib_instance();
+    unsigned saved = puflib_select_instance(instance);
+
+    void * resp;
+    size_t resp_len;
+    bool rc = puflib_chal_resp(module, chal, chal_len, &resp, &resp_len);
+    char buf[PUFLIB_INSTANCE_NAME_LEN];
+    char const * name = rc ? NULL : puflib_instance_name(module, buf);
+    puflib_select_instance(saved);
+    free(chal);
+    if (rc) {
+        return NULL;
+    }
+    free(resp);
+    if (!name) {
+        return NULL;
+    }
+    if (!resp_len) {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    // Datasets from different instances are told apart by the instance name
+    struct collector c = {
+        .module = module,
+        .instance = instance,
+        .dataset = dataset_new(name, n_challenges, chal_len, resp_len, n_reads),
+    };
+    if (!c.dataset) {
+        return NULL;
+    }
+
+    if (!n_threads) {
+        n_threads = puflib_cpu_count();
+    }
+    size_t n_blocks = (n_challenges + BLOCK_CHALLENGES - 1) / BLOCK_CHALLENGES;
+    if (n_threads > n_blocks) {
+        n_threads = (unsigned) n_blocks;
+    }
+    run_workers(n_threads, collect_worker, &c);
+
+    if (c.error) {
+        puflib_dataset_free(c.dataset);
+        errno = c.error;
+        return NULL;
+    }
+
+    c.dataset->intra = c.intra;
+    c.dataset->unstable = c.unstable;
+    return c.dataset;
+}
+
+
+/******************************************************************************
+ * Storage                                                                    *
+ *****************************************************************************/
+
+bool puflib_dataset_save(struct puflib_dataset const * dataset, char const * path)
+{
+    uint8_t header[DATASET_HEADER_LEN];
+    size_t name_len = strlen(dataset->module);
+
+    memcpy(header, DATASET_MAGIC, DATASET_MAGIC_LEN);
+    uint64_t fields[] = {
+        dataset->n_challenges, dataset->chal_len, dataset->resp_len, dataset->n_reads,
+        dataset->intra, dataset->unstable, name_len,
+    };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        puflib_store_le64(header + DATASET_MAGIC_LEN + 8 * i, fields[i]);
+    }
+
+    FILE * f = fopen(path, "wb");
+    if (!f) {
+        return true;
+    }
+
+    if (fwrite(header, 1, DATASET_HEADER_LEN, f) != DATASET_HEADER_LEN
+            || fwrite(dataset->module, 1, name_len, f) != name_len
+            || fwrite(dataset->ref, 1, dataset->n_bytes, f) != dataset->n_bytes) {
+        int errno_hold = errno;
+        fclose(f);
+        errno = errno_hold;
+        return true;
+    }
+
+    return fclose(f) != 0;
+}
+
+
+struct puflib_dataset * puflib_dataset_load(char const * path)
+{
+    struct puflib_dataset * dataset = NULL;
+    char * name = NULL;
+    uint8_t header[DATASET_HEADER_LEN];
+    uint64_t fields[7];
+
+    FILE * f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+
+    if (fread(header, 1, DATASET_HEADER_LEN, f) != DATASET_HEADER_LEN
+            || memcmp(header, DATASET_MAGIC, DATASET_MAGIC_LEN)) {
+        goto bad;
+    }
+    for (size_t i = 0; i < 7; ++i) {
+        fields[i] = puflib_load_le64(header + DATASET_MAGIC_LEN + 8 * i);
+    }
+
+    uint64_t n_challenges = fields[0], chal_len = fields[1], resp_len = fields[2];
+    uint64_t n_reads = fields[3], name_len = fields[6];
+    if (!n_challenges || n_challenges > SIZE_MAX || chal_len > SIZE_MAX
+            || !resp_len || resp_len > SIZE_MAX / n_challenges
+            || !n_reads || n_reads > PUFLIB_VOTE_MAX_READS || name_len > MAX_NAME_LEN) {
+        goto bad;
+    }
+
+    name = calloc(1, name_len + 1);
+    if (!name) {
+        goto err;
+    }
+    if (fread(name, 1, name_len, f) != name_len) {
+        goto bad;
+    }
+
+    dataset = dataset_new(name, n_challenges, chal_len, resp_len, n_reads);
+    if (!dataset) {
+        goto err;
+    }
+    dataset->intra = fields[4];
+    dataset->unstable = fields[5];
+
+    if (fread(dataset->ref, 1, dataset->n_bytes, f) != dataset->n_bytes
+            || fgetc(f) != EOF) {
+        goto bad;
+    }
+
+    free(name);
+    fclose(f);
+    return dataset;
+
+bad:
+    if (!ferror(f)) {
+        errno = EBADMSG;
+    }
+err:
+    {
+        int errno_hold = errno;
+        puflib_dataset_free(dataset);
+        free(name);
+        fclose(f);
+        errno = errno_hold;
+    }
+    return NULL;
+}
+
+
+/******************************************************************************
+ * Analysis                                                                   *
+ *****************************************************************************/
+
+struct analyzer {
+    struct puflib_dataset const * const * datasets;
+    size_t n;
+    size_t n_words;
+    size_t n_bytes;
+
+    size_t next_row;            ///< atomic, for pairwise distances
+    size_t next_chunk;          ///< atomic, for per-bit statistics
+
+    pthread_mutex_t lock;       ///< protects everything below
+    int error;
+    uint64_t inter_sum;
+    uint64_t inter_min;
+    uint64_t inter_max;
+    uint64_t ones_min;
+    uint64_t ones_max;
+    uint64_t * histogram;       ///< n + 1 counts of bits by majority size
+};
+
+
+/// Distances between device i and all later devices
+static void analyze_row(struct analyzer * a, size_t i)
+{
+    uint64_t sum = 0, min = UINT64_MAX, max = 0;
+
+    for (size_t j = i + 1; j < a->n; ++j) {
+        uint64_t d = puflib_bs_distance(a->datasets[i]->ref, a->datasets[j]->ref, a->n_words);
+        sum += d;
+        min = d < min ? d : min;
+        max = d > max ? d : max;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    a->inter_sum += sum;
+    a->inter_min = min < a->inter_min ? min : a->inter_min;
+    a->inter_max = max > a->inter_max ? max : a->inter_max;
+    pthread_mutex_unlock(&a->lock);
+}
+
+
+/// Per-bit counts of devices setting each bit of one chunk
+static bool analyze_chunk(struct analyzer * a, size_t offset, size_t bytes,
+        uint8_t * majority, uint16_t * stability, uint64_t * histogram)
+{
+    struct puflib_vote * vote = puflib_vote_new(bytes);
+    if (!vote) {
+        return true;
+    }
+
+    for (size_t i = 0; i < a->n; ++i) {
+        if (puflib_vote_add(vote, (uint8_t const *) a->datasets[i]->ref + offset)) {
+            puflib_vote_free(vote);
+            return true;
+        }
+    }
+    bool rc = puflib_vote_result(vote, majority, stability);
+    puflib_vote_free(vote);
+    if (rc) {
+        return true;
+    }
+
+    uint64_t ones_min = UINT64_MAX, ones_max = 0;
+    for (size_t j = 0; j < bytes * 8; ++j) {
+        bool set = (majority[j / 8] >> (j % 8)) & 1;
+        uint64_t ones = set ? stability[j] : a->n - stability[j];
+        ones_min = ones < ones_min ? ones : ones_min;
+        ones_max = ones > ones_max ? ones : ones_max;
+        ++histogram[stability[j]];
+    }
+
+    pthread_mutex_lock(&a->lock);
+    a->ones_min = ones_min < a->ones_min ? ones_min : a->ones_min;
+    a->ones_max = ones_max > a->ones_max ? ones_max : a->ones_max;
+    pthread_mutex_unlock(&a->lock);
+    return false;
+}
+
+
+static void * analyze_worker(void * arg)
+{
+    struct analyzer * a = arg;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&a->next_row, 1, __ATOMIC_RELAXED);
+        if (i + 1 >= a->n) {
+            break;
+        }
+        analyze_row(a, i);
+    }
+
+    uint8_t * majority = malloc(CHUNK_BYTES);
+    uint16_t * stability = malloc(CHUNK_BYTES * 8 * sizeof(uint16_t));
+    uint64_t * histogram = calloc(a->n + 1, sizeof(uint64_t));
+    bool failed = !majority || !stability || !histogram;
+
+    while (!failed) {
+        size_t offset = __atomic_fetch_add(&a->next_chunk, 1, __ATOMIC_RELAXED) * CHUNK_BYTES;
+        if (offset >= a->n_bytes) {
+            break;
+        }
+        size_t bytes = a->n_bytes - offset < CHUNK_BYTES ? a->n_bytes - offset : CHUNK_BYTES;
+        failed = analyze_chunk(a, offset, bytes, majority, stability, histogram);
+    }
+
+    pthread_mutex_lock(&a->lock);
+    if (failed) {
+        a->error = a->error ? a->error : errno;
+    } else {
+        for (size_t s = 0; s <= a->n; ++s) {
+            a->histogram[s] += histogram[s];
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    free(majority);
+    free(stability);
+    free(histogram);
+    return NULL;
+}
+
+
+bool puflib_analyze(struct puflib_dataset const * const * datasets, size_t n_datasets,
+        unsigned n_threads, struct puflib_quality * quality)
+{
+    if (!n_datasets || n_datasets > PUFLIB_VOTE_MAX_READS) {
+        errno = EINVAL;
+        return true;
+    }
+    struct puflib_dataset const * first = datasets[0];
+    for (size_t i = 1; i < n_datasets; ++i) {
+        if (datasets[i]->n_challenges != first->n_challenges
+                || datasets[i]->chal_len != first->chal_len
+                || datasets[i]->resp_len != first->resp_len) {
+            errno = EINVAL;
+            return true;
+        }
+    }
+
+    struct analyzer a = {
+        .datasets = datasets,
+        .n = n_datasets,
+        .n_words = first->n_bytes / 8 + 1,
+        .n_bytes = first->n_bytes,
+        .inter_min = UINT64_MAX,
+        .ones_min = UINT64_MAX,
+        .histogram = calloc(n_datasets + 1, sizeof(uint64_t)),
+    };
+    if (!a.histogram) {
+        return true;
+    }
+    pthread_mutex_init(&a.lock, NULL);
+
+    if (!n_threads) {
+        n_threads = puflib_cpu_count();
+    }
+    run_workers(n_threads, analyze_worker, &a);
+    pthread_mutex_destroy(&a.lock);
+
+    if (a.error) {
+        free(a.histogram);
+        errno = a.error;
+        return true;
+    }
+
+    double n_bits = (double) first->n_bytes * 8;
+    memset(quality, 0, sizeof(*quality));
+    quality->n_devices = n_datasets;
+    quality->n_bits = (uint64_t) first->n_bytes * 8;
+    quality->uniformity_min = quality->reliability_min = INFINITY;
+
+    for (size_t i = 0; i < n_datasets; ++i) {
+        struct puflib_dataset const * ds = datasets[i];
+        double uniformity = puflib_bs_distance(ds->ref, NULL, a.n_words) / n_bits;
+        double reliability = 1.0 - ds->intra / (n_bits * ds->n_reads);
+
+        quality->uniformity += uniformity / n_datasets;
+        quality->uniformity_min = fmin(quality->uniformity_min, uniformity);
+        quality->uniformity_max = fmax(quality->uniformity_max, uniformity);
+        quality->reliability += reliability / n_datasets;
+        quality->reliability_min = fmin(quality->reliability_min, reliability);
+        quality->unstable += ds->unstable / n_bits / n_datasets;
+    }
+
+    if (n_datasets > 1) {
+        double n_pairs = (double) n_datasets * (n_datasets - 1) / 2;
+        quality->uniqueness = a.inter_sum / n_bits / n_pairs;
+        quality->uniqueness_min = a.inter_min / n_bits;
+        quality->uniqueness_max = a.inter_max / n_bits;
+    } else {
+        quality->uniqueness = quality->uniqueness_min = quality->uniqueness_max = NAN;
+    }
+
+    quality->bit_aliasing_min = (double) a.ones_min / n_datasets;
+    quality->bit_aliasing_max = (double) a.ones_max / n_datasets;
+
+    // A bit on which the majority of devices agree has min-entropy
+    // -log2(majority / n); histogram[s] counts bits with a majority of s
+    double entropy = 0;
+    for (size_t s = 1; s <= n_datasets; ++s) {
+        entropy += a.histogram[s] * -log2((double) s / n_datasets);
+    }
+    quality->min_entropy = entropy / n_bits;
+
+    free(a.histogram);
+    return false;
+}
@@ -0,0 +1,177 @@
+// PUFlib bit-sliced SIMD helpers
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+
+#include "bitslice.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define MAX_PLANES 9
+
+/// Carry-save adder: high and low bits of a + b + c, lane by lane
+#define CSA(high, low, a, b, c) do {        \
+        puflib_vec u_ = (a) ^ (b);          \
+        (high) = ((a) & (b)) | (u_ & (c));  \
+        (low) = u_ ^ (c);                   \
+    } while (0)
+
+PUFLIB_SIMD_DISPATCH
+void puflib_bs_majority(uint64_t const * in, size_t n_inputs, size_t n_words,
+        uint64_t * out)
+{
+    // Each lane holds a counter spread over `planes` vectors, bit p of the
+    // counter in planes[p]. Counters start at 2^top - threshold, so the top
+    // plane becomes set exactly when a lane has seen `threshold` ones.
+    size_t threshold = n_inputs / 2 + 1;
+    size_t top = 0;
+    while (((size_t) 1 << top) < threshold) {
+        ++top;
+    }
+    size_t start = ((size_t) 1 << top) - threshold;
+
+    for (size_t w = 0; w < n_words; w += PUFLIB_VEC_WORDS) {
+        size_t chunk = n_words - w < PUFLIB_VEC_WORDS ? n_words - w : PUFLIB_VEC_WORDS;
+        puflib_vec planes[MAX_PLANES];
+
+        for (size_t p = 0; p <= top; ++p) {
+            uint64_t fill = ((start >> p) & 1) ? UINT64_MAX : 0;
+            planes[p] = (puflib_vec) { 0 } + fill;
+        }
+
+        for (size_t i = 0; i < n_inputs; ++i) {
+            puflib_vec carry = { 0 };
+            memcpy(&carry, in + i * n_words + w, chunk * sizeof(uint64_t));
+            for (size_t p = 0; p <= top; ++p) {
+                puflib_vec next = planes[p] & carry;
+                planes[p] ^= carry;
+                carry = next;
+            }
+        }
+
+        memcpy(out + w, &planes[top], chunk * sizeof(uint64_t));
+    }
+}
+
+
+PUFLIB_SIMD_DISPATCH
+void puflib_bs_accumulate(uint64_t * planes, size_t n_planes, size_t n_words,
+        uint64_t const * in)
+{
+    for (size_t w = 0; w < n_words; w += PUFLIB_VEC_WORDS) {
+        size_t chunk = n_words - w < PUFLIB_VEC_WORDS ? n_words - w : PUFLIB_VEC_WORDS;
+        size_t bytes = chunk * sizeof(uint64_t);
+        puflib_vec carry = { 0 };
+        memcpy(&carry, in + w, bytes);
+
+        // Ripple the carry upwards; on average it dies out within two planes
+        for (size_t p = 0; p < n_planes; ++p) {
+            puflib_vec plane = { 0 };
+            memcpy(&plane, planes + p * n_words + w, bytes);
+            puflib_vec next = plane & carry;
+            plane ^= carry;
+            memcpy(planes + p * n_words + w, &plane, bytes);
+            carry = next;
+
+            uint64_t any = 0;
+            for (size_t i = 0; i < PUFLIB_VEC_WORDS; ++i) {
+                any |= carry[i];
+            }
+            if (!any) {
+                break;
+            }
+        }
+    }
+}
+
+
+PUFLIB_SIMD_DISPATCH
+void puflib_bs_compare(uint64_t const * planes, size_t n_planes, size_t n_words,
+        uint64_t value, uint64_t * gt, uint64_t * eq)
+{
+    // A value wider than the counters is greater than all of them
+    bool too_wide = n_planes < 64 && (value >> n_planes);
+
+    for (size_t w = 0; w < n_words; w += PUFLIB_VEC_WORDS) {
+        size_t chunk = n_words - w < PUFLIB_VEC_WORDS ? n_words - w : PUFLIB_VEC_WORDS;
+        size_t bytes = chunk * sizeof(uint64_t);
+        puflib_vec greater = { 0 };
+        puflib_vec equal = (puflib_vec) { 0 } + (too_wide ? 0 : UINT64_MAX);
+
+        // Scan from the most significant plane: a lane is greater at the
+        // first plane where it has a 1 and the value has a 0.
+        for (size_t p = n_planes; p-- > 0;) {
+            puflib_vec plane = { 0 };
+            memcpy(&plane, planes + p * n_words + w, bytes);
+            if ((value >> p) & 1) {
+                equal &= plane;
+            } else {
+                greater |= equal & plane;
+                equal &= ~plane;
+            }
+        }
+
+        if (gt) {
+            memcpy(gt + w, &greater, bytes);
+        }
+        if (eq) {
+            memcpy(eq + w, &equal, bytes);
+        }
+    }
+}
+
+
+static inline uint64_t vec_popcount(puflib_vec const * v)
+{
+    uint64_t n = 0;
+    for (size_t i = 0; i < PUFLIB_VEC_WORDS; ++i) {
+        n += (uint64_t) __builtin_popcountll((*v)[i]);
+    }
+    return n;
+}
+
+
+static inline void load_xor(puflib_vec * v, uint64_t const * a, uint64_t const * b, size_t w)
+{
+    puflib_vec vb = { 0 };
+    memcpy(v, a + w, sizeof(*v));
+    if (b) {
+        memcpy(&vb, b + w, sizeof(vb));
+    }
+    *v ^= vb;
+}
+
+
+PUFLIB_SIMD_DISPATCH
+uint64_t puflib_bs_distance(uint64_t const * a, uint64_t const * b, size_t n_words)
+{
+    // Harley-Seal: sum eight vectors at a time through a tree of carry-save
+    // adders, so that only one in eight vectors needs a full popcount
+    puflib_vec ones = { 0 }, twos = { 0 }, fours = { 0 }, eights;
+    puflib_vec twos_a, twos_b, fours_a, fours_b;
+    puflib_vec v[8];
+    uint64_t total = 0;
+    size_t w = 0;
+
+    for (; w + 8 * PUFLIB_VEC_WORDS <= n_words; w += 8 * PUFLIB_VEC_WORDS) {
+        for (size_t i = 0; i < 8; ++i) {
+            load_xor(&v[i], a, b, w + i * PUFLIB_VEC_WORDS);
+        }
+        CSA(twos_a, ones, ones, v[0], v[1]);
+        CSA(twos_b, ones, ones, v[2], v[3]);
+        CSA(fours_a, twos, twos, twos_a, twos_b);
+        CSA(twos_a, ones, ones, v[4], v[5]);
+        CSA(twos_b, ones, ones, v[6], v[7]);
+        CSA(fours_b, twos, twos, twos_a, twos_b);
+        CSA(eights, fours, fours, fours_a, fours_b);
+        total += vec_popcount(&eights);
+    }
+
+    total = 8 * total + 4 * vec_popcount(&fours) + 2 * vec_popcount(&twos)
+        + vec_popcount(&ones);
+
+    for (; w < n_words; ++w) {
+        total += (uint64_t) __builtin_popcountll(a[w] ^ (b ? b[w] : 0));
+    }
+    return total;
+}
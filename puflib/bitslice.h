@@ -0,0 +1,136 @@
+// PUFlib bit-sliced SIMD helpers
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+// Bit-sliced arithmetic treats each bit position of a machine word as an
+// independent lane, so one vector operation updates hundreds of per-bit
+// counters at once. Vectors are GCC vector extensions, which compile to
+// SSE2, AVX2 or AVX-512 as the target allows; on x86-64, hot functions are
+// cloned for each of these and the best one is picked at load time.
+//
+
+#ifndef _PUFLIB_BITSLICE_H_
+#define _PUFLIB_BITSLICE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Number of 64-bit words in one SIMD vector
+#define PUFLIB_VEC_WORDS 8
+
+/// 512-bit vector of 64-bit lanes
+typedef uint64_t puflib_vec __attribute__((vector_size(PUFLIB_VEC_WORDS * 8)));
+
+// Not under ThreadSanitizer, whose runtime is not yet initialised when the
+// load-time dispatch runs.
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute) \
+        && !defined(__SANITIZE_THREAD__)
+# if __has_attribute(target_clones)
+/// Compile a function once per x86-64 SIMD level and dispatch at load time.
+/// GCC only clears the upper vector halves (vzeroupper) on leaving AVX code
+/// when expensive-optimizations is on, which -Og and -O1 leave off; without
+/// it, all SSE code run afterwards in the process pays a transition penalty.
+#  define PUFLIB_SIMD_DISPATCH __attribute__((target_clones("avx512f", "avx2", "default"), \
+                                              optimize("expensive-optimizations")))
+# endif
+#endif
+#ifndef PUFLIB_SIMD_DISPATCH
+# define PUFLIB_SIMD_DISPATCH
+#endif
+
+/**
+ * Maximum number of inputs to puflib_bs_majority().
+ */
+#define PUFLIB_BS_MAX_INPUTS 255
+
+/**
+ * Per-bit majority vote across several equally sized bit strings.
+ *
+ * Input i occupies words [i * n_words, (i + 1) * n_words) of @a in. Bit j of
+ * the output is set iff bit j is set in more than half of the inputs; ties
+ * (possible only for an even number of inputs) resolve to zero.
+ *
+ * @param in - n_inputs * n_words input words
+ * @param n_inputs - number of inputs, 1 to PUFLIB_BS_MAX_INPUTS
+ * @param n_words - words per input
+ * @param out - n_words output words
+ */
+void puflib_bs_majority(uint64_t const * in, size_t n_inputs, size_t n_words,
+        uint64_t * out);
+
+/**
+ * Add one bit string to a set of bit-sliced counters: every counter whose
+ * bit is set in @a in is incremented.
+ *
+ * Counters are stored plane by plane: bit p of the counter for bit j lives in
+ * bit j of planes[p * n_words ...]. Carries out of the top plane are lost.
+ *
+ * @param planes - n_planes * n_words words of counter planes
+ * @param n_planes - number of planes (counter width in bits)
+ * @param n_words - words per plane
+ * @param in - n_words words to add
+ */
+void puflib_bs_accumulate(uint64_t * planes, size_t n_planes, size_t n_words,
+        uint64_t const * in);
+
+/**
+ * Compare bit-sliced counters against a constant.
+ *
+ * @param planes - counter planes, as for puflib_bs_accumulate()
+ * @param n_planes - number of planes
+ * @param n_words - words per plane
+ * @param value - constant to compare against
+ * @param gt - outparam, n_words words: bit j set iff counter j > value.
+ *  May be NULL.
+ * @param eq - outparam, n_words words: bit j set iff counter j == value.
+ *  May be NULL.
+ */
+void puflib_bs_compare(uint64_t const * planes, size_t n_planes, size_t n_words,
+        uint64_t value, uint64_t * gt, uint64_t * eq);
+
+/**
+ * Hamming distance between two bit strings, or the weight of one.
+ *
+ * @param a - n_words words
+ * @param b - n_words words, or NULL to count the set bits of @a a
+ * @param n_words - length of the strings, in words
+ * @return number of bits that differ (or are set)
+ */
+uint64_t puflib_bs_distance(uint64_t const * a, uint64_t const * b, size_t n_words);
+
+/**
+ * Load a little-endian 64-bit word from a byte buffer, so that bit i of the
+ * buffer (LSB-first within each byte) becomes bit i of the word.
+ */
+static inline uint64_t puflib_load_le64(uint8_t const * src)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t word;
+    __builtin_memcpy(&word, src, sizeof(word));
+    return word;
+#else
+    uint64_t word = 0;
+    for (size_t i = 0; i < 8; ++i) {
+        word |= (uint64_t) src[i] << (8 * i);
+    }
+    return word;
+#endif
+}
+
+/**
+ * Store a 64-bit word to a byte buffer; the inverse of puflib_load_le64().
+ */
+static inline void puflib_store_le64(uint8_t * dest, uint64_t word)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    __builtin_memcpy(dest, &word, sizeof(word));
+#else
+    for (size_t i = 0; i < 8; ++i) {
+        dest[i] = (uint8_t) (word >> (8 * i));
+    }
+#endif
+}
+
+#endif // _PUFLIB_BITSLICE_H_
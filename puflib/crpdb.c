@@ -0,0 +1,457 @@
+// PUFlib challenge-response database
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// File layout, all integers little-endian:
+//
+//   0   magic "PUFCRPDB"
+//   8   u32 version
+//   12  u32 challenge length
+//   16  u32 response length
+//   20  u32 reserved, zero
+//   24  u64 number of records
+//   32  u64 number of index buckets, a power of two
+//   40  reserved, zero, up to HEADER_LEN
+//
+// followed by the index, one u64 per bucket holding a record number plus one
+// (zero for an empty bucket), found by hashing the challenge and probing
+// linearly; then the records, each a flags byte, the challenge and the
+// response.
+//
+
+#include <puflib_internal.h>
+#include <puflib.h>
+#include <puflib_module.h>
+#include "bitslice.h"
+#include <string.h>
+#include <errno.h>
+
+#define CRPDB_MAGIC "PUFCRPDB"
+#define CRPDB_MAGIC_LEN 8
+#define CRPDB_VERSION 1
+#define HEADER_LEN 64
+#define RECORD_USED 0x01
+
+struct puflib_crpdb {
+    uint8_t * map;
+    size_t map_len;
+    bool writable;
+    size_t chal_len;
+    size_t resp_len;
+    size_t record_len;
+    size_t n_records;
+    size_t n_buckets;
+    uint8_t const * index;
+    uint8_t * records;
+};
+
+
+static uint32_t load_le32(uint8_t const * buf)
+{
+    return (uint32_t) buf[0] | (uint32_t) buf[1] << 8
+        | (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+
+static void store_le32(uint8_t * buf, uint32_t value)
+{
+    for (size_t i = 0; i < 4; ++i) {
+        buf[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+
+/**
+ * FNV-1a. Challenges are chosen by the verifier, so there is no need for a
+ * keyed hash here.
+ */
+static uint64_t hash_challenge(uint8_t const * challenge, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= challenge[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+
+static size_t bucket_count(size_t n_records)
+{
+    // Keep the table at most half full, so probe sequences stay short and
+    // always reach an empty bucket
+    size_t n_buckets = 2;
+    while (n_buckets < 2 * n_records) {
+        n_buckets *= 2;
+    }
+    return n_buckets;
+}
+
+
+bool puflib_crpdb_create(char const * path, size_t chal_len, size_t resp_len,
+        size_t n_crps, uint8_t const * challenges, uint8_t const * responses)
+{
+    uint64_t * index = NULL;
+    FILE * f = NULL;
+    bool created = false;
+
+    if (!chal_len || chal_len > UINT32_MAX || resp_len > UINT32_MAX
+            || n_crps > SIZE_MAX / 4) {
+        errno = EINVAL;
+        return true;
+    }
+
+    size_t n_buckets = bucket_count(n_crps);
+    size_t mask = n_buckets - 1;
+    index = calloc(n_buckets, sizeof(*index));
+    if (!index) {
+        goto err;
+    }
+
+    for (size_t i = 0; i < n_crps; ++i) {
+        uint8_t const * challenge = challenges + i * chal_len;
+        size_t b = (size_t) hash_challenge(challenge, chal_len) & mask;
+        for (; index[b]; b = (b + 1) & mask) {
+            if (!memcmp(challenges + (index[b] - 1) * chal_len, challenge, chal_len)) {
+                errno = EEXIST;
+                goto err;
+            }
+        }
+        index[b] = i + 1;
+    }
+
+    f = puflib_create_and_open(path, "wb");
+    if (!f) {
+        goto err;
+    }
+    created = true;
+
+    uint8_t header[HEADER_LEN] = { 0 };
+    memcpy(header, CRPDB_MAGIC, CRPDB_MAGIC_LEN);
+    store_le32(header + 8, CRPDB_VERSION);
+    store_le32(header + 12, (uint32_t) chal_len);
+    store_le32(header + 16, (uint32_t) resp_len);
+    puflib_store_le64(header + 24, n_crps);
+    puflib_store_le64(header + 32, n_buckets);
+    if (fwrite(header, 1, sizeof(header), f) != sizeof(header)) {
+        goto err;
+    }
+
+    for (size_t b = 0; b < n_buckets; ++b) {
+        uint8_t entry[8];
+        puflib_store_le64(entry, index[b]);
+        if (fwrite(entry, 1, sizeof(entry), f) != sizeof(entry)) {
+            goto err;
+        }
+    }
+
+    for (size_t i = 0; i < n_crps; ++i) {
+        uint8_t flags = 0;
+        if (fwrite(&flags, 1, 1, f) != 1
+                || fwrite(challenges + i * chal_len, 1, chal_len, f) != chal_len
+                || fwrite(responses + i * resp_len, 1, resp_len, f) != resp_len) {
+            goto err;
+        }
+    }
+
+    if (fclose(f)) {
+        f = NULL;
+        goto err;
+    }
+
+    free(index);
+    return false;
+
+err:
+    {
+        int errno_hold = errno;
+        if (f) {
+            fclose(f);
+        }
+        if (created) {
+            remove(path);
+        }
+        free(index);
+        errno = errno_hold;
+        return true;
+    }
+}
+
+
+bool puflib_crpdb_enroll(module_info const * module, char const * path,
+        size_t n_crps, size_t chal_len)
+{
+    uint8_t * challenges = NULL;
+    uint8_t * responses = NULL;
+    size_t resp_len = 0;
+    unsigned saved_instance;
+    bool rc = true;
+
+    if (!chal_len || n_crps > SIZE_MAX / chal_len) {
+        errno = EINVAL;
+        return true;
+    }
+
+    // The database is for one device, however the challenges would be balanced
+    saved_instance = puflib_select_instance(puflib_instance());
+
+    challenges = malloc(n_crps * chal_len);
+    if (!challenges || puflib_random_bytes(challenges, n_crps * chal_len)) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < n_crps; ++i) {
+        void * response;
+        size_t len;
+        if (puflib_chal_resp(module, challenges + i * chal_len, chal_len, &response, &len)) {
+            goto out;
+        }
+
+        if (!responses) {
+            resp_len = len;
+            if (resp_len && n_crps > SIZE_MAX / resp_len) {
+                free(response);
+                errno = EINVAL;
+                goto out;
+            }
+            // One spare byte so that empty responses still allocate
+            responses = malloc(n_crps * resp_len + 1);
+            if (!responses) {
+                free(response);
+                goto out;
+            }
+        } else if (len != resp_len) {
+            free(response);
+            errno = EINVAL;
+            goto out;
+        }
+
+        memcpy(responses + i * resp_len, response, len);
+        free(response);
+    }
+
+    rc = puflib_crpdb_create(path, chal_len, resp_len, n_crps, challenges, responses);
+
+out:
+    {
+        int errno_hold = errno;
+        puflib_select_instance(saved_instance);
+        free(challenges);
+        free(responses);
+        errno = errno_hold;
+        return rc;
+    }
+}
+
+
+struct puflib_crpdb * puflib_crpdb_open(char const * path, bool writable)
+{
+    struct puflib_crpdb * db = calloc(1, sizeof(*db));
+    if (!db) {
+        return NULL;
+    }
+
+    db->writable = writable;
+    db->map = puflib_map_file(path, writable, &db->map_len);
+    if (!db->map) {
+        goto err;
+    }
+
+    uint8_t const * header = db->map;
+    if (db->map_len < HEADER_LEN || memcmp(header, CRPDB_MAGIC, CRPDB_MAGIC_LEN)
+            || load_le32(header + 8) != CRPDB_VERSION) {
+        goto err_format;
+    }
+
+    uint64_t n_records = puflib_load_le64(header + 24);
+    uint64_t n_buckets = puflib_load_le64(header + 32);
+    db->chal_len = load_le32(header + 12);
+    db->resp_len = load_le32(header + 16);
+    db->record_len = 1 + db->chal_len + db->resp_len;
+
+    // Check sizes without overflowing: the file must be exactly the header,
+    // the index and the records
+    size_t rest = db->map_len - HEADER_LEN;
+    if (!db->chal_len || n_buckets < 2 || (n_buckets & (n_buckets - 1))
+            || n_buckets <= n_records || n_buckets > rest / 8) {
+        goto err_format;
+    }
+    rest -= (size_t) n_buckets * 8;
+    if (rest % db->record_len || rest / db->record_len != n_records) {
+        goto err_format;
+    }
+
+    db->n_records = (size_t) n_records;
+    db->n_buckets = (size_t) n_buckets;
+    db->index = db->map + HEADER_LEN;
+    db->records = db->map + HEADER_LEN + db->n_buckets * 8;
+    return db;
+
+err_format:
+    errno = EBADMSG;
+err:
+    {
+        int errno_hold = errno;
+        if (db->map) {
+            puflib_unmap_file(db->map, db->map_len);
+        }
+        free(db);
+        errno = errno_hold;
+        return NULL;
+    }
+}
+
+
+bool puflib_crpdb_close(struct puflib_crpdb * db)
+{
+    bool rc = false;
+    int errno_hold = 0;
+
+    if (!db) {
+        return false;
+    }
+
+    if (db->writable && puflib_sync_mapping(db->map, db->map_len)) {
+        rc = true;
+        errno_hold = errno;
+    }
+    if (puflib_unmap_file(db->map, db->map_len) && !rc) {
+        rc = true;
+        errno_hold = errno;
+    }
+    free(db);
+
+    if (rc) {
+        errno = errno_hold;
+    }
+    return rc;
+}
+
+
+size_t puflib_crpdb_count(struct puflib_crpdb const * db)
+{
+    return db->n_records;
+}
+
+
+size_t puflib_crpdb_chal_len(struct puflib_crpdb const * db)
+{
+    return db->chal_len;
+}
+
+
+size_t puflib_crpdb_resp_len(struct puflib_crpdb const * db)
+{
+    return db->resp_len;
+}
+
+
+static void fill_crp(struct puflib_crpdb const * db, size_t i, struct puflib_crp * crp)
+{
+    uint8_t const * record = db->records + i * db->record_len;
+    crp->index = i;
+    crp->challenge = record + 1;
+    crp->response = record + 1 + db->chal_len;
+    crp->used = __atomic_load_n(record, __ATOMIC_ACQUIRE) & RECORD_USED;
+}
+
+
+bool puflib_crpdb_lookup(struct puflib_crpdb const * db,
+        uint8_t const * challenge, size_t chal_len, struct puflib_crp * crp)
+{
+    if (chal_len != db->chal_len) {
+        errno = ENOENT;
+        return true;
+    }
+
+    size_t mask = db->n_buckets - 1;
+    size_t b = (size_t) hash_challenge(challenge, chal_len) & mask;
+
+    // A well-formed index always has an empty bucket, but a damaged or
+    // hostile file must not make this loop forever
+    for (size_t probes = 0; probes < db->n_buckets; ++probes, b = (b + 1) & mask) {
+        uint64_t entry = puflib_load_le64(db->index + b * 8);
+        if (!entry) {
+            errno = ENOENT;
+            return true;
+        } else if (entry > db->n_records) {
+            errno = EBADMSG;
+            return true;
+        }
+
+        size_t i = (size_t) entry - 1;
+        if (!memcmp(db->records + i * db->record_len + 1, challenge, chal_len)) {
+            fill_crp(db, i, crp);
+            return false;
+        }
+    }
+
+    errno = EBADMSG;
+    return true;
+}
+
+
+bool puflib_crpdb_next_unused(struct puflib_crpdb const * db, size_t * cursor,
+        struct puflib_crp * crp)
+{
+    for (size_t i = *cursor; i < db->n_records; ++i) {
+        if (!(__atomic_load_n(db->records + i * db->record_len, __ATOMIC_ACQUIRE) & RECORD_USED)) {
+            fill_crp(db, i, crp);
+            *cursor = i + 1;
+            return false;
+        }
+    }
+
+    *cursor = db->n_records;
+    errno = ENOENT;
+    return true;
+}
+
+
+static size_t hamming_distance(uint8_t const * a, uint8_t const * b, size_t len)
+{
+    size_t distance = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        distance += (size_t) __builtin_popcountll(puflib_load_le64(a + i) ^ puflib_load_le64(b + i));
+    }
+    for (; i < len; ++i) {
+        distance += (size_t) __builtin_popcount(a[i] ^ b[i]);
+    }
+    return distance;
+}
+
+
+enum crp_result puflib_crpdb_verify(struct puflib_crpdb * db,
+        uint8_t const * challenge, size_t chal_len,
+        uint8_t const * response, size_t resp_len,
+        size_t max_distance, bool consume)
+{
+    struct puflib_crp crp;
+
+    if (consume && !db->writable) {
+        errno = EBADF;
+        return CRP_ERROR;
+    }
+
+    if (puflib_crpdb_lookup(db, challenge, chal_len, &crp)) {
+        return errno == ENOENT ? CRP_UNKNOWN : CRP_ERROR;
+    }
+
+    if (consume) {
+        // Whoever sets the flag first gets to use the CRP
+        uint8_t * flags = db->records + crp.index * db->record_len;
+        if (__atomic_fetch_or(flags, RECORD_USED, __ATOMIC_ACQ_REL) & RECORD_USED) {
+            return CRP_USED;
+        }
+    } else if (crp.used) {
+        return CRP_USED;
+    }
+
+    if (resp_len != db->resp_len
+            || hamming_distance(crp.response, response, resp_len) > max_distance) {
+        return CRP_MISMATCH;
+    }
+    return CRP_MATCH;
+}
@@ -0,0 +1,379 @@
+// PUFlib cryptographic helpers for modules
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// SHA-256 (FIPS 180-4), HMAC-SHA256 (RFC 2104), HKDF (RFC 5869), and a
+// small authenticated encryption scheme built from them, so that modules
+// turning a PUF response into a key do not each need their own crypto.
+//
+
+#include <puflib_module.h>
+#include <string.h>
+#include <errno.h>
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_compress(uint32_t state[8], uint8_t const block[64])
+{
+    uint32_t w[64];
+
+    for (size_t i = 0; i < 16; ++i) {
+        w[i] = (uint32_t) block[4 * i] << 24
+            | (uint32_t) block[4 * i + 1] << 16
+            | (uint32_t) block[4 * i + 2] << 8
+            | (uint32_t) block[4 * i + 3];
+    }
+
+    for (size_t i = 16; i < 64; ++i) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (size_t i = 0; i < 64; ++i) {
+        uint32_t s1 = ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+        uint32_t s0 = ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+
+void puflib_sha256_init(struct puflib_sha256_ctx * ctx)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->total_len = 0;
+    ctx->buffer_len = 0;
+}
+
+
+void puflib_sha256_update(struct puflib_sha256_ctx * ctx, void const * data, size_t len)
+{
+    uint8_t const * bytes = data;
+
+    ctx->total_len += len;
+
+    if (ctx->buffer_len) {
+        size_t fill = 64 - ctx->buffer_len;
+        if (fill > len) {
+            fill = len;
+        }
+        memcpy(ctx->buffer + ctx->buffer_len, bytes, fill);
+        ctx->buffer_len += fill;
+        bytes += fill;
+        len -= fill;
+
+        if (ctx->buffer_len < 64) {
+            return;
+        }
+        sha256_compress(ctx->state, ctx->buffer);
+        ctx->buffer_len = 0;
+    }
+
+    while (len >= 64) {
+        sha256_compress(ctx->state, bytes);
+        bytes += 64;
+        len -= 64;
+    }
+
+    memcpy(ctx->buffer, bytes, len);
+    ctx->buffer_len = len;
+}
+
+
+void puflib_sha256_final(struct puflib_sha256_ctx * ctx, uint8_t digest[PUFLIB_SHA256_LEN])
+{
+    uint64_t bit_len = ctx->total_len * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_len = (ctx->buffer_len < 56) ? (56 - ctx->buffer_len) : (120 - ctx->buffer_len);
+
+    for (size_t i = 0; i < 8; ++i) {
+        pad[pad_len + i] = (uint8_t) (bit_len >> (56 - 8 * i));
+    }
+    puflib_sha256_update(ctx, pad, pad_len + 8);
+
+    for (size_t i = 0; i < 8; ++i) {
+        digest[4 * i]     = (uint8_t) (ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t) (ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t) (ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t) (ctx->state[i]);
+    }
+
+    puflib_secure_zero(ctx, sizeof(*ctx));
+}
+
+
+void puflib_sha256(void const * data, size_t len, uint8_t digest[PUFLIB_SHA256_LEN])
+{
+    struct puflib_sha256_ctx ctx;
+    puflib_sha256_init(&ctx);
+    puflib_sha256_update(&ctx, data, len);
+    puflib_sha256_final(&ctx, digest);
+}
+
+
+/**
+ * Begin an HMAC computation: key the inner hash and keep the outer key block
+ * for hmac_finish().
+ */
+static void hmac_start(struct puflib_sha256_ctx * ctx, uint8_t outer_pad[64],
+        void const * key, size_t key_len)
+{
+    uint8_t key_block[64] = { 0 };
+    uint8_t pad[64];
+
+    if (key_len > sizeof(key_block)) {
+        puflib_sha256(key, key_len, key_block);
+    } else {
+        memcpy(key_block, key, key_len);
+    }
+
+    for (size_t i = 0; i < 64; ++i) {
+        pad[i] = key_block[i] ^ 0x36;
+        outer_pad[i] = key_block[i] ^ 0x5c;
+    }
+    puflib_sha256_init(ctx);
+    puflib_sha256_update(ctx, pad, sizeof(pad));
+
+    puflib_secure_zero(key_block, sizeof(key_block));
+    puflib_secure_zero(pad, sizeof(pad));
+}
+
+
+static void hmac_finish(struct puflib_sha256_ctx * ctx, uint8_t outer_pad[64],
+        uint8_t mac[PUFLIB_SHA256_LEN])
+{
+    uint8_t inner[PUFLIB_SHA256_LEN];
+
+    puflib_sha256_final(ctx, inner);
+    puflib_sha256_init(ctx);
+    puflib_sha256_update(ctx, outer_pad, 64);
+    puflib_sha256_update(ctx, inner, sizeof(inner));
+    puflib_sha256_final(ctx, mac);
+
+    puflib_secure_zero(inner, sizeof(inner));
+    puflib_secure_zero(outer_pad, 64);
+    puflib_secure_zero(ctx, sizeof(*ctx));
+}
+
+
+void puflib_hmac_sha256(void const * key, size_t key_len,
+        void const * data, size_t len, uint8_t mac[PUFLIB_SHA256_LEN])
+{
+    struct puflib_sha256_ctx ctx;
+    uint8_t outer_pad[64];
+
+    hmac_start(&ctx, outer_pad, key, key_len);
+    puflib_sha256_update(&ctx, data, len);
+    hmac_finish(&ctx, outer_pad, mac);
+}
+
+
+bool puflib_hkdf_sha256(void const * salt, size_t salt_len,
+        void const * ikm, size_t ikm_len,
+        void const * info, size_t info_len,
+        uint8_t * out, size_t out_len)
+{
+    uint8_t prk[PUFLIB_SHA256_LEN];
+    uint8_t block[PUFLIB_SHA256_LEN];
+    uint8_t zero_salt[PUFLIB_SHA256_LEN] = { 0 };
+
+    if (out_len > 255 * PUFLIB_SHA256_LEN) {
+        errno = EINVAL;
+        return true;
+    }
+
+    // Extract (RFC 5869 section 2.2): an absent salt is a block of zeros
+    if (!salt) {
+        salt = zero_salt;
+        salt_len = sizeof(zero_salt);
+    }
+    puflib_hmac_sha256(salt, salt_len, ikm, ikm_len, prk);
+
+    // Expand: T(i) = HMAC(PRK, T(i - 1) || info || i)
+    for (uint8_t counter = 1; out_len; ++counter) {
+        struct puflib_sha256_ctx ctx;
+        uint8_t outer_pad[64];
+
+        hmac_start(&ctx, outer_pad, prk, sizeof(prk));
+        if (counter > 1) {
+            puflib_sha256_update(&ctx, block, sizeof(block));
+        }
+        puflib_sha256_update(&ctx, info, info_len);
+        puflib_sha256_update(&ctx, &counter, 1);
+        hmac_finish(&ctx, outer_pad, block);
+
+        size_t n = out_len < sizeof(block) ? out_len : sizeof(block);
+        memcpy(out, block, n);
+        out += n;
+        out_len -= n;
+    }
+
+    puflib_secure_zero(prk, sizeof(prk));
+    puflib_secure_zero(block, sizeof(block));
+    return false;
+}
+
+
+void puflib_secure_zero(void * buf, size_t len)
+{
+    volatile uint8_t * p = buf;
+    while (len--) {
+        *p++ = 0;
+    }
+}
+
+
+// Sealed format: nonce || ciphertext || tag
+//   enc_key = HMAC(key, "enc" || nonce),  mac_key = HMAC(key, "mac" || nonce)
+//   keystream block i = HMAC(enc_key, be32(i))
+//   tag = HMAC(mac_key, ciphertext)
+#define KEY_SEAL_NONCE_LEN 16
+#define KEY_SEAL_OVERHEAD (KEY_SEAL_NONCE_LEN + PUFLIB_SHA256_LEN)
+
+static void key_seal_derive(uint8_t const key[PUFLIB_SHA256_LEN], uint8_t const * nonce,
+        uint8_t enc_key[PUFLIB_SHA256_LEN], uint8_t mac_key[PUFLIB_SHA256_LEN])
+{
+    uint8_t label[3 + KEY_SEAL_NONCE_LEN];
+
+    memcpy(label + 3, nonce, KEY_SEAL_NONCE_LEN);
+    memcpy(label, "enc", 3);
+    puflib_hmac_sha256(key, PUFLIB_SHA256_LEN, label, sizeof(label), enc_key);
+    memcpy(label, "mac", 3);
+    puflib_hmac_sha256(key, PUFLIB_SHA256_LEN, label, sizeof(label), mac_key);
+}
+
+
+static void key_seal_xor_stream(uint8_t const enc_key[PUFLIB_SHA256_LEN],
+        uint8_t const * in, uint8_t * out, size_t len)
+{
+    uint8_t block[PUFLIB_SHA256_LEN];
+
+    for (uint32_t counter = 0; len; ++counter) {
+        uint8_t counter_be[4] = {
+            (uint8_t) (counter >> 24), (uint8_t) (counter >> 16),
+            (uint8_t) (counter >> 8),  (uint8_t) counter,
+        };
+        puflib_hmac_sha256(enc_key, PUFLIB_SHA256_LEN, counter_be, sizeof(counter_be), block);
+
+        size_t n = len < sizeof(block) ? len : sizeof(block);
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = in[i] ^ block[i];
+        }
+        in += n;
+        out += n;
+        len -= n;
+    }
+
+    puflib_secure_zero(block, sizeof(block));
+}
+
+
+bool puflib_key_seal(uint8_t const key[PUFLIB_SHA256_LEN],
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t enc_key[PUFLIB_SHA256_LEN], mac_key[PUFLIB_SHA256_LEN];
+
+    uint8_t * buf = malloc(data_in_len + KEY_SEAL_OVERHEAD);
+    if (!buf) {
+        return true;
+    }
+
+    if (puflib_random_bytes(buf, KEY_SEAL_NONCE_LEN)) {
+        int errno_hold = errno;
+        free(buf);
+        errno = errno_hold;
+        return true;
+    }
+
+    key_seal_derive(key, buf, enc_key, mac_key);
+    key_seal_xor_stream(enc_key, data_in, buf + KEY_SEAL_NONCE_LEN, data_in_len);
+    puflib_hmac_sha256(mac_key, sizeof(mac_key), buf, KEY_SEAL_NONCE_LEN + data_in_len,
+            buf + KEY_SEAL_NONCE_LEN + data_in_len);
+
+    puflib_secure_zero(enc_key, sizeof(enc_key));
+    puflib_secure_zero(mac_key, sizeof(mac_key));
+
+    *data_out = buf;
+    *data_out_len = data_in_len + KEY_SEAL_OVERHEAD;
+    return false;
+}
+
+
+bool puflib_key_unseal(uint8_t const key[PUFLIB_SHA256_LEN],
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t enc_key[PUFLIB_SHA256_LEN], mac_key[PUFLIB_SHA256_LEN];
+    uint8_t tag[PUFLIB_SHA256_LEN];
+
+    if (data_in_len < KEY_SEAL_OVERHEAD) {
+        errno = EINVAL;
+        return true;
+    }
+
+    size_t len = data_in_len - KEY_SEAL_OVERHEAD;
+    key_seal_derive(key, data_in, enc_key, mac_key);
+    puflib_hmac_sha256(mac_key, sizeof(mac_key), data_in, KEY_SEAL_NONCE_LEN + len, tag);
+
+    // Constant-time tag comparison
+    uint8_t diff = 0;
+    for (size_t i = 0; i < sizeof(tag); ++i) {
+        diff |= tag[i] ^ data_in[KEY_SEAL_NONCE_LEN + len + i];
+    }
+
+    uint8_t * buf = NULL;
+    if (diff) {
+        errno = EBADMSG;
+        goto out;
+    }
+
+    // Always allocate at least one byte so an empty secret is not NULL
+    buf = malloc(len ? len : 1);
+    if (!buf) {
+        goto out;
+    }
+    key_seal_xor_stream(enc_key, data_in + KEY_SEAL_NONCE_LEN, buf, len);
+
+    *data_out = buf;
+    *data_out_len = len;
+
+out:
+    puflib_secure_zero(enc_key, sizeof(enc_key));
+    puflib_secure_zero(mac_key, sizeof(mac_key));
+    return buf == NULL;
+}
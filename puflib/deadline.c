@@ -0,0 +1,123 @@
+// PUFlib operation deadlines and cancellation
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// The limits of the operation being run are kept in a thread-local context,
+// set by the _deadline entry points. The library checks them while queued
+// for a device, and modules check them through puflib_op_expired() while
+// running, since module calls run on the caller's thread.
+//
+
+#include <puflib.h>
+#include <puflib_module.h>
+#include <puflib_internal.h>
+#include "deadline.h"
+
+#include <errno.h>
+
+/// How often a cancellable wait wakes to check its token, in milliseconds
+#define CANCEL_POLL_MS 5
+
+struct puflib_cancel {
+    bool cancelled;
+};
+
+static __thread struct op_context CURRENT;
+
+
+struct puflib_cancel * puflib_cancel_new(void)
+{
+    return calloc(1, sizeof(struct puflib_cancel));
+}
+
+
+void puflib_cancel_free(struct puflib_cancel * cancel)
+{
+    free(cancel);
+}
+
+
+void puflib_cancel(struct puflib_cancel * cancel)
+{
+    __atomic_store_n(&cancel->cancelled, true, __ATOMIC_RELEASE);
+}
+
+
+bool puflib_op_expired(void)
+{
+    if (CURRENT.cancel && __atomic_load_n(&CURRENT.cancel->cancelled, __ATOMIC_ACQUIRE)) {
+        errno = ECANCELED;
+        return true;
+    }
+    if (CURRENT.deadline_ms && puflib_monotonic_ms() >= CURRENT.deadline_ms) {
+        errno = ETIMEDOUT;
+        return true;
+    }
+    return false;
+}
+
+
+uint64_t puflib_op_time_left_ms(void)
+{
+    if (!CURRENT.deadline_ms) {
+        return UINT64_MAX;
+    }
+    uint64_t now = puflib_monotonic_ms();
+    return now < CURRENT.deadline_ms ? CURRENT.deadline_ms - now : 0;
+}
+
+
+bool puflib_op_enter(struct puflib_deadline const * deadline, struct op_context * saved)
+{
+    *saved = CURRENT;
+    if (deadline) {
+        uint64_t deadline_ms = deadline->timeout_ms
+            ? puflib_monotonic_ms() + deadline->timeout_ms : 0;
+
+        // A nested operation can only tighten its caller's limits
+        if (deadline_ms && (!CURRENT.deadline_ms || deadline_ms < CURRENT.deadline_ms)) {
+            CURRENT.deadline_ms = deadline_ms;
+        }
+        if (deadline->cancel) {
+            CURRENT.cancel = deadline->cancel;
+        }
+    }
+    return puflib_op_expired();
+}
+
+
+void puflib_op_leave(struct op_context const * saved)
+{
+    CURRENT = *saved;
+}
+
+
+void puflib_op_current(struct puflib_deadline * deadline)
+{
+    deadline->cancel = CURRENT.cancel;
+    deadline->timeout_ms = 0;
+    if (CURRENT.deadline_ms) {
+        // 0 would mean no limit, so an expired deadline becomes the shortest
+        uint64_t left = puflib_op_time_left_ms();
+        deadline->timeout_ms = left ? left : 1;
+    }
+}
+
+
+bool puflib_op_limited(void)
+{
+    return CURRENT.deadline_ms || CURRENT.cancel;
+}
+
+
+uint64_t puflib_op_wake_ms(void)
+{
+    uint64_t wake_ms = CURRENT.deadline_ms;
+    if (CURRENT.cancel) {
+        uint64_t poll_ms = puflib_monotonic_ms() + CANCEL_POLL_MS;
+        if (!wake_ms || poll_ms < wake_ms) {
+            wake_ms = poll_ms;
+        }
+    }
+    return wake_ms;
+}
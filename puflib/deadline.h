@@ -0,0 +1,54 @@
+// PUFlib operation deadlines and cancellation
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+
+#ifndef _PUFLIB_DEADLINE_H_
+#define _PUFLIB_DEADLINE_H_
+
+#include <puflib.h>
+
+/**
+ * Limits on the operation the calling thread is running, if any. Kept per
+ * thread, so that modules can check them without having them passed down.
+ */
+struct op_context {
+    uint64_t deadline_ms;               ///< puflib_monotonic_ms() time, or 0
+    struct puflib_cancel * cancel;      ///< token, or NULL
+};
+
+/**
+ * Start an operation under @a deadline (which may be NULL), saving the
+ * calling thread's previous limits in @a saved.
+ * @return true if the deadline has already expired (with errno set)
+ */
+bool puflib_op_enter(struct puflib_deadline const * deadline, struct op_context * saved);
+
+/**
+ * End an operation, restoring the limits saved by puflib_op_enter().
+ * Preserves errno.
+ */
+void puflib_op_leave(struct op_context const * saved);
+
+/**
+ * Describe what is left of the calling thread's limits as a deadline, so
+ * that another thread can carry on the operation under them.
+ */
+void puflib_op_current(struct puflib_deadline * deadline);
+
+/**
+ * Return whether the calling thread's operation has a deadline or a
+ * cancellation token.
+ */
+bool puflib_op_limited(void);
+
+/**
+ * Return when a wait made on behalf of the calling thread's operation should
+ * next wake up to check its limits, as a puflib_monotonic_ms() time: at its
+ * deadline, or sooner if it can be cancelled.
+ */
+uint64_t puflib_op_wake_ms(void);
+
+#endif // _PUFLIB_DEADLINE_H_
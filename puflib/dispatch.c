@@ -0,0 +1,333 @@
+// PUFlib per-device request dispatch
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Each device (a module, or a hw_resource, for each instance) has a FIFO
+// queue: a request joins the back and waits until it
+// is at the front and the device is idle, so hardware access is strictly
+// first come, first served. A request whose deadline expires while queued
+// leaves the queue. Requests that are queued or running are also kept on the
+// device's in-flight list, where an identical later request finds them and
+// waits for their result instead of queueing itself.
+//
+
+#define _XOPEN_SOURCE 700
+
+#include <puflib.h>
+#include <puflib_module.h>
+#include "dispatch.h"
+#include "deadline.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+struct request {
+    module_info const * module;
+    enum dispatch_op op;
+    void const * in;            ///< owned by the leader, who outlives the request
+    size_t in_len;
+    bool done;
+    bool abandoned;             ///< leader's deadline expired before it ran
+    bool failed;
+    int error;                  ///< errno, if failed
+    void * out;                 ///< leader's result, copied by followers
+    size_t out_len;
+    unsigned followers;         ///< callers waiting on this request's result
+    struct request * next;
+};
+
+struct waiter {
+    struct waiter * next;
+};
+
+struct device {
+    module_info const * module;     ///< module, if the device has no resource name
+    char const * resource;          ///< hw_resource, if set
+    unsigned instance;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;         ///< signalled on every queue or request change
+    struct waiter * queue;          ///< waiting requests, oldest first
+    struct waiter ** queue_tail;
+    bool busy;                      ///< a request is running on the hardware
+    struct request * in_flight;
+    struct device * next;
+};
+
+// Devices are never freed, so a pointer to one stays valid after
+// DEVICES_LOCK is released.
+static struct device * DEVICES = NULL;
+static pthread_mutex_t DEVICES_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+static bool device_matches(struct device const * device, module_info const * module,
+        unsigned instance)
+{
+    if (device->instance != instance) {
+        return false;
+    } else if (module->hw_resource) {
+        return device->resource && !strcmp(device->resource, module->hw_resource);
+    } else {
+        return device->module == module;
+    }
+}
+
+
+static struct device * get_device(module_info const * module, unsigned instance)
+{
+    pthread_mutex_lock(&DEVICES_LOCK);
+
+    struct device * device = DEVICES;
+    while (device && !device_matches(device, module, instance)) {
+        device = device->next;
+    }
+
+    if (!device) {
+        device = calloc(1, sizeof(*device));
+        if (device) {
+            if (module->hw_resource) {
+                device->resource = module->hw_resource;
+            } else {
+                device->module = module;
+            }
+            device->instance = instance;
+            // Waits are timed against the monotonic clock, like deadlines
+            pthread_condattr_t attr;
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_mutex_init(&device->lock, NULL);
+            pthread_cond_init(&device->changed, &attr);
+            pthread_condattr_destroy(&attr);
+            device->queue_tail = &device->queue;
+            device->next = DEVICES;
+            DEVICES = device;
+        }
+    }
+
+    pthread_mutex_unlock(&DEVICES_LOCK);
+    return device;
+}
+
+
+static struct request * find_request(struct device * device, module_info const * module,
+        enum dispatch_op op, void const * in, size_t in_len)
+{
+    for (struct request * req = device->in_flight; req; req = req->next) {
+        if (req->module == module && req->op == op && req->in_len == in_len
+                && (!in_len || !memcmp(req->in, in, in_len))) {
+            return req;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Wait for a change on the device, or until the calling thread's operation
+ * should check its limits. Caller holds device->lock.
+ * @return true if the operation has expired (with errno set)
+ */
+static bool wait_changed(struct device * device)
+{
+    if (!puflib_op_limited()) {
+        pthread_cond_wait(&device->changed, &device->lock);
+        return false;
+    }
+
+    // puflib_monotonic_ms() reads CLOCK_MONOTONIC, as the condition does
+    uint64_t wake_ms = puflib_op_wake_ms();
+    struct timespec when = {
+        .tv_sec = (time_t) (wake_ms / 1000),
+        .tv_nsec = (long) (wake_ms % 1000) * 1000000,
+    };
+    pthread_cond_timedwait(&device->changed, &device->lock, &when);
+    return puflib_op_expired();
+}
+
+
+/**
+ * Wait for another caller's identical request and copy its result. Caller
+ * holds device->lock, which is released on return unless the request was
+ * abandoned, in which case the caller must make the request itself.
+ */
+static bool follow(struct device * device, struct request * req, void ** out, size_t * out_len,
+        bool * abandoned)
+{
+    bool rc = false;
+    int error = 0;
+
+    ++req->followers;
+    while (!req->done) {
+        if (wait_changed(device)) {
+            rc = true;
+            error = errno;
+            break;
+        }
+    }
+
+    *abandoned = !rc && req->abandoned;
+    if (!rc && !*abandoned) {
+        rc = req->failed;
+        error = req->error;
+        if (!rc) {
+            void * copy = malloc(req->out_len ? req->out_len : 1);
+            if (copy) {
+                memcpy(copy, req->out, req->out_len);
+                *out = copy;
+                *out_len = req->out_len;
+            } else {
+                rc = true;
+                error = errno;
+            }
+        }
+    }
+
+    if (!--req->followers) {
+        pthread_cond_broadcast(&device->changed);
+    }
+    if (*abandoned) {
+        return false;
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    if (rc) {
+        errno = error;
+    }
+    return rc;
+}
+
+
+bool puflib_dispatch(module_info const * module, void * state, enum dispatch_op op,
+        bool coalesce, dispatch_fn fn, void const * in, size_t in_len,
+        void ** out, size_t * out_len)
+{
+    struct device * device = get_device(module, puflib_instance());
+    if (!device) {
+        return true;
+    }
+
+    pthread_mutex_lock(&device->lock);
+
+    if (coalesce) {
+        struct request * existing;
+        while ((existing = find_request(device, module, op, in, in_len))) {
+            bool abandoned;
+            bool rc = follow(device, existing, out, out_len, &abandoned);
+            if (!abandoned) {
+                return rc;
+            }
+        }
+    }
+
+    struct request req = {
+        .module = module,
+        .op = op,
+        .in = in,
+        .in_len = in_len,
+    };
+    if (coalesce) {
+        req.next = device->in_flight;
+        device->in_flight = &req;
+    }
+
+    struct waiter waiter = { .next = NULL };
+    *device->queue_tail = &waiter;
+    device->queue_tail = &waiter.next;
+
+    while (device->busy || device->queue != &waiter) {
+        if (wait_changed(device)) {
+            req.abandoned = true;
+            req.failed = true;
+            req.error = errno;
+            break;
+        }
+    }
+
+    // Leave the queue, whether served or given up
+    struct waiter ** wlink = &device->queue;
+    while (*wlink != &waiter) {
+        wlink = &(*wlink)->next;
+    }
+    *wlink = waiter.next;
+    if (device->queue_tail == &waiter.next) {
+        device->queue_tail = wlink;
+    }
+
+    if (!req.failed) {
+        device->busy = true;
+        pthread_mutex_unlock(&device->lock);
+
+        req.failed = fn(module, state, in, in_len, &req.out, &req.out_len);
+        req.error = errno;
+
+        pthread_mutex_lock(&device->lock);
+        device->busy = false;
+    }
+    req.done = true;
+    pthread_cond_broadcast(&device->changed);
+
+    if (coalesce) {
+        struct request ** link = &device->in_flight;
+        while (*link != &req) {
+            link = &(*link)->next;
+        }
+        *link = req.next;
+    }
+
+    // Followers copy from req, which lives on this stack frame
+    while (req.followers) {
+        pthread_cond_wait(&device->changed, &device->lock);
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    if (req.failed) {
+        errno = req.error;
+        return true;
+    }
+    *out = req.out;
+    *out_len = req.out_len;
+    return false;
+}
+
+
+bool puflib_dispatch_prepare(module_info const * module)
+{
+    return get_device(module, puflib_instance()) == NULL;
+}
+
+
+unsigned puflib_dispatch_load(module_info const * module, unsigned instance)
+{
+    struct device * device = get_device(module, instance);
+    if (!device) {
+        return (unsigned) -1;
+    }
+
+    pthread_mutex_lock(&device->lock);
+    unsigned load = device->busy;
+    for (struct waiter const * w = device->queue; w; w = w->next) {
+        ++load;
+    }
+    pthread_mutex_unlock(&device->lock);
+    return load;
+}
+
+
+static bool run_chal_resp(module_info const * module, void * state,
+        void const * in, size_t in_len, void ** out, size_t * out_len)
+{
+    if (state && module->session_chal_resp) {
+        return module->session_chal_resp(state, in, in_len, out, out_len);
+    }
+    return module->chal_resp(in, in_len, out, out_len);
+}
+
+
+bool puflib_dispatch_chal_resp(module_info const * module, void * state,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len)
+{
+    return puflib_dispatch(module, state, DISPATCH_CHAL_RESP, true, run_chal_resp,
+            data_in, data_in_len, data_out, data_out_len);
+}
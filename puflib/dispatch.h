@@ -0,0 +1,71 @@
+// PUFlib per-device request dispatch
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+
+#ifndef _PUFLIB_DISPATCH_H_
+#define _PUFLIB_DISPATCH_H_
+
+#include <puflib.h>
+
+/**
+ * Kinds of request. Only requests of the same kind, to the same module, with
+ * the same input are merged.
+ */
+enum dispatch_op {
+    DISPATCH_SEAL,
+    DISPATCH_UNSEAL,
+    DISPATCH_CHAL_RESP,
+    DISPATCH_ROOT_KEY,      ///< read of a get_root_key() module's root key
+};
+
+/**
+ * Operation run by the dispatcher on behalf of a request. @a state is the
+ * module's session state, or NULL outside a session. On success, *out must
+ * be allocated with malloc().
+ * @return false on success, true on error (with errno set)
+ */
+typedef bool (*dispatch_fn)(module_info const * module, void * state,
+        void const * in, size_t in_len, void ** out, size_t * out_len);
+
+/**
+ * Run an operation on a module's hardware, for the calling thread's
+ * instance. Operations on the same device (an instance of a module, or of
+ * all the modules sharing a hw_resource) run one at a time, in the order
+ * they were requested. If @a coalesce is set and an identical request
+ * is already queued or running, this waits for it and returns a copy of its
+ * result instead of running the operation again. @a state is passed through
+ * to @a fn. Waiting gives up if the calling thread's operation reaches its
+ * deadline or is cancelled (see deadline.h).
+ *
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_dispatch(module_info const * module, void * state, enum dispatch_op op,
+        bool coalesce, dispatch_fn fn, void const * in, size_t in_len,
+        void ** out, size_t * out_len);
+
+/**
+ * Set up the request queue for a module's device ahead of its first request.
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_dispatch_prepare(module_info const * module);
+
+/**
+ * Return the number of requests running or queued on an instance of a
+ * module's device, for balancing load across instances.
+ */
+unsigned puflib_dispatch_load(module_info const * module, unsigned instance);
+
+/**
+ * Query a module's chal_resp() through the dispatcher, merging identical
+ * concurrent challenges. @a state is the module's session state, or NULL;
+ * other arguments are as for puflib_chal_resp().
+ * @return false on success, true on error
+ */
+bool puflib_dispatch_chal_resp(module_info const * module, void * state,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len);
+
+#endif // _PUFLIB_DISPATCH_H_
@@ -0,0 +1,789 @@
+// PUFlib fuzzy extractor
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Code-offset fuzzy extractor over a concatenated code: an outer binary
+// BCH(255, k, t) code, whose codeword is repeated `rep` times as the inner
+// code. The helper data is the PUF response XOR the encoded key, so that a
+// later, noisy response XOR the helper data is a noisy codeword.
+//
+// Layout of the response and helper data: the outer codeword (all BCH blocks
+// back to back, zero-padded to whole 64-bit words) followed by rep - 1 more
+// copies of it. Bits are numbered LSB-first within each byte.
+//
+// Decoding works on whole words wherever it can: the repetition code by a
+// bit-sliced majority vote (bitslice.c), and the BCH syndromes a byte of the
+// block at a time, from a table of each byte value's contribution. Error
+// location (Berlekamp-Massey and a Chien search) only runs for a block with
+// errors, and then costs per error rather than per bit.
+//
+
+#include <puflib_module.h>
+#include "bitslice.h"
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#define GF_M 8
+#define GF_N 255            ///< multiplicative order of GF(2^8), and BCH length
+#define GF_POLY 0x11d       ///< x^8 + x^4 + x^3 + x^2 + 1
+#define BCH_MAX_T 60
+#define BCH_CHUNKS ((GF_N + 7) / 8)    ///< bytes per block, the last one short
+
+struct puflib_fe {
+    size_t key_bits;
+    unsigned t;
+    unsigned rep;
+    unsigned k;                     ///< message bits per BCH block
+    size_t blocks;                  ///< BCH blocks per key
+    size_t words;                   ///< 64-bit words per outer codeword
+    uint8_t gen[GF_N + 1];          ///< generator polynomial, one bit per byte
+    unsigned gen_deg;
+    uint8_t exp[2 * GF_N];
+    uint8_t log[GF_N + 1];
+    uint8_t syn_table[BCH_MAX_T][256];  ///< [(j - 1) / 2][v]: sum of alpha^(j*k)
+                                        ///< over the bits k set in v
+};
+
+
+/******************************************************************************
+ * GF(2^8) and BCH code                                                       *
+ *****************************************************************************/
+
+static void gf_init(struct puflib_fe * fe)
+{
+    unsigned x = 1;
+    for (unsigned i = 0; i < GF_N; ++i) {
+        fe->exp[i] = fe->exp[i + GF_N] = (uint8_t) x;
+        fe->log[x] = (uint8_t) i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= GF_POLY;
+        }
+    }
+    fe->log[0] = 0;
+}
+
+
+static uint8_t gf_mul(struct puflib_fe const * fe, uint8_t a, uint8_t b)
+{
+    if (!a || !b) {
+        return 0;
+    }
+    return fe->exp[fe->log[a] + fe->log[b]];
+}
+
+
+static uint8_t gf_inv(struct puflib_fe const * fe, uint8_t a)
+{
+    return fe->exp[GF_N - fe->log[a]];
+}
+
+
+/**
+ * Build the generator polynomial as the product of the minimal polynomials of
+ * alpha^1 .. alpha^2t, taking each cyclotomic coset once.
+ * @return false on success, true if the code has no message bits left
+ */
+static bool bch_init(struct puflib_fe * fe)
+{
+    bool covered[GF_N] = { false };
+
+    memset(fe->gen, 0, sizeof(fe->gen));
+    fe->gen[0] = 1;
+    fe->gen_deg = 0;
+
+    for (unsigned i = 1; i <= 2 * fe->t; ++i) {
+        if (covered[i % GF_N]) {
+            continue;
+        }
+
+        // Minimal polynomial of alpha^i: product of (x - alpha^e) over the
+        // coset {i, 2i, 4i, ...}. Coefficients end up in GF(2).
+        uint8_t minpoly[GF_M + 1] = { 1 };
+        unsigned deg = 0;
+        unsigned e = i % GF_N;
+        do {
+            covered[e] = true;
+            uint8_t root = fe->exp[e];
+            for (unsigned j = deg + 1; j > 0; --j) {
+                minpoly[j] = minpoly[j - 1] ^ gf_mul(fe, minpoly[j], root);
+            }
+            minpoly[0] = gf_mul(fe, minpoly[0], root);
+            ++deg;
+            e = (e * 2) % GF_N;
+        } while (e != i % GF_N);
+
+        if (fe->gen_deg + deg >= GF_N) {
+            return true;
+        }
+
+        uint8_t product[GF_N + 1] = { 0 };
+        for (unsigned a = 0; a <= fe->gen_deg; ++a) {
+            for (unsigned b = 0; b <= deg; ++b) {
+                product[a + b] ^= fe->gen[a] & minpoly[b];
+            }
+        }
+        fe->gen_deg += deg;
+        memcpy(fe->gen, product, sizeof(product));
+    }
+
+    fe->k = GF_N - fe->gen_deg;
+
+    for (unsigned j = 1; j <= 2 * fe->t; j += 2) {
+        uint8_t * table = fe->syn_table[(j - 1) / 2];
+        for (unsigned v = 1; v < 256; ++v) {
+            unsigned low = v & -v;
+            unsigned k = 0;
+            while (!(low >> k & 1)) {
+                ++k;
+            }
+            // v is its lowest bit plus v without it, already in the table
+            table[v] = table[v ^ low] ^ fe->exp[(j * k) % GF_N];
+        }
+    }
+    return false;
+}
+
+
+static int word_bit(uint64_t const * words, size_t i)
+{
+    return (int) ((words[i / 64] >> (i % 64)) & 1);
+}
+
+
+static void flip_bit(uint64_t * words, size_t i)
+{
+    words[i / 64] ^= (uint64_t) 1 << (i % 64);
+}
+
+
+/**
+ * Systematic encoding of one block: message bits go to positions
+ * [n - k, n), the remainder of message * x^(n-k) mod g to [0, n - k).
+ */
+static void bch_encode(struct puflib_fe const * fe, uint8_t const * msg, uint8_t * codeword)
+{
+    unsigned parity_len = fe->gen_deg;
+    uint8_t rem[GF_N] = { 0 };
+
+    for (unsigned i = fe->k; i-- > 0;) {
+        uint8_t feedback = msg[i] ^ rem[parity_len - 1];
+        for (unsigned j = parity_len - 1; j > 0; --j) {
+            rem[j] = rem[j - 1] ^ (feedback & fe->gen[j]);
+        }
+        rem[0] = feedback & fe->gen[0];
+    }
+
+    memcpy(codeword, rem, parity_len);
+    memcpy(codeword + parity_len, msg, fe->k);
+}
+
+
+/**
+ * Read n_bits (at most 8) bits starting at bit i.
+ */
+static unsigned word_bits(uint64_t const * words, size_t i, unsigned n_bits)
+{
+    unsigned shift = i % 64;
+    uint64_t value = words[i / 64] >> shift;
+    if (shift + n_bits > 64) {
+        value |= words[i / 64 + 1] << (64 - shift);
+    }
+    return (unsigned) (value & ((1u << n_bits) - 1));
+}
+
+
+/**
+ * Compute the odd syndromes S_j = r(alpha^j) of the block starting at bit
+ * `base`. Even syndromes follow from S_2j = S_j^2 and are left to
+ * bch_locate().
+ *
+ * Byte c of the block, holding bits 8c .. 8c + 7, adds
+ * syn_table[j][byte] * alpha^(8cj) to S_j, so each syndrome takes one table
+ * lookup and one multiplication per byte rather than work for every bit.
+ * @return true if any syndrome is nonzero
+ */
+static bool bch_syndromes(struct puflib_fe const * fe, uint64_t const * words, size_t base,
+        uint8_t syn[2 * BCH_MAX_T + 1])
+{
+    unsigned t2 = 2 * fe->t;
+    uint8_t chunks[BCH_CHUNKS];
+    memset(syn, 0, 2 * BCH_MAX_T + 1);
+
+    bool any = false;
+    for (unsigned c = 0; c < BCH_CHUNKS; ++c) {
+        unsigned n_bits = c + 1 < BCH_CHUNKS ? 8 : GF_N - 8 * c;
+        chunks[c] = (uint8_t) word_bits(words, base + 8 * c, n_bits);
+        any |= chunks[c] != 0;
+    }
+    if (!any) {
+        return false;
+    }
+
+    bool nonzero = false;
+    for (unsigned j = 1; j <= t2; j += 2) {
+        uint8_t const * table = fe->syn_table[(j - 1) / 2];
+        unsigned step = (8 * j) % GF_N;
+        unsigned e = 0;             // log of alpha^(8cj)
+        uint8_t sum = 0;
+        for (unsigned c = 0; c < BCH_CHUNKS; ++c) {
+            uint8_t term = table[chunks[c]];
+            if (term) {
+                sum ^= fe->exp[fe->log[term] + e];
+            }
+            e += step;
+            if (e >= GF_N) {
+                e -= GF_N;
+            }
+        }
+        syn[j] = sum;
+        nonzero |= sum != 0;
+    }
+    return nonzero;
+}
+
+
+/**
+ * Find the error positions for a set of odd syndromes.
+ * @param syn - syndromes from bch_syndromes(); even entries are overwritten
+ * @param positions - outparam for up to t error positions within the block
+ * @param count - outparam for the number of errors
+ * @return false on success, true if the block is uncorrectable
+ */
+static bool bch_locate(struct puflib_fe const * fe, uint8_t syn[2 * BCH_MAX_T + 1],
+        unsigned * positions, unsigned * count)
+{
+    unsigned t2 = 2 * fe->t;
+
+    for (unsigned j = 2; j <= t2; j += 2) {
+        syn[j] = gf_mul(fe, syn[j / 2], syn[j / 2]);
+    }
+
+    // Berlekamp-Massey: find the error locator polynomial lambda
+    uint8_t lambda[2 * BCH_MAX_T + 2] = { 1 };
+    uint8_t prev[2 * BCH_MAX_T + 2] = { 1 };
+    unsigned len = 0;
+    unsigned shift = 1;
+    uint8_t prev_disc = 1;
+
+    for (unsigned r = 1; r <= t2; ++r) {
+        uint8_t disc = syn[r];
+        for (unsigned i = 1; i <= len; ++i) {
+            disc ^= gf_mul(fe, lambda[i], syn[r - i]);
+        }
+
+        if (!disc) {
+            ++shift;
+            continue;
+        }
+
+        uint8_t scale = gf_mul(fe, disc, gf_inv(fe, prev_disc));
+        uint8_t old[2 * BCH_MAX_T + 2];
+        memcpy(old, lambda, sizeof(old));
+
+        for (unsigned i = 0; i + shift <= t2; ++i) {
+            lambda[i + shift] ^= gf_mul(fe, scale, prev[i]);
+        }
+
+        if (2 * len <= r - 1) {
+            len = r - len;
+            memcpy(prev, old, sizeof(prev));
+            prev_disc = disc;
+            shift = 1;
+        } else {
+            ++shift;
+        }
+    }
+
+    if (len > fe->t) {
+        return true;
+    }
+
+    // Chien search: position i is in error iff lambda(alpha^-i) = 0. Term j
+    // is tracked as a logarithm and stepped by -j each position.
+    unsigned term[BCH_MAX_T + 1];
+    unsigned n_terms = 0;
+    unsigned step[BCH_MAX_T + 1];
+    for (unsigned j = 1; j <= len; ++j) {
+        if (lambda[j]) {
+            term[n_terms] = fe->log[lambda[j]];
+            step[n_terms] = GF_N - j;
+            ++n_terms;
+        }
+    }
+
+    unsigned found = 0;
+    for (unsigned i = 0; i < GF_N && found < len; ++i) {
+        uint8_t sum = lambda[0];
+        for (unsigned j = 0; j < n_terms; ++j) {
+            sum ^= fe->exp[term[j]];
+            term[j] += step[j];
+            if (term[j] >= GF_N) {
+                term[j] -= GF_N;
+            }
+        }
+        if (!sum) {
+            positions[found++] = i;
+        }
+    }
+
+    *count = found;
+    return found != len;
+}
+
+
+/**
+ * Correct up to t errors in place in the block starting at bit `base`.
+ * @return false on success, true if the block is uncorrectable
+ */
+static bool bch_decode(struct puflib_fe const * fe, uint64_t * words, size_t base)
+{
+    uint8_t syn[2 * BCH_MAX_T + 1];
+    unsigned positions[BCH_MAX_T];
+    unsigned count;
+
+    if (!bch_syndromes(fe, words, base, syn)) {
+        return false;
+    }
+
+    if (bch_locate(fe, syn, positions, &count)) {
+        return true;
+    }
+
+    for (unsigned i = 0; i < count; ++i) {
+        flip_bit(words, base + positions[i]);
+    }
+    return false;
+}
+
+
+/**
+ * Encode a key into an outer codeword of fe->words words.
+ */
+static void encode_key(struct puflib_fe const * fe, uint8_t const * key, uint64_t * codeword)
+{
+    uint8_t msg[GF_N], block[GF_N];
+
+    memset(codeword, 0, fe->words * sizeof(uint64_t));
+
+    for (size_t b = 0; b < fe->blocks; ++b) {
+        for (unsigned i = 0; i < fe->k; ++i) {
+            size_t bit = b * fe->k + i;
+            msg[i] = bit < fe->key_bits ? (key[bit / 8] >> (bit % 8)) & 1 : 0;
+        }
+        bch_encode(fe, msg, block);
+        for (unsigned i = 0; i < GF_N; ++i) {
+            if (block[i]) {
+                flip_bit(codeword, b * GF_N + i);
+            }
+        }
+    }
+
+    puflib_secure_zero(msg, sizeof(msg));
+    puflib_secure_zero(block, sizeof(block));
+}
+
+
+/**
+ * Read the key back out of a corrected outer codeword.
+ */
+static void extract_key(struct puflib_fe const * fe, uint64_t const * codeword, uint8_t * key)
+{
+    memset(key, 0, fe->key_bits / 8);
+    for (size_t bit = 0; bit < fe->key_bits; ++bit) {
+        size_t pos = (bit / fe->k) * GF_N + fe->gen_deg + bit % fe->k;
+        key[bit / 8] |= (uint8_t) (word_bit(codeword, pos) << (bit % 8));
+    }
+}
+
+
+/******************************************************************************
+ * Public interface                                                           *
+ *****************************************************************************/
+
+struct puflib_fe * puflib_fe_new(size_t key_bits, unsigned t, unsigned rep)
+{
+    if (!key_bits || key_bits % 8 || !t || t > BCH_MAX_T
+            || !rep || rep > PUFLIB_BS_MAX_INPUTS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct puflib_fe * fe = calloc(1, sizeof(*fe));
+    if (!fe) {
+        return NULL;
+    }
+
+    fe->key_bits = key_bits;
+    fe->t = t;
+    fe->rep = rep;
+
+    gf_init(fe);
+    if (bch_init(fe)) {
+        free(fe);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    fe->blocks = (key_bits + fe->k - 1) / fe->k;
+    fe->words = (fe->blocks * GF_N + 63) / 64;
+    return fe;
+}
+
+
+void puflib_fe_free(struct puflib_fe * fe)
+{
+    free(fe);
+}
+
+
+size_t puflib_fe_response_len(struct puflib_fe const * fe)
+{
+    return fe->words * 8 * fe->rep;
+}
+
+
+size_t puflib_fe_helper_len(struct puflib_fe const * fe)
+{
+    return puflib_fe_response_len(fe);
+}
+
+
+bool puflib_fe_generate(struct puflib_fe const * fe, uint8_t const * response,
+        uint8_t * key, uint8_t * helper)
+{
+    size_t cw_len = fe->words * 8;
+
+    if (puflib_random_bytes(key, fe->key_bits / 8)) {
+        return true;
+    }
+
+    uint64_t * codeword = malloc(cw_len);
+    if (!codeword) {
+        return true;
+    }
+
+    encode_key(fe, key, codeword);
+
+    for (unsigned r = 0; r < fe->rep; ++r) {
+        for (size_t i = 0; i < cw_len; ++i) {
+            uint8_t byte = (uint8_t) (codeword[i / 8] >> (8 * (i % 8)));
+            helper[r * cw_len + i] = response[r * cw_len + i] ^ byte;
+        }
+    }
+
+    puflib_secure_zero(codeword, cw_len);
+    free(codeword);
+    return false;
+}
+
+
+bool puflib_fe_reproduce(struct puflib_fe const * fe, uint8_t const * response,
+        uint8_t const * helper, uint8_t * key)
+{
+    size_t n_words = fe->words * fe->rep;
+    bool rc = true;
+
+    uint64_t * noisy = malloc(n_words * sizeof(uint64_t));
+    uint64_t * codeword = malloc(fe->words * sizeof(uint64_t));
+    if (!noisy || !codeword) {
+        goto out;
+    }
+
+    // Words are assembled byte by byte so the bit numbering matches
+    // puflib_fe_generate() regardless of host byte order.
+    for (size_t w = 0; w < n_words; ++w) {
+        uint64_t word = 0;
+        for (size_t i = 0; i < 8; ++i) {
+            word |= (uint64_t) (response[8 * w + i] ^ helper[8 * w + i]) << (8 * i);
+        }
+        noisy[w] = word;
+    }
+
+    puflib_bs_majority(noisy, fe->rep, fe->words, codeword);
+
+    for (size_t b = 0; b < fe->blocks; ++b) {
+        if (bch_decode(fe, codeword, b * GF_N)) {
+            errno = EBADMSG;
+            goto out;
+        }
+    }
+
+    extract_key(fe, codeword, key);
+    rc = false;
+
+out:
+    if (noisy) {
+        puflib_secure_zero(noisy, n_words * sizeof(uint64_t));
+    }
+    if (codeword) {
+        puflib_secure_zero(codeword, fe->words * sizeof(uint64_t));
+    }
+    free(noisy);
+    free(codeword);
+    return rc;
+}
+
+
+/******************************************************************************
+ * Soft-decision decoding                                                     *
+ *                                                                            *
+ * Soft helper data is the code offset followed by a 4-bit reliability per    *
+ * response bit: the magnitude of its log-likelihood ratio as measured over   *
+ * the enrollment reads, in steps of half a nat. At reproduction, each        *
+ * repetition copy votes with its reliability as weight, and each BCH block   *
+ * is decoded with Chase-II: the least reliable bits are flipped in every     *
+ * combination, each candidate is hard-decoded, and the codeword closest to   *
+ * the soft input wins.                                                       *
+ *****************************************************************************/
+
+#define RELIABILITY_MAX 15
+#define RELIABILITY_STEPS_PER_NAT 2.0
+#define CHASE_BITS 5
+
+size_t puflib_fe_soft_helper_len(struct puflib_fe const * fe)
+{
+    // Code offset plus one nibble per response bit
+    return puflib_fe_response_len(fe) * 5;
+}
+
+
+bool puflib_fe_generate_soft(struct puflib_fe const * fe, uint8_t const * reads,
+        size_t n_reads, uint8_t * key, uint8_t * helper)
+{
+    size_t len = puflib_fe_response_len(fe);
+    struct puflib_vote * vote = NULL;
+    uint8_t * reference = NULL;
+    uint16_t * agree = NULL;
+    bool rc = true;
+
+    if (!n_reads || n_reads > PUFLIB_VOTE_MAX_READS) {
+        errno = EINVAL;
+        return true;
+    }
+
+    vote = puflib_vote_new(len);
+    reference = calloc(1, len);
+    agree = calloc(len * 8, sizeof(*agree));
+    if (!vote || !reference || !agree) {
+        goto out;
+    }
+
+    for (size_t i = 0; i < n_reads; ++i) {
+        if (puflib_vote_add(vote, reads + i * len)) {
+            goto out;
+        }
+    }
+    if (puflib_vote_result(vote, reference, agree)) {
+        goto out;
+    }
+
+    uint8_t * reliability = helper + len;
+    memset(reliability, 0, len * 4);
+
+    for (size_t bit = 0; bit < len * 8; ++bit) {
+        double same = agree[bit] + 0.5, differ = (double) (n_reads - agree[bit]) + 0.5;
+        double q = log(same / differ) * RELIABILITY_STEPS_PER_NAT + 0.5;
+        unsigned level = q > RELIABILITY_MAX ? RELIABILITY_MAX : (unsigned) q;
+
+        reliability[bit / 2] |= (uint8_t) (level << (4 * (bit % 2)));
+    }
+
+    rc = puflib_fe_generate(fe, reference, key, helper);
+
+out:
+    {
+        int errno_hold = errno;
+        if (reference) {
+            puflib_secure_zero(reference, len);
+        }
+        if (agree) {
+            puflib_secure_zero(agree, len * 8 * sizeof(*agree));
+        }
+        puflib_vote_free(vote);
+        free(reference);
+        free(agree);
+        errno = errno_hold;
+    }
+    return rc;
+}
+
+
+/**
+ * Chase-II decoding of the block starting at bit `base` of the hard decision.
+ * @return false on success (block corrected in place), true if no candidate
+ *  decoded
+ */
+static bool chase_decode(struct puflib_fe const * fe, uint64_t * hard,
+        int32_t const * soft, size_t base)
+{
+    uint8_t syn[2 * BCH_MAX_T + 1];
+    unsigned t2 = 2 * fe->t;
+
+    if (!bch_syndromes(fe, hard, base, syn)) {
+        return false;
+    }
+
+    // Least reliable positions, ordered by increasing |soft|
+    unsigned weak[CHASE_BITS];
+    uint32_t weak_mag[CHASE_BITS];
+    unsigned n_weak = 0;
+
+    for (unsigned i = 0; i < GF_N; ++i) {
+        uint32_t mag = (uint32_t) (soft[base + i] < 0 ? -soft[base + i] : soft[base + i]);
+        if (n_weak == CHASE_BITS && mag >= weak_mag[CHASE_BITS - 1]) {
+            continue;
+        }
+        unsigned j = n_weak < CHASE_BITS ? n_weak++ : CHASE_BITS - 1;
+        for (; j > 0 && weak_mag[j - 1] > mag; --j) {
+            weak[j] = weak[j - 1];
+            weak_mag[j] = weak_mag[j - 1];
+        }
+        weak[j] = i;
+        weak_mag[j] = mag;
+    }
+
+    uint64_t best_metric = UINT64_MAX;
+    unsigned best[BCH_MAX_T + CHASE_BITS];
+    unsigned n_best = 0;
+
+    for (unsigned pattern = 0; pattern < (1u << n_weak); ++pattern) {
+        // The flipped test bits alone bound the metric from below
+        uint64_t pattern_cost = 0;
+        for (unsigned w = 0; w < n_weak; ++w) {
+            if (pattern & (1u << w)) {
+                pattern_cost += weak_mag[w];
+            }
+        }
+        if (pattern_cost >= best_metric) {
+            continue;
+        }
+
+        uint8_t trial[2 * BCH_MAX_T + 1];
+        memcpy(trial, syn, sizeof(trial));
+
+        // Syndromes are linear, so flipping a bit adds its column
+        for (unsigned w = 0; w < n_weak; ++w) {
+            if (pattern & (1u << w)) {
+                for (unsigned j = 1; j <= t2; j += 2) {
+                    trial[j] ^= fe->exp[(weak[w] * j) % GF_N];
+                }
+            }
+        }
+
+        unsigned located[BCH_MAX_T];
+        unsigned n_located = 0;
+        bool nonzero = false;
+        for (unsigned j = 1; j <= t2; j += 2) {
+            nonzero |= trial[j] != 0;
+        }
+        if (nonzero && bch_locate(fe, trial, located, &n_located)) {
+            continue;
+        }
+
+        // Flips relative to the hard decision: the test pattern XOR the
+        // errors the hard decoder found on top of it
+        unsigned flips[BCH_MAX_T + CHASE_BITS];
+        unsigned n_flips = 0;
+        for (unsigned w = 0; w < n_weak; ++w) {
+            if (pattern & (1u << w)) {
+                flips[n_flips++] = weak[w];
+            }
+        }
+        for (unsigned l = 0; l < n_located; ++l) {
+            unsigned f = 0;
+            while (f < n_flips && flips[f] != located[l]) {
+                ++f;
+            }
+            if (f < n_flips) {
+                flips[f] = flips[--n_flips];
+            } else {
+                flips[n_flips++] = located[l];
+            }
+        }
+
+        uint64_t metric = 0;
+        for (unsigned f = 0; f < n_flips; ++f) {
+            int32_t v = soft[base + flips[f]];
+            metric += (uint64_t) (v < 0 ? -v : v);
+        }
+
+        if (metric < best_metric) {
+            best_metric = metric;
+            memcpy(best, flips, n_flips * sizeof(*flips));
+            n_best = n_flips;
+        }
+
+        // Stop early when the hard decision alone decodes with at most t/2
+        // errors. Every other codeword is then at least 3t/2 + 1 bits away,
+        // but candidates are ranked by soft metric rather than Hamming
+        // distance, so a test pattern could still win. That rare case is
+        // traded for skipping the remaining trial decodings in the common one.
+        if (!pattern && n_located <= fe->t / 2) {
+            break;
+        }
+    }
+
+    if (best_metric == UINT64_MAX) {
+        return true;
+    }
+
+    for (unsigned f = 0; f < n_best; ++f) {
+        flip_bit(hard, base + best[f]);
+    }
+    return false;
+}
+
+
+bool puflib_fe_reproduce_soft(struct puflib_fe const * fe, uint8_t const * response,
+        uint8_t const * helper, uint8_t * key)
+{
+    size_t cw_bits = fe->words * 64;
+    size_t len = puflib_fe_response_len(fe);
+    uint8_t const * reliability = helper + len;
+    bool rc = true;
+
+    int32_t * soft = calloc(cw_bits, sizeof(*soft));
+    uint64_t * hard = calloc(fe->words, sizeof(*hard));
+    if (!soft || !hard) {
+        goto out;
+    }
+
+    // Positive soft values favour 0, negative favour 1
+    for (unsigned r = 0; r < fe->rep; ++r) {
+        for (size_t j = 0; j < cw_bits; ++j) {
+            size_t bit = r * cw_bits + j;
+            int y = ((response[bit / 8] ^ helper[bit / 8]) >> (bit % 8)) & 1;
+            int32_t level = (reliability[bit / 2] >> (4 * (bit % 2))) & 0xf;
+            soft[j] += y ? -level : level;
+        }
+    }
+
+    for (size_t j = 0; j < cw_bits; ++j) {
+        if (soft[j] < 0) {
+            flip_bit(hard, j);
+        }
+    }
+
+    for (size_t b = 0; b < fe->blocks; ++b) {
+        if (chase_decode(fe, hard, soft, b * GF_N)) {
+            errno = EBADMSG;
+            goto out;
+        }
+    }
+
+    extract_key(fe, hard, key);
+    rc = false;
+
+out:
+    if (soft) {
+        puflib_secure_zero(soft, cw_bits * sizeof(*soft));
+    }
+    if (hard) {
+        puflib_secure_zero(hard, fe->words * sizeof(*hard));
+    }
+    free(soft);
+    free(hard);
+    return rc;
+}
@@ -0,0 +1,157 @@
+// PUFlib module instances
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// The instance a call is for is kept per thread, like the limits of the
+// operation (see deadline.c): the library sets it around each call into a
+// module, and modules and the NV store functions read it back. Left unset,
+// it reads as instance 0, so single-device modules never see another.
+//
+
+#include <puflib.h>
+#include <puflib_module.h>
+#include <puflib_internal.h>
+#include "instance.h"
+#include "dispatch.h"
+#include "misc.h"
+
+#include <string.h>
+#include <errno.h>
+
+static __thread unsigned SELECTED = PUFLIB_INSTANCE_ANY;
+
+// Where the search for the least loaded instance starts, so that idle
+// instances share the load rather than the first taking it all
+static unsigned NEXT_START = 0;
+
+
+unsigned puflib_select_instance(unsigned instance)
+{
+    unsigned previous = SELECTED;
+    SELECTED = instance;
+    return previous;
+}
+
+
+unsigned puflib_instance(void)
+{
+    return SELECTED == PUFLIB_INSTANCE_ANY ? 0 : SELECTED;
+}
+
+
+unsigned puflib_instance_selected(void)
+{
+    return SELECTED;
+}
+
+
+unsigned puflib_instance_count(module_info const * module)
+{
+    if (!module) {
+        return 0;
+    }
+    if (!module->instances) {
+        return 1;
+    }
+    unsigned count = module->instances();
+    return count > PUFLIB_MAX_INSTANCES ? PUFLIB_MAX_INSTANCES : count;
+}
+
+
+char * puflib_instance_name(module_info const * module, char * buf)
+{
+    unsigned instance = puflib_instance();
+    int len = instance
+        ? snprintf(buf, PUFLIB_INSTANCE_NAME_LEN, "%s%c%u",
+                module->name, PUFLIB_INSTANCE_SEP, instance)
+        : snprintf(buf, PUFLIB_INSTANCE_NAME_LEN, "%s", module->name);
+
+    if (len < 0 || len >= PUFLIB_INSTANCE_NAME_LEN) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    return buf;
+}
+
+
+static bool instance_usable(module_info const * module, unsigned instance)
+{
+    unsigned saved = puflib_select_instance(instance);
+    enum module_status status = puflib_module_status(module);
+    puflib_select_instance(saved);
+
+    return status != MODULE_STATUS_ERROR
+        && (status & MODULE_PROVISIONED) && !(status & MODULE_DISABLED);
+}
+
+
+bool puflib_instance_choose(module_info const * module, void const * key, size_t key_len,
+        unsigned * instance)
+{
+    unsigned count = puflib_instance_count(module);
+
+    if (SELECTED != PUFLIB_INSTANCE_ANY) {
+        if (SELECTED >= count) {
+            puflib_report_fmt(module, STATUS_ERROR, "no instance %u; module has %u",
+                    SELECTED, count);
+            errno = ENODEV;
+            return true;
+        }
+        *instance = SELECTED;
+        return false;
+    }
+
+    // A single device needs no choice, nor the status checks below
+    if (count == 1) {
+        *instance = 0;
+        return false;
+    }
+
+    if (key) {
+        // FNV-1a, as the response cache hashes challenges. The hash is taken
+        // over all instances, not just the usable ones, so that a challenge
+        // keeps going to the same device when another one is disabled; its
+        // responses from any other device would be worthless to a verifier.
+        uint64_t hash = 0xcbf29ce484222325ull;
+        uint8_t const * bytes = key;
+        for (size_t i = 0; i < key_len; ++i) {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+        unsigned chosen = (unsigned) (hash % count);
+        if (!instance_usable(module, chosen)) {
+            puflib_report_fmt(module, STATUS_ERROR,
+                    "instance %u, which answers this challenge, is not provisioned and enabled",
+                    chosen);
+            errno = ENODEV;
+            return true;
+        }
+        *instance = chosen;
+        return false;
+    }
+
+    unsigned usable[PUFLIB_MAX_INSTANCES];
+    unsigned n_usable = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        if (instance_usable(module, i)) {
+            usable[n_usable++] = i;
+        }
+    }
+    if (!n_usable) {
+        puflib_report(module, STATUS_ERROR, "no provisioned and enabled instance");
+        errno = ENODEV;
+        return true;
+    }
+
+    unsigned start = __atomic_fetch_add(&NEXT_START, 1, __ATOMIC_RELAXED);
+    unsigned best_load = (unsigned) -1;
+    for (unsigned i = 0; i < n_usable && best_load; ++i) {
+        unsigned candidate = usable[(start + i) % n_usable];
+        unsigned load = puflib_dispatch_load(module, candidate);
+        if (load < best_load) {
+            best_load = load;
+            *instance = candidate;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,50 @@
+// PUFlib module instances
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+
+#ifndef _PUFLIB_INSTANCE_H_
+#define _PUFLIB_INSTANCE_H_
+
+#include <puflib.h>
+
+/// Most instances of one module that the library will use
+#define PUFLIB_MAX_INSTANCES 64
+
+/// Separates the module name from the instance number in store names and
+/// blob headers
+#define PUFLIB_INSTANCE_SEP '@'
+
+/// Size of the buffer taken by puflib_instance_name()
+#define PUFLIB_INSTANCE_NAME_LEN 128
+
+/**
+ * Format the name of the calling thread's instance of a module, for its NV
+ * stores and blob headers: the module name for instance 0, which keeps the
+ * stores and blobs of single-device modules unchanged, and "name@N" for
+ * the others.
+ * @param buf - buffer of PUFLIB_INSTANCE_NAME_LEN bytes to format into
+ * @return buf, or NULL (with errno set) if the name does not fit
+ */
+char * puflib_instance_name(module_info const * module, char * buf);
+
+/**
+ * Return the calling thread's selected instance, or PUFLIB_INSTANCE_ANY.
+ */
+unsigned puflib_instance_selected(void);
+
+/**
+ * Pick the instance of a module for a call. A selected instance (see
+ * puflib_select_instance()) is always used. Otherwise a call with a @a key
+ * (the challenge, for chal_resp) goes to the instance the key hashes to,
+ * among all instances, and one without goes to the provisioned and enabled
+ * instance with the fewest requests queued.
+ * @return false on success, true on error (errno is ENODEV if there is no
+ *  usable instance, or the one the key hashes to is not usable)
+ */
+bool puflib_instance_choose(module_info const * module, void const * key, size_t key_len,
+        unsigned * instance);
+
+#endif // _PUFLIB_INSTANCE_H_
@@ -0,0 +1,369 @@
+// PUFlib root key handling
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Sealing for modules that provide get_root_key(), and the optional cache of
+// their root keys, one for each instance. Sealed format (after the puflib
+// header):
+//
+//   salt[BLOB_SALT_LEN] || puflib_key_seal(HKDF(salt, root key, BLOB_INFO), data)
+//
+
+#include <puflib.h>
+#include <puflib_module.h>
+#include <puflib_internal.h>
+#include "keycache.h"
+#include "dispatch.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define BLOB_SALT_LEN 16
+#define BLOB_INFO "puflib blob key"
+
+struct cache_entry {
+    module_info const * module;
+    unsigned instance;
+    pthread_mutex_t lock;       ///< held while the key is read or rebuilt
+    unsigned long ttl_ms;       ///< 0 for no limit
+    unsigned long max_uses;     ///< 0 for no limit
+    uint8_t * key;              ///< locked memory, or NULL if nothing cached
+    uint64_t expires;           ///< puflib_monotonic_ms() time
+    unsigned long uses_left;
+    bool lock_failed;           ///< already warned that memory can't be locked
+    struct cache_entry * next;
+};
+
+// Entries are created on first configuration (for instance 0) or first use
+// (for the others) and never freed, so a pointer to one stays valid after
+// CACHE_LOCK is released. CACHE_LOCK is taken before any entry lock.
+static struct cache_entry * CACHE = NULL;
+static pthread_mutex_t CACHE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+/// Caller holds CACHE_LOCK
+static struct cache_entry * new_entry(module_info const * module, unsigned instance)
+{
+    struct cache_entry * entry = calloc(1, sizeof(*entry));
+    if (entry) {
+        entry->module = module;
+        entry->instance = instance;
+        pthread_mutex_init(&entry->lock, NULL);
+        entry->next = CACHE;
+        CACHE = entry;
+    }
+    return entry;
+}
+
+
+/**
+ * Find the entry for an instance of a module. The cache is configured per
+ * module, so an instance of a configured module gets an entry with the same
+ * limits on first use.
+ * @return entry, or NULL if the module is not configured
+ */
+static struct cache_entry * find_entry(module_info const * module, unsigned instance)
+{
+    pthread_mutex_lock(&CACHE_LOCK);
+    struct cache_entry * entry = CACHE;
+    struct cache_entry * sibling = NULL;
+    for (; entry; entry = entry->next) {
+        if (entry->module == module) {
+            if (entry->instance == instance) {
+                break;
+            }
+            sibling = entry;
+        }
+    }
+
+    if (!entry && sibling) {
+        entry = new_entry(module, instance);
+        if (entry) {
+            pthread_mutex_lock(&sibling->lock);
+            entry->ttl_ms = sibling->ttl_ms;
+            entry->max_uses = sibling->max_uses;
+            pthread_mutex_unlock(&sibling->lock);
+        }
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+    return entry;
+}
+
+
+/// Discard the cached key. Caller holds entry->lock.
+static void entry_clear(struct cache_entry * entry)
+{
+    puflib_secure_free(entry->key, PUFLIB_ROOT_KEY_LEN);
+    entry->key = NULL;
+}
+
+
+bool puflib_key_cache_configure(module_info const * module,
+        unsigned long ttl_ms, unsigned long max_uses)
+{
+    if (!module || !module->get_root_key) {
+        errno = ENOTSUP;
+        return true;
+    }
+
+    // Holding CACHE_LOCK throughout means no instance's entry is created
+    // with the old limits
+    pthread_mutex_lock(&CACHE_LOCK);
+    struct cache_entry * entry = CACHE;
+    while (entry && entry->module != module) {
+        entry = entry->next;
+    }
+    if (!entry && !new_entry(module, 0)) {
+        pthread_mutex_unlock(&CACHE_LOCK);
+        return true;
+    }
+
+    for (entry = CACHE; entry; entry = entry->next) {
+        if (entry->module == module) {
+            pthread_mutex_lock(&entry->lock);
+            entry_clear(entry);
+            entry->ttl_ms = ttl_ms;
+            entry->max_uses = max_uses;
+            pthread_mutex_unlock(&entry->lock);
+        }
+    }
+    pthread_mutex_unlock(&CACHE_LOCK);
+    return false;
+}
+
+
+void puflib_key_cache_flush(module_info const * module)
+{
+    pthread_mutex_lock(&CACHE_LOCK);
+    struct cache_entry * first = CACHE;
+    pthread_mutex_unlock(&CACHE_LOCK);
+
+    // Entries are only ever prepended, so the list from `first` on is stable
+    for (struct cache_entry * entry = first; entry; entry = entry->next) {
+        if (!module || entry->module == module) {
+            pthread_mutex_lock(&entry->lock);
+            entry_clear(entry);
+            pthread_mutex_unlock(&entry->lock);
+        }
+    }
+}
+
+
+__attribute__((destructor))
+static void flush_at_unload(void)
+{
+    puflib_key_cache_flush(NULL);
+}
+
+
+static bool run_get_root_key(module_info const * module, void * state,
+        void const * in, size_t in_len, void ** out, size_t * out_len)
+{
+    (void) in;
+    (void) in_len;
+
+    uint8_t * key = malloc(PUFLIB_ROOT_KEY_LEN);
+    if (!key) {
+        return true;
+    }
+
+    bool rc;
+    if (state && module->session_get_root_key) {
+        rc = module->session_get_root_key(state, key);
+    } else {
+        rc = module->get_root_key(key);
+    }
+    if (rc) {
+        int errno_hold = errno;
+        puflib_secure_zero(key, PUFLIB_ROOT_KEY_LEN);
+        free(key);
+        errno = errno_hold;
+        return true;
+    }
+
+    *out = key;
+    *out_len = PUFLIB_ROOT_KEY_LEN;
+    return false;
+}
+
+
+/**
+ * Read a module's root key from the PUF, through the session if there is one.
+ * Only the read goes through the device's queue, where concurrent reads are
+ * merged; deriving blob keys and encrypting stay on the calling thread.
+ */
+static bool read_root_key(module_info const * module, void * state,
+        uint8_t key[PUFLIB_ROOT_KEY_LEN])
+{
+    void * out;
+    size_t out_len;
+
+    if (puflib_dispatch(module, state, DISPATCH_ROOT_KEY, true, run_get_root_key,
+                NULL, 0, &out, &out_len)) {
+        return true;
+    }
+
+    memcpy(key, out, PUFLIB_ROOT_KEY_LEN);
+    puflib_secure_zero(out, out_len);
+    free(out);
+    return false;
+}
+
+
+/**
+ * Get the root key of the calling thread's instance of a module, from the
+ * cache if it is enabled and holds a fresh key, or else from the module.
+ * @a use says whether this counts against the cached key's max_uses.
+ */
+static bool load_root_key(module_info const * module, void * state,
+        uint8_t key[PUFLIB_ROOT_KEY_LEN], bool use)
+{
+    struct cache_entry * entry = find_entry(module, puflib_instance());
+    if (!entry) {
+        return read_root_key(module, state, key);
+    }
+
+    pthread_mutex_lock(&entry->lock);
+
+    if (!entry->ttl_ms && !entry->max_uses) {
+        pthread_mutex_unlock(&entry->lock);
+        return read_root_key(module, state, key);
+    }
+
+    if (entry->key && entry->ttl_ms && puflib_monotonic_ms() >= entry->expires) {
+        entry_clear(entry);
+    }
+
+    if (!entry->key) {
+        // Holding the entry lock here means concurrent callers wait for this
+        // reconstruction rather than each reading the PUF
+        if (read_root_key(module, state, key)) {
+            int errno_hold = errno;
+            pthread_mutex_unlock(&entry->lock);
+            errno = errno_hold;
+            return true;
+        }
+
+        entry->key = puflib_secure_alloc(PUFLIB_ROOT_KEY_LEN);
+        if (!entry->key) {
+            if (!entry->lock_failed) {
+                puflib_report(module, STATUS_WARN,
+                        "cannot lock memory for key cache; not caching key");
+                entry->lock_failed = true;
+            }
+            pthread_mutex_unlock(&entry->lock);
+            return false;
+        }
+
+        memcpy(entry->key, key, PUFLIB_ROOT_KEY_LEN);
+        entry->expires = puflib_monotonic_ms() + entry->ttl_ms;
+        entry->uses_left = entry->max_uses;
+    } else {
+        memcpy(key, entry->key, PUFLIB_ROOT_KEY_LEN);
+    }
+
+    if (use && entry->max_uses && !--entry->uses_left) {
+        entry_clear(entry);
+    }
+
+    pthread_mutex_unlock(&entry->lock);
+    return false;
+}
+
+
+bool puflib_key_cache_fill(module_info const * module, bool * filled)
+{
+    struct cache_entry * entry = find_entry(module, puflib_instance());
+    if (entry) {
+        pthread_mutex_lock(&entry->lock);
+        *filled = entry->ttl_ms || entry->max_uses;
+        pthread_mutex_unlock(&entry->lock);
+    } else {
+        *filled = false;
+    }
+    if (!*filled) {
+        return false;
+    }
+
+    uint8_t key[PUFLIB_ROOT_KEY_LEN];
+    bool rc = load_root_key(module, NULL, key, false);
+    puflib_secure_zero(key, sizeof(key));
+    return rc;
+}
+
+
+static bool blob_key(module_info const * module, void * state,
+        uint8_t const salt[BLOB_SALT_LEN], uint8_t key[PUFLIB_SHA256_LEN])
+{
+    uint8_t root[PUFLIB_ROOT_KEY_LEN];
+
+    if (load_root_key(module, state, root, true)) {
+        return true;
+    }
+
+    bool rc = puflib_hkdf_sha256(salt, BLOB_SALT_LEN, root, sizeof(root),
+            BLOB_INFO, strlen(BLOB_INFO), key, PUFLIB_SHA256_LEN);
+    puflib_secure_zero(root, sizeof(root));
+    return rc;
+}
+
+
+bool puflib_root_seal(module_info const * module, void * state,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t salt[BLOB_SALT_LEN];
+    uint8_t key[PUFLIB_SHA256_LEN];
+    uint8_t * sealed = NULL;
+    size_t sealed_len;
+
+    if (puflib_random_bytes(salt, sizeof(salt)) || blob_key(module, state, salt, key)) {
+        return true;
+    }
+
+    bool rc = puflib_key_seal(key, data_in, data_in_len, &sealed, &sealed_len);
+    puflib_secure_zero(key, sizeof(key));
+    if (rc) {
+        return true;
+    }
+
+    uint8_t * out = malloc(BLOB_SALT_LEN + sealed_len);
+    if (!out) {
+        free(sealed);
+        return true;
+    }
+    memcpy(out, salt, BLOB_SALT_LEN);
+    memcpy(out + BLOB_SALT_LEN, sealed, sealed_len);
+    free(sealed);
+
+    *data_out = out;
+    *data_out_len = BLOB_SALT_LEN + sealed_len;
+    return false;
+}
+
+
+bool puflib_root_unseal(module_info const * module, void * state,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t key[PUFLIB_SHA256_LEN];
+
+    if (data_in_len < BLOB_SALT_LEN) {
+        puflib_report(module, STATUS_ERROR, "sealed data is truncated");
+        errno = EBADMSG;
+        return true;
+    }
+
+    if (blob_key(module, state, data_in, key)) {
+        return true;
+    }
+
+    bool rc = puflib_key_unseal(key, data_in + BLOB_SALT_LEN, data_in_len - BLOB_SALT_LEN,
+            data_out, data_out_len);
+    puflib_secure_zero(key, sizeof(key));
+    if (rc && errno == EBADMSG) {
+        puflib_report(module, STATUS_ERROR, "sealed data is corrupt or from another device");
+    }
+    return rc;
+}
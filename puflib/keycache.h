@@ -0,0 +1,41 @@
+// PUFlib root key handling
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+
+#ifndef _PUFLIB_KEYCACHE_H_
+#define _PUFLIB_KEYCACHE_H_
+
+#include <puflib.h>
+
+/**
+ * Seal data for a module that provides get_root_key(), with a key derived
+ * from the (possibly cached) root key. @a state is the module's session
+ * state, or NULL; other arguments are as for module->seal().
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_root_seal(module_info const * module, void * state,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Unseal data sealed by puflib_root_seal(). Arguments are as for
+ * puflib_root_seal().
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_root_unseal(module_info const * module, void * state,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+/**
+ * Read the root key of the calling thread's instance of a module into the
+ * key cache, if the cache is enabled for the module and does not already
+ * hold a fresh key.
+ * @param filled - outparam: whether the cache is enabled for the module
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_key_cache_fill(module_info const * module, bool * filled);
+
+#endif // _PUFLIB_KEYCACHE_H_
@@ -0,0 +1,819 @@
+// PUFlib sealed keystore
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Many named secrets in one file, each sealed on its own, so that reading one
+// unseals only that one. File layout, all integers little-endian:
+//
+//   0   magic "PUFKEYST"
+//   8   u32 version
+//   12  u32 flags: FILE_SUPERSEDED once compaction has replaced the file
+//   16  u64 number of index buckets, a power of two
+//   24  u64 buckets in use, including those of deleted names
+//   32  u64 end of the log, where the next record goes
+//   40  u64 bytes of the log taken by replaced and deleted records
+//   48  reserved, zero, up to HEADER_LEN
+//
+// followed by the index, one u64 per bucket holding the offset of the newest
+// record for a name (zero for an empty bucket), found by hashing the name and
+// probing linearly; then the log of records, each:
+//
+//   0   u32 name length
+//   4   u32 blob length
+//   8   u32 flags: RECORD_DELETED for a deleted name
+//   12  u32 reserved, zero
+//   16  name, then the sealed blob, then zeros up to a multiple of 8 bytes
+//
+// Records are only ever appended. An update writes its record and makes it
+// durable, then advances the end of the log, and only then points the index
+// at it, so a crash leaves either the old value or the new one. Compaction
+// writes the live records to a new file, renames it over the old one and
+// marks the old one superseded, so that other openers switch to the new
+// file. A lock file beside the keystore keeps writers apart from each other
+// and from readers, across processes.
+//
+
+#define _XOPEN_SOURCE 700
+
+#include <puflib_internal.h>
+#include <puflib.h>
+#include <puflib_module.h>
+#include "bitslice.h"
+#include "misc.h"
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define KEYSTORE_MAGIC "PUFKEYST"
+#define KEYSTORE_MAGIC_LEN 8
+#define KEYSTORE_VERSION 1
+#define HEADER_LEN 64
+#define RECORD_HEADER_LEN 16
+#define FILE_SUPERSEDED 0x01
+#define RECORD_DELETED 0x01
+#define KEYSTORE_MIN_BUCKETS 64
+#define KEYSTORE_MAX_NAME_LEN 1024
+#define COMPACT_MIN_GARBAGE (1024 * 1024)   ///< log bytes worth compacting away
+
+// Header field offsets
+#define H_FLAGS 12
+#define H_BUCKETS 16
+#define H_USED 24
+#define H_LOG_END 32
+#define H_GARBAGE 40
+
+struct puflib_keystore {
+    char * path;
+    bool writable;
+    FILE * file;            ///< for writing, if writable
+    uint8_t * map;          ///< read-only mapping of the whole file
+    size_t map_len;
+    int lock;               ///< lock file, against other processes
+    pthread_mutex_t mutex;  ///< against other threads using this handle
+};
+
+/**
+ * A record, pointing into the mapping.
+ */
+struct record {
+    uint64_t offset;
+    size_t len;             ///< whole record, with padding
+    char const * name;
+    size_t name_len;
+    uint8_t const * blob;
+    size_t blob_len;
+    uint32_t flags;
+};
+
+
+static uint32_t read_le32(uint8_t const * buf)
+{
+    return (uint32_t) buf[0] | (uint32_t) buf[1] << 8
+        | (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+
+static void write_le32(uint8_t * buf, uint32_t value)
+{
+    for (size_t i = 0; i < 4; ++i) {
+        buf[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+
+/**
+ * FNV-1a. Names are chosen by whoever can write the keystore, so there is no
+ * need for a keyed hash here.
+ */
+static uint64_t hash_name(char const * name, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t) name[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+
+static size_t record_len(size_t name_len, size_t blob_len)
+{
+    return RECORD_HEADER_LEN + ((name_len + blob_len + 7) & ~(size_t) 7);
+}
+
+
+static uint64_t header_field(struct puflib_keystore const * ks, size_t field)
+{
+    return puflib_load_le64(ks->map + field);
+}
+
+
+static size_t log_start(size_t n_buckets)
+{
+    return HEADER_LEN + n_buckets * 8;
+}
+
+
+static bool check_name(char const * name, size_t * len)
+{
+    *len = name ? strlen(name) : 0;
+    if (!*len || *len > KEYSTORE_MAX_NAME_LEN) {
+        errno = EINVAL;
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Write to the file at an offset.
+ * @return false on success, true on error (with errno set)
+ */
+static bool write_at(FILE * f, uint64_t offset, void const * buf, size_t len)
+{
+    if (offset > LONG_MAX) {
+        errno = EFBIG;
+        return true;
+    }
+    if (fseek(f, (long) offset, SEEK_SET)) {
+        return true;
+    }
+    return len && fwrite(buf, 1, len, f) != len;
+}
+
+
+/**
+ * Write a header with the given index size and log state, followed by an
+ * empty index.
+ */
+static bool write_header(FILE * f, uint64_t n_buckets, uint64_t used, uint64_t log_end)
+{
+    uint8_t header[HEADER_LEN] = { 0 };
+    memcpy(header, KEYSTORE_MAGIC, KEYSTORE_MAGIC_LEN);
+    write_le32(header + 8, KEYSTORE_VERSION);
+    puflib_store_le64(header + H_BUCKETS, n_buckets);
+    puflib_store_le64(header + H_USED, used);
+    puflib_store_le64(header + H_LOG_END, log_end);
+    return fwrite(header, 1, sizeof(header), f) != sizeof(header);
+}
+
+
+/**
+ * Map the file at ks->path afresh and check its header.
+ */
+static bool map_keystore(struct puflib_keystore * ks)
+{
+    if (ks->map) {
+        puflib_unmap_file(ks->map, ks->map_len);
+        ks->map = NULL;
+    }
+
+    ks->map = puflib_map_file(ks->path, false, &ks->map_len);
+    if (!ks->map) {
+        return true;
+    }
+
+    if (ks->map_len < HEADER_LEN || memcmp(ks->map, KEYSTORE_MAGIC, KEYSTORE_MAGIC_LEN)
+            || read_le32(ks->map + 8) != KEYSTORE_VERSION) {
+        goto err_format;
+    }
+
+    // Check sizes without overflowing: the index and the log must fit in the
+    // file, and the index must always have an empty bucket
+    uint64_t n_buckets = header_field(ks, H_BUCKETS);
+    uint64_t used = header_field(ks, H_USED);
+    uint64_t log_end = header_field(ks, H_LOG_END);
+    if (n_buckets < 2 || (n_buckets & (n_buckets - 1)) || used >= n_buckets
+            || n_buckets > (ks->map_len - HEADER_LEN) / 8
+            || log_end < log_start((size_t) n_buckets) || log_end > ks->map_len) {
+        goto err_format;
+    }
+    return false;
+
+err_format:
+    puflib_unmap_file(ks->map, ks->map_len);
+    ks->map = NULL;
+    errno = EBADMSG;
+    return true;
+}
+
+
+/**
+ * Open the file at ks->path afresh, for writing if the handle is writable,
+ * and map it.
+ */
+static bool reopen(struct puflib_keystore * ks)
+{
+    if (ks->file) {
+        fclose(ks->file);
+        ks->file = NULL;
+    }
+    if (ks->writable) {
+        ks->file = puflib_open_existing(ks->path, "r+b");
+        if (!ks->file) {
+            return true;
+        }
+    }
+    return map_keystore(ks);
+}
+
+
+/**
+ * Bring the handle up to date with changes made through other handles, with
+ * the lock file held: switch to a compacted file, and extend the mapping
+ * over records appended since it was made.
+ */
+static bool refresh(struct puflib_keystore * ks)
+{
+    if (!ks->map || (read_le32(ks->map + H_FLAGS) & FILE_SUPERSEDED)) {
+        return reopen(ks);
+    }
+    if (header_field(ks, H_LOG_END) > ks->map_len) {
+        return map_keystore(ks);
+    }
+    return false;
+}
+
+
+/**
+ * Lock the handle and the lock file, and refresh the handle.
+ */
+static bool enter(struct puflib_keystore * ks, bool exclusive)
+{
+    pthread_mutex_lock(&ks->mutex);
+    if (puflib_lock_file(ks->lock, exclusive)) {
+        goto err;
+    }
+    if (refresh(ks)) {
+        puflib_unlock_file(ks->lock);
+        goto err;
+    }
+    return false;
+
+err:
+    {
+        int errno_hold = errno;
+        pthread_mutex_unlock(&ks->mutex);
+        errno = errno_hold;
+        return true;
+    }
+}
+
+
+static void leave(struct puflib_keystore * ks)
+{
+    int errno_hold = errno;
+    puflib_unlock_file(ks->lock);
+    pthread_mutex_unlock(&ks->mutex);
+    errno = errno_hold;
+}
+
+
+/**
+ * Read and check the record at an offset.
+ */
+static bool read_record(struct puflib_keystore const * ks, uint64_t offset, struct record * r)
+{
+    uint64_t log_end = header_field(ks, H_LOG_END);
+    uint64_t start = log_start((size_t) header_field(ks, H_BUCKETS));
+
+    if (offset < start || offset > log_end || log_end - offset < RECORD_HEADER_LEN) {
+        errno = EBADMSG;
+        return true;
+    }
+
+    uint8_t const * rec = ks->map + offset;
+    r->offset = offset;
+    r->name_len = read_le32(rec);
+    r->blob_len = read_le32(rec + 4);
+    r->flags = read_le32(rec + 8);
+    r->len = record_len(r->name_len, r->blob_len);
+    if (!r->name_len || r->len > log_end - offset) {
+        errno = EBADMSG;
+        return true;
+    }
+    r->name = (char const *) rec + RECORD_HEADER_LEN;
+    r->blob = rec + RECORD_HEADER_LEN + r->name_len;
+    return false;
+}
+
+
+/**
+ * Find a name in the index.
+ * @param bucket - outparam: the bucket holding the name, or the empty bucket
+ *  it would go into
+ * @param found - outparam: whether the name is in the index. Its record may
+ *  mark it deleted.
+ * @param r - outparam for the name's record, if found
+ * @return false on success, true on error (with errno set)
+ */
+static bool lookup(struct puflib_keystore const * ks, char const * name, size_t name_len,
+        size_t * bucket, bool * found, struct record * r)
+{
+    size_t n_buckets = (size_t) header_field(ks, H_BUCKETS);
+    size_t mask = n_buckets - 1;
+    size_t b = (size_t) hash_name(name, name_len) & mask;
+    uint8_t const * index = ks->map + HEADER_LEN;
+
+    // There is always an empty bucket (checked at open), but a damaged file
+    // must not make this loop forever
+    for (size_t probes = 0; probes < n_buckets; ++probes, b = (b + 1) & mask) {
+        uint64_t offset = puflib_load_le64(index + b * 8);
+        if (!offset) {
+            *bucket = b;
+            *found = false;
+            return false;
+        }
+        if (read_record(ks, offset, r)) {
+            return true;
+        }
+        if (r->name_len == name_len && !memcmp(r->name, name, name_len)) {
+            *bucket = b;
+            *found = true;
+            return false;
+        }
+    }
+
+    errno = EBADMSG;
+    return true;
+}
+
+
+bool puflib_keystore_create(char const * path)
+{
+    FILE * f = puflib_create_and_open(path, "wb");
+    if (!f) {
+        return true;
+    }
+
+    bool rc = write_header(f, KEYSTORE_MIN_BUCKETS, 0, log_start(KEYSTORE_MIN_BUCKETS));
+    uint8_t zero[8] = { 0 };
+    for (size_t b = 0; b < KEYSTORE_MIN_BUCKETS && !rc; ++b) {
+        rc = fwrite(zero, 1, sizeof(zero), f) != sizeof(zero);
+    }
+    rc = rc || puflib_sync_file(f);
+
+    int errno_hold = errno;
+    if (fclose(f) && !rc) {
+        rc = true;
+        errno_hold = errno;
+    }
+    if (rc) {
+        remove(path);
+    }
+    errno = errno_hold;
+    return rc;
+}
+
+
+struct puflib_keystore * puflib_keystore_open(char const * path, bool writable)
+{
+    struct puflib_keystore * ks = calloc(1, sizeof(*ks));
+    if (!ks) {
+        return NULL;
+    }
+    ks->lock = -1;
+    ks->writable = writable;
+    pthread_mutex_init(&ks->mutex, NULL);
+
+    char * lock_path = puflib_concat(path, ".lock", NULL);
+    ks->path = puflib_duplicate_string(path);
+    if (!lock_path || !ks->path) {
+        goto err;
+    }
+
+    ks->lock = puflib_open_lock_file(lock_path);
+    if (ks->lock < 0) {
+        goto err;
+    }
+
+    if (enter(ks, false)) {
+        goto err;
+    }
+    leave(ks);
+    free(lock_path);
+    return ks;
+
+err:
+    {
+        int errno_hold = errno;
+        free(lock_path);
+        puflib_keystore_close(ks);
+        errno = errno_hold;
+        return NULL;
+    }
+}
+
+
+bool puflib_keystore_close(struct puflib_keystore * ks)
+{
+    bool rc = false;
+    int errno_hold = 0;
+
+    if (!ks) {
+        return false;
+    }
+
+    if (ks->file && fclose(ks->file)) {
+        rc = true;
+        errno_hold = errno;
+    }
+    if (ks->map) {
+        puflib_unmap_file(ks->map, ks->map_len);
+    }
+    puflib_close_lock_file(ks->lock);
+    pthread_mutex_destroy(&ks->mutex);
+    free(ks->path);
+    free(ks);
+
+    if (rc) {
+        errno = errno_hold;
+    }
+    return rc;
+}
+
+
+/**
+ * Rewrite the keystore with only its live records, and an index with room
+ * for as many again. Called with the handle entered exclusively.
+ */
+static bool compact(struct puflib_keystore * ks)
+{
+    size_t n_buckets = (size_t) header_field(ks, H_BUCKETS);
+    uint8_t const * index = ks->map + HEADER_LEN;
+    uint64_t * new_index = NULL;
+    uint64_t * live = NULL;
+    char * tmp_path = NULL;
+    FILE * f = NULL;
+    size_t n_live = 0;
+
+    live = malloc(n_buckets * sizeof(*live));
+    if (!live) {
+        goto err;
+    }
+    for (size_t b = 0; b < n_buckets; ++b) {
+        uint64_t offset = puflib_load_le64(index + b * 8);
+        struct record r;
+        if (!offset) {
+            continue;
+        } else if (read_record(ks, offset, &r)) {
+            goto err;
+        } else if (!(r.flags & RECORD_DELETED)) {
+            live[n_live++] = offset;
+        }
+    }
+
+    size_t new_buckets = KEYSTORE_MIN_BUCKETS;
+    while (new_buckets < 4 * (n_live + 1)) {
+        new_buckets *= 2;
+    }
+    new_index = calloc(new_buckets, sizeof(*new_index));
+    if (!new_index) {
+        goto err;
+    }
+
+    // Lay the live records out one after the other and index them
+    size_t mask = new_buckets - 1;
+    uint64_t log_end = log_start(new_buckets);
+    for (size_t i = 0; i < n_live; ++i) {
+        struct record r;
+        read_record(ks, live[i], &r);
+        size_t b = (size_t) hash_name(r.name, r.name_len) & mask;
+        while (new_index[b]) {
+            b = (b + 1) & mask;
+        }
+        new_index[b] = log_end;
+        log_end += r.len;
+    }
+
+    tmp_path = puflib_concat(ks->path, ".compact", NULL);
+    if (!tmp_path) {
+        goto err;
+    }
+    // Left over from an interrupted compaction, which held the same lock
+    remove(tmp_path);
+    f = puflib_create_and_open(tmp_path, "wb");
+    if (!f || write_header(f, new_buckets, n_live, log_end)) {
+        goto err_remove;
+    }
+    for (size_t b = 0; b < new_buckets; ++b) {
+        uint8_t entry[8];
+        puflib_store_le64(entry, new_index[b]);
+        if (fwrite(entry, 1, sizeof(entry), f) != sizeof(entry)) {
+            goto err_remove;
+        }
+    }
+    for (size_t i = 0; i < n_live; ++i) {
+        struct record r;
+        read_record(ks, live[i], &r);
+        if (fwrite(ks->map + r.offset, 1, r.len, f) != r.len) {
+            goto err_remove;
+        }
+    }
+    if (puflib_sync_file(f)) {
+        goto err_remove;
+    }
+    int close_rc = fclose(f);
+    f = NULL;
+    if (close_rc || puflib_replace_file(tmp_path, ks->path)) {
+        goto err_remove;
+    }
+
+    // Send other openers of the old file to the new one
+    uint8_t flags[4];
+    write_le32(flags, read_le32(ks->map + H_FLAGS) | FILE_SUPERSEDED);
+    if (write_at(ks->file, H_FLAGS, flags, sizeof(flags)) || puflib_sync_file(ks->file)) {
+        goto err;
+    }
+
+    free(live);
+    free(new_index);
+    free(tmp_path);
+    return reopen(ks);
+
+err_remove:
+    {
+        int errno_hold = errno;
+        if (f) {
+            fclose(f);
+            f = NULL;
+        }
+        remove(tmp_path);
+        errno = errno_hold;
+    }
+err:
+    {
+        int errno_hold = errno;
+        if (f) {
+            fclose(f);
+        }
+        free(live);
+        free(new_index);
+        free(tmp_path);
+        errno = errno_hold;
+        return true;
+    }
+}
+
+
+/**
+ * Append a record for a name and point the index at it.
+ */
+static bool append(struct puflib_keystore * ks, char const * name, size_t name_len,
+        uint8_t const * blob, size_t blob_len, uint32_t flags)
+{
+    if (!ks->writable) {
+        errno = EBADF;
+        return true;
+    }
+    if (blob_len > UINT32_MAX) {
+        errno = EFBIG;
+        return true;
+    }
+    if (enter(ks, true)) {
+        return true;
+    }
+
+    size_t bucket;
+    bool found;
+    struct record old;
+    if (lookup(ks, name, name_len, &bucket, &found, &old)) {
+        goto err;
+    }
+    if ((flags & RECORD_DELETED) && (!found || (old.flags & RECORD_DELETED))) {
+        errno = ENOENT;
+        goto err;
+    }
+
+    // Compact when the index would be over half full, or when most of a
+    // sizeable log is garbage
+    uint64_t used = header_field(ks, H_USED);
+    uint64_t garbage = header_field(ks, H_GARBAGE);
+    uint64_t log_len = header_field(ks, H_LOG_END)
+        - log_start((size_t) header_field(ks, H_BUCKETS));
+    if ((!found && 2 * (used + 1) > header_field(ks, H_BUCKETS))
+            || (garbage > COMPACT_MIN_GARBAGE && 2 * garbage > log_len)) {
+        if (compact(ks) || lookup(ks, name, name_len, &bucket, &found, &old)) {
+            goto err;
+        }
+        used = header_field(ks, H_USED);
+        garbage = header_field(ks, H_GARBAGE);
+    }
+
+    // The record, made durable before anything refers to it
+    uint64_t offset = header_field(ks, H_LOG_END);
+    size_t len = record_len(name_len, blob_len);
+    uint8_t rec_header[RECORD_HEADER_LEN] = { 0 };
+    uint8_t const padding[8] = { 0 };
+    write_le32(rec_header, (uint32_t) name_len);
+    write_le32(rec_header + 4, (uint32_t) blob_len);
+    write_le32(rec_header + 8, flags);
+    if (write_at(ks->file, offset, rec_header, sizeof(rec_header))
+            || fwrite(name, 1, name_len, ks->file) != name_len
+            || (blob_len && fwrite(blob, 1, blob_len, ks->file) != blob_len)
+            || fwrite(padding, 1, len - RECORD_HEADER_LEN - name_len - blob_len, ks->file)
+                != len - RECORD_HEADER_LEN - name_len - blob_len
+            || puflib_sync_file(ks->file)) {
+        goto err;
+    }
+
+    // Then the end of the log, and then the index
+    // A deleted name's record already counts as garbage
+    if (found && !(old.flags & RECORD_DELETED)) {
+        garbage += old.len;
+    }
+    if (flags & RECORD_DELETED) {
+        garbage += len;
+    }
+    uint8_t fields[H_GARBAGE + 8 - H_USED];
+    puflib_store_le64(fields, used + !found);
+    puflib_store_le64(fields + H_LOG_END - H_USED, offset + len);
+    puflib_store_le64(fields + H_GARBAGE - H_USED, garbage);
+    if (write_at(ks->file, H_USED, fields, sizeof(fields)) || puflib_sync_file(ks->file)) {
+        goto err;
+    }
+
+    uint8_t entry[8];
+    puflib_store_le64(entry, offset);
+    if (write_at(ks->file, HEADER_LEN + bucket * 8, entry, sizeof(entry))
+            || puflib_sync_file(ks->file)) {
+        goto err;
+    }
+
+    leave(ks);
+    return false;
+
+err:
+    leave(ks);
+    return true;
+}
+
+
+bool puflib_keystore_put(struct puflib_keystore * ks, module_info const * module,
+        char const * name, uint8_t const * data, size_t data_len)
+{
+    size_t name_len;
+    uint8_t * blob;
+    size_t blob_len;
+
+    if (check_name(name, &name_len)) {
+        return true;
+    }
+    // Seal first, so that the keystore is not held while the module works
+    if (puflib_seal(module, data, data_len, &blob, &blob_len)) {
+        return true;
+    }
+
+    bool rc = append(ks, name, name_len, blob, blob_len, 0);
+    int errno_hold = errno;
+    free(blob);
+    errno = errno_hold;
+    return rc;
+}
+
+
+bool puflib_keystore_get(struct puflib_keystore * ks, char const * name,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    size_t name_len;
+    if (check_name(name, &name_len) || enter(ks, false)) {
+        return true;
+    }
+
+    size_t bucket;
+    bool found;
+    struct record r;
+    uint8_t * blob = NULL;
+    size_t blob_len = 0;
+    if (lookup(ks, name, name_len, &bucket, &found, &r)) {
+        leave(ks);
+        return true;
+    }
+    if (!found || (r.flags & RECORD_DELETED)) {
+        leave(ks);
+        errno = ENOENT;
+        return true;
+    }
+
+    // Copied out, so that the keystore is not held while the module works
+    blob_len = r.blob_len;
+    blob = malloc(blob_len ? blob_len : 1);
+    if (blob) {
+        memcpy(blob, r.blob, blob_len);
+    }
+    leave(ks);
+    if (!blob) {
+        return true;
+    }
+
+    bool rc = puflib_unseal(blob, blob_len, data_out, data_out_len);
+    int errno_hold = errno;
+    free(blob);
+    errno = errno_hold;
+    return rc;
+}
+
+
+bool puflib_keystore_delete(struct puflib_keystore * ks, char const * name)
+{
+    size_t name_len;
+    if (check_name(name, &name_len)) {
+        return true;
+    }
+    return append(ks, name, name_len, NULL, 0, RECORD_DELETED);
+}
+
+
+bool puflib_keystore_list(struct puflib_keystore * ks, char *** names, size_t * n_names)
+{
+    if (enter(ks, false)) {
+        return true;
+    }
+
+    size_t n_buckets = (size_t) header_field(ks, H_BUCKETS);
+    uint8_t const * index = ks->map + HEADER_LEN;
+    size_t count = 0;
+    size_t chars = 0;
+
+    // Two passes: size the single allocation, then fill it in
+    for (int pass = 0; pass < 2; ++pass) {
+        char * strings = pass ? (char *) (*names + count + 1) : NULL;
+        size_t n = 0;
+
+        for (size_t b = 0; b < n_buckets; ++b) {
+            uint64_t offset = puflib_load_le64(index + b * 8);
+            struct record r;
+            if (!offset) {
+                continue;
+            } else if (read_record(ks, offset, &r)) {
+                if (pass) {
+                    free(*names);
+                }
+                leave(ks);
+                return true;
+            } else if (r.flags & RECORD_DELETED) {
+                continue;
+            }
+
+            if (!pass) {
+                ++count;
+                chars += r.name_len + 1;
+            } else {
+                memcpy(strings, r.name, r.name_len);
+                strings[r.name_len] = 0;
+                (*names)[n++] = strings;
+                strings += r.name_len + 1;
+            }
+        }
+
+        if (!pass) {
+            *names = malloc((count + 1) * sizeof(**names) + chars);
+            if (!*names) {
+                leave(ks);
+                return true;
+            }
+        } else {
+            (*names)[n] = NULL;
+        }
+    }
+
+    *n_names = count;
+    leave(ks);
+    return false;
+}
+
+
+bool puflib_keystore_compact(struct puflib_keystore * ks)
+{
+    if (!ks->writable) {
+        errno = EBADF;
+        return true;
+    }
+    if (enter(ks, true)) {
+        return true;
+    }
+    bool rc = compact(ks);
+    leave(ks);
+    return rc;
+}
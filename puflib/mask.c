@@ -0,0 +1,316 @@
+// PUFlib dark-bit masks
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+
+#include <puflib_module.h>
+#include "bitslice.h"
+#include <string.h>
+#include <errno.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# include <immintrin.h>
+# define HAVE_PEXT_DISPATCH
+#endif
+
+/// Maximum encoded length of one run: a 64-bit LEB128 varint
+#define MAX_VARINT_LEN 10
+
+/// Encoded masks start with one of these
+enum mask_format {
+    MASK_RAW = 0,           ///< followed by the mask itself
+    MASK_RUNS = 1,          ///< followed by varint run lengths
+};
+
+
+static bool mask_bit(uint8_t const * buf, size_t bit)
+{
+    return (buf[bit / 8] >> (bit % 8)) & 1;
+}
+
+
+size_t puflib_mask_weight(uint8_t const * mask, size_t len)
+{
+    size_t weight = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        weight += (size_t) __builtin_popcountll(puflib_load_le64(mask + i));
+    }
+    for (; i < len; ++i) {
+        weight += (size_t) __builtin_popcount(mask[i]);
+    }
+    return weight;
+}
+
+
+size_t puflib_mask_truncate(uint8_t * mask, size_t len, size_t n_bits)
+{
+    size_t weight = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        size_t here = (size_t) __builtin_popcount(mask[i]);
+        if (weight + here <= n_bits) {
+            weight += here;
+            continue;
+        }
+
+        // Keep only the lowest (n_bits - weight) set bits of this byte
+        uint8_t byte = mask[i], kept = 0;
+        for (; weight < n_bits; ++weight) {
+            uint8_t lowest = byte & (uint8_t) -byte;
+            kept |= lowest;
+            byte ^= lowest;
+        }
+        mask[i] = kept;
+        memset(mask + i + 1, 0, len - i - 1);
+        break;
+    }
+    return weight;
+}
+
+
+static size_t put_varint(uint8_t * buf, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (uint8_t) value;
+    return n;
+}
+
+
+/**
+ * Read a varint from buf[*pos...], advancing *pos.
+ * @return false on success, true if the varint is truncated or too long
+ */
+static bool get_varint(uint8_t const * buf, size_t len, size_t * pos, uint64_t * value)
+{
+    *value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (*pos >= len) {
+            return true;
+        }
+        uint8_t byte = buf[(*pos)++];
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool puflib_mask_encode(uint8_t const * mask, size_t len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    size_t n_bits = len * 8;
+
+    // Count runs first so the output can be allocated once
+    size_t n_runs = 1;
+    for (size_t bit = 1; bit < n_bits; ++bit) {
+        n_runs += mask_bit(mask, bit) != mask_bit(mask, bit - 1);
+    }
+    if (n_bits && mask_bit(mask, 0)) {
+        // The first run is always of clear bits, possibly empty
+        ++n_runs;
+    }
+
+    // Masks of unstable bits scattered at random have short runs, which
+    // take more space as varints than the mask itself.
+    if (n_runs >= len) {
+        uint8_t * buf = malloc(1 + len);
+        if (!buf) {
+            return true;
+        }
+        buf[0] = MASK_RAW;
+        memcpy(buf + 1, mask, len);
+        *data_out = buf;
+        *data_out_len = 1 + len;
+        return false;
+    }
+
+    uint8_t * buf = malloc(1 + n_runs * MAX_VARINT_LEN);
+    if (!buf) {
+        return true;
+    }
+
+    size_t pos = 0;
+    size_t bit = 0;
+    bool value = false;
+    buf[pos++] = MASK_RUNS;
+    while (bit < n_bits || pos == 1) {
+        size_t start = bit;
+        while (bit < n_bits && mask_bit(mask, bit) == value) {
+            ++bit;
+        }
+        pos += put_varint(buf + pos, bit - start);
+        value = !value;
+    }
+
+    if (pos > 1 + len) {
+        // Runs turned out longer than expected; fall back to raw
+        buf[0] = MASK_RAW;
+        memcpy(buf + 1, mask, len);
+        pos = 1 + len;
+    }
+
+    *data_out = buf;
+    *data_out_len = pos;
+    return false;
+}
+
+
+bool puflib_mask_decode(uint8_t const * data_in, size_t data_in_len,
+        uint8_t * mask, size_t len)
+{
+    size_t n_bits = len * 8;
+    size_t pos = 1;
+    size_t bit = 0;
+    bool value = false;
+
+    memset(mask, 0, len);
+
+    if (data_in_len && data_in[0] == MASK_RAW) {
+        if (data_in_len != 1 + len) {
+            goto err;
+        }
+        memcpy(mask, data_in + 1, len);
+        return false;
+    }
+
+    if (!data_in_len || data_in[0] != MASK_RUNS) {
+        goto err;
+    }
+
+    while (pos < data_in_len) {
+        uint64_t run;
+        if (get_varint(data_in, data_in_len, &pos, &run) || run > n_bits - bit) {
+            goto err;
+        }
+
+        if (value) {
+            for (size_t i = bit; i < bit + run; ++i) {
+                mask[i / 8] |= (uint8_t) (1u << (i % 8));
+            }
+        }
+        bit += run;
+        value = !value;
+    }
+
+    if (bit != n_bits || pos == 1) {
+        goto err;
+    }
+    return false;
+
+err:
+    memset(mask, 0, len);
+    errno = EBADMSG;
+    return true;
+}
+
+
+/**
+ * Portable parallel bit extract: gather the bits of x selected by mask into
+ * the low bits of the result.
+ */
+static inline uint64_t pext_generic(uint64_t x, uint64_t mask)
+{
+    uint64_t result = 0;
+    for (uint64_t out_bit = 1; mask; out_bit <<= 1) {
+        if (x & mask & -mask) {
+            result |= out_bit;
+        }
+        mask &= mask - 1;
+    }
+    return result;
+}
+
+
+/**
+ * Gather loop, parameterised on the bit-extract primitive so that it can be
+ * instantiated once for PEXT and once for the portable fallback.
+ */
+static inline __attribute__((always_inline))
+size_t gather(uint8_t const * in, uint8_t const * mask, size_t len, uint8_t * out,
+        uint64_t (*extract)(uint64_t, uint64_t))
+{
+    uint64_t acc = 0;
+    unsigned acc_bits = 0;
+    size_t n_out = 0;
+
+    for (size_t i = 0; i < len; i += 8) {
+        uint64_t in_word, mask_word;
+        if (len - i >= 8) {
+            in_word = puflib_load_le64(in + i);
+            mask_word = puflib_load_le64(mask + i);
+        } else {
+            uint8_t in_tail[8] = { 0 }, mask_tail[8] = { 0 };
+            memcpy(in_tail, in + i, len - i);
+            memcpy(mask_tail, mask + i, len - i);
+            in_word = puflib_load_le64(in_tail);
+            mask_word = puflib_load_le64(mask_tail);
+        }
+
+        if (!mask_word) {
+            continue;
+        }
+
+        uint64_t bits = extract(in_word, mask_word);
+        unsigned n = (unsigned) __builtin_popcountll(mask_word);
+
+        acc |= bits << acc_bits;
+        if (acc_bits + n >= 64) {
+            puflib_store_le64(out + n_out / 8, acc);
+            n_out += 64;
+            acc = acc_bits ? bits >> (64 - acc_bits) : 0;
+            acc_bits = acc_bits + n - 64;
+        } else {
+            acc_bits += n;
+        }
+    }
+
+    for (unsigned b = 0; b < acc_bits; b += 8) {
+        out[n_out / 8] = (uint8_t) (acc >> b);
+        n_out += acc_bits - b < 8 ? acc_bits - b : 8;
+    }
+    return n_out;
+}
+
+
+static size_t gather_generic(uint8_t const * in, uint8_t const * mask, size_t len,
+        uint8_t * out)
+{
+    return gather(in, mask, len, out, pext_generic);
+}
+
+
+#ifdef HAVE_PEXT_DISPATCH
+__attribute__((target("bmi2")))
+static inline uint64_t pext_bmi2(uint64_t x, uint64_t mask)
+{
+    return _pext_u64(x, mask);
+}
+
+
+__attribute__((target("bmi2")))
+static size_t gather_bmi2(uint8_t const * in, uint8_t const * mask, size_t len,
+        uint8_t * out)
+{
+    return gather(in, mask, len, out, pext_bmi2);
+}
+#endif
+
+
+size_t puflib_mask_gather(uint8_t const * in, uint8_t const * mask, size_t len,
+        uint8_t * out)
+{
+#ifdef HAVE_PEXT_DISPATCH
+    if (__builtin_cpu_supports("bmi2")) {
+        return gather_bmi2(in, mask, len, out);
+    }
+#endif
+    return gather_generic(in, mask, len, out);
+}
@@ -26,7 +26,7 @@ char * puflib_duplicate_string(char const * src)
         return NULL;
     }
 
-    strncpy(dest, src, len);
+    memcpy(dest, src, len);
     dest[len] = 0;
     return dest;
 }
@@ -110,12 +110,13 @@ char * puflib_concat(char const * first, ...)
     }
     tail = head;
 
-    while ((each = va_arg(ap2, char const *))) {
+    each = first;
+    do {
         size_t each_len = strlen(each);
-        strncpy(tail, each, each_len);
+        memcpy(tail, each, each_len);
         len -= each_len;
         tail += each_len;
-    }
+    } while ((each = va_arg(ap2, char const *)));
     va_end(ap2);
 
     *tail = 0;
@@ -5,6 +5,7 @@
 //
 
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE     // MAP_ANONYMOUS, MADV_DONTDUMP
 
 #include <puflib_internal.h>
 #include "misc.h"
@@ -13,10 +14,13 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <ftw.h>
+#include <time.h>
 
 
 char const * puflib_get_path_sep()
@@ -25,6 +29,25 @@ char const * puflib_get_path_sep()
 }
 
 
+/**
+ * Return a path under the root of all NV stores: /var/lib/puflib for root,
+ * or ~/.local/lib/puflib otherwise.
+ */
+static char * nv_root_path(char const * subdir, char const * name)
+{
+    if (getuid() == 0) {
+        return puflib_concat("/var/lib/puflib/", subdir, name, NULL);
+    } else {
+        char const * home = getenv("HOME");
+        if (!home) {
+            errno = ENOENT;
+            return NULL;
+        }
+        return puflib_concat(home, "/.local/lib/puflib/", subdir, name, NULL);
+    }
+}
+
+
 char * puflib_get_nv_store_path(char const * module_name, enum puflib_storage_type type)
 {
     char const * typedir;
@@ -49,16 +72,86 @@ char * puflib_get_nv_store_path(char const * module_name, enum puflib_storage_ty
         return NULL;
     }
 
-    if (getuid() == 0) {
-        return puflib_concat("/var/lib/puflib/", typedir, module_name, NULL);
-    } else {
-        char const * home = getenv("HOME");
-        char const * subdir = "/.local/lib/puflib/";
-        if (!home) {
-            errno = ENOENT;
-            return NULL;
+    return nv_root_path(typedir, module_name);
+}
+
+
+int puflib_lock_stores(bool exclusive)
+{
+    char * path = nv_root_path("", ".lock");
+    if (!path) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0 && !exclusive && (errno == EACCES || errno == EROFS)) {
+        // Readers without write access can still take shared locks
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            // Nor can such a reader change state, so just read it unlocked,
+            // as if the lock did not exist
+            free(path);
+            return PUFLIB_NO_LOCK;
+        }
+    }
+    free(path);
+    if (fd < 0) {
+        // No store has been created yet, so there is no state to protect
+        return errno == ENOENT ? PUFLIB_NO_LOCK : -1;
+    }
+
+    while (flock(fd, exclusive ? LOCK_EX : LOCK_SH)) {
+        if (errno != EINTR) {
+            int errno_hold = errno;
+            close(fd);
+            errno = errno_hold;
+            return -1;
+        }
+    }
+    return fd;
+}
+
+
+void puflib_unlock_stores(int lock)
+{
+    if (lock >= 0) {
+        close(lock);
+    }
+}
+
+
+int puflib_open_lock_file(char const * path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+        // Readers without write access can still take shared locks
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    return fd;
+}
+
+
+bool puflib_lock_file(int lock, bool exclusive)
+{
+    while (flock(lock, exclusive ? LOCK_EX : LOCK_SH)) {
+        if (errno != EINTR) {
+            return true;
         }
-        return puflib_concat(home, subdir, typedir, module_name, NULL);
+    }
+    return false;
+}
+
+
+void puflib_unlock_file(int lock)
+{
+    flock(lock, LOCK_UN);
+}
+
+
+void puflib_close_lock_file(int lock)
+{
+    if (lock >= 0) {
+        close(lock);
     }
 }
 
@@ -125,6 +218,72 @@ FILE * puflib_open_existing(char const * path, char const * mode)
 }
 
 
+bool puflib_sync_file(FILE * f)
+{
+    return fflush(f) || fsync(fileno(f));
+}
+
+
+bool puflib_replace_file(char const * from, char const * path)
+{
+    if (rename(from, path)) {
+        return true;
+    }
+
+    // Make the rename itself durable by syncing the directory holding it
+    char * dir = puflib_duplicate_string(path);
+    if (!dir) {
+        return true;
+    }
+    char * sep = strrchr(dir, '/');
+    if (sep == dir) {
+        sep[1] = 0;
+    } else if (sep) {
+        *sep = 0;
+    } else {
+        strcpy(dir, ".");
+    }
+
+    int fd = open(dir, O_RDONLY | O_CLOEXEC);
+    free(dir);
+    if (fd < 0) {
+        return true;
+    }
+    bool rc = fsync(fd) != 0;
+    int errno_hold = errno;
+    close(fd);
+    errno = errno_hold;
+    return rc;
+}
+
+
+bool puflib_random_bytes(void * buf, size_t len)
+{
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return true;
+    }
+
+    uint8_t * bytes = buf;
+    while (len) {
+        ssize_t n = read(fd, bytes, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            int errno_hold = n < 0 ? errno : EIO;
+            close(fd);
+            errno = errno_hold;
+            return true;
+        }
+        bytes += n;
+        len -= (size_t) n;
+    }
+
+    close(fd);
+    return false;
+}
+
+
 bool puflib_mkdir(char const * path)
 {
     return mkdir(path, 0700) != 0;
@@ -174,3 +333,108 @@ bool puflib_delete_tree(char const * path)
         return false;
     }
 }
+
+
+void * puflib_map_file(char const * path, bool writable, size_t * len)
+{
+    int fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat sbuf;
+    if (fstat(fd, &sbuf)) {
+        goto err;
+    }
+    if (sbuf.st_size <= 0) {
+        errno = EINVAL;
+        goto err;
+    }
+
+    void * addr = mmap(NULL, (size_t) sbuf.st_size,
+            PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        goto err;
+    }
+
+    // The mapping holds its own reference to the file
+    close(fd);
+    *len = (size_t) sbuf.st_size;
+    return addr;
+
+err:
+    {
+        int errno_hold = errno;
+        close(fd);
+        errno = errno_hold;
+        return NULL;
+    }
+}
+
+
+bool puflib_unmap_file(void * addr, size_t len)
+{
+    return munmap(addr, len) != 0;
+}
+
+
+bool puflib_sync_mapping(void * addr, size_t len)
+{
+    return msync(addr, len, MS_SYNC) != 0;
+}
+
+
+void * puflib_secure_alloc(size_t len)
+{
+    void * addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (mlock(addr, len)) {
+        int errno_hold = errno;
+        munmap(addr, len);
+        errno = errno_hold;
+        return NULL;
+    }
+
+#ifdef MADV_DONTDUMP
+    madvise(addr, len, MADV_DONTDUMP);
+#endif
+    return addr;
+}
+
+
+void puflib_secure_free(void * addr, size_t len)
+{
+    if (!addr) {
+        return;
+    }
+
+    puflib_secure_zero(addr, len);
+    munlock(addr, len);
+    munmap(addr, len);
+}
+
+
+uint64_t puflib_monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+
+uint64_t puflib_monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+
+unsigned puflib_cpu_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned) n : 1;
+}
@@ -7,6 +7,12 @@
 #include <puflib.h>
 #include <puflib_internal.h>
 #include "misc.h"
+#include "keycache.h"
+#include "respcache.h"
+#include "dispatch.h"
+#include "deadline.h"
+#include "redundant.h"
+#include "instance.h"
 
 #include <string.h>
 #include <errno.h>
@@ -14,8 +20,10 @@
 #include <stddef.h>
 
 extern module_info const * const PUFLIB_MODULES[];
-static puflib_status_handler_p volatile STATUS_CALLBACK = NULL;
-static puflib_query_handler_p volatile QUERY_CALLBACK = NULL;
+// Handlers may be replaced while other threads report or query, so they are
+// always accessed atomically, and read once per use.
+static puflib_status_handler_p STATUS_CALLBACK = NULL;
+static puflib_query_handler_p QUERY_CALLBACK = NULL;
 
 static bool storage_type_is_dir(enum puflib_storage_type type)
 {
@@ -24,6 +32,18 @@ static bool storage_type_is_dir(enum puflib_storage_type type)
         || type == STORAGE_DISABLED_DIR;
 }
 
+/**
+ * Return the path of an NV store of the calling thread's instance of a
+ * module.
+ */
+static char * store_path(module_info const * module, enum puflib_storage_type type)
+{
+    char buf[PUFLIB_INSTANCE_NAME_LEN];
+    char const * name = puflib_instance_name(module, buf);
+    return name ? puflib_get_nv_store_path(name, type) : NULL;
+}
+
+
 module_info const * const * puflib_get_modules()
 {
     return PUFLIB_MODULES;
@@ -58,9 +78,21 @@ enum module_status puflib_module_status(module_info const * module)
 
     enum module_status status = 0;
 
+    char buf[PUFLIB_INSTANCE_NAME_LEN];
+    char const * name = puflib_instance_name(module, buf);
+    if (!name) {
+        return MODULE_STATUS_ERROR;
+    }
+
+    // Enabling and disabling move a store between two of these paths
+    int lock = puflib_lock_stores(false);
+    if (lock == -1) {
+        goto err;
+    }
+
     for (size_t i = 0; i < sizeof(paths)/sizeof(paths[0]); ++i) {
 
-        char * path = puflib_get_nv_store_path(module->name, paths[i].stype);
+        char * path = puflib_get_nv_store_path(name, paths[i].stype);
         if (!path) {
             goto err;
         }
@@ -74,33 +106,102 @@ enum module_status puflib_module_status(module_info const * module)
         free(path);
     }
 
+    puflib_unlock_stores(lock);
     return status;
 
 err:
-    return MODULE_STATUS_ERROR;
+    {
+        int errno_hold = errno;
+        puflib_unlock_stores(lock);
+        errno = errno_hold;
+        return MODULE_STATUS_ERROR;
+    }
 }
 
 
-bool puflib_seal(module_info const * module,
+/**
+ * Open module session: the module's state, if it supports sessions.
+ */
+struct puflib_session {
+    module_info const * module;
+    unsigned instance;          ///< chosen when the session was opened
+    void * state;               ///< from module->session_open(), or NULL
+};
+
+
+static bool run_seal(module_info const * module, void * state,
+        void const * in, size_t in_len, void ** out, size_t * out_len)
+{
+    uint8_t * buf;
+    bool rc;
+
+    if (state && module->session_seal) {
+        rc = module->session_seal(state, in, in_len, &buf, out_len);
+    } else {
+        rc = module->seal(in, in_len, &buf, out_len);
+    }
+    if (!rc) {
+        *out = buf;
+    }
+    return rc;
+}
+
+
+static bool run_unseal(module_info const * module, void * state,
+        void const * in, size_t in_len, void ** out, size_t * out_len)
+{
+    uint8_t * buf;
+    bool rc;
+
+    if (state && module->session_unseal) {
+        rc = module->session_unseal(state, in, in_len, &buf, out_len);
+    } else {
+        rc = module->unseal(in, in_len, &buf, out_len);
+    }
+    if (!rc) {
+        *out = buf;
+    }
+    return rc;
+}
+
+
+static bool seal_with(module_info const * module, void * state, unsigned instance,
         uint8_t const * data_in, size_t data_in_len,
         uint8_t ** data_out, size_t * data_out_len)
 {
+    char name_buf[PUFLIB_INSTANCE_NAME_LEN];
     char * header = NULL;
     uint8_t * rawbuffer = NULL;
     uint8_t * header_buffer = NULL;
     size_t rawbuflen;
 
-    if (!module) {
+    if (!module->get_root_key && !module->seal) {
+        errno = ENOTSUP;
         return true;
     }
 
-    header = puflib_concat(PUFLIB_HEADER, module->name, "\n", NULL);
+    // The header names the instance, which alone can unseal the blob
+    unsigned saved = puflib_select_instance(instance);
+
+    char const * name = puflib_instance_name(module, name_buf);
+    header = name ? puflib_concat(PUFLIB_HEADER, name, "\n", NULL) : NULL;
     if (!header) {
         goto err;
     }
 
-    if (module->seal(data_in, data_in_len, &rawbuffer, &rawbuflen)) {
-        goto err;
+    // Modules with a root key only queue to read it, and the crypto runs
+    // here. Sealing is randomised, so identical requests are never merged.
+    if (module->get_root_key) {
+        if (puflib_root_seal(module, state, data_in, data_in_len, &rawbuffer, &rawbuflen)) {
+            goto err;
+        }
+    } else {
+        void * sealed;
+        if (puflib_dispatch(module, state, DISPATCH_SEAL, false, run_seal,
+                    data_in, data_in_len, &sealed, &rawbuflen)) {
+            goto err;
+        }
+        rawbuffer = sealed;
     }
 
     size_t header_len = strlen(header);
@@ -115,22 +216,48 @@ bool puflib_seal(module_info const * module,
     memcpy(header_buffer + header_len, rawbuffer, rawbuflen);
     free(header);
     free(rawbuffer);
+    puflib_select_instance(saved);
 
     *data_out = header_buffer;
     *data_out_len = header_buflen;
 
     return false;
 err:
-    free(header);
-    free(rawbuffer);
-    free(header_buffer);
-    return true;
+    {
+        int errno_hold = errno;
+        free(header);
+        free(rawbuffer);
+        free(header_buffer);
+        puflib_select_instance(saved);
+        errno = errno_hold;
+        return true;
+    }
 }
 
 
-bool puflib_unseal(
+bool puflib_seal(module_info const * module,
         uint8_t const * data_in, size_t data_in_len,
         uint8_t ** data_out, size_t * data_out_len)
+{
+    unsigned instance;
+
+    if (!module) {
+        return true;
+    }
+    if (puflib_instance_choose(module, NULL, 0, &instance)) {
+        return true;
+    }
+    return seal_with(module, NULL, instance, data_in, data_in_len, data_out, data_out_len);
+}
+
+
+/**
+ * Parse the header of a sealed blob, returning the module that sealed it,
+ * the instance, and the module's part of the blob.
+ * @return module, or NULL on error
+ */
+static module_info const * parse_header(uint8_t const * data_in, size_t data_in_len,
+        unsigned * instance, uint8_t const ** data_raw, size_t * data_raw_len)
 {
     char * module_name = NULL;
 
@@ -170,6 +297,23 @@ bool puflib_unseal(
     memcpy(module_name, module_name_start, module_name_end - module_name_start);
     module_name[module_name_end - module_name_start] = 0;
 
+    // "name@N" for any instance but the first
+    size_t header_len = strlen(PUFLIB_HEADER) + strlen(module_name);
+    *instance = 0;
+    char * sep = strchr(module_name, PUFLIB_INSTANCE_SEP);
+    if (sep) {
+        char * end;
+        unsigned long n = strtoul(sep + 1, &end, 10);
+        if (sep[1] < '0' || sep[1] > '9' || *end || !n || n >= PUFLIB_MAX_INSTANCES) {
+            puflib_report_fmt(NULL, STATUS_ERROR,
+                    "malformed header: bad instance: %s", module_name);
+            errno = EBADMSG;
+            goto err;
+        }
+        *sep = 0;
+        *instance = (unsigned) n;
+    }
+
     module_info const * module = puflib_get_module(module_name);
     if (!module) {
         puflib_report_fmt(NULL, STATUS_ERROR,
@@ -178,28 +322,331 @@ bool puflib_unseal(
         goto err;
     }
 
-    size_t header_len = strlen(PUFLIB_HEADER) + strlen(module_name);
-    uint8_t const * data_raw = data_in + header_len + 1;
-    size_t data_raw_len = data_in_len - header_len - 1;
-    free(module_name);
+    if (!module->get_root_key && !module->unseal) {
+        puflib_report_fmt(module, STATUS_ERROR, "module does not support unsealing");
+        errno = ENOTSUP;
+        goto err;
+    }
 
-    return module->unseal(data_raw, data_raw_len, data_out, data_out_len);
+    *data_raw = data_in + header_len + 1;
+    *data_raw_len = data_in_len - header_len - 1;
+    free(module_name);
+    return module;
 
 err:
     free(module_name);
-    return true;
+    return NULL;
 }
 
 
-bool puflib_chal_resp(module_info const * module,
+static bool unseal_with(module_info const * module, void * state, unsigned instance,
+        uint8_t const * data_raw, size_t data_raw_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    void * unsealed = NULL;
+    unsigned saved = puflib_select_instance(instance);
+    bool rc;
+    if (module->get_root_key) {
+        // As for sealing, only the root key read is queued
+        uint8_t * buf;
+        rc = puflib_root_unseal(module, state, data_raw, data_raw_len, &buf, data_out_len);
+        if (!rc) {
+            unsealed = buf;
+        }
+    } else {
+        rc = puflib_dispatch(module, state, DISPATCH_UNSEAL, true, run_unseal,
+                data_raw, data_raw_len, &unsealed, data_out_len);
+    }
+    puflib_select_instance(saved);
+    if (rc) {
+        return true;
+    }
+    *data_out = unsealed;
+    return false;
+}
+
+
+bool puflib_unseal(
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t const * data_raw;
+    size_t data_raw_len;
+    unsigned instance;
+
+    size_t const redundant_len = strlen(PUFLIB_HEADER PUFLIB_REDUNDANT_NAME "\n");
+    if (data_in_len >= redundant_len
+            && !memcmp(data_in, PUFLIB_HEADER PUFLIB_REDUNDANT_NAME "\n", redundant_len)) {
+        return puflib_redundant_unseal(data_in + redundant_len, data_in_len - redundant_len,
+                data_out, data_out_len);
+    }
+
+    module_info const * module = parse_header(data_in, data_in_len, &instance,
+            &data_raw, &data_raw_len);
+    if (!module) {
+        return true;
+    }
+    if (instance >= puflib_instance_count(module)) {
+        puflib_report_fmt(module, STATUS_ERROR,
+                "cannot unseal blob; instance %u is not present", instance);
+        errno = ENODEV;
+        return true;
+    }
+    return unseal_with(module, NULL, instance, data_raw, data_raw_len, data_out, data_out_len);
+}
+
+
+static bool chal_resp_with(module_info const * module, void * state, unsigned instance,
         void const * data_in, size_t data_in_len,
         void ** data_out, size_t * data_out_len)
 {
-    if (module && module->chal_resp) {
-        return module->chal_resp(data_in, data_in_len, data_out, data_out_len);
+    if (!module->chal_resp) {
+        return true;
+    }
+
+    unsigned saved = puflib_select_instance(instance);
+    bool rc;
+    if (module->chal_resp_deterministic && puflib_resp_cache_enabled(module)) {
+        rc = puflib_resp_cache_chal_resp(module, state, data_in, data_in_len,
+                data_out, data_out_len);
     } else {
+        rc = puflib_dispatch_chal_resp(module, state, data_in, data_in_len,
+                data_out, data_out_len);
+    }
+    puflib_select_instance(saved);
+    return rc;
+}
+
+
+bool puflib_chal_resp(module_info const * module,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len)
+{
+    unsigned instance = 0;
+
+    if (!module) {
         return true;
     }
+    // Responses differ between devices, so a challenge always goes to the
+    // same instance
+    if (module->chal_resp && puflib_instance_choose(module, data_in, data_in_len, &instance)) {
+        return true;
+    }
+    return chal_resp_with(module, NULL, instance, data_in, data_in_len, data_out, data_out_len);
+}
+
+
+bool puflib_seal_deadline(module_info const * module,
+        struct puflib_deadline const * deadline,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    struct op_context saved;
+    bool rc = puflib_op_enter(deadline, &saved)
+        || puflib_seal(module, data_in, data_in_len, data_out, data_out_len);
+    puflib_op_leave(&saved);
+    return rc;
+}
+
+
+bool puflib_unseal_deadline(struct puflib_deadline const * deadline,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    struct op_context saved;
+    bool rc = puflib_op_enter(deadline, &saved)
+        || puflib_unseal(data_in, data_in_len, data_out, data_out_len);
+    puflib_op_leave(&saved);
+    return rc;
+}
+
+
+bool puflib_chal_resp_deadline(module_info const * module,
+        struct puflib_deadline const * deadline,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len)
+{
+    struct op_context saved;
+    bool rc = puflib_op_enter(deadline, &saved)
+        || puflib_chal_resp(module, data_in, data_in_len, data_out, data_out_len);
+    puflib_op_leave(&saved);
+    return rc;
+}
+
+
+enum provisioning_status puflib_provision_deadline(module_info const * module,
+        struct puflib_deadline const * deadline)
+{
+    struct op_context saved;
+    enum provisioning_status status = PROVISION_ERROR;
+    if (!puflib_op_enter(deadline, &saved)) {
+        status = module->provision();
+    }
+    puflib_op_leave(&saved);
+    return status;
+}
+
+
+struct puflib_session * puflib_session_open(module_info const * module)
+{
+    if (!module) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct puflib_session * session = calloc(1, sizeof(*session));
+    if (!session) {
+        return NULL;
+    }
+    session->module = module;
+
+    if (puflib_instance_choose(module, NULL, 0, &session->instance)) {
+        goto err;
+    }
+
+    if (module->session_open) {
+        unsigned saved = puflib_select_instance(session->instance);
+        session->state = module->session_open();
+        puflib_select_instance(saved);
+        if (!session->state) {
+            goto err;
+        }
+    }
+    return session;
+
+err:
+    {
+        int errno_hold = errno;
+        free(session);
+        errno = errno_hold;
+        return NULL;
+    }
+}
+
+
+void puflib_session_close(struct puflib_session * session)
+{
+    if (!session) {
+        return;
+    }
+    if (session->state) {
+        unsigned saved = puflib_select_instance(session->instance);
+        session->module->session_close(session->state);
+        puflib_select_instance(saved);
+    }
+    free(session);
+}
+
+
+module_info const * puflib_session_module(struct puflib_session const * session)
+{
+    return session->module;
+}
+
+
+bool puflib_session_seal(struct puflib_session * session,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    return seal_with(session->module, session->state, session->instance,
+            data_in, data_in_len, data_out, data_out_len);
+}
+
+
+bool puflib_session_unseal(struct puflib_session * session,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t const * data_raw;
+    size_t data_raw_len;
+    unsigned instance;
+
+    module_info const * module = parse_header(data_in, data_in_len, &instance,
+            &data_raw, &data_raw_len);
+    if (!module) {
+        return true;
+    }
+    if (module != session->module) {
+        puflib_report_fmt(session->module, STATUS_ERROR,
+                "cannot unseal blob; it was sealed by module %s", module->name);
+        errno = EINVAL;
+        return true;
+    }
+    if (instance != session->instance) {
+        puflib_report_fmt(session->module, STATUS_ERROR,
+                "cannot unseal blob; it was sealed by instance %u, not %u",
+                instance, session->instance);
+        errno = EINVAL;
+        return true;
+    }
+    return unseal_with(module, session->state, instance, data_raw, data_raw_len,
+            data_out, data_out_len);
+}
+
+
+bool puflib_session_chal_resp(struct puflib_session * session,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len)
+{
+    return chal_resp_with(session->module, session->state, session->instance,
+            data_in, data_in_len, data_out, data_out_len);
+}
+
+
+bool puflib_reseal(struct puflib_session * from, struct puflib_session * to,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t * plain = NULL;
+    size_t plain_len = 0;
+    bool rc;
+
+    if (!to) {
+        errno = EINVAL;
+        return true;
+    }
+
+    if (from) {
+        uint8_t const * data_raw;
+        size_t data_raw_len;
+        unsigned instance;
+
+        module_info const * module = parse_header(data_in, data_in_len, &instance,
+                &data_raw, &data_raw_len);
+        if (!module) {
+            return true;
+        }
+        if (module != from->module) {
+            puflib_report_fmt(from->module, STATUS_ERROR,
+                    "cannot reseal blob; it was sealed by module %s", module->name);
+            errno = EINVAL;
+            return true;
+        }
+        if (instance >= puflib_instance_count(module)) {
+            puflib_report_fmt(module, STATUS_ERROR,
+                    "cannot reseal blob; instance %u is not present", instance);
+            errno = ENODEV;
+            return true;
+        }
+
+        // The session only holds the setup of the instance it was opened on
+        void * state = (instance == from->instance) ? from->state : NULL;
+        rc = unseal_with(module, state, instance, data_raw, data_raw_len, &plain, &plain_len);
+    } else {
+        rc = puflib_unseal(data_in, data_in_len, &plain, &plain_len);
+    }
+
+    if (!rc) {
+        rc = puflib_session_seal(to, plain, plain_len, data_out, data_out_len);
+    }
+
+    if (plain) {
+        int errno_hold = errno;
+        puflib_secure_zero(plain, plain_len);
+        free(plain);
+        errno = errno_hold;
+    }
+    return rc;
 }
 
 
@@ -217,30 +664,40 @@ bool puflib_deprovision(module_info const * module)
         { STORAGE_TEMP_DIR, true },
     };
 
-    for (size_t i = 0; i < sizeof(paths)/sizeof(paths[0]); ++i) {
-        char * path = puflib_get_nv_store_path(module->name, paths[i].stype);
+    int lock = puflib_lock_stores(true);
+    if (lock == -1) {
+        return true;
+    }
+
+    bool rc = false;
+    for (size_t i = 0; i < sizeof(paths)/sizeof(paths[0]) && !rc; ++i) {
+        char * path = store_path(module, paths[i].stype);
         if (!path) {
-            return true;
+            rc = true;
+            break;
         }
 
         if (!puflib_check_access(path, paths[i].is_dir)) {
-            if (paths[i].is_dir ? puflib_delete_tree(path) : remove(path)) {
-                goto err;
-            }
+            rc = paths[i].is_dir ? puflib_delete_tree(path) : remove(path) != 0;
         }
 
+        int errno_hold = errno;
         free(path);
-        continue;
-err:
-        free(path);
-        return true;
+        errno = errno_hold;
     }
 
-    return false;
+    int errno_hold = errno;
+    // Only now that the stores are gone, so that a key or response read
+    // concurrently from the old stores cannot be cached again after this
+    puflib_key_cache_flush(module);
+    puflib_resp_cache_flush(module);
+    puflib_unlock_stores(lock);
+    errno = errno_hold;
+    return rc;
 }
 
 
-static bool puflib_en_dis(module_info const * module, bool enable)
+static bool en_dis_locked(module_info const * module, bool enable)
 {
     static const struct {
         enum puflib_storage_type stype_en;
@@ -255,8 +712,8 @@ static bool puflib_en_dis(module_info const * module, bool enable)
 
         char * en_path = NULL, * dis_path = NULL;
 
-        en_path  = puflib_get_nv_store_path(module->name, paths[i].stype_en);
-        dis_path = puflib_get_nv_store_path(module->name, paths[i].stype_dis);
+        en_path  = store_path(module, paths[i].stype_en);
+        dis_path = store_path(module, paths[i].stype_dis);
 
         if (!en_path)  goto err;
         if (!dis_path) goto err;
@@ -292,6 +749,10 @@ static bool puflib_en_dis(module_info const * module, bool enable)
             }
         }
 
+        free(en_path);
+        free(dis_path);
+        continue;
+
 err:
         if (en_path)  free(en_path);
         if (dis_path) free(dis_path);
@@ -302,6 +763,25 @@ err:
 }
 
 
+static bool puflib_en_dis(module_info const * module, bool enable)
+{
+    int lock = puflib_lock_stores(true);
+    if (lock == -1) {
+        return true;
+    }
+
+    bool rc = en_dis_locked(module, enable);
+
+    int errno_hold = errno;
+    // After the stores have moved; see puflib_deprovision()
+    puflib_key_cache_flush(module);
+    puflib_resp_cache_flush(module);
+    puflib_unlock_stores(lock);
+    errno = errno_hold;
+    return rc;
+}
+
+
 bool puflib_enable(module_info const * module)
 {
     return puflib_en_dis(module, true);
@@ -316,19 +796,19 @@ bool puflib_disable(module_info const * module)
 
 void puflib_set_status_handler(puflib_status_handler_p callback)
 {
-    STATUS_CALLBACK = callback;
+    __atomic_store_n(&STATUS_CALLBACK, callback, __ATOMIC_RELEASE);
 }
 
 
 void puflib_set_query_handler(puflib_query_handler_p callback)
 {
-    QUERY_CALLBACK = callback;
+    __atomic_store_n(&QUERY_CALLBACK, callback, __ATOMIC_RELEASE);
 }
 
 
 char * puflib_create_nv_store(module_info const * module, enum puflib_storage_type type)
 {
-    char * path = puflib_get_nv_store_path(module->name, type);
+    char * path = store_path(module, type);
     if (!path) {
         return NULL;
     }
@@ -363,7 +843,7 @@ err:
 
 char * puflib_get_nv_store(module_info const * module, enum puflib_storage_type type)
 {
-    char * path = puflib_get_nv_store_path(module->name, type);
+    char * path = store_path(module, type);
     if (!path) {
         return NULL;
     }
@@ -380,7 +860,7 @@ char * puflib_get_nv_store(module_info const * module, enum puflib_storage_type
 
 bool puflib_delete_nv_store(module_info const * module, enum puflib_storage_type type)
 {
-    char * path = puflib_get_nv_store_path(module->name, type);
+    char * path = store_path(module, type);
     if (!path) {
         return true;
     }
@@ -408,6 +888,11 @@ bool puflib_delete_nv_store(module_info const * module, enum puflib_storage_type
 void puflib_report(module_info const * module, enum puflib_status_level level,
         char const * message)
 {
+    puflib_status_handler_p callback = __atomic_load_n(&STATUS_CALLBACK, __ATOMIC_ACQUIRE);
+    if (!callback) {
+        return;
+    }
+
     char const * level_as_string;
     switch (level) {
     case STATUS_DEBUG:
@@ -436,10 +921,10 @@ void puflib_report(module_info const * module, enum puflib_status_level level,
 
     if (puflib_asprintf(&formatted, "%s (%s): %s", level_as_string, name, message) < 0) {
         if (formatted) free(formatted);
-        STATUS_CALLBACK(NULL, STATUS_ERROR,
+        callback(NULL, STATUS_ERROR,
                 "error (puflib): internal error formatting message");
     } else {
-        STATUS_CALLBACK(module, level, formatted);
+        callback(module, level, formatted);
         free(formatted);
     }
 }
@@ -454,8 +939,10 @@ void puflib_report_fmt(module_info const * module, enum puflib_status_level leve
     char *formatted = NULL;
     if (puflib_vasprintf(&formatted, fmt, ap) < 0) {
         if (formatted) free(formatted);
-        STATUS_CALLBACK(NULL, STATUS_ERROR,
-                "error (puflib): internal error formatting message");
+        puflib_status_handler_p callback = __atomic_load_n(&STATUS_CALLBACK, __ATOMIC_ACQUIRE);
+        if (callback) {
+            callback(NULL, STATUS_ERROR, "error (puflib): internal error formatting message");
+        }
     } else {
         puflib_report(module, level, formatted);
         free(formatted);
@@ -472,8 +959,9 @@ void puflib_perror(module_info const * module)
 bool puflib_query(module_info const * module, char const * key, char const * prompt,
         char * buffer, size_t buflen)
 {
-    if (QUERY_CALLBACK) {
-        return QUERY_CALLBACK(module, key, prompt, buffer, buflen);
+    puflib_query_handler_p callback = __atomic_load_n(&QUERY_CALLBACK, __ATOMIC_ACQUIRE);
+    if (callback) {
+        return callback(module, key, prompt, buffer, buflen);
     } else {
         errno = 0;
         return true;
@@ -0,0 +1,605 @@
+// PUFlib redundant sealing across modules
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// A redundant blob seals the data once under a random data key, and seals
+// that key separately under each of several modules, so that any one of them
+// can unseal it. Format, after a puflib header naming PUFLIB_REDUNDANT_NAME:
+//
+//   n[4] || n * (len[4] || puflib_seal(module, data key)) ||
+//   puflib_key_seal(data key, data)
+//
+// with lengths little-endian. Unsealing races the modules: it starts with the
+// one expected to be fastest, from a running estimate of each module's unseal
+// latency, and starts the next one whenever the last has taken longer than
+// expected. The first to recover a data key that decrypts the payload wins
+// and the rest are cancelled, so one slow or failing module only costs its
+// hedge delay. The caller does not wait for the cancelled attempts, which
+// would cost it the remaining time of a module call that cannot be
+// interrupted; they run on detached threads until their module returns.
+//
+
+#define _XOPEN_SOURCE 700
+
+#include <puflib.h>
+#include <puflib_module.h>
+#include <puflib_internal.h>
+#include "redundant.h"
+#include "deadline.h"
+#include "instance.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DATA_KEY_LEN PUFLIB_SHA256_LEN
+#define MAX_RECIPIENTS 16
+#define HEDGE_DEFAULT_MS 20     ///< hedge delay for a module with no history
+#define HEDGE_MIN_MS 1
+#define HEDGE_MAX_MS 2000
+#define FAILURE_PENALTY_MS 100  ///< added to the latency of a failed unseal
+
+/**
+ * Running estimate of a module's unseal latency: a moving average and mean
+ * deviation, as TCP estimates round-trip time.
+ */
+struct latency {
+    module_info const * module;
+    double mean_ms;
+    double dev_ms;
+    struct latency * next;
+};
+
+// Estimates are created on a module's first unseal and never freed
+static struct latency * LATENCIES = NULL;
+static pthread_mutex_t LATENCY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long HEDGE_DELAY_MS = 0;    ///< fixed hedge delay, or 0 for automatic
+
+struct recipient {
+    module_info const * module;
+    uint8_t const * blob;       ///< the data key, sealed by module
+    size_t blob_len;
+    double expected_ms;         ///< expected unseal latency
+    unsigned long hedge_ms;     ///< time to wait before starting the next module
+};
+
+/**
+ * One redundant unseal. Shared by the caller and its attempts, which may
+ * outlive it, and freed by whichever lets go of it last.
+ */
+struct race {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;             ///< signalled when an attempt finishes
+    unsigned refs;
+    unsigned running;                   ///< attempts not yet finished
+    bool won;
+    uint8_t * out;                      ///< the winner's plaintext, until taken
+    size_t out_len;
+    int error;                          ///< errno of a failed attempt
+    struct puflib_cancel * cancel;      ///< cancels the attempts
+    struct puflib_deadline deadline;    ///< limits on each attempt
+    uint8_t * payload;                  ///< copy, since the caller may return first
+    size_t payload_len;
+};
+
+struct attempt {
+    struct race * race;
+    module_info const * module;
+    uint8_t * blob;             ///< copy, since the caller may return first
+    size_t blob_len;
+};
+
+
+static uint32_t load_u32le(uint8_t const * buf)
+{
+    return (uint32_t) buf[0] | (uint32_t) buf[1] << 8
+        | (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+
+static void store_u32le(uint8_t * buf, uint32_t value)
+{
+    for (size_t i = 0; i < 4; ++i) {
+        buf[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+
+/******************************************************************************
+ * Latency estimates                                                          *
+ *****************************************************************************/
+
+void puflib_set_hedge_delay(unsigned long delay_ms)
+{
+    __atomic_store_n(&HEDGE_DELAY_MS, delay_ms, __ATOMIC_RELAXED);
+}
+
+
+/// Caller holds LATENCY_LOCK
+static struct latency * find_latency(module_info const * module)
+{
+    struct latency * latency = LATENCIES;
+    while (latency && latency->module != module) {
+        latency = latency->next;
+    }
+    return latency;
+}
+
+
+static void record_latency(module_info const * module, double sample_ms)
+{
+    pthread_mutex_lock(&LATENCY_LOCK);
+    struct latency * latency = find_latency(module);
+    if (latency) {
+        double err = sample_ms - latency->mean_ms;
+        latency->mean_ms += err / 8;
+        latency->dev_ms += ((err < 0 ? -err : err) - latency->dev_ms) / 4;
+    } else {
+        latency = calloc(1, sizeof(*latency));
+        if (latency) {
+            latency->module = module;
+            latency->mean_ms = sample_ms;
+            latency->dev_ms = sample_ms / 2;
+            latency->next = LATENCIES;
+            LATENCIES = latency;
+        }
+    }
+    pthread_mutex_unlock(&LATENCY_LOCK);
+}
+
+
+static void expect_latency(struct recipient * recipient)
+{
+    double expected_ms = HEDGE_DEFAULT_MS;
+    double hedge_ms = HEDGE_DEFAULT_MS;
+
+    pthread_mutex_lock(&LATENCY_LOCK);
+    struct latency const * latency = find_latency(recipient->module);
+    if (latency) {
+        expected_ms = latency->mean_ms;
+        hedge_ms = latency->mean_ms + 4 * latency->dev_ms;
+    }
+    pthread_mutex_unlock(&LATENCY_LOCK);
+
+    unsigned long fixed_ms = __atomic_load_n(&HEDGE_DELAY_MS, __ATOMIC_RELAXED);
+    recipient->expected_ms = expected_ms;
+    recipient->hedge_ms = fixed_ms ? fixed_ms
+        : hedge_ms < HEDGE_MIN_MS ? HEDGE_MIN_MS
+        : hedge_ms > HEDGE_MAX_MS ? HEDGE_MAX_MS
+        : (unsigned long) hedge_ms;
+}
+
+
+/******************************************************************************
+ * Sealing                                                                    *
+ *****************************************************************************/
+
+struct seal_job {
+    module_info const * module;
+    struct puflib_deadline deadline;
+    uint8_t const * key;
+    uint8_t * out;
+    size_t out_len;
+    bool failed;
+    int error;
+};
+
+
+static void * seal_thread(void * arg)
+{
+    struct seal_job * job = arg;
+    job->failed = puflib_seal_deadline(job->module, &job->deadline,
+            job->key, DATA_KEY_LEN, &job->out, &job->out_len);
+    job->error = errno;
+    return NULL;
+}
+
+
+bool puflib_seal_redundant(module_info const * const * modules, size_t n_modules,
+        uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    uint8_t key[DATA_KEY_LEN];
+    struct seal_job jobs[MAX_RECIPIENTS];
+    pthread_t threads[MAX_RECIPIENTS];
+    bool started[MAX_RECIPIENTS];
+    uint8_t * payload = NULL;
+    size_t payload_len = 0;
+    bool rc = true;
+
+    if (!n_modules || n_modules > MAX_RECIPIENTS) {
+        errno = EINVAL;
+        return true;
+    }
+    for (size_t i = 0; i < n_modules; ++i) {
+        if (!modules[i]) {
+            errno = EINVAL;
+            return true;
+        }
+    }
+
+    if (puflib_random_bytes(key, sizeof(key))) {
+        return true;
+    }
+
+    // Each module seals the key on its own thread, under the caller's limits;
+    // the first uses this one
+    struct puflib_deadline deadline;
+    puflib_op_current(&deadline);
+    memset(jobs, 0, sizeof(jobs));
+    for (size_t i = 0; i < n_modules; ++i) {
+        jobs[i].module = modules[i];
+        jobs[i].deadline = deadline;
+        jobs[i].key = key;
+        started[i] = i && !pthread_create(&threads[i], NULL, seal_thread, &jobs[i]);
+    }
+    for (size_t i = 0; i < n_modules; ++i) {
+        if (!started[i]) {
+            seal_thread(&jobs[i]);
+        }
+    }
+    for (size_t i = 0; i < n_modules; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    size_t blob_len = strlen(PUFLIB_HEADER PUFLIB_REDUNDANT_NAME "\n") + 4;
+    for (size_t i = 0; i < n_modules; ++i) {
+        if (jobs[i].failed) {
+            errno = jobs[i].error;
+            goto out;
+        }
+        blob_len += 4 + jobs[i].out_len;
+    }
+
+    if (puflib_key_seal(key, data_in, data_in_len, &payload, &payload_len)) {
+        goto out;
+    }
+    blob_len += payload_len;
+
+    uint8_t * blob = malloc(blob_len);
+    if (!blob) {
+        goto out;
+    }
+
+    uint8_t * pos = blob;
+    memcpy(pos, PUFLIB_HEADER PUFLIB_REDUNDANT_NAME "\n",
+            strlen(PUFLIB_HEADER PUFLIB_REDUNDANT_NAME "\n"));
+    pos += strlen(PUFLIB_HEADER PUFLIB_REDUNDANT_NAME "\n");
+    store_u32le(pos, (uint32_t) n_modules);
+    pos += 4;
+    for (size_t i = 0; i < n_modules; ++i) {
+        store_u32le(pos, (uint32_t) jobs[i].out_len);
+        memcpy(pos + 4, jobs[i].out, jobs[i].out_len);
+        pos += 4 + jobs[i].out_len;
+    }
+    memcpy(pos, payload, payload_len);
+
+    *data_out = blob;
+    *data_out_len = blob_len;
+    rc = false;
+
+out:
+    {
+        int errno_hold = errno;
+        puflib_secure_zero(key, sizeof(key));
+        for (size_t i = 0; i < n_modules; ++i) {
+            free(jobs[i].out);
+        }
+        free(payload);
+        errno = errno_hold;
+        return rc;
+    }
+}
+
+
+/******************************************************************************
+ * Unsealing                                                                  *
+ *****************************************************************************/
+
+/**
+ * Drop a reference to the race, freeing it if it was the last. Caller holds
+ * race->lock, which is released.
+ */
+static void race_release(struct race * race)
+{
+    bool last = !--race->refs;
+    pthread_mutex_unlock(&race->lock);
+
+    if (last) {
+        pthread_mutex_destroy(&race->lock);
+        pthread_cond_destroy(&race->changed);
+        puflib_cancel_free(race->cancel);
+        if (race->out) {
+            puflib_secure_zero(race->out, race->out_len);
+            free(race->out);
+        }
+        free(race->payload);
+        free(race);
+    }
+}
+
+
+static void * attempt_thread(void * arg)
+{
+    struct attempt * attempt = arg;
+    struct race * race = attempt->race;
+    uint8_t * key = NULL;
+    size_t key_len = 0;
+    uint8_t * out = NULL;
+    size_t out_len = 0;
+
+    // Not every module authenticates what it unseals, so the key only counts
+    // once it has decrypted the payload
+    uint64_t start = puflib_monotonic_us();
+    bool failed = puflib_unseal_deadline(&race->deadline, attempt->blob, attempt->blob_len,
+            &key, &key_len);
+    int error = errno;
+    if (!failed && key_len != DATA_KEY_LEN) {
+        failed = true;
+        error = EBADMSG;
+    } else if (!failed) {
+        failed = puflib_key_unseal(key, race->payload, race->payload_len, &out, &out_len);
+        error = errno;
+    }
+    double elapsed_ms = (double) (puflib_monotonic_us() - start) / 1000;
+
+    // A cancelled attempt had taken at least this long, which is enough to
+    // stop a degraded module from being tried first next time
+    record_latency(attempt->module,
+            failed && error != ECANCELED ? elapsed_ms + FAILURE_PENALTY_MS : elapsed_ms);
+
+    pthread_mutex_lock(&race->lock);
+    if (!failed && !race->won) {
+        race->won = true;
+        race->out = out;
+        race->out_len = out_len;
+        out = NULL;
+    } else if (failed && (!race->error || race->error == ECANCELED)) {
+        race->error = error;
+    }
+    --race->running;
+    pthread_cond_broadcast(&race->changed);
+    race_release(race);
+
+    if (key) {
+        puflib_secure_zero(key, key_len);
+        free(key);
+    }
+    if (out) {
+        puflib_secure_zero(out, out_len);
+        free(out);
+    }
+    free(attempt->blob);
+    free(attempt);
+    return NULL;
+}
+
+
+/**
+ * Start an attempt to unseal the data key with one module. Caller holds
+ * race->lock.
+ * @return false on success, true on error (with errno set)
+ */
+static bool launch(struct race * race, struct recipient const * recipient)
+{
+    struct attempt * attempt = malloc(sizeof(*attempt));
+    uint8_t * blob = malloc(recipient->blob_len);
+    if (!attempt || !blob) {
+        free(attempt);
+        free(blob);
+        return true;
+    }
+    memcpy(blob, recipient->blob, recipient->blob_len);
+    attempt->race = race;
+    attempt->module = recipient->module;
+    attempt->blob = blob;
+    attempt->blob_len = recipient->blob_len;
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, attempt_thread, attempt);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        free(blob);
+        free(attempt);
+        errno = err;
+        return true;
+    }
+
+    ++race->refs;
+    ++race->running;
+    return false;
+}
+
+
+/**
+ * Split a redundant blob into its recipients, ordered fastest expected
+ * first, and its payload. Recipients for modules not built into this library
+ * are left out.
+ * @return number of recipients, or 0 on error (with errno set)
+ */
+static size_t parse_recipients(uint8_t const * data_in, size_t data_in_len,
+        struct recipient * recipients, uint8_t const ** payload, size_t * payload_len)
+{
+    size_t const header_len = strlen(PUFLIB_HEADER);
+
+    if (data_in_len < 4 || !load_u32le(data_in) || load_u32le(data_in) > MAX_RECIPIENTS) {
+        goto malformed;
+    }
+    size_t n_blobs = load_u32le(data_in);
+    uint8_t const * pos = data_in + 4;
+    uint8_t const * end = data_in + data_in_len;
+    size_t n = 0;
+
+    for (size_t i = 0; i < n_blobs; ++i) {
+        if ((size_t) (end - pos) < 4 || load_u32le(pos) > (size_t) (end - pos) - 4) {
+            goto malformed;
+        }
+        uint8_t const * blob = pos + 4;
+        size_t blob_len = load_u32le(pos);
+        pos += 4 + blob_len;
+
+        // Find the module named in the blob's own header
+        uint8_t const * name = blob + header_len;
+        uint8_t const * name_end = blob_len > header_len
+            ? memchr(name, '\n', blob_len - header_len) : NULL;
+        if (!name_end || memcmp(blob, PUFLIB_HEADER, header_len)) {
+            goto malformed;
+        }
+        uint8_t const * sep = memchr(name, PUFLIB_INSTANCE_SEP, name_end - name);
+        if (sep) {
+            name_end = sep;
+        }
+
+        module_info const * const * modules = puflib_get_modules();
+        for (size_t m = 0; modules[m]; ++m) {
+            if (strlen(modules[m]->name) == (size_t) (name_end - name)
+                    && !memcmp(modules[m]->name, name, name_end - name)) {
+                recipients[n].module = modules[m];
+                recipients[n].blob = blob;
+                recipients[n].blob_len = blob_len;
+                expect_latency(&recipients[n]);
+                ++n;
+                break;
+            }
+        }
+    }
+
+    *payload = pos;
+    *payload_len = (size_t) (end - pos);
+
+    if (!n) {
+        puflib_report(NULL, STATUS_ERROR,
+                "cannot unseal blob; none of its modules are available");
+        errno = ENOTSUP;
+        return 0;
+    }
+
+    // Insertion sort, keeping the sealing order between equals
+    for (size_t i = 1; i < n; ++i) {
+        struct recipient r = recipients[i];
+        size_t j = i;
+        for (; j > 0 && recipients[j - 1].expected_ms > r.expected_ms; --j) {
+            recipients[j] = recipients[j - 1];
+        }
+        recipients[j] = r;
+    }
+    return n;
+
+malformed:
+    puflib_report(NULL, STATUS_ERROR, "malformed redundant blob");
+    errno = EBADMSG;
+    return 0;
+}
+
+
+bool puflib_redundant_unseal(uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len)
+{
+    struct recipient recipients[MAX_RECIPIENTS];
+    uint8_t const * payload;
+    size_t payload_len;
+
+    size_t n = parse_recipients(data_in, data_in_len, recipients, &payload, &payload_len);
+    if (!n) {
+        return true;
+    }
+
+    struct race * race = calloc(1, sizeof(*race));
+    if (!race) {
+        return true;
+    }
+    race->cancel = puflib_cancel_new();
+    race->payload = malloc(payload_len ? payload_len : 1);
+    if (!race->cancel || !race->payload) {
+        int errno_hold = errno;
+        puflib_cancel_free(race->cancel);
+        free(race->payload);
+        free(race);
+        errno = errno_hold;
+        return true;
+    }
+    memcpy(race->payload, payload, payload_len);
+    race->payload_len = payload_len;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&race->lock, NULL);
+    pthread_cond_init(&race->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    race->refs = 1;
+
+    // Attempts run under the caller's deadline and the race's token; the
+    // caller watches its own token, and cancels the race if it fires
+    puflib_op_current(&race->deadline);
+    race->deadline.cancel = race->cancel;
+
+    pthread_mutex_lock(&race->lock);
+
+    size_t next = 0;
+    uint64_t hedge_at = 0;
+    int error = 0;
+    while (!race->won) {
+        uint64_t now = puflib_monotonic_ms();
+        if (next < n && (!race->running || now >= hedge_at)) {
+            if (launch(race, &recipients[next]) && !race->error) {
+                race->error = errno;
+            }
+            hedge_at = now + recipients[next].hedge_ms;
+            ++next;
+            continue;
+        }
+        if (!race->running) {
+            break;
+        }
+        if (puflib_op_expired()) {
+            error = errno;
+            break;
+        }
+
+        uint64_t wake_ms = next < n ? hedge_at : 0;
+        if (puflib_op_limited()) {
+            uint64_t op_wake_ms = puflib_op_wake_ms();
+            if (!wake_ms || op_wake_ms < wake_ms) {
+                wake_ms = op_wake_ms;
+            }
+        }
+        if (wake_ms) {
+            struct timespec when = {
+                .tv_sec = (time_t) (wake_ms / 1000),
+                .tv_nsec = (long) (wake_ms % 1000) * 1000000,
+            };
+            pthread_cond_timedwait(&race->changed, &race->lock, &when);
+        } else {
+            pthread_cond_wait(&race->changed, &race->lock);
+        }
+    }
+
+    bool won = race->won;
+    if (won) {
+        *data_out = race->out;
+        *data_out_len = race->out_len;
+        race->out = NULL;
+    } else if (!error) {
+        error = race->error ? race->error : EIO;
+    }
+
+    // Stop the losers; they free the race when the last one finishes
+    puflib_cancel(race->cancel);
+    race_release(race);
+
+    if (!won) {
+        if (error == EBADMSG) {
+            puflib_report(NULL, STATUS_ERROR, "redundant blob is corrupt");
+        }
+        errno = error;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,27 @@
+// PUFlib redundant sealing across modules
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+
+#ifndef _PUFLIB_REDUNDANT_H_
+#define _PUFLIB_REDUNDANT_H_
+
+#include <puflib.h>
+
+/**
+ * Name recorded in the header of a blob sealed by puflib_seal_redundant(),
+ * in place of a module name. Module names never start with '+'.
+ */
+#define PUFLIB_REDUNDANT_NAME "+redundant"
+
+/**
+ * Unseal the body of a redundant blob (everything after its header),
+ * hedging across its modules. Arguments are as for puflib_unseal().
+ * @return false on success, true on error (with errno set)
+ */
+bool puflib_redundant_unseal(uint8_t const * data_in, size_t data_in_len,
+        uint8_t ** data_out, size_t * data_out_len);
+
+#endif // _PUFLIB_REDUNDANT_H_
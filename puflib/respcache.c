@@ -0,0 +1,370 @@
+// PUFlib challenge-response cache
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// A process-wide LRU cache of chal_resp() results for modules that opt in.
+// Entries are spread over independently locked shards by the hash of module,
+// instance and challenge, so concurrent lookups rarely contend; each shard is a
+// chained hash table threaded onto its own LRU list and holds an equal part
+// of the capacity.
+//
+
+#include <puflib.h>
+#include <puflib_module.h>
+#include "respcache.h"
+#include "dispatch.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define N_SHARDS 16
+#define SHARD_BITS 4
+#define MIN_BUCKETS 16
+
+struct resp_entry {
+    uint64_t hash;
+    module_info const * module;
+    unsigned instance;
+    size_t chal_len;
+    size_t resp_len;
+    struct resp_entry * chain;      ///< next entry in the same bucket
+    struct resp_entry * newer;      ///< LRU neighbours
+    struct resp_entry * older;
+    uint8_t data[];                 ///< challenge, then response
+};
+
+struct shard {
+    pthread_mutex_t lock;
+    struct resp_entry ** buckets;
+    size_t n_buckets;               ///< power of two, or zero before first use
+    size_t count;
+    size_t capacity;
+    struct resp_entry * newest;
+    struct resp_entry * oldest;
+};
+
+struct enabled_module {
+    module_info const * module;
+    struct enabled_module * next;
+};
+
+static struct shard SHARDS[N_SHARDS];
+static pthread_once_t SHARDS_ONCE = PTHREAD_ONCE_INIT;
+
+// Bumped by every flush, so that a response fetched from the hardware
+// before a flush is not cached after it
+static unsigned long FLUSH_GENERATION = 0;
+
+static struct enabled_module * ENABLED = NULL;
+static pthread_mutex_t ENABLED_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void init_shards(void)
+{
+    for (size_t i = 0; i < N_SHARDS; ++i) {
+        pthread_mutex_init(&SHARDS[i].lock, NULL);
+        SHARDS[i].capacity = (PUFLIB_RESP_CACHE_DEFAULT_CAPACITY + N_SHARDS - 1) / N_SHARDS;
+    }
+}
+
+
+static uint64_t hash_request(module_info const * module, unsigned instance,
+        void const * challenge, size_t len)
+{
+    // FNV-1a over the module name, the instance and the challenge, with the
+    // name's terminator separating the name from the rest
+    uint64_t hash = 0xcbf29ce484222325ull;
+    char const * name = module->name;
+    do {
+        hash ^= (uint8_t) *name;
+        hash *= 0x100000001b3ull;
+    } while (*name++);
+
+    for (size_t i = 0; i < sizeof(instance); ++i) {
+        hash ^= (uint8_t) (instance >> (8 * i));
+        hash *= 0x100000001b3ull;
+    }
+
+    uint8_t const * bytes = challenge;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+
+static struct shard * shard_for(uint64_t hash)
+{
+    return &SHARDS[hash >> (64 - SHARD_BITS)];
+}
+
+
+/******************************************************************************
+ * Shard operations. Caller holds the shard lock.                             *
+ *****************************************************************************/
+
+static void lru_unlink(struct shard * shard, struct resp_entry * entry)
+{
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        shard->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        shard->oldest = entry->newer;
+    }
+    entry->newer = entry->older = NULL;
+}
+
+
+static void lru_push(struct shard * shard, struct resp_entry * entry)
+{
+    entry->older = shard->newest;
+    entry->newer = NULL;
+    if (shard->newest) {
+        shard->newest->newer = entry;
+    } else {
+        shard->oldest = entry;
+    }
+    shard->newest = entry;
+}
+
+
+static void shard_remove(struct shard * shard, struct resp_entry * entry)
+{
+    struct resp_entry ** link = &shard->buckets[entry->hash & (shard->n_buckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+    lru_unlink(shard, entry);
+    --shard->count;
+    free(entry);
+}
+
+
+static struct resp_entry * shard_find(struct shard * shard, uint64_t hash,
+        module_info const * module, unsigned instance, void const * challenge, size_t len)
+{
+    if (!shard->n_buckets) {
+        return NULL;
+    }
+
+    struct resp_entry * entry = shard->buckets[hash & (shard->n_buckets - 1)];
+    for (; entry; entry = entry->chain) {
+        if (entry->hash == hash && entry->module == module && entry->instance == instance
+                && entry->chal_len == len
+                && !memcmp(entry->data, challenge, len)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+static void shard_evict(struct shard * shard)
+{
+    while (shard->count > shard->capacity) {
+        shard_remove(shard, shard->oldest);
+    }
+}
+
+
+/**
+ * Make sure the shard has a bucket array sized for its capacity.
+ * @return false on success, true on allocation failure
+ */
+static bool shard_size_buckets(struct shard * shard)
+{
+    size_t want = MIN_BUCKETS;
+    while (want < shard->capacity) {
+        want *= 2;
+    }
+    if (want == shard->n_buckets) {
+        return false;
+    }
+
+    struct resp_entry ** buckets = calloc(want, sizeof(*buckets));
+    if (!buckets) {
+        return true;
+    }
+
+    // Rehash by walking the LRU list, which holds every entry
+    for (struct resp_entry * entry = shard->oldest; entry; entry = entry->newer) {
+        size_t b = entry->hash & (want - 1);
+        entry->chain = buckets[b];
+        buckets[b] = entry;
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->n_buckets = want;
+    return false;
+}
+
+
+/******************************************************************************
+ * Public interface                                                           *
+ *****************************************************************************/
+
+bool puflib_resp_cache_enabled(module_info const * module)
+{
+    pthread_mutex_lock(&ENABLED_LOCK);
+    struct enabled_module * e = ENABLED;
+    while (e && e->module != module) {
+        e = e->next;
+    }
+    pthread_mutex_unlock(&ENABLED_LOCK);
+    return e != NULL;
+}
+
+
+bool puflib_resp_cache_configure(module_info const * module, bool enable)
+{
+    if (!module || !module->chal_resp || !module->chal_resp_deterministic) {
+        errno = ENOTSUP;
+        return true;
+    }
+
+    pthread_mutex_lock(&ENABLED_LOCK);
+    struct enabled_module ** link = &ENABLED;
+    while (*link && (*link)->module != module) {
+        link = &(*link)->next;
+    }
+
+    if (enable && !*link) {
+        struct enabled_module * e = calloc(1, sizeof(*e));
+        if (!e) {
+            pthread_mutex_unlock(&ENABLED_LOCK);
+            return true;
+        }
+        e->module = module;
+        *link = e;
+    } else if (!enable && *link) {
+        struct enabled_module * e = *link;
+        *link = e->next;
+        free(e);
+    }
+    pthread_mutex_unlock(&ENABLED_LOCK);
+
+    if (!enable) {
+        puflib_resp_cache_flush(module);
+    }
+    return false;
+}
+
+
+void puflib_resp_cache_set_capacity(size_t max_entries)
+{
+    pthread_once(&SHARDS_ONCE, init_shards);
+
+    size_t per_shard = (max_entries + N_SHARDS - 1) / N_SHARDS;
+    for (size_t i = 0; i < N_SHARDS; ++i) {
+        struct shard * shard = &SHARDS[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->capacity = per_shard;
+        shard_evict(shard);
+        if (shard->n_buckets) {
+            // On failure, keep the old buckets; they still work, just with
+            // longer chains
+            shard_size_buckets(shard);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+
+void puflib_resp_cache_flush(module_info const * module)
+{
+    pthread_once(&SHARDS_ONCE, init_shards);
+    __atomic_add_fetch(&FLUSH_GENERATION, 1, __ATOMIC_SEQ_CST);
+
+    for (size_t i = 0; i < N_SHARDS; ++i) {
+        struct shard * shard = &SHARDS[i];
+        pthread_mutex_lock(&shard->lock);
+        struct resp_entry * entry = shard->oldest;
+        while (entry) {
+            struct resp_entry * next = entry->newer;
+            if (!module || entry->module == module) {
+                shard_remove(shard, entry);
+            }
+            entry = next;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+
+bool puflib_resp_cache_chal_resp(module_info const * module, void * state,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len)
+{
+    pthread_once(&SHARDS_ONCE, init_shards);
+
+    unsigned instance = puflib_instance();
+    uint64_t hash = hash_request(module, instance, data_in, data_in_len);
+    struct shard * shard = shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct resp_entry * entry = shard_find(shard, hash, module, instance, data_in, data_in_len);
+    if (entry) {
+        void * copy = malloc(entry->resp_len ? entry->resp_len : 1);
+        if (!copy) {
+            pthread_mutex_unlock(&shard->lock);
+            return true;
+        }
+        memcpy(copy, entry->data + entry->chal_len, entry->resp_len);
+        *data_out = copy;
+        *data_out_len = entry->resp_len;
+
+        lru_unlink(shard, entry);
+        lru_push(shard, entry);
+        pthread_mutex_unlock(&shard->lock);
+        return false;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // Miss: query the hardware without holding the shard lock
+    unsigned long generation = __atomic_load_n(&FLUSH_GENERATION, __ATOMIC_SEQ_CST);
+    if (puflib_dispatch_chal_resp(module, state, data_in, data_in_len, data_out, data_out_len)) {
+        return true;
+    }
+
+    // Failing to cache the response is not an error; the caller has it
+    entry = malloc(sizeof(*entry) + data_in_len + *data_out_len);
+    if (!entry) {
+        return false;
+    }
+    entry->hash = hash;
+    entry->module = module;
+    entry->instance = instance;
+    entry->chal_len = data_in_len;
+    entry->resp_len = *data_out_len;
+    memcpy(entry->data, data_in, data_in_len);
+    memcpy(entry->data + data_in_len, *data_out, *data_out_len);
+
+    pthread_mutex_lock(&shard->lock);
+    if (!shard->capacity || shard_size_buckets(shard)
+            || shard_find(shard, hash, module, instance, data_in, data_in_len)
+            || __atomic_load_n(&FLUSH_GENERATION, __ATOMIC_SEQ_CST) != generation) {
+        // No room, or another thread cached it first, or the cache was
+        // flushed while the hardware was queried
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return false;
+    }
+
+    size_t b = hash & (shard->n_buckets - 1);
+    entry->chain = shard->buckets[b];
+    shard->buckets[b] = entry;
+    entry->newer = entry->older = NULL;
+    lru_push(shard, entry);
+    ++shard->count;
+    shard_evict(shard);
+    pthread_mutex_unlock(&shard->lock);
+    return false;
+}
@@ -0,0 +1,29 @@
+// PUFlib challenge-response cache
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Internal header, not to be installed with library.
+//
+
+#ifndef _PUFLIB_RESPCACHE_H_
+#define _PUFLIB_RESPCACHE_H_
+
+#include <puflib.h>
+
+/**
+ * Return whether responses from this module are being cached.
+ */
+bool puflib_resp_cache_enabled(module_info const * module);
+
+/**
+ * Challenge-response through the cache: serve the response from the cache
+ * if present, or else query the module and cache its response. @a state is
+ * the module's session state, or NULL; other arguments are as for
+ * puflib_chal_resp().
+ * @return false on success, true on error
+ */
+bool puflib_resp_cache_chal_resp(module_info const * module, void * state,
+        void const * data_in, size_t data_in_len,
+        void ** data_out, size_t * data_out_len);
+
+#endif // _PUFLIB_RESPCACHE_H_
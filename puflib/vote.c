@@ -0,0 +1,201 @@
+// PUFlib temporal majority voting
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Accumulates repeated readouts of a PUF region in bit-sliced counters, so
+// that adding a readout costs a few vector operations per 512 bits no matter
+// how many readouts have been seen.
+//
+
+#include <puflib_module.h>
+#include "bitslice.h"
+#include <string.h>
+#include <errno.h>
+
+#define VOTE_PLANES 16      ///< counter width; allows up to 65535 readouts
+
+struct puflib_vote {
+    size_t len;             ///< readout length in bytes
+    size_t n_words;         ///< words per readout, rounded up
+    size_t n_reads;
+    uint64_t * planes;      ///< VOTE_PLANES * n_words counter planes
+    uint64_t * scratch;     ///< 2 * n_words words
+};
+
+
+struct puflib_vote * puflib_vote_new(size_t len)
+{
+    if (!len) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct puflib_vote * vote = calloc(1, sizeof(*vote));
+    if (!vote) {
+        return NULL;
+    }
+
+    vote->len = len;
+    vote->n_words = (len + 7) / 8;
+    vote->planes = calloc(VOTE_PLANES * vote->n_words, sizeof(uint64_t));
+    vote->scratch = calloc(2 * vote->n_words, sizeof(uint64_t));
+    if (!vote->planes || !vote->scratch) {
+        puflib_vote_free(vote);
+        return NULL;
+    }
+
+    return vote;
+}
+
+
+void puflib_vote_free(struct puflib_vote * vote)
+{
+    if (!vote) {
+        return;
+    }
+    if (vote->planes) {
+        puflib_secure_zero(vote->planes, VOTE_PLANES * vote->n_words * sizeof(uint64_t));
+    }
+    if (vote->scratch) {
+        puflib_secure_zero(vote->scratch, 2 * vote->n_words * sizeof(uint64_t));
+    }
+    free(vote->planes);
+    free(vote->scratch);
+    free(vote);
+}
+
+
+/**
+ * Copy a readout into the scratch words, zero-padding the last word.
+ */
+static void load_readout(struct puflib_vote * vote, uint8_t const * readout)
+{
+    size_t full = vote->len / 8;
+    for (size_t w = 0; w < full; ++w) {
+        vote->scratch[w] = puflib_load_le64(readout + 8 * w);
+    }
+    if (full < vote->n_words) {
+        uint8_t tail[8] = { 0 };
+        memcpy(tail, readout + 8 * full, vote->len - 8 * full);
+        vote->scratch[full] = puflib_load_le64(tail);
+    }
+}
+
+
+static void store_words(struct puflib_vote const * vote, uint64_t const * words, uint8_t * out)
+{
+    size_t full = vote->len / 8;
+    for (size_t w = 0; w < full; ++w) {
+        puflib_store_le64(out + 8 * w, words[w]);
+    }
+    if (full < vote->n_words) {
+        uint8_t tail[8];
+        puflib_store_le64(tail, words[full]);
+        memcpy(out + 8 * full, tail, vote->len - 8 * full);
+    }
+}
+
+
+bool puflib_vote_add(struct puflib_vote * vote, uint8_t const * readout)
+{
+    if (vote->n_reads >= PUFLIB_VOTE_MAX_READS) {
+        errno = EOVERFLOW;
+        return true;
+    }
+
+    load_readout(vote, readout);
+    puflib_bs_accumulate(vote->planes, VOTE_PLANES, vote->n_words, vote->scratch);
+    ++vote->n_reads;
+    return false;
+}
+
+
+size_t puflib_vote_count(struct puflib_vote const * vote)
+{
+    return vote->n_reads;
+}
+
+
+bool puflib_vote_result(struct puflib_vote * vote, uint8_t * majority, uint16_t * stability)
+{
+    if (!vote->n_reads) {
+        errno = EINVAL;
+        return true;
+    }
+
+    puflib_bs_compare(vote->planes, VOTE_PLANES, vote->n_words, vote->n_reads / 2,
+            vote->scratch, NULL);
+
+    if (majority) {
+        store_words(vote, vote->scratch, majority);
+    }
+
+    if (stability) {
+        // Per-bit counts have to be gathered out of the planes one lane at a
+        // time; only the planes that can be nonzero are visited.
+        size_t n_planes = 0;
+        while (n_planes < VOTE_PLANES && (vote->n_reads >> n_planes)) {
+            ++n_planes;
+        }
+
+        for (size_t bit = 0; bit < vote->len * 8; ++bit) {
+            size_t w = bit / 64, b = bit % 64;
+            uint32_t ones = 0;
+            for (size_t p = 0; p < n_planes; ++p) {
+                ones |= (uint32_t) ((vote->planes[p * vote->n_words + w] >> b) & 1) << p;
+            }
+            bool is_one = (vote->scratch[w] >> b) & 1;
+            stability[bit] = (uint16_t) (is_one ? ones : vote->n_reads - ones);
+        }
+    }
+
+    return false;
+}
+
+
+size_t puflib_vote_stable(struct puflib_vote * vote, size_t max_disagree, uint8_t * mask)
+{
+    size_t count = 0;
+    uint64_t * low = vote->scratch;
+    uint64_t * high = vote->scratch + vote->n_words;
+
+    if (!vote->n_reads) {
+        if (mask) {
+            memset(mask, 0, vote->len);
+        }
+        return 0;
+    }
+
+    // Stable bits have a count of at most max_disagree, or at least
+    // n_reads - max_disagree. If these overlap, every bit is stable.
+    if (2 * max_disagree >= vote->n_reads) {
+        memset(low, 0, vote->n_words * sizeof(uint64_t));
+        memset(high, 0xff, vote->n_words * sizeof(uint64_t));
+    } else {
+        puflib_bs_compare(vote->planes, VOTE_PLANES, vote->n_words, max_disagree,
+                low, NULL);
+        puflib_bs_compare(vote->planes, VOTE_PLANES, vote->n_words,
+                vote->n_reads - max_disagree - 1, high, NULL);
+    }
+
+    size_t tail_bits = vote->len * 8 % 64;
+    for (size_t w = 0; w < vote->n_words; ++w) {
+        uint64_t word = ~low[w] | high[w];
+        if (w == vote->n_words - 1 && tail_bits) {
+            word &= ((uint64_t) 1 << tail_bits) - 1;
+        }
+        low[w] = word;
+        count += (size_t) __builtin_popcountll(word);
+    }
+
+    if (mask) {
+        store_words(vote, low, mask);
+    }
+    return count;
+}
+
+
+size_t puflib_vote_unanimous(struct puflib_vote * vote, uint8_t * mask)
+{
+    return puflib_vote_stable(vote, 0, mask);
+}
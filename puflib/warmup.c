@@ -0,0 +1,156 @@
+// PUFlib warm-up
+//
+// (C) Copyright 2016 Assured Information Security, Inc.
+//
+// Moves the cost of a module's first call to startup: the library's code is
+// faulted in by running each path once on throwaway data, the module gets to
+// initialise its hardware, and the root key cache is filled. The last two
+// are done for each instance of the module.
+//
+
+#include <puflib.h>
+#include <puflib_module.h>
+#include <puflib_internal.h>
+#include "keycache.h"
+#include "dispatch.h"
+#include "instance.h"
+
+#include <string.h>
+#include <errno.h>
+
+#define WARMUP_DATA_LEN 64
+
+
+/**
+ * Run the library's sealing path once: key derivation, authenticated
+ * encryption and decryption, and the random source.
+ */
+static bool warm_library(module_info const * module)
+{
+    uint8_t key[PUFLIB_SHA256_LEN];
+    uint8_t data[WARMUP_DATA_LEN];
+    uint8_t * sealed = NULL;
+    uint8_t * unsealed = NULL;
+    size_t sealed_len, unsealed_len;
+    bool rc = true;
+
+    if (puflib_dispatch_prepare(module)) {
+        return true;
+    }
+
+    memset(data, 0, sizeof(data));
+    if (puflib_random_bytes(data, sizeof(data))
+            || puflib_hkdf_sha256(data, 16, data, sizeof(data), "puflib warmup", 13,
+                key, sizeof(key))
+            || puflib_key_seal(key, data, sizeof(data), &sealed, &sealed_len)
+            || puflib_key_unseal(key, sealed, sealed_len, &unsealed, &unsealed_len)) {
+        goto out;
+    }
+
+    if (unsealed_len != sizeof(data) || memcmp(unsealed, data, sizeof(data))) {
+        puflib_report(NULL, STATUS_ERROR, "warm-up: crypto self-check failed");
+        errno = EIO;
+        goto out;
+    }
+    rc = false;
+
+out:
+    {
+        int errno_hold = errno;
+        puflib_secure_zero(key, sizeof(key));
+        if (unsealed) {
+            puflib_secure_zero(unsealed, unsealed_len);
+        }
+        free(sealed);
+        free(unsealed);
+        errno = errno_hold;
+        return rc;
+    }
+}
+
+
+/**
+ * Warm up the calling thread's instance of a module, adding the time taken
+ * to @a report.
+ */
+static bool warm_instance(module_info const * module, unsigned flags,
+        struct puflib_warmup_report * report)
+{
+    uint64_t start;
+    uint64_t elapsed;
+
+    if ((flags & WARMUP_MODULE) && module->warmup) {
+        start = puflib_monotonic_us();
+        if (puflib_dispatch_prepare(module) || module->warmup()) {
+            return true;
+        }
+        elapsed = puflib_monotonic_us() - start;
+        report->module_us += elapsed;
+        report->done |= WARMUP_MODULE;
+        puflib_report_fmt(module, STATUS_INFO, "warm-up: instance %u ready in %llu us",
+                puflib_instance(), (unsigned long long) elapsed);
+    }
+
+    if ((flags & WARMUP_ROOT_KEY) && module->get_root_key) {
+        bool filled;
+        start = puflib_monotonic_us();
+        if (puflib_key_cache_fill(module, &filled)) {
+            return true;
+        }
+        if (filled) {
+            elapsed = puflib_monotonic_us() - start;
+            report->root_key_us += elapsed;
+            report->done |= WARMUP_ROOT_KEY;
+            puflib_report_fmt(module, STATUS_INFO,
+                    "warm-up: instance %u root key cached in %llu us",
+                    puflib_instance(), (unsigned long long) elapsed);
+        }
+    }
+
+    return false;
+}
+
+
+bool puflib_warmup(module_info const * module, unsigned flags,
+        struct puflib_warmup_report * report)
+{
+    struct puflib_warmup_report local;
+    if (!report) {
+        report = &local;
+    }
+    memset(report, 0, sizeof(*report));
+
+    if (!module) {
+        errno = EINVAL;
+        return true;
+    }
+
+    uint64_t start;
+
+    if (flags & WARMUP_LIBRARY) {
+        start = puflib_monotonic_us();
+        if (warm_library(module)) {
+            return true;
+        }
+        report->library_us = puflib_monotonic_us() - start;
+        report->done |= WARMUP_LIBRARY;
+        puflib_report_fmt(module, STATUS_INFO, "warm-up: library ready in %llu us",
+                (unsigned long long) report->library_us);
+    }
+
+    // The selected instance, or else all of them
+    unsigned first = puflib_instance_selected();
+    unsigned last = first;
+    if (first == PUFLIB_INSTANCE_ANY) {
+        first = 0;
+        last = puflib_instance_count(module) - 1;
+    }
+
+    bool rc = false;
+    for (unsigned i = first; i <= last && !rc; ++i) {
+        unsigned saved = puflib_select_instance(i);
+        rc = warm_instance(module, flags, report);
+        puflib_select_instance(saved);
+    }
+    return rc;
+}
@@ -0,0 +1,609 @@
+// stress - concurrency stress test and scaling benchmark for libpuf
+//
+// Copyright (C) 2016 Assured Information Security, Inc.
+//
+// Worker threads, optionally spread over several processes, call the library
+// concurrently and check every result:
+//   seal       seal a per-worker payload through the test module, unseal it
+//              and compare the round trip
+//   chal_resp  query the test module twice with a challenge from a small pool
+//              shared by all workers, so that identical requests meet; the
+//              answers must have the same length, and be equal if the module
+//              is deterministic
+//   status     read the status of a placeholder module, which must always be
+//              provisioned, and either enabled or disabled
+//   toggle     enable or disable the placeholder module
+//   report     replace the status handler, or report a message through it
+// The placeholder module's NV store is shared by all workers in all
+// processes, so that enabling and disabling race with each other and with
+// status reads. seal and chal_resp are left out for a test module that does
+// not implement them. A test module that needs provisioning to seal is
+// provisioned for the run. NV stores, root's included, live in a temporary
+// directory that is removed afterwards, so that the host's provisioned
+// modules are never touched. Build the library with BUILD=tsan to detect
+// data races.
+//
+// usage: stress [-t THREADS] [-p PROCESSES] [-d SECONDS] [-m MODULE] [-s]
+//   -t  worker threads per process (default: twice the CPU count, at least 4)
+//   -p  worker processes (default 1)
+//   -d  duration of each run, in seconds (default 2)
+//   -m  test module (default puflibtest)
+//   -s  scaling mode: run the seal workload alone (chal_resp for a module
+//       that cannot seal) with 1, 2, 4, ... THREADS threads in each of the
+//       PROCESSES processes, and report the throughput and speedup of each
+//       step
+// Exits with status 1 if any result was wrong.
+
+#define _XOPEN_SOURCE 700
+
+#include <puflib.h>
+#include <puflib_module.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define PAYLOAD_LEN 256
+#define CHALLENGE_LEN 16            ///< a whole number of arbitersim challenges
+#define N_CHALLENGES 16
+#define MAX_ERRORS_SHOWN 10
+
+/// Stand-in module for status and enable/disable, so that no real module's
+/// store is touched
+static module_info const STRESS_MODULE = {
+    .name = "puflib-stress",
+    .author = "",
+    .desc = "stress test placeholder",
+};
+
+enum op {
+    OP_SEAL,
+    OP_CHAL_RESP,
+    OP_STATUS,
+    OP_TOGGLE,
+    OP_REPORT,
+    N_OPS
+};
+
+static char const * const OP_NAMES[N_OPS] = {
+    "seal", "chal_resp", "status", "toggle", "report"
+};
+
+/// Relative frequency of each operation in the mixed workload; set to zero
+/// for operations the test module does not implement
+static unsigned MIX[N_OPS] = { 4, 4, 4, 1, 1 };
+
+struct totals {
+    unsigned long ops[N_OPS];
+    unsigned long errors[N_OPS];
+};
+
+struct worker {
+    pthread_t thread;
+    unsigned id;
+    enum op only;           ///< run only this operation, or N_OPS for the mix
+    struct totals totals;
+};
+
+static module_info const * TEST_MODULE;
+static double DURATION = 2.0;
+static bool STOP;
+
+// Messages delivered to each status handler, and messages sent
+static unsigned long DELIVERED[2];
+static unsigned long REPORTED;
+
+static pthread_mutex_t ERROR_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static unsigned ERRORS_SHOWN;
+
+
+/**
+ * Never report root. libpuf's getuid() calls resolve here, ahead of the C
+ * library's; as root it would keep NV stores under /var/lib/puflib, where
+ * provisioning and deprovisioning the test module would clobber the host's.
+ */
+uid_t getuid(void)
+{
+    uid_t uid = geteuid();
+    return uid ? uid : 65534;       // nobody
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static uint64_t xorshift(uint64_t * state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+
+static void wrong(struct worker * w, enum op op, char const * what)
+{
+    int errno_hold = errno;
+    ++w->totals.errors[op];
+
+    pthread_mutex_lock(&ERROR_LOCK);
+    if (ERRORS_SHOWN++ < MAX_ERRORS_SHOWN) {
+        fprintf(stderr, "stress: pid %ld worker %u: %s: %s (errno: %s)\n",
+                (long) getpid(), w->id, OP_NAMES[op], what,
+                errno_hold ? strerror(errno_hold) : "none");
+    }
+    pthread_mutex_unlock(&ERROR_LOCK);
+}
+
+
+static void handler_a(module_info const * module, enum puflib_status_level level,
+        char const * message)
+{
+    (void) module; (void) level; (void) message;
+    __atomic_add_fetch(&DELIVERED[0], 1, __ATOMIC_RELAXED);
+}
+
+
+static void handler_b(module_info const * module, enum puflib_status_level level,
+        char const * message)
+{
+    (void) module; (void) level; (void) message;
+    __atomic_add_fetch(&DELIVERED[1], 1, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+ * Operations                                                                 *
+ *****************************************************************************/
+
+static void do_seal(struct worker * w, uint64_t * rng)
+{
+    uint8_t payload[PAYLOAD_LEN];
+    for (size_t i = 0; i < sizeof(payload); i += 8) {
+        uint64_t r = xorshift(rng);
+        memcpy(payload + i, &r, 8);
+    }
+
+    uint8_t * sealed = NULL, * unsealed = NULL;
+    size_t sealed_len, unsealed_len;
+
+    errno = 0;
+    if (puflib_seal(TEST_MODULE, payload, sizeof(payload), &sealed, &sealed_len)) {
+        wrong(w, OP_SEAL, "seal failed");
+    } else if (puflib_unseal(sealed, sealed_len, &unsealed, &unsealed_len)) {
+        wrong(w, OP_SEAL, "unseal failed");
+    } else if (unsealed_len != sizeof(payload) || memcmp(unsealed, payload, sizeof(payload))) {
+        wrong(w, OP_SEAL, "unsealed data differs from the sealed data");
+    }
+    free(sealed);
+    free(unsealed);
+}
+
+
+static void do_chal_resp(struct worker * w, uint64_t * rng)
+{
+    uint8_t challenge[CHALLENGE_LEN];
+    unsigned pick = (unsigned) (xorshift(rng) % N_CHALLENGES);
+    for (size_t i = 0; i < sizeof(challenge); ++i) {
+        challenge[i] = (uint8_t) (pick * 31 + i);
+    }
+
+    void * first = NULL, * second = NULL;
+    size_t first_len, second_len;
+
+    errno = 0;
+    if (puflib_chal_resp(TEST_MODULE, challenge, sizeof(challenge), &first, &first_len)
+            || puflib_chal_resp(TEST_MODULE, challenge, sizeof(challenge), &second, &second_len)) {
+        wrong(w, OP_CHAL_RESP, "chal_resp failed");
+    } else if (!first_len || first_len != second_len) {
+        wrong(w, OP_CHAL_RESP, "responses to one challenge differ in length");
+    } else if (TEST_MODULE->chal_resp_deterministic && memcmp(first, second, first_len)) {
+        wrong(w, OP_CHAL_RESP, "deterministic module answered one challenge differently");
+    }
+    free(first);
+    free(second);
+}
+
+
+static void do_status(struct worker * w)
+{
+    errno = 0;
+    enum module_status status = puflib_module_status(&STRESS_MODULE);
+    if (status != MODULE_PROVISIONED && status != (MODULE_PROVISIONED | MODULE_DISABLED)) {
+        char what[64];
+        snprintf(what, sizeof(what), "unexpected status 0x%x", (unsigned) status);
+        wrong(w, OP_STATUS, what);
+    }
+}
+
+
+static void do_toggle(struct worker * w, uint64_t * rng)
+{
+    errno = 0;
+    if (xorshift(rng) & 1) {
+        if (puflib_enable(&STRESS_MODULE)) {
+            wrong(w, OP_TOGGLE, "enable failed");
+        }
+    } else {
+        if (puflib_disable(&STRESS_MODULE)) {
+            wrong(w, OP_TOGGLE, "disable failed");
+        }
+    }
+}
+
+
+static void do_report(uint64_t * rng)
+{
+    uint64_t r = xorshift(rng);
+    if (!(r & 7)) {
+        puflib_set_status_handler(r & 8 ? handler_a : handler_b);
+    } else {
+        puflib_report_fmt(&STRESS_MODULE, STATUS_DEBUG, "message %lu", (unsigned long) r);
+        __atomic_add_fetch(&REPORTED, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+static void * worker_main(void * arg)
+{
+    struct worker * w = arg;
+    uint64_t rng = 0x9e3779b97f4a7c15ull * (w->id + 1) ^ (uint64_t) getpid();
+    unsigned mix_total = 0;
+    for (size_t i = 0; i < N_OPS; ++i) {
+        mix_total += MIX[i];
+    }
+
+    while (!__atomic_load_n(&STOP, __ATOMIC_RELAXED)) {
+        enum op op = w->only;
+        if (op == N_OPS) {
+            unsigned pick = xorshift(&rng) % mix_total;
+            for (op = 0; pick >= MIX[op]; ++op) {
+                pick -= MIX[op];
+            }
+        }
+
+        switch (op) {
+        case OP_SEAL:       do_seal(w, &rng);       break;
+        case OP_CHAL_RESP:  do_chal_resp(w, &rng);  break;
+        case OP_STATUS:     do_status(w);           break;
+        case OP_TOGGLE:     do_toggle(w, &rng);     break;
+        case OP_REPORT:     do_report(&rng);        break;
+        default:                                    break;
+        }
+        ++w->totals.ops[op];
+    }
+    return NULL;
+}
+
+
+/******************************************************************************
+ * Runs                                                                       *
+ *****************************************************************************/
+
+/**
+ * Run the workers of one process for DURATION seconds, and add up their
+ * totals.
+ * @return false on success, true if the workers could not be started
+ */
+static bool run_threads(unsigned n_threads, unsigned first_id, enum op only,
+        struct totals * totals)
+{
+    struct worker * workers = calloc(n_threads, sizeof(*workers));
+    if (!workers) {
+        perror("stress");
+        return true;
+    }
+
+    __atomic_store_n(&STOP, false, __ATOMIC_RELAXED);
+    unsigned started;
+    for (started = 0; started < n_threads; ++started) {
+        workers[started].id = first_id + started;
+        workers[started].only = only;
+        int rc = pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]);
+        if (rc) {
+            fprintf(stderr, "stress: cannot start thread: %s\n", strerror(rc));
+            break;
+        }
+    }
+
+    if (started == n_threads) {
+        struct timespec ts = {
+            .tv_sec = (time_t) DURATION,
+            .tv_nsec = (long) ((DURATION - (time_t) DURATION) * 1e9),
+        };
+        while (nanosleep(&ts, &ts) && errno == EINTR);
+    }
+    __atomic_store_n(&STOP, true, __ATOMIC_RELAXED);
+
+    memset(totals, 0, sizeof(*totals));
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        for (size_t op = 0; op < N_OPS; ++op) {
+            totals->ops[op] += workers[i].totals.ops[op];
+            totals->errors[op] += workers[i].totals.errors[op];
+        }
+    }
+
+    bool failed = started != n_threads;
+    free(workers);
+    return failed;
+}
+
+
+/**
+ * Run n_procs processes of n_threads workers each, and add up their totals.
+ * A single process runs in this one.
+ * @return elapsed time in seconds, or a negative value on error
+ */
+static double run(unsigned n_procs, unsigned n_threads, enum op only, struct totals * totals)
+{
+    double start = now();
+
+    if (n_procs == 1) {
+        return run_threads(n_threads, 0, only, totals) ? -1 : now() - start;
+    }
+
+    // Each child writes its totals to a shared pipe; the writes are smaller
+    // than PIPE_BUF, so they do not interleave
+    int fds[2];
+    if (pipe(fds)) {
+        perror("stress: pipe");
+        return -1;
+    }
+    fflush(NULL);
+
+    unsigned forked;
+    for (forked = 0; forked < n_procs; ++forked) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("stress: fork");
+            break;
+        } else if (pid == 0) {
+            close(fds[0]);
+            struct totals child;
+            bool failed = run_threads(n_threads, forked * n_threads, only, &child);
+            if (!failed && write(fds[1], &child, sizeof(child)) != sizeof(child)) {
+                failed = true;
+            }
+            _exit(failed);
+        }
+    }
+    close(fds[1]);
+
+    bool failed = forked != n_procs;
+    memset(totals, 0, sizeof(*totals));
+    struct totals child;
+    ssize_t n;
+    while ((n = read(fds[0], &child, sizeof(child))) == sizeof(child)) {
+        for (size_t op = 0; op < N_OPS; ++op) {
+            totals->ops[op] += child.ops[op];
+            totals->errors[op] += child.errors[op];
+        }
+    }
+    close(fds[0]);
+
+    for (unsigned i = 0; i < forked; ++i) {
+        int status;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            failed = true;
+        }
+    }
+
+    return failed ? -1 : now() - start;
+}
+
+
+static unsigned long total_errors(struct totals const * totals)
+{
+    unsigned long errors = 0;
+    for (size_t op = 0; op < N_OPS; ++op) {
+        errors += totals->errors[op];
+    }
+    return errors;
+}
+
+
+static int stress(unsigned n_procs, unsigned n_threads)
+{
+    struct totals totals;
+    double elapsed = run(n_procs, n_threads, N_OPS, &totals);
+    if (elapsed < 0) {
+        return 1;
+    }
+
+    printf("%u process(es) x %u thread(s), %.1f s, module %s\n",
+            n_procs, n_threads, elapsed, TEST_MODULE->name);
+    printf("%-10s %12s %12s %8s\n", "op", "calls", "calls/s", "wrong");
+    for (size_t op = 0; op < N_OPS; ++op) {
+        printf("%-10s %12lu %12.0f %8lu\n", OP_NAMES[op], totals.ops[op],
+                totals.ops[op] / elapsed, totals.errors[op]);
+    }
+
+    unsigned long errors = total_errors(&totals);
+
+    // Every message is delivered to exactly one handler. Only this process's
+    // own messages are visible to it.
+    if (n_procs == 1) {
+        unsigned long delivered = DELIVERED[0] + DELIVERED[1];
+        if (delivered != REPORTED) {
+            fprintf(stderr, "stress: %lu messages reported, but %lu delivered\n",
+                    REPORTED, delivered);
+            ++errors;
+        }
+    }
+
+    printf("%s\n", errors ? "FAILED" : "ok");
+    return errors != 0;
+}
+
+
+static int scale(unsigned n_procs, unsigned max_threads)
+{
+    enum op op = MIX[OP_SEAL] ? OP_SEAL : OP_CHAL_RESP;
+    printf("%s scaling, %u process(es), %.1f s per step, module %s\n",
+            op == OP_SEAL ? "seal/unseal" : "chal_resp", n_procs, DURATION, TEST_MODULE->name);
+    printf("%8s %12s %9s %11s\n", "threads", "calls/s", "speedup", "efficiency");
+
+    double base = 0;
+    unsigned long errors = 0;
+    for (unsigned n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) {
+        struct totals totals;
+        double elapsed = run(n_procs, n, op, &totals);
+        if (elapsed < 0) {
+            return 1;
+        }
+
+        double rate = totals.ops[op] / elapsed;
+        if (n == 1) {
+            base = rate;
+        }
+        printf("%8u %12.0f %8.2fx %10.0f%%\n", n, rate, rate / base, 100 * rate / base / n);
+        errors += total_errors(&totals);
+
+        if (n == max_threads) {
+            break;
+        }
+    }
+
+    printf("%s\n", errors ? "FAILED" : "ok");
+    return errors != 0;
+}
+
+
+static int remove_entry(char const * path, struct stat const * sb, int flag, struct FTW * ftw)
+{
+    (void) sb; (void) flag; (void) ftw;
+    return remove(path);
+}
+
+
+static bool parse_unsigned(char const * s, unsigned * out)
+{
+    char * end;
+    errno = 0;
+    unsigned long n = strtoul(s, &end, 10);
+    if (errno || !*s || *end || !n || n > 4096) {
+        return true;
+    }
+    *out = (unsigned) n;
+    return false;
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: stress [-t THREADS] [-p PROCESSES] [-d SECONDS] [-m MODULE] [-s]\n");
+}
+
+
+int main(int argc, char ** argv)
+{
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned n_threads = n_cpus > 2 ? (unsigned) n_cpus * 2 : 4;
+    unsigned n_procs = 1;
+    char const * module_name = "puflibtest";
+    bool scaling = false, threads_given = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:p:d:m:s")) != -1) {
+        switch (opt) {
+        case 't':
+            threads_given = true;
+            if (parse_unsigned(optarg, &n_threads)) {
+                usage();
+                return 2;
+            }
+            break;
+        case 'p':
+            if (parse_unsigned(optarg, &n_procs)) {
+                usage();
+                return 2;
+            }
+            break;
+        case 'd':
+            DURATION = strtod(optarg, NULL);
+            if (!(DURATION > 0 && DURATION < 3600)) {
+                usage();
+                return 2;
+            }
+            break;
+        case 'm':
+            module_name = optarg;
+            break;
+        case 's':
+            scaling = true;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (optind != argc) {
+        usage();
+        return 2;
+    }
+    if (scaling && !threads_given) {
+        n_threads = n_cpus > 1 ? (unsigned) n_cpus : 1;
+    }
+
+    TEST_MODULE = puflib_get_module(module_name);
+    if (!TEST_MODULE) {
+        fprintf(stderr, "stress: module %s is not built\n", module_name);
+        return 2;
+    }
+    if (!TEST_MODULE->seal && !TEST_MODULE->get_root_key) {
+        MIX[OP_SEAL] = 0;
+    }
+    if (!TEST_MODULE->chal_resp) {
+        MIX[OP_CHAL_RESP] = 0;
+    }
+    if (!MIX[OP_SEAL] && !MIX[OP_CHAL_RESP]) {
+        fprintf(stderr, "stress: module %s implements neither seal nor chal_resp\n",
+                module_name);
+        return 2;
+    }
+
+    // Keep all NV stores in a fresh directory, for root too (see getuid()),
+    // which starts with nothing provisioned
+    char home[] = "/tmp/puflib-stress.XXXXXX";
+    if (!mkdtemp(home) || setenv("HOME", home, 1)) {
+        perror("stress: temporary HOME");
+        return 2;
+    }
+
+    int rc = 2;
+    if (TEST_MODULE->get_root_key && TEST_MODULE->provision() != PROVISION_COMPLETE) {
+        fprintf(stderr, "stress: cannot provision module %s\n", module_name);
+        goto out;
+    }
+
+    // Only after provisioning, so that the handlers count just the messages
+    // of the run
+    puflib_set_status_handler(handler_a);
+    puflib_deprovision(&STRESS_MODULE);
+    char * path = puflib_create_nv_store(&STRESS_MODULE, STORAGE_FINAL_FILE);
+    if (!path) {
+        perror("stress: cannot create placeholder NV store");
+        goto out;
+    }
+    free(path);
+
+    rc = scaling ? scale(n_procs, n_threads) : stress(n_procs, n_threads);
+
+out:
+    puflib_deprovision(&STRESS_MODULE);
+    nftw(home, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return rc;
+}
@@ -2,7 +2,10 @@
 //
 // Copyright (C) 2016 Assured Information Security, Inc.
 
+#define _XOPEN_SOURCE 700
+
 #include <puflib.h>
+#include <puflib_internal.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -10,6 +13,11 @@
 #include <errno.h>
 #include <alloca.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <readline/readline.h>
 #include "optparse.h"
 #include "base64.h"
@@ -19,6 +27,7 @@ struct opts {
     bool input_base64;
     bool output_base64;
     char * output;
+    unsigned jobs;
     int argc;
     char ** argv;
 };
@@ -34,11 +43,29 @@ static void usage(void)
     printf("  -I, --input-base64    input is base64-encoded\n");
     printf("  -O, --output-base64   output is base64-encoded\n");
     printf("  -o OUT, --output=OUT  output to OUT instead of stdout\n");
+    printf("  -j N, --jobs=N        reseal N files at a time (default: one per CPU)\n");
     printf("\n");
     printf("commands:\n");
-    printf("  seal MOD IN       Seal IN using MOD\n");
+    printf("  seal MOD IN       Seal IN using MOD, or using any of MOD,MOD,... to\n");
+    printf("                    unseal with whichever answers first\n");
     printf("  unseal IN         Unseal IN\n");
     printf("  chal MOD IN       Use MOD's raw challenge-response interface\n");
+    printf("  reseal FROM TO FILE...\n");
+    printf("                    Move the blobs in FILE... from module FROM to\n");
+    printf("                    module TO, replacing each file atomically\n");
+    printf("  keystore put KS NAME MOD IN\n");
+    printf("                    Seal IN using MOD and store it as NAME in keystore\n");
+    printf("                    file KS, creating KS if needed\n");
+    printf("  keystore get KS NAME\n");
+    printf("                    Unseal the secret stored as NAME in KS\n");
+    printf("  keystore list KS  List the names in KS\n");
+    printf("  keystore delete KS NAME\n");
+    printf("                    Delete NAME from KS\n");
+    printf("  keystore compact KS\n");
+    printf("                    Reclaim the space of replaced and deleted secrets\n");
+    printf("\n");
+    printf("MOD@N uses instance N of a module with several; otherwise one is chosen\n");
+    printf("for each call.\n");
 }
 
 
@@ -71,6 +98,9 @@ static bool query_handler(module_info const * module, char const * key,
 
 #define MAX_BUFFER_LEN (8 * 1024 * 1024)
 #define INIT_BUFFER_LEN 1024
+#define MAX_SEAL_MODULES 16     // as many as puflib_seal_redundant() takes
+#define WRITE_CHUNK_LEN (64 * 1024)
+#define MAX_JOBS 64
 
 
 static uint8_t * read_input_buffer(FILE * f, size_t * len)
@@ -278,6 +308,68 @@ err:
 }
 
 
+/**
+ * Load and check a module, printing an error if it cannot be used.
+ * @return module, or NULL on error
+ */
+static module_info const * usable_module(char * name)
+{
+    // MOD@N selects instance N; otherwise the library picks one
+    unsigned long instance = PUFLIB_INSTANCE_ANY;
+    char * at = strchr(name, '@');
+    if (at) {
+        *at = 0;
+    }
+
+    module_info const * mod = puflib_get_module(name);
+    if (!mod) {
+        fprintf(stderr, "puf: cannot use module \"%s\": does not exist\n", name);
+        return NULL;
+    }
+
+    unsigned count = puflib_instance_count(mod);
+    if (at) {
+        char * end;
+        errno = 0;
+        instance = strtoul(at + 1, &end, 10);
+        if (errno || end == at + 1 || *end || instance >= count) {
+            fprintf(stderr, "puf: cannot use module \"%s\": no instance \"%s\"\n",
+                    name, at + 1);
+            return NULL;
+        }
+    }
+
+    // Usable if the selected instance, or any instance, is
+    unsigned first = at ? (unsigned) instance : 0;
+    unsigned last = at ? (unsigned) instance : count - 1;
+    enum module_status status = MODULE_STATUS_ERROR;
+    for (unsigned i = first; i <= last; ++i) {
+        puflib_select_instance(i);
+        status = puflib_module_status(mod);
+        if (status != MODULE_STATUS_ERROR && (status & MODULE_PROVISIONED)
+                && !(status & MODULE_DISABLED)) {
+            break;
+        }
+    }
+    puflib_select_instance((unsigned) instance);
+
+    if (status == MODULE_STATUS_ERROR) {
+        if (errno) perror("puf");
+        return NULL;
+    }
+    if (status & MODULE_DISABLED) {
+        fprintf(stderr, "puf: cannot use module \"%s\": module is disabled\n", mod->name);
+        return NULL;
+    }
+    if (!(status & MODULE_PROVISIONED)) {
+        fprintf(stderr, "puf: cannot use module \"%s\": module has not been provisioned\n",
+                mod->name);
+        return NULL;
+    }
+    return mod;
+}
+
+
 int do_action(struct opts opts)
 {
     int argc = opts.argc;
@@ -293,26 +385,31 @@ int do_action(struct opts opts)
     uint8_t * in_buf = NULL;
     uint8_t * out_buf = NULL;
 
-    // Load and check the module
-    module_info const * mod = puflib_get_module(argv[1]);
-    if (!mod) {
-        fprintf(stderr, "puf: cannot use module \"%s\": does not exist\n", argv[1]);
-        goto err;
-    }
-
-    enum module_status status = puflib_module_status(mod);
-    if (status == MODULE_STATUS_ERROR) {
-        goto perr;
+    // Load and check the modules; only seal takes a list
+    module_info const * mods[MAX_SEAL_MODULES];
+    size_t n_mods = 0;
+    bool pinned = false;
+    for (char * name = strtok(argv[1], ","); name; name = strtok(NULL, ",")) {
+        if (n_mods == MAX_SEAL_MODULES || (n_mods && strcmp(argv[0], "seal"))) {
+            fprintf(stderr, "puf: too many modules for command \"%s\"\n", argv[0]);
+            goto err;
+        }
+        pinned = pinned || strchr(name, '@');
+        mods[n_mods] = usable_module(name);
+        if (!mods[n_mods++]) {
+            goto err;
+        }
     }
-    if (status & MODULE_DISABLED) {
-        fprintf(stderr, "puf: cannot use module \"%s\": module is disabled\n", mod->name);
+    if (!n_mods) {
+        fprintf(stderr, "puf: no module given. Try --help\n");
         goto err;
     }
-    if (!(status & MODULE_PROVISIONED)) {
-        fprintf(stderr, "puf: cannot use module \"%s\": module has not been provisioned\n",
-                mod->name);
+    if (pinned && n_mods > 1) {
+        // Redundant sealing calls each module from a thread of its own
+        fprintf(stderr, "puf: an instance can only be given for a single module\n");
         goto err;
     }
+    module_info const * mod = mods[0];
 
     in_buf = get_input_data(argv[2], &in_buf_len, opts.input_base64);
     if (!in_buf) {
@@ -321,7 +418,9 @@ int do_action(struct opts opts)
 
     // Seal or unseal
     bool rc = false;
-    if (!strcmp(argv[0], "seal")) {
+    if (!strcmp(argv[0], "seal") && n_mods > 1) {
+        rc = puflib_seal_redundant(mods, n_mods, in_buf, in_buf_len, &out_buf, &out_buf_len);
+    } else if (!strcmp(argv[0], "seal")) {
         rc = puflib_seal(mod, in_buf, in_buf_len, &out_buf, &out_buf_len);
     } else if (!strcmp(argv[0], "chal")) {
         rc = puflib_chal_resp(mod, (void const *) in_buf, in_buf_len,
@@ -401,6 +500,383 @@ perr:
 }
 
 
+/**
+ * Replace a file's contents atomically: write them to a temporary file in
+ * the same directory, in bounded chunks, and rename it over the original
+ * once it is safely on disk. The file keeps its permissions.
+ * @return false on success, true on error (with errno set)
+ */
+static bool replace_file(char const * path, uint8_t const * data, size_t len)
+{
+    size_t path_len = strlen(path);
+    char * tmp = malloc(path_len + sizeof(".XXXXXX"));
+    char * dir_buf = malloc(path_len + 1);
+    int fd = -1;
+    int dir_fd = -1;
+
+    if (!tmp || !dir_buf) {
+        goto err;
+    }
+    memcpy(tmp, path, path_len);
+    memcpy(tmp + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+    memcpy(dir_buf, path, path_len + 1);
+
+    struct stat st;
+    if (stat(path, &st)) {
+        goto err;
+    }
+
+    fd = mkstemp(tmp);
+    if (fd == -1) {
+        goto err;
+    }
+    if (fchmod(fd, st.st_mode & 07777)) {
+        goto err_unlink;
+    }
+
+    for (size_t done = 0; done < len; ) {
+        size_t chunk = len - done < WRITE_CHUNK_LEN ? len - done : WRITE_CHUNK_LEN;
+        ssize_t n = write(fd, data + done, chunk);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            goto err_unlink;
+        }
+        done += (size_t) n;
+    }
+
+    if (fsync(fd) || close(fd)) {
+        fd = -1;
+        goto err_unlink;
+    }
+    fd = -1;
+
+    if (rename(tmp, path)) {
+        goto err_unlink;
+    }
+
+    // Make the rename itself durable
+    dir_fd = open(dirname(dir_buf), O_RDONLY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    free(tmp);
+    free(dir_buf);
+    return false;
+
+err_unlink:
+    {
+        int errno_hold = errno;
+        unlink(tmp);
+        errno = errno_hold;
+    }
+err:
+    {
+        int errno_hold = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        free(tmp);
+        free(dir_buf);
+        errno = errno_hold;
+        return true;
+    }
+}
+
+
+/**
+ * Files to reseal, shared by the worker threads, which each take the next
+ * file in turn.
+ */
+struct reseal_work {
+    char ** files;
+    size_t n_files;
+    size_t next;            ///< index of the next file to take (atomic)
+    size_t n_failed;        ///< (atomic)
+    struct opts const * opts;
+};
+
+
+/**
+ * A worker thread and its own pair of sessions, so that the workers spread
+ * over the instances of both modules.
+ */
+struct reseal_worker {
+    struct reseal_work * work;
+    struct puflib_session * from;
+    struct puflib_session * to;
+    pthread_t thread;
+};
+
+
+static bool reseal_file(struct reseal_worker * worker, char const * path)
+{
+    size_t in_len = 0;
+    size_t out_len = 0;
+    uint8_t * in_buf = NULL;
+    uint8_t * out_buf = NULL;
+    bool rc = true;
+
+    in_buf = get_input_data(path, &in_len, worker->work->opts->input_base64);
+    if (!in_buf) {
+        goto out;
+    }
+    if (puflib_reseal(worker->from, worker->to, in_buf, in_len, &out_buf, &out_len)) {
+        goto out;
+    }
+    if (worker->work->opts->output_base64) {
+        uint8_t * raw = out_buf;
+        if (replace_with_b64_encoded(&out_buf, &out_len)) {
+            goto out;
+        }
+        free(raw);
+    }
+    rc = replace_file(path, out_buf, out_len);
+
+out:
+    {
+        int errno_hold = errno;
+        free(in_buf);
+        free(out_buf);
+        errno = errno_hold;
+        return rc;
+    }
+}
+
+
+static void * reseal_thread(void * arg)
+{
+    struct reseal_worker * worker = arg;
+    struct reseal_work * work = worker->work;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+        if (i >= work->n_files) {
+            break;
+        }
+        errno = 0;
+        if (reseal_file(worker, work->files[i])) {
+            fprintf(stderr, "puf: cannot reseal %s: %s\n", work->files[i],
+                    errno ? strerror(errno) : "unknown error");
+            __atomic_fetch_add(&work->n_failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+
+int do_reseal(struct opts opts)
+{
+    if (opts.argc < 4) {
+        fprintf(stderr, "puf: expected FROM, TO and files for command \"reseal\". Try --help\n");
+        return 1;
+    }
+    if (opts.output) {
+        fprintf(stderr, "puf: command \"reseal\" replaces its files and takes no --output\n");
+        return 1;
+    }
+
+    module_info const * from = usable_module(opts.argv[1]);
+    if (!from) {
+        return 1;
+    }
+    module_info const * to = usable_module(opts.argv[2]);
+    if (!to) {
+        return 1;
+    }
+    // Each blob is unsealed by the instance that sealed it, so only TO's
+    // instance can be chosen; otherwise the sessions pick theirs
+    unsigned to_instance = puflib_select_instance(PUFLIB_INSTANCE_ANY);
+
+    struct reseal_work work = {
+        .files = opts.argv + 3,
+        .n_files = (size_t) opts.argc - 3,
+        .opts = &opts,
+    };
+
+    unsigned n_workers = opts.jobs ? opts.jobs : puflib_cpu_count();
+    if (n_workers > MAX_JOBS) {
+        n_workers = MAX_JOBS;
+    }
+    if (n_workers > work.n_files) {
+        n_workers = (unsigned) work.n_files;
+    }
+
+    int rc = 1;
+    unsigned n_started = 0;
+    struct reseal_worker * workers = calloc(n_workers, sizeof(*workers));
+    if (!workers) {
+        perror("puf");
+        return 1;
+    }
+
+    // Open every session before touching any file. New sessions take turns
+    // between idle instances, so each module's are opened in a row.
+    puflib_select_instance(to_instance);
+    for (unsigned i = 0; i < n_workers; ++i) {
+        workers[i].work = &work;
+        workers[i].to = puflib_session_open(to);
+        if (!workers[i].to) {
+            perror("puf: cannot open session");
+            goto out;
+        }
+    }
+    puflib_select_instance(PUFLIB_INSTANCE_ANY);
+    for (unsigned i = 0; i < n_workers; ++i) {
+        workers[i].from = puflib_session_open(from);
+        if (!workers[i].from) {
+            perror("puf: cannot open session");
+            goto out;
+        }
+    }
+
+    for (; n_started < n_workers; ++n_started) {
+        int err = pthread_create(&workers[n_started].thread, NULL,
+                &reseal_thread, &workers[n_started]);
+        if (err) {
+            fprintf(stderr, "puf: cannot start reseal thread: %s\n", strerror(err));
+            break;
+        }
+    }
+    for (unsigned i = 0; i < n_started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    // Files left untaken if no thread could be started
+    size_t n_taken = work.next < work.n_files ? work.next : work.n_files;
+    size_t n_failed = work.n_failed + (work.n_files - n_taken);
+    printf("resealed %zu of %zu files from %s to %s\n",
+            work.n_files - n_failed, work.n_files, from->name, to->name);
+    rc = n_failed ? 1 : 0;
+
+out:
+    for (unsigned i = 0; i < n_workers; ++i) {
+        puflib_session_close(workers[i].from);
+        puflib_session_close(workers[i].to);
+    }
+    free(workers);
+    return rc;
+}
+
+
+static int compare_names(void const * a, void const * b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+int do_keystore(struct opts opts)
+{
+    static const struct {
+        char const * name;
+        int argc;
+        bool writable;
+    } commands[] = {
+        { "put",     6, true  },
+        { "get",     4, false },
+        { "list",    3, false },
+        { "delete",  4, true  },
+        { "compact", 3, true  },
+    };
+
+    char ** argv = opts.argv;
+    size_t cmd = 0;
+    for (; opts.argc >= 2 && cmd < sizeof(commands)/sizeof(commands[0]); ++cmd) {
+        if (!strcmp(argv[1], commands[cmd].name)) {
+            break;
+        }
+    }
+    if (opts.argc < 2 || cmd == sizeof(commands)/sizeof(commands[0])) {
+        fprintf(stderr, "puf: expected put, get, list, delete or compact after \"keystore\". Try --help\n");
+        return 1;
+    }
+    if (opts.argc != commands[cmd].argc) {
+        fprintf(stderr, "puf: wrong number of arguments to \"keystore %s\". Try --help\n", argv[1]);
+        return 1;
+    }
+
+    module_info const * mod = NULL;
+    uint8_t * in_buf = NULL;
+    uint8_t * out_buf = NULL;
+    size_t in_buf_len = 0;
+    size_t out_buf_len = 0;
+    char ** names = NULL;
+    size_t n_names = 0;
+    bool opened = false;
+    int rc = 1;
+
+    if (!strcmp(argv[1], "put")) {
+        mod = usable_module(argv[4]);
+        if (!mod) {
+            return 1;
+        }
+        in_buf = get_input_data(argv[5], &in_buf_len, opts.input_base64);
+        if (!in_buf) {
+            perror("puf");
+            return 1;
+        }
+        if (puflib_keystore_create(argv[2]) && errno != EEXIST) {
+            goto perr;
+        }
+    }
+
+    struct puflib_keystore * ks = puflib_keystore_open(argv[2], commands[cmd].writable);
+    if (!ks) {
+        goto perr;
+    }
+    opened = true;
+
+    bool failed;
+    if (!strcmp(argv[1], "put")) {
+        failed = puflib_keystore_put(ks, mod, argv[3], in_buf, in_buf_len);
+    } else if (!strcmp(argv[1], "get")) {
+        failed = puflib_keystore_get(ks, argv[3], &out_buf, &out_buf_len)
+            || write_output_data(opts.output, &out_buf, &out_buf_len, opts.output_base64);
+    } else if (!strcmp(argv[1], "list")) {
+        failed = puflib_keystore_list(ks, &names, &n_names);
+        if (!failed) {
+            qsort(names, n_names, sizeof(*names), &compare_names);
+            for (size_t i = 0; i < n_names; ++i) {
+                printf("%s\n", names[i]);
+            }
+        }
+    } else if (!strcmp(argv[1], "delete")) {
+        failed = puflib_keystore_delete(ks, argv[3]);
+    } else {
+        failed = puflib_keystore_compact(ks);
+    }
+
+    if (failed) {
+        int errno_hold = errno;
+        puflib_keystore_close(ks);
+        errno = errno_hold;
+        goto perr;
+    }
+    rc = puflib_keystore_close(ks) ? 1 : 0;
+    if (rc) {
+        goto perr;
+    }
+    goto out;
+
+perr:
+    if (errno == ENOENT && opened && opts.argc == 4) {
+        fprintf(stderr, "puf: no secret \"%s\" in %s\n", argv[3], argv[2]);
+    } else if (errno) {
+        perror("puf");
+    }
+out:
+    if (in_buf) {
+        puflib_secure_zero(in_buf, in_buf_len);
+    }
+    free(in_buf);
+    free(out_buf);
+    free(names);
+    return rc;
+}
+
+
 int main(int argc, char ** argv)
 {
     struct opts opts = {0};
@@ -415,6 +891,7 @@ int main(int argc, char ** argv)
         {"input-base64",    'I',    OPTPARSE_NONE},
         {"output-base64",   'O',    OPTPARSE_NONE},
         {"output",          'o',    OPTPARSE_REQUIRED},
+        {"jobs",            'j',    OPTPARSE_REQUIRED},
         {0}
     };
 
@@ -433,6 +910,17 @@ int main(int argc, char ** argv)
         case 'o':
             opts.output = options.optarg;
             break;
+        case 'j':
+        {
+            char * end;
+            unsigned long jobs = strtoul(options.optarg, &end, 10);
+            if (*end || !jobs || jobs > MAX_JOBS) {
+                fprintf(stderr, "%s: invalid number of jobs \"%s\"\n", argv[0], options.optarg);
+                return 1;
+            }
+            opts.jobs = (unsigned) jobs;
+            break;
+        }
         case '?':
             fprintf(stderr, "%s: %s\n", argv[0], options.errmsg);
             return 1;
@@ -459,6 +947,10 @@ int main(int argc, char ** argv)
         return do_action(opts);
     } else if (!strcmp(opts.argv[0], "unseal")) {
         return do_unseal(opts);
+    } else if (!strcmp(opts.argv[0], "reseal")) {
+        return do_reseal(opts);
+    } else if (!strcmp(opts.argv[0], "keystore")) {
+        return do_keystore(opts);
     } else {
         fprintf(stderr, "pufctl: unrecognized command '%s'\n", opts.argv[0]);
         return 1;
@@ -5,8 +5,11 @@
 #include <puflib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 #include <readline/readline.h>
 #include "optparse.h"
 
@@ -22,14 +25,87 @@ static void usage(void)
     printf("pufctl [OPTIONS] COMMAND [...]\n");
     printf("manage and provision PUFlib PUFs.\n");
     printf("\n");
+    printf("MOD is a module name, optionally followed by @N for its instance N;\n");
+    printf("without it, warmup acts on every instance and other commands on\n");
+    printf("instance 0.\n");
+    printf("\n");
     printf("commands:\n");
     printf("  list                  List all PUF modules\n");
     printf("  provisioned           List all provisioned PUF modules\n");
     printf("  provision MOD         Provision MOD. May be interactive.\n");
     printf("  continue MOD          Continue provisioning MOD.\n");
+    printf("  provision-all         Provision all instances of all supported modules\n");
+    printf("                        concurrently.\n");
     printf("  deprovision MOD...    Deprovision modules.\n");
     printf("  disable MOD...        Temporarily disable modules.\n");
     printf("  enable MOD...         Re-enable modules.\n");
+    printf("  enroll-crps MOD FILE COUNT\n");
+    printf("                        Record COUNT challenge-response pairs from MOD\n");
+    printf("                        into a new verifier database FILE.\n");
+    printf("  collect MOD FILE COUNT [READS]\n");
+    printf("                        Read COUNT challenges READS times each (default 5)\n");
+    printf("                        from MOD and save a quality dataset to FILE.\n");
+    printf("  analyze FILE...       Report quality metrics over datasets, one per\n");
+    printf("                        device.\n");
+    printf("  warmup MOD            Run MOD's start-up work and report how long each\n");
+    printf("                        phase takes.\n");
+}
+
+
+/// Longest module name shown, including any instance suffix
+#define NAME_MAX_LEN 64
+
+
+/**
+ * Look up a module by name, selecting the instance given as MOD@N.
+ * @return the module, or NULL (after printing an error) if there is no such
+ *  module or instance
+ */
+static module_info const * get_module(char const * name)
+{
+    char base[NAME_MAX_LEN];
+    unsigned long instance = PUFLIB_INSTANCE_ANY;
+
+    char const * at = strchr(name, '@');
+    size_t len = at ? (size_t) (at - name) : strlen(name);
+    if (len >= sizeof(base)) {
+        fprintf(stderr, "pufctl: module \"%s\" not found\n", name);
+        return NULL;
+    }
+    memcpy(base, name, len);
+    base[len] = 0;
+
+    module_info const * module = puflib_get_module(base);
+    if (!module) {
+        fprintf(stderr, "pufctl: module \"%s\" not found\n", base);
+        return NULL;
+    }
+
+    if (at) {
+        char * end;
+        errno = 0;
+        instance = strtoul(at + 1, &end, 10);
+        if (errno || end == at + 1 || *end || instance >= puflib_instance_count(module)) {
+            fprintf(stderr, "pufctl: module \"%s\" has no instance \"%s\"\n", base, at + 1);
+            return NULL;
+        }
+    }
+
+    puflib_select_instance((unsigned) instance);
+    return module;
+}
+
+
+/**
+ * Format the name of a module instance as accepted by get_module().
+ */
+static void instance_name(char * buf, size_t len, module_info const * module, unsigned instance)
+{
+    if (instance) {
+        snprintf(buf, len, "%s@%u", module->name, instance);
+    } else {
+        snprintf(buf, len, "%s", module->name);
+    }
 }
 
 
@@ -48,17 +124,26 @@ static int do_list(bool include_all)
 
     for (size_t i = 0; modules[i]; ++i) {
         bool hwsupp = modules[i]->is_hw_supported();
-        enum module_status status = puflib_module_status(modules[i]);
-        bool provisioned = (status & MODULE_PROVISIONED);
-        bool enabled = !(status & MODULE_DISABLED);
-
-        if (include_all || (provisioned && enabled)) {
-            printf(fmt, modules[i]->name,
-                    hwsupp ? "supported" : "not-supp",
-                    provisioned ? "provisioned" : "not-prov",
-                    enabled ? "enabled" : "disabled");
+        unsigned count = puflib_instance_count(modules[i]);
+
+        // One row per instance
+        for (unsigned inst = 0; inst < count; ++inst) {
+            puflib_select_instance(inst);
+            enum module_status status = puflib_module_status(modules[i]);
+            bool provisioned = (status & MODULE_PROVISIONED);
+            bool enabled = !(status & MODULE_DISABLED);
+
+            if (include_all || (provisioned && enabled)) {
+                char name[NAME_MAX_LEN];
+                instance_name(name, sizeof(name), modules[i], inst);
+                printf(fmt, name,
+                        hwsupp ? "supported" : "not-supp",
+                        provisioned ? "provisioned" : "not-prov",
+                        enabled ? "enabled" : "disabled");
+            }
         }
     }
+    puflib_select_instance(PUFLIB_INSTANCE_ANY);
 
     return 0;
 }
@@ -73,13 +158,20 @@ static void status_handler(module_info const * module,
 }
 
 
+// Modules provisioned by provision-all may query from several threads at
+// once; only one of them may own the terminal at a time.
+static pthread_mutex_t QUERY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
 static bool query_handler(module_info const * module, char const * key,
         char const * prompt, char * buffer, size_t buflen)
 {
     char * input;
 
+    pthread_mutex_lock(&QUERY_LOCK);
     printf("Query from module \"%s\", key \"%s\"\n", module->name, key);
     input = readline(prompt);
+    pthread_mutex_unlock(&QUERY_LOCK);
+
     if (!input) {
         return true;
     } else {
@@ -93,7 +185,7 @@ static bool query_handler(module_info const * module, char const * key,
 
 static int do_provision(char const * modname)
 {
-    module_info const * module = puflib_get_module(modname);
+    module_info const * module = get_module(modname);
 
     if (module) {
         enum module_status status = puflib_module_status(module);
@@ -119,7 +211,6 @@ static int do_provision(char const * modname)
             return 1;
         }
     } else {
-        fprintf(stderr, "pufctl: module \"%s\" not found\n", modname);
         return 1;
     }
 }
@@ -127,7 +218,7 @@ static int do_provision(char const * modname)
 
 static int do_continue(char const * modname)
 {
-    module_info const * module = puflib_get_module(modname);
+    module_info const * module = get_module(modname);
 
     if (module) {
         enum module_status status = puflib_module_status(module);
@@ -153,12 +244,196 @@ static int do_continue(char const * modname)
             return 1;
         }
     } else {
-        fprintf(stderr, "pufctl: module \"%s\" not found\n", modname);
         return 1;
     }
 }
 
 
+/// Length of the random challenges issued by enroll-crps
+#define CRP_CHALLENGE_LEN 16
+
+/// Length of the challenges issued by collect
+#define COLLECT_CHALLENGE_LEN 16
+
+// Upper bound on provision() calls per module in provision-all, to protect
+// against a module that never leaves PROVISION_INCOMPLETE.
+#define MAX_PROVISION_STEPS 1000
+
+/**
+ * A set of module instances that must be provisioned one after the other,
+ * because they share a hardware resource. Each group gets its own thread.
+ * Instances of one module share a resource only if the module names one.
+ */
+struct provision_group {
+    char const * resource;
+    size_t n_modules;
+    module_info const ** modules;
+    unsigned * instances;
+    enum provisioning_status * results;
+    pthread_t thread;
+};
+
+
+static void * provision_group_thread(void * arg)
+{
+    struct provision_group * group = arg;
+
+    for (size_t i = 0; i < group->n_modules; ++i) {
+        enum provisioning_status result = PROVISION_ERROR;
+        puflib_select_instance(group->instances[i]);
+
+        for (int step = 0; step < MAX_PROVISION_STEPS; ++step) {
+            result = group->modules[i]->provision();
+            if (result != PROVISION_INCOMPLETE) {
+                break;
+            }
+        }
+
+        group->results[i] = result;
+    }
+
+    return NULL;
+}
+
+
+static char const * provisioning_status_name(enum provisioning_status status)
+{
+    switch (status) {
+    case PROVISION_NOT_SUPPORTED:
+        return "not-supp";
+    case PROVISION_INCOMPLETE:
+        return "incomplete";
+    case PROVISION_COMPLETE:
+        return "complete";
+    case PROVISION_REBOOT_REQUIRED:
+        return "reboot-required";
+    case PROVISION_ERROR:
+    default:
+        return "error";
+    }
+}
+
+
+static int do_provision_all(void)
+{
+    module_info const * const * modules = puflib_get_modules();
+    size_t n_modules = 0;
+    size_t n_groups = 0;
+    int rc = 0;
+
+    // Every instance is provisioned separately, so list them all
+    for (size_t i = 0; modules[i]; ++i) {
+        n_modules += puflib_instance_count(modules[i]);
+    }
+
+    struct provision_group * groups = calloc(n_modules + 1, sizeof(*groups));
+    module_info const ** all_modules = calloc(n_modules + 1, sizeof(*all_modules));
+    unsigned * all_instances = calloc(n_modules + 1, sizeof(*all_instances));
+    if (!groups || !all_modules || !all_instances) {
+        perror("pufctl");
+        free(groups);
+        free(all_modules);
+        free(all_instances);
+        return 1;
+    }
+
+    for (size_t i = 0, k = 0; modules[i]; ++i) {
+        unsigned count = puflib_instance_count(modules[i]);
+        for (unsigned inst = 0; inst < count; ++inst, ++k) {
+            all_modules[k] = modules[i];
+            all_instances[k] = inst;
+        }
+    }
+
+    // Sort the instances needing work into groups by shared hardware
+    // resource. Instances without a resource each get a group of their own.
+    for (size_t i = 0; i < n_modules; ++i) {
+        module_info const * module = all_modules[i];
+
+        puflib_select_instance(all_instances[i]);
+        enum module_status status = puflib_module_status(module);
+        if (status == MODULE_STATUS_ERROR) {
+            perror("puflib_module_status");
+            rc = 1;
+            goto out;
+        }
+        if ((status & MODULE_PROVISIONED) || !module->is_hw_supported()) {
+            continue;
+        }
+
+        struct provision_group * group = NULL;
+        for (size_t j = 0; module->hw_resource && j < n_groups; ++j) {
+            if (groups[j].resource && !strcmp(groups[j].resource, module->hw_resource)) {
+                group = &groups[j];
+                break;
+            }
+        }
+
+        if (!group) {
+            group = &groups[n_groups++];
+            group->resource = module->hw_resource;
+            group->modules = calloc(n_modules, sizeof(*group->modules));
+            group->instances = calloc(n_modules, sizeof(*group->instances));
+            group->results = calloc(n_modules, sizeof(*group->results));
+            if (!group->modules || !group->instances || !group->results) {
+                perror("pufctl");
+                rc = 1;
+                goto out;
+            }
+        }
+
+        group->instances[group->n_modules] = all_instances[i];
+        group->modules[group->n_modules++] = module;
+    }
+    puflib_select_instance(PUFLIB_INSTANCE_ANY);
+
+    size_t n_started = 0;
+    for (; n_started < n_groups; ++n_started) {
+        int err = pthread_create(&groups[n_started].thread, NULL,
+                &provision_group_thread, &groups[n_started]);
+        if (err) {
+            fprintf(stderr, "pufctl: cannot start provisioning thread: %s\n",
+                    strerror(err));
+            rc = 1;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < n_started; ++i) {
+        pthread_join(groups[i].thread, NULL);
+    }
+
+    if (rc) {
+        goto out;
+    }
+
+    char const * fmt = "%-20s %-15s\n";
+    printf(fmt, "MODULE", "RESULT");
+    for (size_t i = 0; i < n_groups; ++i) {
+        for (size_t j = 0; j < groups[i].n_modules; ++j) {
+            enum provisioning_status result = groups[i].results[j];
+            char name[NAME_MAX_LEN];
+            instance_name(name, sizeof(name), groups[i].modules[j], groups[i].instances[j]);
+            printf(fmt, name, provisioning_status_name(result));
+            if (result != PROVISION_COMPLETE && result != PROVISION_REBOOT_REQUIRED) {
+                rc = 1;
+            }
+        }
+    }
+
+out:
+    for (size_t i = 0; i < n_groups; ++i) {
+        free(groups[i].modules);
+        free(groups[i].instances);
+        free(groups[i].results);
+    }
+    free(groups);
+    free(all_modules);
+    free(all_instances);
+    return rc;
+}
+
+
 enum module_simple_actions { DEPROVISION, ENABLE, DISABLE };
 
 
@@ -184,15 +459,15 @@ static int do_simple(int argc, char ** argv, enum module_simple_actions action)
     // First check that all modules exist, and abort before doing anything if
     // not.
     for (int i = 0; i < argc; ++i) {
-        if (!puflib_get_module(argv[i])) {
-            fprintf(stderr, "pufctl: cannot %s module \"%s\": does not exist\n",
+        if (!get_module(argv[i])) {
+            fprintf(stderr, "pufctl: cannot %s module \"%s\"\n",
                     action_name, argv[i]);
             return 1;
         }
     }
 
     for (int i = 0; i < argc; ++i) {
-        module_info const * mod = puflib_get_module(argv[i]);
+        module_info const * mod = get_module(argv[i]);
         assert(mod);
         enum module_status status = puflib_module_status(mod);
         if (status == MODULE_STATUS_ERROR) {
@@ -225,6 +500,163 @@ static int do_simple(int argc, char ** argv, enum module_simple_actions action)
 }
 
 
+/**
+ * Parse a count argument.
+ * @return false on success, true (after printing an error) if invalid
+ */
+static bool parse_count(char const * str, unsigned long long max, unsigned long long * count)
+{
+    char * end;
+    errno = 0;
+    *count = strtoull(str, &end, 10);
+    if (errno || !*str || *end || *count > max) {
+        fprintf(stderr, "pufctl: invalid count \"%s\"\n", str);
+        return true;
+    }
+    return false;
+}
+
+
+/**
+ * Command to enroll challenge-response pairs into a verifier database.
+ * @return exit code
+ */
+static int do_enroll_crps(char const * modname, char const * path, char const * count_str)
+{
+    module_info const * module = get_module(modname);
+    if (!module) {
+        return 1;
+    }
+
+    unsigned long long count;
+    if (parse_count(count_str, SIZE_MAX, &count)) {
+        return 1;
+    }
+
+    if (puflib_crpdb_enroll(module, path, (size_t) count, CRP_CHALLENGE_LEN)) {
+        perror("puflib_crpdb_enroll");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Command to collect a quality dataset from a module.
+ * @return exit code
+ */
+static int do_collect(char const * modname, char const * path,
+        char const * count_str, char const * reads_str)
+{
+    module_info const * module = get_module(modname);
+    if (!module) {
+        return 1;
+    }
+
+    unsigned long long count, reads = 5;
+    if (parse_count(count_str, SIZE_MAX, &count)
+            || (reads_str && parse_count(reads_str, 65535, &reads))) {
+        return 1;
+    }
+
+    struct puflib_dataset * dataset = puflib_dataset_collect(module, (size_t) count,
+            COLLECT_CHALLENGE_LEN, (unsigned) reads, 0);
+    if (!dataset) {
+        perror("puflib_dataset_collect");
+        return 1;
+    }
+
+    int rc = 0;
+    if (puflib_dataset_save(dataset, path)) {
+        perror(path);
+        rc = 1;
+    }
+    puflib_dataset_free(dataset);
+    return rc;
+}
+
+
+/**
+ * Command to report quality metrics over datasets.
+ * @return exit code
+ */
+static int do_analyze(int n_paths, char ** paths)
+{
+    struct puflib_dataset ** datasets = calloc(n_paths, sizeof(*datasets));
+    struct puflib_quality q;
+    int rc = 1;
+
+    if (!datasets) {
+        perror("pufctl");
+        return 1;
+    }
+
+    for (int i = 0; i < n_paths; ++i) {
+        datasets[i] = puflib_dataset_load(paths[i]);
+        if (!datasets[i]) {
+            perror(paths[i]);
+            goto out;
+        }
+    }
+
+    if (puflib_analyze((struct puflib_dataset const * const *) datasets, n_paths, 0, &q)) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "pufctl: datasets have different challenges or response lengths\n");
+        } else {
+            perror("puflib_analyze");
+        }
+        goto out;
+    }
+
+    printf("devices:       %zu\n", q.n_devices);
+    printf("bits/device:   %llu\n", (unsigned long long) q.n_bits);
+    printf("uniformity:    %.4f  (min %.4f, max %.4f; ideal 0.5)\n",
+            q.uniformity, q.uniformity_min, q.uniformity_max);
+    printf("reliability:   %.4f  (min %.4f; ideal 1)\n", q.reliability, q.reliability_min);
+    printf("unstable bits: %.4f  (ideal 0)\n", q.unstable);
+    if (q.n_devices > 1) {
+        printf("uniqueness:    %.4f  (min %.4f, max %.4f; ideal 0.5)\n",
+                q.uniqueness, q.uniqueness_min, q.uniqueness_max);
+        printf("bit-aliasing:  min %.4f, max %.4f  (ideal 0.5)\n",
+                q.bit_aliasing_min, q.bit_aliasing_max);
+        printf("min-entropy:   %.4f bits/bit  (ideal 1)\n", q.min_entropy);
+    }
+    rc = 0;
+
+out:
+    for (int i = 0; i < n_paths; ++i) {
+        puflib_dataset_free(datasets[i]);
+    }
+    free(datasets);
+    return rc;
+}
+
+
+/**
+ * Command to warm up a module, reporting the time taken by each phase.
+ * @return exit code
+ */
+static int do_warmup(char const * modname)
+{
+    module_info const * module = get_module(modname);
+    if (!module) {
+        return 1;
+    }
+
+    // Phases are reported through the status handler as they complete
+    struct puflib_warmup_report report;
+    if (puflib_warmup(module, WARMUP_ALL, &report)) {
+        perror("puflib_warmup");
+        return 1;
+    }
+
+    printf("total: %llu us\n", (unsigned long long)
+            (report.library_us + report.module_us + report.root_key_us));
+    return 0;
+}
+
+
 int main(int argc, char ** argv)
 {
     struct opts opts = {0};
@@ -282,6 +714,13 @@ int main(int argc, char ** argv)
         } else {
             return do_continue(opts.argv[1]);
         }
+    } else if (!strcmp(opts.argv[0], "provision-all")) {
+        if (opts.argc != 1) {
+            fprintf(stderr, "pufctl: command \"provision-all\" takes no arguments. Try --help\n");
+            return 1;
+        } else {
+            return do_provision_all();
+        }
     } else if (!strcmp(opts.argv[0], "deprovision")) {
         if (opts.argc < 2) {
             fprintf(stderr, "pufctl: expected at least one argument to command \"deprovision\". Try --help\n");
@@ -303,6 +742,35 @@ int main(int argc, char ** argv)
         } else {
             return do_simple(opts.argc - 1, opts.argv + 1, DISABLE);
         }
+    } else if (!strcmp(opts.argv[0], "enroll-crps")) {
+        if (opts.argc != 4) {
+            fprintf(stderr, "pufctl: expected three arguments to command \"enroll-crps\". Try --help\n");
+            return 1;
+        } else {
+            return do_enroll_crps(opts.argv[1], opts.argv[2], opts.argv[3]);
+        }
+    } else if (!strcmp(opts.argv[0], "collect")) {
+        if (opts.argc != 4 && opts.argc != 5) {
+            fprintf(stderr, "pufctl: expected three or four arguments to command \"collect\". Try --help\n");
+            return 1;
+        } else {
+            return do_collect(opts.argv[1], opts.argv[2], opts.argv[3],
+                    opts.argc == 5 ? opts.argv[4] : NULL);
+        }
+    } else if (!strcmp(opts.argv[0], "analyze")) {
+        if (opts.argc < 2) {
+            fprintf(stderr, "pufctl: expected at least one argument to command \"analyze\". Try --help\n");
+            return 1;
+        } else {
+            return do_analyze(opts.argc - 1, opts.argv + 1);
+        }
+    } else if (!strcmp(opts.argv[0], "warmup")) {
+        if (opts.argc != 2) {
+            fprintf(stderr, "pufctl: expected one argument to command \"warmup\". Try --help\n");
+            return 1;
+        } else {
+            return do_warmup(opts.argv[1]);
+        }
     } else {
         fprintf(stderr, "pufctl: unrecognized command '%s'\n", opts.argv[0]);
         return 1;